@@ -480,6 +480,11 @@ UString UString::slice(int begin, int end) const
     return result;
 }
 
+UString UString::slice_code_units(TextPos begin, TextPos end) const
+{
+    return icu::UnicodeString{m_us, begin, end - begin};
+}
+
 UString UString::slice_logchar(int begin, int end) const
 {
     int n = 0;
@@ -120,6 +120,9 @@ class UString
         // Result is truncated for out of range indizes.
         UString slice(int begin, int end=INT_MAX) const;
 
+        // Slicing on UTF-16 code units, the unit of TextPos in spans.
+        UString slice_code_units(TextPos begin, TextPos end) const;
+
         // Python like slicing on logical characters (grapheme clusters,
         // spanning one or more code points).
         UString slice_logchar(int begin, int end=INT_MAX) const;
@@ -20,8 +20,9 @@
 #include <sstream>
 #include <stdlib.h>
 #include <stdio.h>
-#include <error.h>
 #include <algorithm>
+#include <atomic>
+#include <new>
 #include <cmath>
 #include <string>
 #include <wctype.h>
@@ -52,62 +53,39 @@ static bool wstartswith(const std::wstring& s, const std::wstring& prefix) {
 }
 
 
-StrConv::StrConv()
+// Order of indices into the cmp array: descending values,
+// ties in ascending index order.
+template <class T, class TCMP>
+struct cmp_argsort_desc
 {
-    cd_mb_wc = iconv_open ("WCHAR_T", "UTF-8");
-    if (cd_mb_wc == (iconv_t) -1)
-    {
-        if (errno == EINVAL)
-            error (0, 0, "conversion from UTF-8 to wchar_t not available");
-        else
-            perror ("iconv_open mb2wc");
-    }
-    cd_wc_mb = iconv_open ("UTF-8", "WCHAR_T");
-    if (cd_wc_mb == (iconv_t) -1)
+    cmp_argsort_desc(const vector<TCMP>& cmp_) : cmp(cmp_) {}
+    bool operator() (T a, T b) const
     {
-        if (errno == EINVAL)
-            error (0, 0, "conversion from wchar_t to UTF-8 not available");
-        else
-            perror ("iconv_open wc2mb");
+        if (cmp[b] < cmp[a])
+            return true;
+        if (cmp[a] < cmp[b])
+            return false;
+        return a < b;
     }
-}
+    const vector<TCMP>& cmp;
+};
 
-StrConv::~StrConv()
+// Sort an identity initialized index array according to values
+// from the cmp array, descending. Stable, equal values keep their
+// index order.
+template <class T, class TCMP>
+void stable_argsort_desc(vector<T>& v, const vector<TCMP>& cmp)
 {
-    if (cd_mb_wc != (iconv_t) -1)
-        if (iconv_close (cd_mb_wc) != 0)
-            perror ("iconv_close mb2wc");
-    if (cd_wc_mb != (iconv_t) -1)
-        if (iconv_close (cd_wc_mb) != 0)
-            perror ("iconv_close wc2mb");
+    sort(v.begin(), v.end(), cmp_argsort_desc<T, TCMP>(cmp));
 }
 
-
-// Sort an index array according to values from the cmp array, descending.
-// Shellsort in place: stable and fast for already sorted arrays.
+// Same order as stable_argsort_desc, but only the k largest entries
+// are sorted to the front: O(n log k) instead of O(n log n).
 template <class T, class TCMP>
-void stable_argsort_desc(vector<T>& v, const vector<TCMP>& cmp)
+void partial_argsort_desc(vector<T>& v, const vector<TCMP>& cmp, int k)
 {
-    int i, j, gap;
-    int n = v.size();
-    T t;
-
-    for (gap = n/2; gap > 0; gap >>= 1)
-    {
-        for (i = gap; i < n; i++)
-        {
-            for (j = i-gap; j >= 0; j -= gap)
-            {
-                if (!(cmp[v[j]] < cmp[v[j+gap]]))
-                    break;
-
-                // Swap p with q
-                t = v[j+gap];
-                v[j+gap] = v[j];
-                v[j] = t;
-            }
-        }
-    }
+    partial_sort(v.begin(), v.begin()+k, v.end(),
+                 cmp_argsort_desc<T, TCMP>(cmp));
 }
 
 // Replacement for wcscmp with optional case-
@@ -138,9 +116,9 @@ class PrefixCmp
 
         int matches(const char* s)
         {
-            const wchar_t* stmp = conv.mb2wc(s);
-            if (stmp)
-                return matches(stmp);
+            Utf8ToWide w(s);
+            if (w.c_str())
+                return matches(w.c_str());
             return false;
         }
 
@@ -199,6 +177,22 @@ class PrefixCmp
             return c1 == c2;
         }
 
+        // Lower case and remove accents. Repeat until stable, so that
+        // folding is independent of the order of both transformations.
+        // Any prefix match with the options above implies a match of
+        // the folded strings.
+        static wint_t fold(wint_t c)
+        {
+            for (int i=0; i<4; i++)
+            {
+                wint_t cf = op_remove_accent(op_lower(c));
+                if (cf == c)
+                    break;
+                c = cf;
+            }
+            return c;
+        }
+
     private:
         static wint_t op_lower(wint_t c)
         {
@@ -241,83 +235,212 @@ class PrefixCmp
     private:
         wstring prefix;
         uint32_t options;
-        StrConv conv;
 };
 
 
+//------------------------------------------------------------------------
+// StringArena - append-only storage of zero terminated strings
+//------------------------------------------------------------------------
+
+void StringArena::clear()
+{
+    vector<const char*>().swap(m_blocks);
+    vector<unique_ptr<char[]>>().swap(m_chunks);
+    m_pos = m_end = nullptr;
+    m_pos_offset = 0;
+    m_chunks_size = 0;
+    m_used_size = 0;
+    m_external_size = 0;
+}
+
+// Register consecutive blocks covering size bytes of data.
+bool StringArena::add_blocks(const char* data, size_t size, uint32_t& base)
+{
+    size_t num_blocks = std::max<size_t>((size + BLOCK_MASK) >> BLOCK_BITS, 1);
+    if (m_blocks.size() + num_blocks > MAX_BLOCKS)
+        return false;
+
+    base = m_blocks.size() << BLOCK_BITS;
+    for (size_t i=0; i<num_blocks; i++)
+        m_blocks.push_back(data + (i << BLOCK_BITS));
+    return true;
+}
+
+bool StringArena::reserve(size_t size)
+{
+    if (size <= static_cast<size_t>(m_end - m_pos))
+        return true;
+
+    // Chunks grow with the arena by a quarter, keeping the unused
+    // rest of the last one small. The free space left behind in the
+    // previous chunk is abandoned.
+    size_t chunk_size = std::min<size_t>(std::max<size_t>(m_chunks_size / 4,
+                                                          MIN_CHUNK_SIZE),
+                                         MAX_CHUNK_SIZE);
+    chunk_size = std::max(chunk_size, size);
+    char* chunk = new (nothrow) char[chunk_size];
+    if (!chunk)
+        return false;
+
+    uint32_t base;
+    if (!add_blocks(chunk, chunk_size, base))
+    {
+        delete [] chunk;
+        return false;
+    }
+    m_chunks.emplace_back(chunk);
+    m_chunks_size += chunk_size;
+    m_pos = chunk;
+    m_end = chunk + chunk_size;
+    m_pos_offset = base;
+    return true;
+}
+
+bool StringArena::add(const char* s, uint32_t& offset)
+{
+    size_t size = strlen(s) + 1;
+    if (!reserve(size))
+        return false;
+
+    memcpy(m_pos, s, size);
+    offset = m_pos_offset;
+    m_pos += size;
+    m_pos_offset += size;
+    m_used_size += size;
+    return true;
+}
+
+bool StringArena::add_external(const char* data, size_t size, uint32_t& base)
+{
+    if (!add_blocks(data, size, base))
+        return false;
+    m_external_size += size;
+
+    // Nothing may be appended behind the external data.
+    m_pos = m_end = nullptr;
+    return true;
+}
+
+uint64_t StringArena::get_memory_size() const
+{
+    return m_chunks_size +
+           sizeof(const char*) * m_blocks.capacity() +
+           sizeof(unique_ptr<char[]>) * m_chunks.capacity();
+}
+
+
 //------------------------------------------------------------------------
 // Dictionary - holds the vocabulary of the language model
 //------------------------------------------------------------------------
 
 Dictionary::Dictionary()
 {
-    sorted = nullptr;
     clear();
 }
 
 void Dictionary::clear()
 {
-    vector<char*>::iterator it;
-    for (it=m_words.begin(); it < m_words.end(); it++)
-        MemFree(*it);
-
-    vector<char*>().swap(m_words);  // clear and really free the memory
+    m_arena.clear();
+    vector<uint32_t>().swap(m_word_offsets);  // clear and really free the memory
 
-    if (sorted)
-    {
-        delete sorted;
-        sorted = nullptr;
-    }
+    vector<WordId>().swap(m_sorted);
+    vector<WordId>().swap(m_sorted_tail);
     sorted_words_begin = 0;
+    m_implicit_end = 0;
+
+    clear_folded();
+    m_generation = new_generation();
+}
+
+uint64_t Dictionary::new_generation()
+{
+    static std::atomic<uint64_t> generation{0};
+    return ++generation;
 }
 
 void Dictionary::dump()
 {
-    for (size_t i=0; i<m_words.size(); ++i)
+    for (size_t i=0; i<m_word_offsets.size(); ++i)
     {
-        printf("%6zu: %s\n", i, m_words[i]);
+        printf("%6zu: %s\n", i, get_word(i));
     }
     printf("\n");
 }
 
+// Binary search for the insertion point of word (std::lower_bound())
+// in a sorted run of positions [lo, hi); word_at(i) is the word at i.
+template <class F>
+static int lower_bound_word(int lo, int hi, const char* word, F word_at)
+{
+    while (lo < hi)
+    {
+        int mid = (lo+hi)>>1;
+        if (strcmp(word_at(mid), word) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-struct cmp_str
+// Binary search for the range of words starting with prefix.
+// strncmp sorts like strcmp, so all matches are adjacent in the
+// sorted order, starting at the insertion point of the prefix.
+template <class F>
+static void prefix_range_of(int lo, int hi, const char* prefix, F word_at,
+                            int& begin, int& end)
 {
-        bool operator() (const char* w1, const char* w2)
-        { return strcmp(w1, w2) < 0; }
-};
+    size_t len = strlen(prefix);
+    lo = lower_bound_word(lo, hi, prefix, word_at);
+    begin = lo;
+    while (lo < hi)
+    {
+        int mid = (lo+hi)>>1;
+        if (strncmp(word_at(mid), prefix, len) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    end = lo;
+}
 
 // Set words in bulk.
-// Allows us to sort "words" and ignore the "sorted" vector.
+// Allows us to sort the words themselves and leave the main run of
+// the sorted index implicit.
 //
 // Preconditions:
 // - Control words and only those are expected to exist in
-//   the dictionary already (vector "words").
+//   the dictionary already.
 // - If new_words contains control words, they are
 //   located close to its begin.
 LMError Dictionary::set_words(const std::vector<const char*>& new_words)
 {
-    // This is the goal: keep "sorted" unallocated
+    // This is the goal: keep m_sorted unallocated
     // (for large static system models).
-    if (sorted)
+    vector<WordId>().swap(m_sorted);
+    vector<WordId>().swap(m_sorted_tail);
+
+    // word ids change, rebuild the folded index on demand
+    clear_folded();
+    m_generation = new_generation();
+
+    // one chunk for all words
+    size_t bytes = 0;
+    for (auto w : new_words)
     {
-        delete sorted;
-        sorted = nullptr;
+        if (!w)
+            return ERR_WC2MB;
+        bytes += strlen(w) + 1;
     }
+    if (!m_arena.reserve(bytes))
+        return ERR_MEMORY;
 
-    // encode as utf-8 and store in "words"
-    size_t initial_size = m_words.size(); // number of initial control words
+    size_t initial_size = m_word_offsets.size(); // number of initial control words
     size_t n = new_words.size();
+    m_word_offsets.reserve(initial_size + n);
     for (size_t i = 0; i<n; i++)
     {
-        // encode word to utf-8, this is how it is stored in the dictionary
-        const char* wnew = new_words[i];
-        if (!wnew)
-            return ERR_WC2MB;
-        char* w = reinterpret_cast<char*>(MemAlloc((strlen(wnew) + 1) * sizeof(char)));
-        if (!w)
-            return ERR_MEMORY;
-        strcpy(w, wnew);
+        const char* w = new_words[i];
 
         // is this a known control word?
         bool exists = false;
@@ -326,7 +449,7 @@ LMError Dictionary::set_words(const std::vector<const char*>& new_words)
         {
             for (size_t j = 0; j<initial_size; j++)
             {
-                if (strcmp(w, m_words[j]) == 0)
+                if (strcmp(w, get_word(j)) == 0)
                 {
                     exists = true;
                     break;
@@ -336,36 +459,120 @@ LMError Dictionary::set_words(const std::vector<const char*>& new_words)
 
         // add it, if it wasn't a known control word
         if (!exists)
-            m_words.push_back(w);
+        {
+            uint32_t offset;
+            if (!m_arena.add(w, offset))
+                return ERR_MEMORY;
+            m_word_offsets.push_back(offset);
+        }
     }
 
     // sort words, make sure to use the same comparison function
-    // as Dictionary::search_index.
-    cmp_str cmp;
-    sort(m_words.begin()+initial_size, m_words.end(), cmp);
+    // as the binary searches.
+    sort(m_word_offsets.begin()+initial_size, m_word_offsets.end(),
+         [this](uint32_t a, uint32_t b)
+         { return strcmp(m_arena.get(a), m_arena.get(b)) < 0; });
 
     sorted_words_begin = initial_size;
+    m_implicit_end = m_word_offsets.size();
 
     return ERR_NONE;
 }
 
+LMError Dictionary::set_external_words(const char* blob, size_t blob_size,
+                                       const uint32_t* offsets, int num_words)
+{
+    clear();
+
+    uint32_t base;
+    if (!m_arena.add_external(blob, blob_size, base))
+        return ERR_MEMORY;
+
+    m_word_offsets.resize(num_words);
+    for (int i=0; i<num_words; i++)
+        m_word_offsets[i] = base + offsets[i];
+
+    sorted_words_begin = std::min(num_words,
+                                  static_cast<int>(NUM_CONTROL_WORDS));
+    m_implicit_end = num_words;
+
+    return ERR_NONE;
+}
+
+int Dictionary::binsearch_main(const char* word)
+{
+    if (m_sorted.empty())
+        return lower_bound_word(sorted_words_begin, m_implicit_end, word,
+                                [this](int i) {return get_word(i);});
+    return lower_bound_word(0, m_sorted.size(), word,
+                            [this](int i) {return get_word(m_sorted[i]);});
+}
+
+int Dictionary::binsearch_tail(const char* word)
+{
+    return lower_bound_word(0, m_sorted_tail.size(), word,
+                            [this](int i) {return get_word(m_sorted_tail[i]);});
+}
+
+void Dictionary::main_prefix_range(const char* prefix, int& begin, int& end)
+{
+    if (m_sorted.empty())
+        prefix_range_of(sorted_words_begin, m_implicit_end, prefix,
+                        [this](int i) {return get_word(i);},
+                        begin, end);
+    else
+        prefix_range_of(0, m_sorted.size(), prefix,
+                        [this](int i) {return get_word(m_sorted[i]);},
+                        begin, end);
+}
+
+void Dictionary::tail_prefix_range(const char* prefix, int& begin, int& end)
+{
+    prefix_range_of(0, m_sorted_tail.size(), prefix,
+                    [this](int i) {return get_word(m_sorted_tail[i]);},
+                    begin, end);
+}
+
 // Lookup the given word and return its id, binary search
 WordId Dictionary::word_to_id(const char* word)
 {
-    int index = search_index(word);
-    if (index >= 0 && index < static_cast<int>(m_words.size()))
+    int index = binsearch_main(word);
+    if (index < main_end())
     {
-        WordId wid = sorted ? (*sorted)[index] : index;
-        if (strcmp(m_words[wid], word) == 0)
+        WordId wid = main_to_id(index);
+        if (strcmp(get_word(wid), word) == 0)
             return wid;
     }
+
+    // recently added words
+    if (!m_sorted_tail.empty())
+    {
+        index = binsearch_tail(word);
+        if (index < static_cast<int>(m_sorted_tail.size()))
+        {
+            WordId wid = m_sorted_tail[index];
+            if (strcmp(get_word(wid), word) == 0)
+                return wid;
+        }
+    }
+
+    // control words, in case they aren't in the main run
+    if (m_sorted.empty())
+    {
+        for (int i=0; i<sorted_words_begin; i++)
+            if (strcmp(get_word(i), word) == 0)
+                return i;
+    }
+
     return WIDNONE;
 }
 
 WordId Dictionary::word_to_id(const wchar_t* word)
 {
-    const char* w = conv.wc2mb(word);
-    return word_to_id(w);
+    WideToUtf8 w(word);
+    if (!w.c_str())
+        return WIDNONE;
+    return word_to_id(w.c_str());
 }
 
 vector<WordId> Dictionary::words_to_ids(const wchar_t** word, int n)
@@ -393,98 +600,230 @@ void Dictionary::ids_to_words(std::vector<const char*>& words,
 // return the word for the given id, fast index lookup
 const char* Dictionary::id_to_word_utf8(WordId wid) const
 {
-    if (/* 0 <= wid && */ wid < (WordId)m_words.size())
-        return m_words[wid];
+    if (/* 0 <= wid && */ wid < (WordId)m_word_offsets.size())
+        return get_word(wid);
     return nullptr;
 }
 
 // return the word for the given id, fast index lookup
+// The result lives in a per-thread buffer until the next call.
 const wchar_t* Dictionary::id_to_word_w(WordId wid) const
 {
-    if (/* 0 <= wid && */ wid < (WordId)m_words.size())
-    {
-        const char* w = m_words[wid];
-        const wchar_t* word = conv.mb2wc(w);
-        return word;
-    }
+    if (/* 0 <= wid && */ wid < (WordId)m_word_offsets.size())
+        return utf8_to_wide_tls(get_word(wid));
     return nullptr;
 }
 
 // Add a word to the dictionary
 WordId Dictionary::add_word(const char* word)
 {
-    char* w = (char*)MemAlloc((strlen(word) + 1) * sizeof(char));
-    if (!w)
+    uint32_t offset;
+    if (!m_arena.add(word, offset))
         return -1;
-    strcpy(w, word);
 
-    WordId wid = (WordId)m_words.size();
-    update_sorting(w, wid);
+    WordId wid = (WordId)m_word_offsets.size();
+    m_word_offsets.push_back(offset);
+    update_sorting(wid);
 
-    m_words.emplace_back(w);
+    // keep the folded index up to date, once it exists
+    if (!m_folded.empty() &&
+        m_folded.size() + 1 == m_word_offsets.size())
+        add_folded(wid);
 
     return wid;
 }
 
 WordId Dictionary::add_word(const wchar_t* word)
 {
-    const char* wtmp = conv.wc2mb(word);
-    if (!wtmp)
+    WideToUtf8 conv(word);
+    if (!conv.c_str())
         return -2;
+    return add_word(conv.c_str());
+}
 
-    char* w = (char*)MemAlloc((strlen(wtmp) + 1) * sizeof(char));
-    if (!w)
-        return -1;
-    strcpy(w, wtmp);
-
-    WordId wid = (WordId)m_words.size();
-    update_sorting(w, wid);
-
-    m_words.push_back(w);
+// Insert the new word into the short tail of the sorted index,
+// O(sqrt(n)) instead of O(n) per word for inserts into the main run.
+void Dictionary::update_sorting(WordId wid)
+{
+    int index = binsearch_tail(get_word(wid));
+    m_sorted_tail.insert(m_sorted_tail.begin()+index, wid);
 
-    return wid;
+    size_t max_tail_size = std::max(64, static_cast<int>(
+                                    sqrt(m_word_offsets.size()) / 2));
+    if (m_sorted_tail.size() > max_tail_size)
+        merge_sorted_tail();
 }
 
-void Dictionary::update_sorting(const char* word, WordId wid)
+void Dictionary::merge_sorted_tail()
 {
-    // first add_word() after set_words()?
-    // -> create the sorted vector
-    if (sorted == nullptr)
+    // first merge after set_words()?
+    // -> create the main run
+    if (m_sorted.empty())
     {
         int i;
-        int size = m_words.size();
-        sorted = new vector<WordId>;
-        for (i = sorted_words_begin; i<size; i++)
-            sorted->push_back(i);
+        m_sorted.reserve(m_implicit_end + m_sorted_tail.size());
+        for (i = sorted_words_begin; i<m_implicit_end; i++)
+            m_sorted.push_back(i);
 
         // Control words weren't sorted before, insert them sorted.
         // -> inefficient, but presumably there is few enough data
         //    to not matter.
         for (i = 0; i<sorted_words_begin; i++)
         {
-            int index = binsearch_sorted(m_words[i]);
-            sorted->insert(sorted->begin()+index, i);
+            int index = lower_bound_word(0, m_sorted.size(), get_word(i),
+                            [this](int k) {return get_word(m_sorted[k]);});
+            m_sorted.insert(m_sorted.begin()+index, i);
         }
     }
 
-    // Bottle neck here, this is rather inefficient.
-    // Everything else just appends, this inserts.
-    // Mitigated due to usage of set_words() for bulk data,
-    // but eventually there should be a better performing
-    // data structure (though this one is pretty memory efficient).
-    int index = search_index(word);
-    sorted->insert(sorted->begin()+index, wid);
+    // Merge in place, from the back. The insertion points of the few
+    // tail words are binary searched; the runs of main words between
+    // them are moved without comparing strings.
+    int i = m_sorted.size();
+    int j = m_sorted_tail.size();
+    m_sorted.resize(i + j);
+    auto it = m_sorted.end();
+    while (j > 0)
+    {
+        WordId wid = m_sorted_tail[--j];
+        int index = lower_bound_word(0, i, get_word(wid),
+                        [this](int k) {return get_word(m_sorted[k]);});
+        it = std::move_backward(m_sorted.begin()+index,
+                                m_sorted.begin()+i, it);
+        *--it = wid;
+        i = index;
+    }
+    m_sorted_tail.clear();
+}
+
+std::string Dictionary::fold_word(const char* word)
+{
+    Utf8ToWide w(word);
+    if (!w.c_str())
+        return word;
+    return fold_word(w.c_str());
+}
+
+std::string Dictionary::fold_word(const wchar_t* word)
+{
+    wstring wf = word;
+    transform(wf.begin(), wf.end(), wf.begin(), PrefixCmp::fold);
+    std::string f;
+    wide_to_utf8(f, wf.c_str());
+    return f;
+}
+
+// Create the folded key, store it only if it differs from the word.
+bool Dictionary::add_folded_key(WordId wid)
+{
+    const char* w = get_word(wid);
+    std::string f = fold_word(w);
+    uint32_t offset = SAME_KEY;
+    if (f != w &&
+        !m_folded_arena.add(f.c_str(), offset))
+        return false;
+    m_folded.push_back(offset);
+    return true;
+}
+
+// Create the folded key and add it to the folded index.
+void Dictionary::add_folded(WordId wid)
+{
+    if (!add_folded_key(wid))
+    {
+        clear_folded();   // rebuilt on the next search
+        return;
+    }
+
+    int index = binsearch_folded(get_folded(wid));
+    m_folded_sorted.insert(m_folded_sorted.begin()+index, wid);
+}
+
+// Build the folded index for all words, if it doesn't exist yet.
+void Dictionary::update_folded_index()
+{
+    if (m_folded.size() == m_word_offsets.size())
+        return;
+
+    clear_folded();
+
+    int size = m_word_offsets.size();
+    m_folded.reserve(size);
+    for (int i=0; i<size; i++)
+        if (!add_folded_key(i))
+        {
+            clear_folded();
+            return;
+        }
+
+    m_folded_sorted.resize(size);
+    for (int i=0; i<size; i++)
+        m_folded_sorted[i] = i;
+    sort(m_folded_sorted.begin(), m_folded_sorted.end(),
+         [this](WordId a, WordId b)
+         { return strcmp(get_folded(a), get_folded(b)) < 0; });
+}
+
+void Dictionary::clear_folded()
+{
+    m_folded_arena.clear();
+    vector<uint32_t>().swap(m_folded);
+    vector<WordId>().swap(m_folded_sorted);
+}
+
+// binary search for index of insertion point (std:lower_bound())
+int Dictionary::binsearch_folded(const char* key)
+{
+    return lower_bound_word(0, m_folded_sorted.size(), key,
+                            [this](int i) {return get_folded(m_folded_sorted[i]);});
+}
+
+// Range [begin, end) of positions in m_folded_sorted of all
+// folded keys starting with the folded utf-8 prefix.
+void Dictionary::folded_prefix_range(const char* prefix, int& begin, int& end)
+{
+    prefix_range_of(0, m_folded_sorted.size(), prefix,
+                    [this](int i) {return get_folded(m_folded_sorted[i]);},
+                    begin, end);
+}
+
+// Options answered from the folded index.
+static const uint32_t INSENSITIVE_OPTIONS =
+    PredictOptions::CASE_INSENSITIVE |
+    PredictOptions::CASE_INSENSITIVE_SMART |
+    PredictOptions::ACCENT_INSENSITIVE |
+    PredictOptions::ACCENT_INSENSITIVE_SMART;
+
+void Dictionary::prepare_search(uint32_t options)
+{
+    if (options & INSENSITIVE_OPTIONS)
+        update_folded_index();
 }
 
 // Find all word ids of words starting with prefix
 void Dictionary::prefix_search(const wchar_t* prefix,
-                               std::vector<WordId>* wids_in,  // may be NULL
+                               const std::vector<WordId>* wids_in,  // may be NULL
                                std::vector<WordId>& wids_out,
                                uint32_t options)
 {
     WordId min_wid = (options & PredictOptions::INCLUDE_CONTROL_WORDS) \
                      ? 0 : NUM_CONTROL_WORDS;
 
+    // Case- and accent-sensitive prefixes can be looked up in the
+    // sorted index, insensitive ones in the index of folded keys.
+    const char* prefix_mb = nullptr;
+    std::string prefix_utf8;
+    if (!wids_in &&
+        prefix && prefix[0])
+    {
+        if (options & INSENSITIVE_OPTIONS)
+            prefix_utf8 = fold_word(prefix);
+        else
+            wide_to_utf8(prefix_utf8, prefix);
+        if (!prefix_utf8.empty())
+            prefix_mb = prefix_utf8.c_str();
+    }
+
     // filter the given word ids only
     if (wids_in)
     {
@@ -494,17 +833,69 @@ void Dictionary::prefix_search(const wchar_t* prefix,
         {
             WordId wid = *it;
             if (wid >= min_wid &&
-                cmp.matches(m_words[wid]))
+                cmp.matches(get_word(wid)))
                 wids_out.push_back(wid);
         }
     }
     else
+    if (prefix_mb && (options & INSENSITIVE_OPTIONS))
+    // folded index, O(log n + matches)
+    {
+        // The folded range is a superset of the actual matches,
+        // "smart" and capitalization rules are checked on it.
+        update_folded_index();
+        PrefixCmp cmp = PrefixCmp(prefix, options);
+
+        int begin, end;
+        folded_prefix_range(prefix_mb, begin, end);
+        for (int i = begin; i<end; i++)
+        {
+            WordId wid = m_folded_sorted[i];
+            if (wid >= min_wid &&
+                cmp.matches(get_word(wid)))
+                wids_out.push_back(wid);
+        }
+    }
+    else
+    if (prefix_mb)
+    // sorted index, O(log n + matches)
+    {
+        // Only the capitalization filters remain to be checked.
+        bool filter = options & (PredictOptions::IGNORE_CAPITALIZED |
+                                 PredictOptions::IGNORE_NON_CAPITALIZED);
+        PrefixCmp cmp = PrefixCmp(prefix, options);
+        auto add_match = [&](WordId wid)
+        {
+            if (wid >= min_wid &&
+                (!filter || cmp.matches(get_word(wid))))
+                wids_out.push_back(wid);
+        };
+
+        int begin, end;
+        main_prefix_range(prefix_mb, begin, end);
+        for (int i = begin; i<end; i++)
+            add_match(main_to_id(i));
+
+        tail_prefix_range(prefix_mb, begin, end);
+        for (int i = begin; i<end; i++)
+            add_match(m_sorted_tail[i]);
+
+        // Without the explicit main run, control words aren't
+        // part of the sorted range, check them separately.
+        if (m_sorted.empty())
+        {
+            for (int i = min_wid; i<sorted_words_begin; i++)
+                if (cmp.matches(get_word(i)))
+                    wids_out.push_back(i);
+        }
+    }
+    else
     // exhaustive search through the dictionary
     {
         PrefixCmp cmp = PrefixCmp(prefix, options);
-        int size = m_words.size();
+        int size = m_word_offsets.size();
         for (int i = min_wid; i<size; i++)
-            if (cmp.matches(m_words[i]))
+            if (cmp.matches(get_word(i)))
                 wids_out.push_back(i);
     }
 }
@@ -515,40 +906,51 @@ void Dictionary::prefix_search(const wchar_t* prefix,
 //              -n = number of partial matches (prefix search)
 int Dictionary::lookup_word(const wchar_t* word)
 {
-    const char* w = conv.wc2mb(word);
+    WideToUtf8 conv(word);
+    const char* w = conv.c_str();
     if (!w)
         return 0;
 
-    // binary search for the first match
-    // then linearly collect all subsequent matches
-    int len = strlen(w);
-    int size = m_words.size();
-    int count = 0;
-
-    int index = search_index(w);
+    // binary search for the ranges of words starting with w
+    int begin, end;
+    int tail_begin, tail_end;
+    main_prefix_range(w, begin, end);
+    tail_prefix_range(w, tail_begin, tail_end);
 
     // try exact match first
-    if (index >= 0 && index < (int)m_words.size())
-    {
-        WordId wid = sorted ? (*sorted)[index] : index;
-        if (strcmp(m_words[wid], w) == 0)
-            return 1;
-    }
+    if (begin < end &&
+        strcmp(get_word(main_to_id(begin)), w) == 0)
+        return 1;
+    if (tail_begin < tail_end &&
+        strcmp(get_word(m_sorted_tail[tail_begin]), w) == 0)
+        return 1;
 
     // then count partial matches
-    for (int i=index; i<size; i++)
+    int count = end - begin + tail_end - tail_begin;
+
+    // control words, in case they aren't in the main run
+    if (m_sorted.empty())
     {
-        WordId wid = sorted ? (*sorted)[index] : index;
-        if (strncmp(m_words[wid], w, len) != 0)
-            break;
-        count++;
+        int len = strlen(w);
+        for (int i=0; i<sorted_words_begin; i++)
+        {
+            const char* cw = get_word(i);
+            if (strncmp(cw, w, len) == 0)
+            {
+                if (cw[len] == '\0')
+                    return 1;
+                count++;
+            }
+        }
     }
+
     return -count;
 }
 
 // Estimate a lower bound for the memory usage of the dictionary.
-// This includes overallocations by std::vector, but excludes memory
-// used for heap management and possible heap fragmentation.
+// This includes overallocations by std::vector and the arena, but
+// excludes memory used for heap management and possible heap
+// fragmentation. Words in external storage count as strings.
 uint64_t Dictionary::get_memory_size()
 {
     uint64_t sum = 0;
@@ -556,29 +958,39 @@ uint64_t Dictionary::get_memory_size()
     uint64_t d = sizeof(Dictionary);
     sum += d;
 
-    uint64_t w = 0;
-    for (unsigned i=0; i<m_words.size(); i++)
-        w += (strlen(m_words[i]) + 1);
+    uint64_t w = m_arena.get_memory_size() + m_arena.get_external_size();
     sum += w;
 
-    uint64_t wc = sizeof(char*) * m_words.capacity();
-    sum += wc;
+    uint64_t wo = sizeof(uint32_t) * m_word_offsets.capacity();
+    sum += wo;
 
-    uint64_t sc = sorted ? sizeof(WordId) * sorted->capacity() : 0;
+    uint64_t sc = sizeof(WordId) * (m_sorted.capacity() +
+                                    m_sorted_tail.capacity());
     sum += sc;
 
+    uint64_t f = m_folded_arena.get_memory_size() +
+                 sizeof(uint32_t) * m_folded.capacity() +
+                 sizeof(WordId) * m_folded_sorted.capacity();
+    sum += f;
+
     #ifdef LMDEBUG
-    printf("dictionary object: %12ld Byte\n", d);
-    printf("strings:           %12ld Byte (%u)\n", w, (unsigned)words.size());
-    printf("words.capacity:    %12ld Byte (%u)\n", wc, (unsigned)words.capacity());
-    printf("sorted.capacity:   %12ld Byte (%u)\n", sc, (unsigned)sorted->capacity());
-    printf("Dictionary total:  %12ld Byte\n", sum);
+    printf("dictionary object: %12lu Byte\n", (unsigned long)d);
+    printf("strings:           %12lu Byte (%lu used, %lu external)\n",
+           (unsigned long)w, (unsigned long)m_arena.get_used_size(),
+           (unsigned long)m_arena.get_external_size());
+    printf("offsets:           %12lu Byte (%u words)\n",
+           (unsigned long)wo, (unsigned)m_word_offsets.size());
+    printf("sorted index:      %12lu Byte (%u + %u tail)\n",
+           (unsigned long)sc, (unsigned)m_sorted.size(),
+           (unsigned)m_sorted_tail.size());
+    printf("folded index:      %12lu Byte (%u)\n",
+           (unsigned long)f, (unsigned)m_folded.size());
+    printf("Dictionary total:  %12lu Byte\n", (unsigned long)sum);
     #endif
 
     return sum;
 }
 
-
 //------------------------------------------------------------------------
 // LanguageModel - base class of all language models
 //------------------------------------------------------------------------
@@ -693,6 +1105,32 @@ void LanguageModel::predict(std::vector<PredictResult>& results,
                             const std::vector<const wchar_t*>& context,
                             int limit, PredictOptions options)
 {
+    vector<WordId> wids;
+    vector<double> probabilities;
+    predict_ids(wids, probabilities, context, limit, options);
+
+    // merge words and probabilities into the return array
+    results.clear();
+    results.reserve(wids.size());
+    for (int i=0; i<(int)wids.size(); i++)
+    {
+        const wchar_t* word = id_to_word(wids[i]);
+        if (word)
+        {
+            PredictResult result = {word, probabilities[i]};
+            results.push_back(result);
+        }
+    }
+}
+
+void LanguageModel::predict_ids(std::vector<WordId>& wids_out,
+                                std::vector<double>& probabilities_out,
+                                const std::vector<const wchar_t*>& context,
+                                int limit, PredictOptions options)
+{
+    wids_out.clear();
+    probabilities_out.clear();
+
     if (!context.size())
         return;
 
@@ -707,20 +1145,25 @@ void LanguageModel::predict(std::vector<PredictResult>& results,
     const wchar_t* prefix = split_context(context, h);
     vector<WordId> history = words_to_ids(h);
 
-    // get candidate words, completion
     vector<WordId> wids;
-    get_candidates(history, prefix, wids, options);
+    vector<double> probabilities;
+    if (!get_cached_probs(history, prefix, options, wids, probabilities))
+    {
+        // get candidate words, completion
+        get_candidates(history, prefix, wids, options);
 
-    // calculate probability vector
-    vector<double> probabilities(wids.size());
-    get_probs(history, wids, probabilities);
+        // calculate probability vector
+        probabilities.resize(wids.size());
+        get_probs(history, wids, probabilities);
+    }
+    update_prediction_cache(history, prefix, options, wids, probabilities);
 
-    // prepare results vector
+    // prepare results vectors
     int result_size = wids.size();
     if (limit >= 0 && limit < result_size)
         result_size = limit;
-    results.clear();
-    results.reserve(result_size);
+    wids_out.reserve(result_size);
+    probabilities_out.reserve(result_size);
 
     if (!(options & NO_SORT)) // allow to skip sorting for calls from another model, i.e. linint
     {
@@ -728,84 +1171,140 @@ void LanguageModel::predict(std::vector<PredictResult>& results,
         vector<int32_t> argsort(wids.size());
         for (int i=0; i<(int)wids.size(); i++)
             argsort[i] = i;
-        stable_argsort_desc(argsort, probabilities);
 
-        // merge word ids and probabilities into the return array
+        // With a limit, only the top results need to be in order.
+        if (result_size < (int)wids.size())
+            partial_argsort_desc(argsort, probabilities, result_size);
+        else
+            stable_argsort_desc(argsort, probabilities);
+
         for (int i=0; i<result_size; i++)
         {
             int index = argsort[i];
-            const wchar_t* word = id_to_word(wids[index]);
-            if (word)
-            {
-                PredictResult result = {word, probabilities[index]};
-                results.push_back(result);
-            }
+            wids_out.push_back(wids[index]);
+            probabilities_out.push_back(probabilities[index]);
         }
     }
     else
     {
-        // merge word ids and probabilities into the return array
-        for (int i=0; i<result_size; i++)
-        {
-            const wchar_t* word = id_to_word(wids[i]);
-            if (word)
-            {
-                PredictResult result = {word, probabilities[i]};
-                results.push_back(result);
-            }
-        }
+        wids.resize(result_size);
+        probabilities.resize(result_size);
+        wids_out.swap(wids);
+        probabilities_out.swap(probabilities);
+    }
+}
+
+// Narrow down the candidates of the previous prediction, if the
+// history is unchanged and the completion prefix extends the
+// previous one. Returns false if the cache can't be used.
+bool LanguageModel::get_cached_probs(const std::vector<WordId>& history,
+                                     const wchar_t* prefix, uint32_t options,
+                                     std::vector<WordId>& wids,
+                                     std::vector<double>& probabilities)
+{
+    const PredictionCache& cache = m_prediction_cache;
+    if (!cache.valid ||
+        cache.options != options ||
+        cache.history != history ||
+        !prefix ||
+        wcsncmp(prefix, cache.prefix.c_str(), cache.prefix.size()) != 0)
+        return false;
+
+    // The new candidates are a subset of the cached ones, both sorted.
+    std::vector<WordId> matches;
+    m_dictionary.prefix_search(prefix, &cache.wids, matches, options);
+
+    wids.reserve(matches.size());
+    probabilities.reserve(matches.size());
+    size_t j = 0;
+    for (WordId wid : matches)
+    {
+        while (cache.wids[j] != wid)
+            j++;
+        wids.push_back(wid);
+        probabilities.push_back(cache.probabilities[j]);
     }
+    return true;
 }
 
-// Return the probability of a single n-gram.
-// This is very inefficient, not optimized for speed at all, but it's
-// basically only there for entropy testing and not involved in
-// actual word prediction tasks.
+void LanguageModel::update_prediction_cache(const std::vector<WordId>& history,
+                                            const wchar_t* prefix, uint32_t options,
+                                            const std::vector<WordId>& wids,
+                                            const std::vector<double>& probabilities)
+{
+    PredictionCache& cache = m_prediction_cache;
+
+    // Only completions of non-empty prefixes can be narrowed down.
+    // Without prefix, candidates are chosen differently, see
+    // get_candidates().
+    if (!prefix || !prefix[0])
+    {
+        cache = {};
+        return;
+    }
+
+    cache.valid = true;
+    cache.history = history;
+    cache.prefix = prefix;
+    cache.options = options;
+    cache.wids = wids;
+    cache.probabilities = probabilities;
+}
+
+// Return the probability of a single n-gram, the probability its last
+// word would get in an unlimited prediction with INCLUDE_CONTROL_WORDS,
+// but without predicting all the other words.
 double LanguageModel::get_probability(const wchar_t* const* ngram, int n)
 {
-#if 1
-    if (n)
+    if (!n || !is_model_valid())
+        return 0.0;
+
+    vector<WordId> wids(n);
+    for (int i=0; i<n; i++)
+        wids[i] = word_to_id(ngram[i]);
+
+    NodeValueCache cache;
+    return score_ngram(wids.data(), n, cache);
+}
+
+// Score all n-grams of up to order tokens in a text, e.g. to compute
+// its entropy. Histories recur, their node sums are computed only once.
+void LanguageModel::get_probabilities(vector<double>& probabilities,
+                                      const wchar_t* const* tokens,
+                                      int num_tokens, int order)
+{
+    probabilities.assign(num_tokens, 0.0);
+    if (order < 1 || !is_model_valid())
+        return;
+
+    vector<WordId> wids(num_tokens);
+    for (int i=0; i<num_tokens; i++)
+        wids[i] = word_to_id(tokens[i]);
+
+    NodeValueCache cache;
+    for (int i=0; i<num_tokens; i++)
     {
-        // clear the last word of the context
-        vector<const wchar_t*> ctx((wchar_t**)ngram, (wchar_t**)ngram+n-1);
-        const wchar_t* word = ngram[n-1];
-        ctx.push_back((wchar_t*)L"");
-
-        // run an unlimited prediction to get normalization right for
-        // overlay and loglinint
-        vector<PredictResult> results;
-        predict(results, ctx, -1, NORMALIZE);
-
-        double psum = 0;
-        for (int i=0; i<(int)results.size(); i++)
-            psum += results[i].p;
-        if (fabs(1.0 - psum) > 1e5)
-            printf("%f\n", psum);
-
-        for (int i=0; i<(int)results.size(); i++)
-            if (results[i].word == word)
-                return results[i].p;
-        for (int i=0; i<(int)results.size(); i++)
-            if (results[i].word == L"<unk>")
-                return results[i].p;
+        int begin = std::max(0, i+1 - order);
+        probabilities[i] = score_ngram(&wids[begin], i+1 - begin, cache);
     }
-    return 0.0;
-#else
-    // split ngram into history and last word
-    const wchar_t* word = ngram[n-1];
-    vector<WordId> history;
-    for (int i=0; i<n-1; i++)
-        history.push_back(word_to_id(ngram[i]));
-
-    // build candidate word vector
-    vector<WordId> wids(1, word_to_id(word));
-
-    // calculate probability
-    vector<double> vp(1);
-    get_probs(history, wids, vp);
+}
 
+double LanguageModel::score_ngram(const WordId* wids, int n,
+                                  NodeValueCache& cache)
+{
+    // Prediction drops words with removed unigrams from the
+    // candidates; score them as <unk>, or 0 if that is gone as well.
+    vector<WordId> words;
+    filter_candidates({wids[n-1]}, words);
+    if (words.empty() && wids[n-1] != UNKNOWN_WORD_ID)
+        filter_candidates({UNKNOWN_WORD_ID}, words);
+    if (words.empty())
+        return 0.0;
+
+    vector<WordId> history(wids, wids+n-1);
+    vector<double> vp(1);
+    get_probs(history, words, vp, &cache);
     return vp[0];
-#endif
 }
 
 // split context into history and prefix
@@ -912,6 +1411,8 @@ std::string get_error_msg(const LMError err, const char* filename)
                     msg = "error encoding to UTF-8"; break;
                 case ERR_MD2WC:
                     msg = "error decoding to Unicode"; break;
+                case ERR_FORMAT:
+                    msg = "unknown format or version"; break;
                 default:
                     ss << "Unknown Error";
             }
@@ -25,15 +25,17 @@
 #include <stdio.h>
 #include <optional>
 #include <string.h>
-#include <iconv.h>
 #include <errno.h> // EINVAL
 #include <wchar.h>
 #include <vector>
 #include <map>
+#include <memory>
+#include <unordered_map>
 #include <algorithm>
 #include <string>
 
 #include "lm_decls.h"
+#include "lm_utf8.h"
 #include "pool_allocator.h"
 
 class UString;
@@ -98,6 +100,7 @@ enum LMError
     ERR_UNEXPECTED_EOF,
     ERR_WC2MB,
     ERR_MD2WC,
+    ERR_FORMAT,
 };
 
 class Exception : public std::runtime_error
@@ -122,81 +125,134 @@ int binsearch(const std::vector<T>& v, T key)
     return -1;
 }
 
-class StrConv
+// For each key of the shorter ascending sequence, search forward in the
+// longer one, first in exponentially growing steps, then by bisection.
+// Calls func(index_short, index_long) for each common key.
+template <class KS, class KL, class F>
+void gallop_join(int ns, const KS& key_s, int nl, const KL& key_l, const F& func)
 {
-    public:
-        StrConv();
-        ~StrConv();
+    int lo = 0;
+    for (int i=0; i<ns && lo<nl; i++)
+    {
+        auto key = key_s(i);
+
+        int hi = lo;
+        int step = 1;
+        while (hi < nl && key_l(hi) < key)
+        {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        if (hi > nl)
+            hi = nl;
 
-        // decode multi-byte to wide-char
-        const wchar_t* mb2wc (const char* instr) const
+        while (lo < hi)
         {
-            char* inptr = const_cast<char*>(instr);
-            size_t inbytes = strlen(instr);
+            int mid = lo + (hi - lo) / 2;
+            if (key_l(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
 
-            static char outstr[4096];
-            char* outptr = outstr;
-            size_t outbytes = sizeof(outstr);
+        if (lo < nl && key_l(lo) == key)
+            func(i, lo++);
+    }
+}
 
-            size_t nconv;
+// Intersect two ascending sequences of keys, given by index accessors,
+// and call func(index_a, index_b) for each common key. Merges linearly
+// when both are of similar length, else gallops through the longer one.
+template <class KA, class KB, class F>
+void merge_join(int na, const KA& key_a, int nb, const KB& key_b, const F& func)
+{
+    const int GALLOP_RATIO = 8;
+    if (nb > na * GALLOP_RATIO)
+    {
+        gallop_join(na, key_a, nb, key_b, func);
+    }
+    else if (na > nb * GALLOP_RATIO)
+    {
+        gallop_join(nb, key_b, na, key_a,
+                    [&](int ib, int ia) {func(ia, ib);});
+    }
+    else
+    {
+        int ia = 0;
+        int ib = 0;
+        while (ia < na && ib < nb)
+        {
+            auto a = key_a(ia);
+            auto b = key_b(ib);
+            if (a < b)
+                ia++;
+            else if (b < a)
+                ib++;
+            else
+                func(ia++, ib++);
+        }
+    }
+}
 
-            nconv = iconv (cd_mb_wc, &inptr, &inbytes, &outptr, &outbytes);
-            if (nconv == (size_t) -1)
-            {
-                // Not everything went right.  It might only be
-                // an unfinished byte sequence at the end of the
-                // buffer.  Or it is a real problem.
-                if (errno != EINVAL)
-                {
-                    // It is a real problem.  Maybe we ran out of space
-                    // in the output buffer or we have invalid input.
-                    return NULL;
-                }
-            }
+//------------------------------------------------------------------------
+// StringArena - append-only storage of zero terminated strings
+//------------------------------------------------------------------------
+// Strings are packed into large chunks and addressed by 32 bit offsets,
+// half the size of pointers. Chunks never move; strings stay in place
+// until clear(). The upper bits of an offset select a 64 KiB block in a
+// table of block addresses, the lower bits the byte in that block.
+// Each chunk takes up as many consecutive blocks as it spans, so
+// strings may cross block boundaries within their chunk.
+class StringArena
+{
+    public:
+        StringArena() = default;
+        StringArena(const StringArena&) = delete;
+        StringArena& operator=(const StringArena&) = delete;
 
-            // Terminate the output string.
-            if (outbytes >= sizeof (wchar_t))
-                *((wchar_t *) outptr) = L'\0';
+        void clear();
 
-            return (wchar_t *) outstr;
-        }
+        // Make room for size more bytes in one chunk, before bulk adds.
+        bool reserve(size_t size);
 
-        // encode wide-char to multi-byte
-        const char* wc2mb (const wchar_t *instr)
-        {
-            char* inptr = (char*)instr;
-            size_t inbytes = wcslen(instr) * sizeof(*instr);
+        // Copy s into the arena. Returns false when out of memory or
+        // out of offsets, i.e. beyond 4 GiB.
+        bool add(const char* s, uint32_t& offset);
 
-            static char outstr[4096];
-            char* outptr = outstr;
-            size_t outbytes = sizeof(outstr);
+        // Address read-only storage outside of the arena without copying
+        // it, e.g. a memory mapped file. Byte i of data gets offset
+        // base + i. The data has to stay valid until clear().
+        bool add_external(const char* data, size_t size, uint32_t& base);
 
-            size_t nconv = iconv(cd_wc_mb, &inptr, &inbytes,
-                                           &outptr, &outbytes);
-            if (nconv == (size_t) -1)
-            {
-                // Not everything went right.  It might only be
-                // an unfinished byte sequence at the end of the
-                // buffer.  Or it is a real problem.
-                if (errno != EINVAL)
-                {
-                    // It is a real problem.  Maybe we ran out of space
-                    // in the output buffer or we have invalid input.
-                    return NULL;
-                }
-            }
+        const char* get(uint32_t offset) const
+        {
+            return m_blocks[offset >> BLOCK_BITS] + (offset & BLOCK_MASK);
+        }
 
-            // Terminate the output string.
-            if (outbytes >= sizeof (wchar_t))
-                *outptr = '\0';
+        uint64_t get_memory_size() const;  // owned chunks and block table
+        uint64_t get_used_size() const {return m_used_size;}
+        uint64_t get_external_size() const {return m_external_size;}
 
-            return outstr;
-        }
     private:
-        iconv_t cd_mb_wc;
-        iconv_t cd_wc_mb;
-};
+        bool add_blocks(const char* data, size_t size, uint32_t& base);
 
+    private:
+        static const int BLOCK_BITS = 16;
+        static const uint32_t BLOCK_MASK = (1u << BLOCK_BITS) - 1;
+        static const size_t MAX_BLOCKS = size_t(1) << (32 - BLOCK_BITS);
+        static const size_t MIN_CHUNK_SIZE = 4096;
+        static const size_t MAX_CHUNK_SIZE = 1 << 20;
+
+        std::vector<const char*> m_blocks;  // address of each block
+        std::vector<std::unique_ptr<char[]>> m_chunks;  // owned chunks
+        char* m_pos{nullptr};        // free space in the last chunk
+        char* m_end{nullptr};
+        uint32_t m_pos_offset{0};    // offset of m_pos
+        uint64_t m_chunks_size{0};   // bytes allocated for chunks
+        uint64_t m_used_size{0};     // bytes of strings copied
+        uint64_t m_external_size{0};
+};
 
 //------------------------------------------------------------------------
 // Dictionary - contains the vocabulary of the language model
@@ -229,6 +285,13 @@ class Dictionary
                           const std::vector<WordId>& wids);
 
         LMError set_words(const std::vector<const char*>& new_words);
+
+        // Use words from read-only storage outside of the dictionary,
+        // e.g. a memory mapped model file, without copying them.
+        // Word i starts at blob + offsets[i]. Expects control words
+        // first, then all other words sorted.
+        LMError set_external_words(const char* blob, size_t blob_size,
+                                   const uint32_t* offsets, int num_words);
         WordId add_word(const char* word);  // utf-8
         WordId add_word(const wchar_t* word);
 
@@ -316,85 +379,162 @@ class Dictionary
 
         bool contains(const wchar_t* word) {return word_to_id(word) != WIDNONE;}
 
+        // Find all word ids of words starting with prefix.
+        // Searches with non-empty prefix are answered from the sorted
+        // index, or the folded index for case- and accent-insensitive
+        // options. Results are not ordered by word id then.
         void prefix_search(const wchar_t* prefix,
-                           std::vector<WordId>* wids_in,  // may be NULL
+                           const std::vector<WordId>* wids_in,  // may be NULL
                            std::vector<WordId>& wids_out,
                            uint32_t options = 0);
+
+        // Build the indexes prefix_search() with options would create
+        // on first use.
+        void prepare_search(uint32_t options);
+
         int lookup_word(const wchar_t* word);
 
-        int get_num_word_types() {return m_words.size();}
+        int get_num_word_types() {return m_word_offsets.size();}
 
         uint64_t get_memory_size();
 
+        // Changes whenever word ids may have been reassigned, i.e. on
+        // clear() and set_words(). Unique across all dictionaries.
+        uint64_t get_generation() const {return m_generation;}
+        static uint64_t new_generation();
+
     protected:
-        int search_index(const char* word)
+        const char* get_word(WordId wid) const
         {
-            int index;
-            if (sorted)
-                index = binsearch_sorted(word);
-            else
-            {
-                // search non-control words
-                index = binsearch_words(word);
-
-                // else try to find a control word match
-                if (index >= (int)m_words.size() ||
-                    strcmp(m_words[index], word) != 0)
-                {
-                    for (int i=0; i<sorted_words_begin; i++)
-                        if (strcmp(m_words[i], word) == 0)
-                        {
-                            index = i;
-                            break;
-                        }
-                }
-            }
-            return index;
+            return m_arena.get(m_word_offsets[wid]);
         }
 
-        // binary search for index of insertion point (std:lower_bound())
-        int binsearch_sorted(const char* word)
+        // Main run of the sorted index, position index -> word id.
+        int main_end() const
         {
-            int lo = 0;
-            int hi = sorted->size();
-            while (lo < hi)
-            {
-                int mid = (lo+hi)>>1;
-                int cmp = strcmp(m_words[(*sorted)[mid]], word);
-                if (cmp < 0)
-                    lo = mid + 1;
-                else
-                    hi = mid;
-            }
-            return lo;
+            return m_sorted.empty() ? m_implicit_end : m_sorted.size();
+        }
+        WordId main_to_id(int index) const
+        {
+            return m_sorted.empty() ? index : m_sorted[index];
         }
 
         // binary search for index of insertion point (std:lower_bound())
-        int binsearch_words(const char* word)
+        int binsearch_main(const char* word);
+        int binsearch_tail(const char* word);
+
+        // Range [begin, end) of positions in the main run and in the
+        // tail of all words starting with the utf-8 prefix.
+        void main_prefix_range(const char* prefix, int& begin, int& end);
+        void tail_prefix_range(const char* prefix, int& begin, int& end);
+
+        void update_sorting(WordId wid);
+        void merge_sorted_tail();
+
+        // Folded keys: lower case and accents removed.
+        std::string fold_word(const char* word);
+        std::string fold_word(const wchar_t* word);
+        const char* get_folded(WordId wid) const
         {
-            int lo = sorted_words_begin;
-            int hi = m_words.size();
-            while (lo < hi)
-            {
-                int mid = (lo+hi)>>1;
-                int cmp = strcmp(m_words[mid], word);
-                if (cmp < 0)
-                    lo = mid + 1;
-                else
-                    hi = mid;
-            }
-            return lo;
+            uint32_t offset = m_folded[wid];
+            return offset == SAME_KEY ? get_word(wid) :
+                                        m_folded_arena.get(offset);
         }
-
-        void update_sorting(const char* word, WordId wid);
+        bool add_folded_key(WordId wid);
+        void add_folded(WordId wid);
+        void update_folded_index();
+        void clear_folded();
+        int binsearch_folded(const char* key);
+        void folded_prefix_range(const char* prefix, int& begin, int& end);
 
     protected:
-        std::vector<char*> m_words;
-        std::vector<WordId>* sorted;  // only when words aren't already sorted
+        StringArena m_arena;                  // utf-8 words
+        std::vector<uint32_t> m_word_offsets; // into m_arena, by word id
+
+        // Sorted index: word ids in the order of their words, a main run
+        // and a short sorted tail of recently added words, merged into
+        // the main run once it outgrows half the square root of the
+        // vocabulary size. Until the first merge the main run is
+        // implicit: set_words() leaves the words from sorted_words_begin
+        // to m_implicit_end sorted by id, with the control words before
+        // them unsorted.
+        std::vector<WordId> m_sorted;
+        std::vector<WordId> m_sorted_tail;
         int sorted_words_begin;
-        StrConv conv;
+        int m_implicit_end;
+        uint64_t m_generation{0};
+
+        // Folded keys for case- and accent-insensitive prefix searches,
+        // built on first use. SAME_KEY entries share the key with the word.
+        static const uint32_t SAME_KEY = UINT32_MAX;
+        StringArena m_folded_arena;
+        std::vector<uint32_t> m_folded;       // into m_folded_arena
+        std::vector<WordId> m_folded_sorted;  // word ids sorted by folded key
 };
 
+//------------------------------------------------------------------------
+// PredictionCache - candidates and probabilities of the last prediction
+//------------------------------------------------------------------------
+
+// While typing a word, the history stays the same and the completion
+// prefix only grows. The candidates for the longer prefix are then a
+// subset of the previous candidates and their probabilities don't change.
+struct PredictionCache
+{
+    bool valid{false};
+    std::vector<WordId> history;
+    std::wstring prefix;
+    uint32_t options{0};
+    std::vector<WordId> wids;           // sorted candidate word ids
+    std::vector<double> probabilities;  // one per candidate
+};
+
+//------------------------------------------------------------------------
+// NodeValueCache - values computed from trie nodes, while scoring text
+//------------------------------------------------------------------------
+
+// Smoothing needs sums over all children of history nodes, taking time
+// linear in their number, the whole vocabulary at the root. Scoring a
+// text asks for the same histories over and over; their sums are
+// computed once per text. Entries are only valid as long as the model
+// doesn't change.
+class NodeValueCache
+{
+    public:
+        enum Value {N1PRX, N1PRX_KN, CHILD_COUNTS, RECENCY_WEIGHTS};
+
+        // Value v of node, compute() only if not known yet.
+        template <class F>
+        double get(const void* node, Value v, const F& compute)
+        {
+            auto it = m_values.find({node, v});
+            if (it != m_values.end())
+                return it->second;
+            double value = compute();
+            m_values.emplace(Key{node, v}, value);
+            return value;
+        }
+
+    private:
+        using Key = std::pair<const void*, int>;
+        struct KeyHash
+        {
+            size_t operator()(const Key& key) const
+            {
+                return std::hash<const void*>()(key.first) * 31 + key.second;
+            }
+        };
+        std::unordered_map<Key, double, KeyHash> m_values;
+};
+
+// Value of node through cache, without cache computed on every call.
+template <class F>
+double get_node_value(NodeValueCache* cache, const void* node,
+                      NodeValueCache::Value v, const F& compute)
+{
+    return cache ? cache->get(node, v, compute) : compute();
+}
+
 
 //------------------------------------------------------------------------
 // LanguageModel - base class of language models
@@ -411,9 +551,16 @@ class LanguageModel
 
         virtual void clear()
         {
+            m_prediction_cache = {};
             m_dictionary.clear();
         }
 
+        // Call on every change that may affect probabilities.
+        void invalidate_prediction_cache()
+        {
+            m_prediction_cache.valid = false;
+        }
+
         // never fails
         virtual WordId word_to_id(const wchar_t* word)
         {
@@ -448,6 +595,11 @@ class LanguageModel
             return m_dictionary.lookup_word(word);
         }
 
+        // Predict the words following the history in context, its last
+        // element is the completion prefix. Not read-only: each call
+        // updates the model's PredictionCache and may build the folded
+        // index of the dictionary. Concurrent predictions are only safe
+        // on different model instances, see also prepare_predict().
         virtual void predict(std::vector<UString>& uresults,
                              const std::vector<UString>& ucontext,
                              std::optional<size_t> limit={},
@@ -463,8 +615,47 @@ class LanguageModel
                              int limit=-1,
                              PredictOptions options = DEFAULT_OPTIONS);
 
+        // Same as predict(), but returns word ids instead of words,
+        // see get_predicted_word().
+        virtual void predict_ids(std::vector<WordId>& wids,
+                                 std::vector<double>& probabilities,
+                                 const std::vector<const wchar_t*>& context,
+                                 int limit=-1,
+                                 PredictOptions options = DEFAULT_OPTIONS);
+
+        // Build the state predictions with options would otherwise create
+        // on first use, e.g. before predicting from worker threads.
+        virtual void prepare_predict(PredictOptions options)
+        {
+            m_dictionary.prepare_search(options);
+        }
+
+        // Utf-8 word of an id returned by predict_ids().
+        virtual const char* get_predicted_word(WordId wid)
+        {
+            return m_dictionary.id_to_word_utf8(wid);
+        }
+
+        // Changes whenever the ids of predict_ids() may stand for
+        // different words than before.
+        virtual uint64_t get_word_id_generation()
+        {
+            return m_dictionary.get_generation();
+        }
+
+        // Probability of the last word of ngram following the words
+        // before it, as predicted over the whole vocabulary with
+        // INCLUDE_CONTROL_WORDS. Unknown words score as <unk>.
         virtual double get_probability(const wchar_t* const* ngram, int n);
 
+        // Score a text, e.g. for entropy: probabilities[i] is
+        // get_probability() of the n-gram of up to order tokens ending
+        // at tokens[i]. Words are looked up once per token and sums over
+        // history nodes computed once per text.
+        virtual void get_probabilities(std::vector<double>& probabilities,
+                                       const wchar_t* const* tokens,
+                                       int num_tokens, int order);
+
         virtual int get_num_word_types() {return m_dictionary.get_num_word_types();}
 
         virtual bool is_model_valid() = 0;
@@ -505,18 +696,39 @@ class LanguageModel
         {
             std::copy(in.begin(), in.end(), std::back_inserter(out));
         }
+        // Probabilities of the candidate words following history.
+        // With a cache, values of history nodes are kept for later calls.
         virtual void get_probs(const std::vector<WordId>& history,
                                const std::vector<WordId>& words,
-                               std::vector<double>& probabilities)
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr)
         {
             (void)history;
             (void)words;
             (void)probabilities;
+            (void)cache;
         }
         LMError read_utf8(const char* filename, wchar_t*& text);
 
+        // Probability of the last of n word ids following the others,
+        // get_probs() for a single candidate.
+        double score_ngram(const WordId* wids, int n, NodeValueCache& cache);
+
+    private:
+        bool get_cached_probs(const std::vector<WordId>& history,
+                              const wchar_t* prefix, uint32_t options,
+                              std::vector<WordId>& wids,
+                              std::vector<double>& probabilities);
+        void update_prediction_cache(const std::vector<WordId>& history,
+                                     const wchar_t* prefix, uint32_t options,
+                                     const std::vector<WordId>& wids,
+                                     const std::vector<double>& probabilities);
+
     public:
         Dictionary m_dictionary;
+
+    private:
+        PredictionCache m_prediction_cache;
 };
 
 
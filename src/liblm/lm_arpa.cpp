@@ -0,0 +1,112 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "lm_arpa.h"
+
+namespace lm {
+
+FileContents::~FileContents()
+{
+    if (m_mapped)
+        munmap(const_cast<char*>(m_data), m_size);
+}
+
+LMError FileContents::load(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return ERR_FILE;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            m_data = static_cast<const char*>(p);
+            m_size = st.st_size;
+            m_mapped = true;
+        }
+    }
+
+    // pipes and the like
+    if (!m_mapped)
+    {
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            m_buffer.append(buf, n);
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+        if (n < 0)
+        {
+            close(fd);
+            return ERR_FILE;
+        }
+    }
+
+    close(fd);
+    return ERR_NONE;
+}
+
+int split_line(const char* line, const char* end, const char*& next,
+               char* buf, int buf_size, char** tokens, int max_tokens)
+{
+    const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+    next = eol ? eol + 1 : end;
+
+    int len = std::min(static_cast<int>(next - line), buf_size - 1);
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+
+    int i;
+    char *tstate;
+    tokens[0] = strtok_r(buf, " \n", &tstate);
+    for (i=0; tokens[i] && i < max_tokens-1; i++)
+        tokens[i+1] = strtok_r(NULL, " \n", &tstate);
+    return i;
+}
+
+const char* find_section_end(const char* begin, const char* end)
+{
+    const char* p = begin;
+    while ((p = static_cast<const char*>(memchr(p, '\\', end - p))))
+    {
+        const char* line = p;
+        while (line > begin && line[-1] == ' ')
+            line--;
+        if (line == begin || line[-1] == '\n')
+            return line;
+        p++;
+    }
+    return end;
+}
+
+void split_arpac_chunks(const char*& p, const char* end, int max_chunks,
+                        std::vector<ArpaChunk>& chunks)
+{
+    const size_t CHUNK_SIZE = 1 << 20;
+
+    chunks.clear();
+    while (p < end && static_cast<int>(chunks.size()) < max_chunks)
+    {
+        const char* e = end;
+        if (static_cast<size_t>(end - p) > CHUNK_SIZE)
+        {
+            e = static_cast<const char*>(memchr(p + CHUNK_SIZE, '\n',
+                                                end - p - CHUNK_SIZE));
+            e = e ? e + 1 : end;
+        }
+        chunks.emplace_back();
+        chunks.back().begin = p;
+        chunks.back().end = e;
+        p = e;
+    }
+}
+
+}
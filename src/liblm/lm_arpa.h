@@ -0,0 +1,141 @@
+#ifndef LM_ARPA_H
+#define LM_ARPA_H
+
+#include <stdlib.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "lm.h"
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// Reading of ARPA-like files with counts, shared by the model loaders
+//------------------------------------------------------------------------
+
+// Contents of a file, memory mapped if possible, else read into memory.
+class FileContents
+{
+    public:
+        ~FileContents();
+
+        LMError load(const char* filename);
+
+        const char* begin() const {return m_data;}
+        const char* end() const {return m_data + m_size;}
+
+    private:
+        const char* m_data{NULL};
+        size_t m_size{0};
+        bool m_mapped{false};
+        std::string m_buffer;
+};
+
+// Copy the line starting at line into buf and chop it into tokens.
+// Returns the number of tokens, next is set to the following line.
+int split_line(const char* line, const char* end, const char*& next,
+               char* buf, int buf_size, char** tokens, int max_tokens);
+
+// Start of the first line in [begin, end) whose first token begins with
+// a backslash, i.e. the next section header or \end\, else end.
+const char* find_section_end(const char* begin, const char* end);
+
+// N-grams of one chunk of lines of an n-gram section, parsed
+// independently of all other chunks.
+struct ArpaChunk
+{
+    const char* begin;
+    const char* end;
+    int num_lines{0};
+    int num_removed{0};          // n-grams with count 0
+
+    std::vector<WordId> wids;    // level word ids per n-gram
+    std::vector<int> counts;
+    std::vector<uint32_t> times;
+
+    // n-grams with words that aren't in the dictionary yet
+    std::vector<std::string> unknown_words;
+    std::vector<int> unknown_counts;
+    std::vector<uint32_t> unknown_times;
+
+    LMError error{ERR_NONE};
+    int error_line{0};           // line index in the chunk
+    int error_ntoks{0};
+};
+
+// Word ids by word, for the duration of a load. Hashing is much faster
+// than the binary search of the dictionary for millions of lookups.
+typedef std::unordered_map<std::string_view, WordId> WordIndex;
+
+// Tokenize the lines of chunk and look up their word ids with
+// lookup(word), which returns WIDNONE for unknown words. lookup must
+// only read, then it is safe to run for several chunks at once.
+template <class F>
+void parse_arpac_chunk(ArpaChunk& chunk, int level, const F& lookup)
+{
+    std::vector<WordId> wids(level);
+    for (const char* line = chunk.begin; line < chunk.end; chunk.num_lines++)
+    {
+        char buf[4096];
+        char* tokens[32];
+        int ntoks = split_line(line, chunk.end, line,
+                               buf, ALEN(buf), tokens, ALEN(tokens));
+        if (!ntoks)
+            continue;
+
+        if (ntoks < level+1)
+        {
+            chunk.error = ERR_NUMTOKENS; // too few tokens for cur. level
+            chunk.error_line = chunk.num_lines;
+            chunk.error_ntoks = ntoks;
+            return;
+        }
+
+        int itok = 0;
+        int count = strtol(tokens[itok++], NULL, 10);
+
+        uint32_t time = 0;
+        if (ntoks >= level+2)
+            time  = strtol(tokens[itok++], NULL, 10);
+
+        // ignore n-grams with count 0, see DynamicModelBase::load_arpac()
+        if (count <= 0)
+        {
+            chunk.num_removed++;
+            continue;
+        }
+
+        bool known = true;
+        for (int i=0; i<level && known; i++)
+        {
+            wids[i] = lookup(tokens[itok+i]);
+            known = wids[i] != WIDNONE;
+        }
+
+        if (known)
+        {
+            chunk.wids.insert(chunk.wids.end(), wids.begin(), wids.end());
+            chunk.counts.push_back(count);
+            chunk.times.push_back(time);
+        }
+        else
+        {
+            for (int i=0; i<level; i++)
+                chunk.unknown_words.emplace_back(tokens[itok+i]);
+            chunk.unknown_counts.push_back(count);
+            chunk.unknown_times.push_back(time);
+        }
+    }
+}
+
+// Split the n-gram lines [p, end) into at most max_chunks chunks of
+// about 1MB, cut at line boundaries. p is set to the rest.
+void split_arpac_chunks(const char*& p, const char* end, int max_chunks,
+                        std::vector<ArpaChunk>& chunks);
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+
+#include "lm_dynamic.h"
+#include "lm_dynamic_kn.h"
+
+// Time the intersection of history node children with candidate words,
+// the inner loop of the smoothing kernels.
+//
+// First, merge_join() on synthetic ascending sequences, with the
+// linear merge, galloping and a binary search per item side by side,
+// for tuning the gallop ratio. Then get_probs() of the kernels for the
+// model's histories with the largest and a median fan-out.
+//
+// usage: lm_bench_join <model.lm> [repetitions]
+
+using namespace lm;
+
+template <class F>
+static double time_us(const F& func, int repetitions)
+{
+    double best = 1e30;
+    for (int i=0; i<repetitions; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        double us = std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, us);
+    }
+    return best;
+}
+
+// Sum of the matched indices, must be the same for all join methods.
+static void bench_sequences(int repetitions)
+{
+    printf("%8s %8s %10s %10s %10s %10s\n",
+           "short", "long", "merge", "gallop", "binsearch", "merge_join");
+
+    std::mt19937 rng(1);
+    for (int ns : {16, 256, 4096})
+        for (int ratio : {1, 2, 4, 8, 16, 64, 256})
+        {
+            int nl = ns * ratio;
+
+            // the long side, every other id of a range,
+            // the short side, half of it found in the long one
+            std::vector<WordId> l(nl);
+            for (int i=0; i<nl; i++)
+                l[i] = static_cast<WordId>(i*2);
+            std::vector<WordId> s(ns);
+            for (int i=0; i<ns; i++)
+                s[i] = static_cast<WordId>(rng() % (nl*2));
+            std::sort(s.begin(), s.end());
+            s.erase(std::unique(s.begin(), s.end()), s.end());
+            int n = static_cast<int>(s.size());
+
+            auto key_s = [&](int i) {return s[i];};
+            auto key_l = [&](int i) {return l[i];};
+            long sums[4] = {};
+
+            double t_merge = time_us([&]
+            {
+                sums[0] = 0;
+                int is = 0;
+                int il = 0;
+                while (is < n && il < nl)
+                {
+                    if (s[is] < l[il])
+                        is++;
+                    else if (l[il] < s[is])
+                        il++;
+                    else
+                        sums[0] += is++ + il++;
+                }
+            }, repetitions);
+
+            double t_gallop = time_us([&]
+            {
+                sums[1] = 0;
+                gallop_join(n, key_s, nl, key_l,
+                            [&](int is, int il) {sums[1] += is + il;});
+            }, repetitions);
+
+            double t_binsearch = time_us([&]
+            {
+                sums[2] = 0;
+                for (int is=0; is<n; is++)
+                {
+                    int il = binsearch(l, s[is]);
+                    if (il >= 0)
+                        sums[2] += is + il;
+                }
+            }, repetitions);
+
+            double t_join = time_us([&]
+            {
+                sums[3] = 0;
+                merge_join(n, key_s, nl, key_l,
+                           [&](int is, int il) {sums[3] += is + il;});
+            }, repetitions);
+
+            bool same = sums[0] == sums[1] && sums[0] == sums[2] &&
+                        sums[0] == sums[3];
+            printf("%8d %8d %8.2fus %8.2fus %8.2fus %8.2fus%s\n",
+                   n, nl, t_merge, t_gallop, t_binsearch, t_join,
+                   same ? "" : " MISMATCH");
+        }
+}
+
+// Exposes the kernels of model class M.
+template <class M>
+class KernelModel : public M
+{
+    public:
+        using M::get_probs;
+};
+
+// Histories with the largest and a median number of successors,
+// for each history length up to the model's order-1.
+static void find_histories(DynamicModelBase& model,
+                           std::vector<std::vector<WordId>>& histories)
+{
+    std::map<std::vector<WordId>, int> fan_outs;
+    model.for_each_ngram([&](const std::vector<const char*>& words,
+                             const std::vector<int>& values)
+    {
+        (void)values;
+        if (words.size() < 2)
+            return;
+        std::vector<WordId> history;
+        for (size_t i=0; i+1<words.size(); i++)
+            history.emplace_back(model.m_dictionary.word_to_id(
+                                        UString(words[i]).to_wstring().c_str()));
+        fan_outs[history]++;
+    });
+
+    histories = {{}};
+    for (int n=1; n<model.get_order(); n++)
+    {
+        std::vector<std::pair<int, std::vector<WordId>>> v;
+        for (const auto& it : fan_outs)
+            if (static_cast<int>(it.first.size()) == n)
+                v.emplace_back(it.second, it.first);
+        if (v.empty())
+            continue;
+        std::sort(v.begin(), v.end());
+        histories.emplace_back(v.back().second);
+        histories.emplace_back(v[v.size()/2].second);
+    }
+}
+
+template <class M>
+static void bench_kernel(const char* name, KernelModel<M>& model,
+                         const std::vector<std::vector<WordId>>& histories,
+                         int repetitions)
+{
+    // all words, as for an empty prefix, and sparser sets
+    // as for prefixes of one or two letters
+    int num_words = model.m_dictionary.get_num_word_types();
+    std::vector<std::vector<WordId>> candidate_sets(3);
+    for (int i=0; i<num_words; i++)
+    {
+        candidate_sets[0].emplace_back(i);
+        if (i % 37 == 0)
+            candidate_sets[1].emplace_back(i);
+        if (i % 997 == 0)
+            candidate_sets[2].emplace_back(i);
+    }
+
+    for (const auto& history : histories)
+    {
+        std::string label;
+        for (WordId wid : history)
+            label += std::string(model.m_dictionary.id_to_word_utf8(wid)) + " ";
+        if (label.empty())
+            label = "<unigram>";
+
+        printf("%-6s %-24s", name, label.c_str());
+        for (const auto& candidates : candidate_sets)
+        {
+            std::vector<double> probabilities;
+            double us = time_us([&]
+            {
+                model.get_probs(history, candidates, probabilities);
+            }, repetitions);
+            printf(" %7zu:%8.1fus", candidates.size(), us);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <model.lm> [repetitions]\n", argv[0]);
+        return 2;
+    }
+    const char* filename = argv[1];
+    int repetitions = argc > 2 ? atoi(argv[2]) : 50;
+
+    bench_sequences(repetitions * 10);
+    printf("\n");
+
+    try
+    {
+        KernelModel<DynamicModel> model;
+        model.load(filename);
+        std::vector<std::vector<WordId>> histories;
+        find_histories(model, histories);
+
+        model.set_smoothing(ABS_DISC_I);
+        bench_kernel("abs", model, histories, repetitions);
+        model.set_smoothing(WITTEN_BELL_I);
+        bench_kernel("wb", model, histories, repetitions);
+
+        KernelModel<DynamicModelKN> model_kn;
+        model_kn.load(filename);
+        model_kn.set_smoothing(KNESER_NEY_I);
+        bench_kernel("kn", model_kn, histories, repetitions);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
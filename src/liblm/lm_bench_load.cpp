@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "lm_dynamic.h"
+#include "lm_dynamic_kn.h"
+#include "lm_frozen.h"
+#include "lm_threadpool.h"
+
+// Time loading an ARPA-like model file, with the higher n-gram levels
+// parsed in parallel on the shared ThreadPool, against a serial load.
+// The pool runs loops nested in one of its tasks serially, so the
+// serial load is simply run as such a task. The pool has no workers
+// on single core machines, both times are the same there.
+//
+// usage: lm_bench_load <model.lm> [repetitions]
+
+using namespace lm;
+
+// Best of repetitions, in ms. The memory sizes of the last load,
+// to check that serial and parallel loads agree.
+template <class M>
+static double time_load(const char* filename, int repetitions, bool parallel,
+                        std::vector<long>& sizes)
+{
+    double best = 1e30;
+    for (int i=0; i<repetitions; i++)
+    {
+        M model;
+        auto load = [&]
+        {
+            model.load(filename);
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        if (parallel)
+            load();
+        else
+            ThreadPool::get_shared().run(2, [&](int task)
+            {
+                if (task == 0)
+                    load();
+            });
+        double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, ms);
+
+        sizes.clear();
+        model.get_memory_sizes(sizes);
+    }
+    return best;
+}
+
+template <class M>
+static void bench_model(const char* name, const char* filename,
+                        int repetitions)
+{
+    std::vector<long> sizes_serial;
+    std::vector<long> sizes_parallel;
+    double t_serial = time_load<M>(filename, repetitions, false,
+                                   sizes_serial);
+    double t_parallel = time_load<M>(filename, repetitions, true,
+                                     sizes_parallel);
+    printf("%-8s %10.1fms %10.1fms %7.2fx%s\n",
+           name, t_serial, t_parallel, t_serial / t_parallel,
+           sizes_serial == sizes_parallel ? "" : " MISMATCH");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <model.lm> [repetitions]\n", argv[0]);
+        return 2;
+    }
+    const char* filename = argv[1];
+    int repetitions = argc > 2 ? atoi(argv[2]) : 3;
+
+    printf("%d worker threads\n", ThreadPool::get_shared().get_num_threads());
+    printf("%-8s %12s %12s %8s\n", "model", "serial", "parallel", "speedup");
+
+    try
+    {
+        bench_model<DynamicModel>("dynamic", filename, repetitions);
+        bench_model<DynamicModelKN>("kn", filename, repetitions);
+        bench_model<FrozenModel>("frozen", filename, repetitions);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <random>
+
+#include "lm_dynamic.h"
+#include "pool_allocator.h"
+
+// Stress the pool allocator behind the trie nodes, MemAlloc()/MemFree().
+//
+// First, items of random sizes, pool items and large ones, are
+// allocated and freed in random order. Their contents are checked
+// before they are freed.
+// Then Zipf distributed words of the model's vocabulary are learned
+// into an empty model, which is cleared again, timing both.
+//
+// usage: lm_bench_pool <model.lm> [tokens [order]]
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static long get_peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Returns the number of corrupted items.
+static int stress_items(int num_operations)
+{
+    struct Item
+    {
+        unsigned char* p;
+        size_t size;
+        unsigned char fill;
+    };
+    std::vector<Item> items;
+    std::mt19937 rng(1);
+    int num_errors = 0;
+
+    auto check_and_free = [&](size_t index)
+    {
+        Item& item = items[index];
+        for (size_t i=0; i<item.size; i++)
+            if (item.p[i] != item.fill)
+            {
+                num_errors++;
+                break;
+            }
+        lm::MemFree(item.p);
+        item = items.back();
+        items.pop_back();
+    };
+
+    for (int i=0; i<num_operations; i++)
+    {
+        if (items.size() < 10000 && (items.empty() || rng() % 3))
+        {
+            // mostly node sized items, some beyond the largest pool size
+            size_t size = rng() % 16 ? 8 + rng() % 256 :
+                                       1 + rng() % 65536;
+            unsigned char fill = static_cast<unsigned char>(rng());
+            unsigned char* p = static_cast<unsigned char*>(lm::MemAlloc(size));
+            if (!p)
+                return -1;
+            memset(p, fill, size);
+            items.push_back({p, size, fill});
+        }
+        else
+            check_and_free(rng() % items.size());
+    }
+    while (!items.empty())
+        check_and_free(items.size()-1);
+
+    return num_errors;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <model.lm> [tokens [order]]\n", argv[0]);
+        return 2;
+    }
+    int num_tokens = argc > 2 ? atoi(argv[2]) : 2000000;
+    int order = argc > 3 ? atoi(argv[3]) : 4;
+
+    auto start = Clock::now();
+    int num_operations = 2000000;
+    int num_errors = stress_items(num_operations);
+    printf("items: %d operations in %.3fs, %d corrupted\n",
+           num_operations, seconds_since(start), num_errors);
+    if (num_errors)
+        return 1;
+
+    // vocabulary of the model, without control words
+    std::vector<UString> vocabulary;
+    {
+        lm::DynamicModel model;
+        try
+        {
+            model.load(argv[1]);
+        }
+        catch (const lm::Exception& ex)
+        {
+            fprintf(stderr, "%s\n", ex.what());
+            return 1;
+        }
+        int num_words = model.m_dictionary.get_num_word_types();
+        for (int i=lm::NUM_CONTROL_WORDS; i<num_words; i++)
+            vocabulary.emplace_back(model.m_dictionary.id_to_word_w(i));
+    }
+
+    // words in Zipf distribution, learned in batches as typed text would be
+    std::vector<double> weights(vocabulary.size());
+    for (size_t i=0; i<weights.size(); i++)
+        weights[i] = 1.0 / (i+1);
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    std::mt19937 rng(1);
+    const int batch_size = 10000;
+    std::vector<std::vector<UString>> batches((num_tokens + batch_size-1) /
+                                              batch_size);
+    for (int i=0; i<num_tokens; i++)
+        batches[i / batch_size].push_back(vocabulary[zipf(rng)]);
+
+    lm::DynamicModel model;
+    model.set_order(order);
+
+    start = Clock::now();
+    for (const auto& batch : batches)
+        model.learn_tokens(batch);
+    double t_learn = seconds_since(start);
+
+    std::vector<long> sizes;
+    model.get_memory_sizes(sizes);
+    long ngram_bytes = sizes.size() > 1 ? sizes[1] : 0;
+
+    start = Clock::now();
+    model.clear();
+    double t_clear = seconds_since(start);
+
+    printf("model: %d tokens, order %d, learn %.3fs, clear %.3fs, "
+           "n-grams %.1fMB, peak rss %.1fMB\n",
+           num_tokens, order, t_learn, t_clear, ngram_bytes / 1e6,
+           get_peak_rss_kb() / 1e3);
+
+    return 0;
+}
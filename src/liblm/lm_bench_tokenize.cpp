@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "tools/ustringmain.h"
+
+#include "lm_tokenize.h"
+
+// Throughput of the tokenizer on a UTF-8 text file: whole texts as
+// learned, short contexts as predicted from, and the tail of a long
+// context typed into character by character, with and without keeping
+// the tokens before the last word. lm_check_tokenize compares the
+// results with the former regex tokenizer.
+//
+// usage: lm_bench_tokenize <corpus.txt> [repetitions]
+
+using namespace lm;
+
+// Best of repetitions of f, in seconds.
+template <class F>
+static double time_best(int repetitions, const F& f)
+{
+    double best = 1e30;
+    for (int i=0; i<repetitions; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        double s = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, s);
+    }
+    return best;
+}
+
+// Start of the UTF-8 sequence at or after i.
+static size_t char_begin(const std::string& text, size_t i)
+{
+    while (i < text.size() && (text[i] & 0xc0) == 0x80)
+        i++;
+    return std::min(i, text.size());
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <corpus.txt> [repetitions]\n", argv[0]);
+        return 2;
+    }
+    const char* filename = argv[1];
+    int repetitions = argc > 2 ? atoi(argv[2]) : 3;
+
+    std::ifstream f(filename);
+    if (!f)
+    {
+        perror(filename);
+        return 1;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    const std::string text = ss.str();
+
+    std::vector<UString> tokens;
+    std::vector<Span> spans;
+
+    // whole text
+    UString all(text);
+    double t = time_best(repetitions, [&]
+    {
+        tokens.clear();
+        spans.clear();
+        tokenize_text(tokens, spans, all);
+    });
+    printf("tokenize_text         %8.3fs %10zu tokens %8.1f MB/s\n",
+           t, tokens.size(), text.size() / 1e6 / t);
+
+    // 200 byte contexts
+    std::vector<UString> contexts;
+    for (size_t i=0; i+200 < text.size() && contexts.size() < 10000; i+=200)
+    {
+        size_t begin = char_begin(text, i);
+        size_t end = char_begin(text, begin + 200);
+        contexts.emplace_back(text.substr(begin, end - begin));
+    }
+    t = time_best(repetitions, [&]
+    {
+        for (const auto& context : contexts)
+        {
+            tokens.clear();
+            spans.clear();
+            tokenize_context(tokens, spans, context);
+        }
+    });
+    printf("tokenize_context      %8.3fs %10zu calls  %8.1f us/call\n",
+           t, contexts.size(), t / contexts.size() * 1e6);
+
+    // Typing the last 1000 characters of a context of up to 100KB,
+    // predicting from its last 4 tokens on each keystroke.
+    size_t context_end = char_begin(text, std::min(text.size(),
+                                                   size_t(100000)));
+    UString context(text.substr(0, context_end));
+    int32_t length = context.to_us().length();
+    std::vector<UString> prefixes;
+    for (int32_t i = std::max(length - 1000, 0) + 1; i <= length; i++)
+        prefixes.emplace_back(context.slice_code_units(0, i));
+
+    t = time_best(repetitions, [&]
+    {
+        for (const auto& prefix : prefixes)
+        {
+            tokens.clear();
+            spans.clear();
+            tokenize_context_tail(tokens, spans, prefix, 4);
+        }
+    });
+    printf("tokenize_context_tail %8.3fs %10zu calls  %8.1f us/call\n",
+           t, prefixes.size(), t / prefixes.size() * 1e6);
+
+    t = time_best(repetitions, [&]
+    {
+        ContextTokenizer tokenizer;
+        for (const auto& prefix : prefixes)
+        {
+            tokens.clear();
+            spans.clear();
+            tokenizer.tokenize(tokens, spans, prefix, 4);
+        }
+    });
+    printf("ContextTokenizer      %8.3fs %10zu calls  %8.1f us/call\n",
+           t, prefixes.size(), t / prefixes.size() * 1e6);
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "lm_dynamic.h"
+
+// Time predictions with a limit on the number of results, which only
+// select the top results, against unlimited ones, which sort all
+// candidates. Both must agree on the top results.
+//
+// usage: lm_bench_topk <model.lm> [limit [repetitions]]
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <model.lm> [limit [repetitions]]\n",
+                argv[0]);
+        return 2;
+    }
+    const char* filename = argv[1];
+    int limit = argc > 2 ? atoi(argv[2]) : 20;
+    int repetitions = argc > 3 ? atoi(argv[3]) : 20;
+
+    lm::DynamicModel model;
+    try
+    {
+        model.load(filename);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    // empty prefixes, where all words or all successors of the history
+    // are candidates, and short ones
+    std::vector<std::vector<const wchar_t*>> contexts = {
+        {L""},
+        {L"New", L""},
+        {L"the", L"New", L""},
+        {L"the", L"c"},
+        {L"s"},
+    };
+
+    // best of all repetitions, the prediction cache is invalidated
+    // so that every call scores all candidates
+    auto time_predict = [&](const std::vector<const wchar_t*>& context,
+                            int n, std::vector<lm::PredictResult>& results)
+    {
+        double best = 1e9;
+        for (int i=0; i<repetitions; i++)
+        {
+            model.invalidate_prediction_cache();
+            auto start = std::chrono::steady_clock::now();
+            model.predict(results, context, n);
+            double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start).count();
+            best = std::min(best, seconds);
+        }
+        return best;
+    };
+
+    printf("%-16s %10s %10s %10s %8s %s\n",
+           "context", "candidates", "limited", "sorted", "speedup", "same");
+    int num_differences = 0;
+    for (const auto& context : contexts)
+    {
+        std::vector<lm::PredictResult> limited;
+        std::vector<lm::PredictResult> sorted;
+        double t_limited = time_predict(context, limit, limited);
+        double t_sorted = time_predict(context, -1, sorted);
+
+        bool same = limited.size() == std::min<size_t>(limit, sorted.size());
+        for (size_t i=0; same && i<limited.size(); i++)
+            same = limited[i].word == sorted[i].word &&
+                   limited[i].p == sorted[i].p;
+        if (!same)
+            num_differences++;
+
+        std::string label;
+        for (const wchar_t* word : context)
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%ls|", word);
+            label += buf;
+        }
+        printf("%-16s %10d %8.3fms %8.3fms %7.1fx %s\n",
+               label.c_str(), static_cast<int>(sorted.size()),
+               t_limited * 1e3, t_sorted * 1e3, t_sorted / t_limited,
+               same ? "yes" : "NO");
+    }
+
+    return num_differences ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+
+#include <map>
+#include <random>
+
+#include "lm_dynamic.h"
+#include "lm_dynamic_kn.h"
+#include "lm_dynamic_cached.h"
+#include "lm_tokenize.h"
+
+// Check that learning large texts in bulk builds the same trie as
+// counting their n-grams one by one. learn_tokens() switches to
+// learn_tokens_bulk() from BULK_LEARN_MIN_TOKENS tokens on, the
+// reference counts each n-gram with count_ngram() instead. Compared are
+// the word ids, all node values, i.e. counts, N1prx, the Kneser-Ney
+// statistics and recency times, the discounts and the current time.
+// Both trie layouts are checked, see DynamicModelSoA.
+//
+// usage: lm_check_bulk
+
+using namespace lm;
+
+// Exposes the time of recency models and the bulk threshold.
+template <class M>
+class CheckModel : public M
+{
+    public:
+        using M::get_current_time;
+        using M::BULK_LEARN_MIN_TOKENS;
+};
+
+typedef std::map<std::vector<std::string>, std::vector<int>> NodeValues;
+
+static void get_node_values(DynamicModelBase& model, NodeValues& values)
+{
+    values.clear();
+    std::vector<WordId> wids;
+    for (auto it = model.ngrams_begin(); ; (*it)++)
+    {
+        const BaseNode* node = *(*it);
+        if (!node)
+            break;
+
+        it->get_ngram(wids);
+        std::vector<std::string> ngram;
+        for (WordId wid : wids)
+            ngram.emplace_back(model.m_dictionary.id_to_word_utf8(wid));
+        model.get_node_values(node, wids.size(), values[ngram]);
+    }
+}
+
+// Counts the n-grams of tokens one by one,
+// like learn_tokens() does for short texts.
+static void count_tokens(DynamicModelBase& model,
+                         const std::vector<std::string>& tokens,
+                         bool allow_new_words)
+{
+    std::vector<const char*> ngram;
+    for_each_ngram_in(tokens, model.get_order(), ngram, [&]
+    {
+        model.count_ngram(ngram, 1, allow_new_words);
+    });
+}
+
+// Random text over vocabulary with sentence begins and
+// unknown word markers, both of which split the n-grams.
+static std::vector<std::string> random_text(
+                                    const std::vector<std::string>& vocabulary,
+                                    size_t num_tokens, std::mt19937& rng)
+{
+    std::vector<double> weights;
+    for (size_t i=0; i<vocabulary.size(); i++)
+        weights.emplace_back(1.0 / (i+1));
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+
+    std::vector<std::string> tokens;
+    for (size_t i=0; i<num_tokens; i++)
+    {
+        if (rng() % 20 == 0)
+            tokens.emplace_back("<s>");
+        else if (rng() % 200 == 0)
+            tokens.emplace_back("<unk>");
+        else
+            tokens.emplace_back(vocabulary[zipf(rng)]);
+    }
+    return tokens;
+}
+
+// Returns the number of differences.
+template <class M>
+static int check_model(const char* name)
+{
+    std::mt19937 rng(1);
+    std::vector<std::string> vocabulary;
+    for (int i=0; i<800; i++)
+        vocabulary.emplace_back("w" + std::to_string(i));
+    std::vector<std::string> more_vocabulary;
+    for (int i=0; i<100; i++)
+        more_vocabulary.emplace_back("x" + std::to_string(i));
+
+    // Short texts are learned one by one by both models, large ones
+    // in bulk by the first, the last one without new words.
+    struct Text
+    {
+        std::vector<std::string> tokens;
+        bool allow_new_words;
+    };
+    std::vector<Text> texts = {
+        {random_text(vocabulary, 300, rng), true},
+        {random_text(vocabulary, 30000, rng), true},
+        {random_text(vocabulary, CheckModel<M>::BULK_LEARN_MIN_TOKENS, rng),
+         true},
+        {random_text(vocabulary, 200, rng), true},
+        {random_text(more_vocabulary, 5000, rng), false},
+        {random_text(vocabulary, 100, rng), true},
+    };
+
+    CheckModel<M> model_bulk;
+    CheckModel<M> model_single;
+    for (const auto& text : texts)
+    {
+        model_bulk.learn_tokens(text.tokens, text.allow_new_words);
+        count_tokens(model_single, text.tokens, text.allow_new_words);
+    }
+
+    int num_errors = 0;
+
+    int num_words = model_bulk.m_dictionary.get_num_word_types();
+    bool same_words =
+        num_words == model_single.m_dictionary.get_num_word_types();
+    for (int i=0; same_words && i<num_words; i++)
+        same_words = strcmp(model_bulk.m_dictionary.id_to_word_utf8(i),
+                            model_single.m_dictionary.id_to_word_utf8(i)) == 0;
+    if (!same_words)
+    {
+        printf("%s: word ids differ\n", name);
+        num_errors++;
+    }
+
+    NodeValues values_bulk;
+    NodeValues values_single;
+    get_node_values(model_bulk, values_bulk);
+    get_node_values(model_single, values_single);
+    if (values_bulk != values_single)
+    {
+        printf("%s: n-grams differ\n", name);
+        num_errors++;
+    }
+
+    if (model_bulk.get_discounts() != model_single.get_discounts())
+    {
+        printf("%s: discounts differ\n", name);
+        num_errors++;
+    }
+
+    if (model_bulk.get_current_time() != model_single.get_current_time())
+    {
+        printf("%s: current times differ, %u and %u\n", name,
+               model_bulk.get_current_time(),
+               model_single.get_current_time());
+        num_errors++;
+    }
+
+    printf("%s: %zu n-grams compared\n", name, values_single.size());
+    return num_errors;
+}
+
+int main()
+{
+    int num_errors = 0;
+    num_errors += check_model<DynamicModel>("dynamic");
+    num_errors += check_model<DynamicModelKN>("kneser-ney");
+    num_errors += check_model<CachedDynamicModel>("cached");
+    num_errors += check_model<DynamicModelSoA>("dynamic soa");
+    num_errors += check_model<DynamicModelKNSoA>("kneser-ney soa");
+    num_errors += check_model<CachedDynamicModelSoA>("cached soa");
+
+    printf("bulk counting: %s\n", num_errors ? "FAILED" : "ok");
+    return num_errors ? 1 : 0;
+}
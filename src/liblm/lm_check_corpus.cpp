@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+#include <random>
+
+#include "tools/ustringmain.h"
+
+#include "lm_corpus.h"
+#include "lm_dynamic.h"
+#include "lm_tokenize.h"
+
+// Check that training on a corpus in shards builds the same model as
+// learning the tokens of the whole text at once. Shards are cut only at
+// sentence begins; the texts have sentence punctuation, blank lines,
+// sentence end marks and long stretches without any sentence begin.
+// The parts tokenize_text_part() makes of a text are checked to add up
+// to the tokens of the whole text, too.
+//
+// usage: lm_check_corpus
+
+using namespace lm;
+
+typedef std::map<std::vector<std::string>, std::vector<int>> NodeValues;
+
+static void get_node_values(DynamicModelBase& model, NodeValues& values)
+{
+    values.clear();
+    std::vector<WordId> wids;
+    for (auto it = model.ngrams_begin(); ; (*it)++)
+    {
+        const BaseNode* node = *(*it);
+        if (!node)
+            break;
+
+        it->get_ngram(wids);
+        std::vector<std::string> ngram;
+        for (WordId wid : wids)
+            ngram.emplace_back(model.m_dictionary.id_to_word_utf8(wid));
+        model.get_node_values(node, wids.size(), values[ngram]);
+    }
+}
+
+// Random UTF-8 text with all kinds of sentence and word boundaries.
+static std::string random_text(size_t num_words, std::mt19937& rng)
+{
+    static const char* const words[] = {
+        "the", "whales", "we", "saw", "Hello", "there", "über", "naïve",
+        "日本語", "\xf0\x9f\x90\x8b", "e.g.", "U.S.", "don't", "5", "3.14",
+        "a--b", "----", "x@y.z", "<unk>",
+    };
+    static const char* const separators[] = {
+        " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ", " ",
+        ". ", "! ", "? ", "; ", ": ", ".\" ", "?\"\n", ".",
+        "\n", "\n\n", " \n \n ", "\n\n\n", "\r\n\r\n", "\t",
+        "\xc2\xa0", "\xe2\x80\x83", ". \n\n", " <s> ", "<s>", " . ",
+    };
+
+    std::string text;
+    for (size_t i=0; i<num_words; i++)
+    {
+        text += words[rng() % ALEN(words)];
+        // long sentences, longer than the smaller shards
+        if (i % 2000 < 1500)
+            text += separators[rng() % ALEN(separators)];
+        else
+            text += " ";
+    }
+    return text;
+}
+
+static void get_tokens(std::vector<std::string>& tokens,
+                       const std::vector<UString>& utokens)
+{
+    tokens.clear();
+    to_string(tokens, utokens);
+}
+
+// Cut text at sentence begins into parts of about part_size bytes and
+// compare their tokens with the tokens of the whole text.
+static int check_parts(const std::string& text, size_t part_size,
+                       const std::vector<std::string>& expected)
+{
+    std::vector<UString> utokens;
+    std::vector<Span> spans;
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        std::string_view rest(text.data() + begin, text.size() - begin);
+        size_t cut = 0;
+        if (rest.size() > part_size)
+            cut = find_sentence_begin(rest.substr(0, part_size));
+        size_t end = cut ? begin + cut : text.size();
+
+        tokenize_text_part(utokens, spans,
+                           UString(text.substr(begin, end - begin)),
+                           begin > 0, end < text.size());
+        begin = end;
+    }
+
+    std::vector<std::string> tokens;
+    get_tokens(tokens, utokens);
+    if (tokens != expected)
+    {
+        printf("parts of %zu bytes: tokens differ\n", part_size);
+        return 1;
+    }
+    return 0;
+}
+
+// Returns the number of differences.
+static int check_trainer(const char* filename, int order, size_t shard_size,
+                         int num_threads, DynamicModel& expected,
+                         const NodeValues& expected_values,
+                         size_t expected_num_tokens)
+{
+    DynamicModel model;
+    model.set_order(order);
+    CorpusTrainer trainer(model, num_threads);
+    trainer.set_shard_size(shard_size);
+    LMError error = trainer.train_file(filename);
+    if (error)
+    {
+        printf("%s\n", get_error_msg(error, filename).c_str());
+        return 1;
+    }
+
+    int num_errors = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "shards of %zu bytes, %d threads",
+             shard_size, num_threads);
+
+    if (trainer.get_num_tokens() != expected_num_tokens)
+    {
+        printf("%s: %lu tokens instead of %zu\n", name,
+               static_cast<unsigned long>(trainer.get_num_tokens()),
+               expected_num_tokens);
+        num_errors++;
+    }
+
+    int num_words = model.m_dictionary.get_num_word_types();
+    bool same_words =
+        num_words == expected.m_dictionary.get_num_word_types();
+    for (int i=0; same_words && i<num_words; i++)
+        same_words = strcmp(model.m_dictionary.id_to_word_utf8(i),
+                            expected.m_dictionary.id_to_word_utf8(i)) == 0;
+    if (!same_words)
+    {
+        printf("%s: word ids differ\n", name);
+        num_errors++;
+    }
+
+    NodeValues values;
+    get_node_values(model, values);
+    if (values != expected_values)
+    {
+        printf("%s: n-grams differ\n", name);
+        num_errors++;
+    }
+
+    printf("%s: %d shards, %zu n-grams compared\n", name,
+           trainer.get_num_shards(), values.size());
+    return num_errors;
+}
+
+int main()
+{
+    const int order = 4;
+    std::mt19937 rng(1);
+    std::string text = random_text(20000, rng);
+
+    char filename[] = "/tmp/lm_check_corpus_XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0 || write(fd, text.data(), text.size()) !=
+                  static_cast<ssize_t>(text.size()))
+    {
+        perror(filename);
+        return 1;
+    }
+    close(fd);
+
+    std::vector<UString> utokens;
+    std::vector<Span> spans;
+    tokenize_text(utokens, spans, UString(text));
+    std::vector<std::string> tokens;
+    get_tokens(tokens, utokens);
+
+    DynamicModel expected;
+    expected.set_order(order);
+    expected.learn_tokens(tokens);
+    NodeValues expected_values;
+    get_node_values(expected, expected_values);
+
+    int num_errors = 0;
+    for (size_t part_size : {16, 100, 1000, 30000})
+        num_errors += check_parts(text, part_size, tokens);
+
+    for (size_t shard_size : {64, 1000, 50000})
+        for (int num_threads : {1, 3})
+            num_errors += check_trainer(filename, order, shard_size,
+                                        num_threads, expected,
+                                        expected_values, tokens.size());
+
+    unlink(filename);
+
+    printf("corpus training: %s\n", num_errors ? "FAILED" : "ok");
+    return num_errors ? 1 : 0;
+}
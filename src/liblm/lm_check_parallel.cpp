@@ -0,0 +1,155 @@
+#include <stdio.h>
+
+#include <random>
+
+#include "lm_dynamic.h"
+#include "lm_merged.h"
+#include "lm_threadpool.h"
+
+// Check that merged models predicting their components in parallel
+// return the same results as serial ones, for case- and accent-
+// insensitive options too, whose folded indexes are built on first use.
+// Each merged model gets its own, identically learned components, so
+// the parallel ones start out without any index. The shared ThreadPool
+// has no workers on single core machines, so components are predicted
+// in a pool of their own as well, the way MergedModel does.
+//
+// usage: lm_check_parallel
+
+using namespace lm;
+
+static void learn_random_text(const std::vector<DynamicModel*>& models,
+                              const std::vector<std::wstring>& vocabulary,
+                              unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<UString> tokens;
+    for (int i=0; i<60000; i++)
+        tokens.emplace_back(vocabulary[rng() % vocabulary.size()].c_str());
+    for (auto model : models)
+        model->learn_tokens(tokens);
+}
+
+int main()
+{
+    // words of mixed case and accents, enough of them for
+    // MergedModel to predict in parallel
+    const std::wstring letters = L"abcdeABCDEéÉüÜ";
+    std::mt19937 rng(1);
+    std::vector<std::wstring> vocabulary;
+    for (int i=0; i<20000; i++)
+    {
+        std::wstring word;
+        int length = 2 + rng() % 6;
+        for (int j=0; j<length; j++)
+            word += letters[rng() % letters.size()];
+        vocabulary.emplace_back(word);
+    }
+
+    // components, the first of each pair for the parallel models
+    std::vector<DynamicModel> models_a(2);
+    std::vector<DynamicModel> models_b(2);
+    learn_random_text({&models_a[0], &models_a[1]}, vocabulary, 2);
+    learn_random_text({&models_b[0], &models_b[1]}, vocabulary, 3);
+
+    std::vector<std::unique_ptr<MergedModel>> merged;
+    for (int i=0; i<2; i++)
+    {
+        merged.emplace_back(new OverlayModel);
+        merged.emplace_back(new LinintModel);
+        merged.emplace_back(new LoglinintModel);
+    }
+    for (size_t i=0; i<merged.size(); i++)
+    {
+        bool parallel = i < merged.size() / 2;
+        int k = parallel ? 0 : 1;
+        merged[i]->set_models({&models_a[k], &models_b[k]});
+        merged[i]->set_parallel(parallel);
+    }
+
+    std::vector<PredictOptions> options_list = {
+        CASE_INSENSITIVE,
+        CASE_INSENSITIVE_SMART,
+        ACCENT_INSENSITIVE,
+        ACCENT_INSENSITIVE_SMART,
+        CASE_INSENSITIVE | ACCENT_INSENSITIVE,
+        CASE_INSENSITIVE_SMART | ACCENT_INSENSITIVE_SMART |
+            IGNORE_CAPITALIZED,
+        DEFAULT_OPTIONS,
+    };
+    std::vector<const wchar_t*> prefixes = {
+        L"", L"a", L"A", L"e", L"é", L"É", L"ue", L"Ü", L"dÉ", L"bca",
+    };
+
+    int num_checks = 0;
+    int num_errors = 0;
+    for (auto options : options_list)
+        for (const wchar_t* prefix : prefixes)
+        {
+            std::vector<const wchar_t*> context =
+                {vocabulary[num_checks % 100].c_str(), prefix};
+            size_t n = merged.size() / 2;
+            for (size_t i=0; i<n; i++)
+            {
+                std::vector<PredictResult> results_parallel;
+                std::vector<PredictResult> results_serial;
+                merged[i]->predict(results_parallel, context, 50, options);
+                merged[i+n]->predict(results_serial, context, 50, options);
+
+                bool same = results_parallel.size() == results_serial.size();
+                for (size_t j=0; same && j<results_serial.size(); j++)
+                    same = results_parallel[j].word == results_serial[j].word &&
+                           results_parallel[j].p == results_serial[j].p;
+                if (!same)
+                {
+                    printf("merged model %zu, options %d, prefix '%ls': "
+                           "parallel predictions differ\n",
+                           i, options, prefix);
+                    num_errors++;
+                }
+                num_checks++;
+            }
+        }
+
+    // components in a pool with workers, after prepare_predict()
+    std::vector<DynamicModel> models_c(4);
+    std::vector<DynamicModel> models_d(4);
+    for (int i=0; i<4; i++)
+        learn_random_text({&models_c[i], &models_d[i]}, vocabulary, 4 + i);
+    ThreadPool pool(3);
+    for (auto options : options_list)
+        for (const wchar_t* prefix : prefixes)
+        {
+            std::vector<const wchar_t*> context = {prefix};
+            std::vector<std::vector<PredictResult>> results(4);
+            for (auto& model : models_c)
+                model.prepare_predict(options);
+            pool.run(4, [&](int i)
+            {
+                models_c[i].predict(results[i], context, 50, options);
+            });
+
+            for (int i=0; i<4; i++)
+            {
+                std::vector<PredictResult> results_serial;
+                models_d[i].predict(results_serial, context, 50, options);
+
+                bool same = results[i].size() == results_serial.size();
+                for (size_t j=0; same && j<results_serial.size(); j++)
+                    same = results[i][j].word == results_serial[j].word &&
+                           results[i][j].p == results_serial[j].p;
+                if (!same)
+                {
+                    printf("component %d, options %d, prefix '%ls': "
+                           "pooled predictions differ\n",
+                           i, options, prefix);
+                    num_errors++;
+                }
+                num_checks++;
+            }
+        }
+
+    printf("%d predictions compared: %s\n", num_checks,
+           num_errors ? "FAILED" : "ok");
+    return num_errors ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+#include <random>
+
+#include "lm_dynamic.h"
+#include "lm_dynamic_kn.h"
+#include "lm_dynamic_cached.h"
+#include "lm_frozen.h"
+#include "lm_kernels.h"
+
+// Check that the vectorized interpolation kernels return the same
+// results as the scalar ones, bit for bit. First the kernels on their
+// own, for all lengths around the vector widths and at unaligned
+// offsets, then the predictions of models learned from random text.
+// The single precision kernels are held to the same, and besides have
+// to stay within a relative tolerance of the scalar double precision
+// results: 1e-6 for a single kernel call, 1e-5 for the normalized
+// probabilities of a prediction, interpolated over all orders.
+//
+// usage: lm_check_simd
+
+using namespace lm;
+
+static const SimdLevel simd_levels[] = {SIMD_NONE, SIMD_SSE2, SIMD_AVX2};
+static const SimdPrecision simd_precisions[] = {SIMD_DOUBLE, SIMD_FLOAT};
+
+static const double KERNEL_TOLERANCE = 1e-6;
+static const double PREDICTION_TOLERANCE = 1e-5;
+
+// Largest relative difference of a to the reference b.
+static double get_max_error(const std::vector<double>& a,
+                            const std::vector<double>& b)
+{
+    double max_error = 0.0;
+    for (size_t i=0; i<a.size(); i++)
+        max_error = std::max(max_error, fabs(a[i] - b[i]) / fabs(b[i]));
+    return max_error;
+}
+
+// Returns the number of mismatching kernel results.
+static int check_kernels(SimdPrecision precision, double& max_error)
+{
+    std::mt19937 rng(1);
+    int num_errors = 0;
+    for (int n=0; n<70; n++)
+        for (int offset=0; offset<4; offset++)
+        {
+            std::vector<int32_t> counts(n + offset);
+            std::vector<double> weights(n + offset);
+            std::vector<double> probabilities(n + offset);
+            for (int i=0; i<n+offset; i++)
+            {
+                counts[i] = static_cast<int32_t>(rng() % 50);
+                weights[i] = (rng() % 1000) / 7.0;
+                probabilities[i] = (rng() % 1000 + 1) / 1e5;
+            }
+
+            // per level, the results of the three kernels,
+            // the last entry is the scalar double precision reference
+            std::vector<std::vector<double>> results[ALEN(simd_levels)+1];
+            for (int l=0; l<=ALEN(simd_levels); l++)
+            {
+                bool reference = l == ALEN(simd_levels);
+                set_simd_level(reference ? SIMD_NONE : simd_levels[l]);
+                set_simd_precision(reference ? SIMD_DOUBLE : precision);
+                auto& r = results[l];
+                r.assign(3, probabilities);
+                interpolate_abs_disc(&r[0][offset], &counts[offset], n,
+                                     0.7, 123.0, 0.3);
+                interpolate_linear(&r[1][offset], &counts[offset], n,
+                                   77.0f, 0.6, 0.4);
+                interpolate_linear(&r[2][offset], &weights[offset], n,
+                                   77.3, 0.6, 0.4);
+            }
+
+            for (int l=1; l<ALEN(simd_levels); l++)
+                for (int k=0; k<3; k++)
+                    if (memcmp(results[0][k].data(), results[l][k].data(),
+                               results[0][k].size() * sizeof(double)))
+                    {
+                        printf("kernel %d, level %d, precision %d: "
+                               "n=%d offset=%d differs\n",
+                               k, simd_levels[l], precision, n, offset);
+                        num_errors++;
+                    }
+
+            for (int k=0; k<3; k++)
+            {
+                double e = get_max_error(results[0][k],
+                                         results[ALEN(simd_levels)][k]);
+                max_error = std::max(max_error, e);
+                if (e > KERNEL_TOLERANCE)
+                {
+                    printf("kernel %d, precision %d: n=%d offset=%d "
+                           "off by %g\n", k, precision, n, offset, e);
+                    num_errors++;
+                }
+            }
+        }
+    set_simd_precision(SIMD_DOUBLE);
+    return num_errors;
+}
+
+// Returns the number of contexts with differing predictions.
+static int check_predictions(const char* name, LanguageModel& model,
+                             const std::vector<std::vector<const wchar_t*>>& contexts,
+                             SimdPrecision precision, double& max_error)
+{
+    int num_errors = 0;
+    for (const auto& context : contexts)
+    {
+        std::vector<std::vector<PredictResult>> results(ALEN(simd_levels));
+        for (int l=0; l<ALEN(simd_levels); l++)
+        {
+            set_simd_level(simd_levels[l]);
+            set_simd_precision(precision);
+            model.invalidate_prediction_cache();
+            model.predict(results[l], context, -1, NORMALIZE);
+        }
+
+        for (int l=1; l<ALEN(simd_levels); l++)
+        {
+            bool same = results[l].size() == results[0].size();
+            for (size_t i=0; same && i<results[0].size(); i++)
+                same = results[l][i].word == results[0][i].word &&
+                       results[l][i].p == results[0][i].p;
+            if (!same)
+            {
+                printf("%s, level %d, precision %d: predictions differ\n",
+                       name, simd_levels[l], precision);
+                num_errors++;
+            }
+        }
+
+        // Against the scalar double precision reference, by word,
+        // the order of nearly equal probabilities may change.
+        std::vector<PredictResult> reference;
+        set_simd_level(SIMD_NONE);
+        set_simd_precision(SIMD_DOUBLE);
+        model.invalidate_prediction_cache();
+        model.predict(reference, context, -1, NORMALIZE);
+
+        std::map<std::wstring, double> probabilities;
+        for (const auto& result : reference)
+            probabilities[result.word] = result.p;
+        bool same = results[0].size() == reference.size();
+        for (size_t i=0; same && i<results[0].size(); i++)
+        {
+            auto it = probabilities.find(results[0][i].word);
+            same = it != probabilities.end();
+            if (same)
+            {
+                double e = fabs(results[0][i].p - it->second) / it->second;
+                max_error = std::max(max_error, e);
+                same = e <= PREDICTION_TOLERANCE;
+            }
+        }
+        if (!same)
+        {
+            printf("%s, precision %d: predictions off the reference\n",
+                   name, precision);
+            num_errors++;
+        }
+    }
+    model.invalidate_prediction_cache();
+    return num_errors;
+}
+
+int main()
+{
+    int num_errors = 0;
+    double kernel_errors[ALEN(simd_precisions)] = {};
+    for (int p=0; p<ALEN(simd_precisions); p++)
+        num_errors += check_kernels(simd_precisions[p], kernel_errors[p]);
+
+    // random text over a small vocabulary, dense enough for
+    // all n-gram levels to take part
+    std::mt19937 rng(1);
+    std::vector<std::wstring> vocabulary;
+    for (int i=0; i<500; i++)
+        vocabulary.emplace_back(L"w" + std::to_wstring(i));
+    std::vector<double> weights;
+    for (size_t i=0; i<vocabulary.size(); i++)
+        weights.emplace_back(1.0 / (i+1));
+    std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+    std::vector<UString> tokens;
+    for (int i=0; i<50000; i++)
+        tokens.emplace_back(vocabulary[zipf(rng)].c_str());
+
+    std::vector<std::vector<const wchar_t*>> contexts = {
+        {L""},
+        {L"w1"},
+        {L"w0", L""},
+        {L"w0", L"w1", L""},
+        {L"w2", L"w0", L"w"},
+        {L"w499", L"w3", L""},
+    };
+
+    DynamicModel model;
+    model.learn_tokens(tokens);
+    DynamicModelKN model_kn;
+    model_kn.learn_tokens(tokens);
+    model_kn.set_smoothing(KNESER_NEY_I);
+    CachedDynamicModel model_cached;
+    model_cached.learn_tokens(tokens);
+    model_cached.set_recency_ratio(0.3);
+    FrozenModel model_frozen;
+
+    double prediction_errors[ALEN(simd_precisions)] = {};
+    for (int p=0; p<ALEN(simd_precisions); p++)
+    {
+        SimdPrecision precision = simd_precisions[p];
+        double& e = prediction_errors[p];
+        for (Smoothing smoothing : {WITTEN_BELL_I, ABS_DISC_I})
+        {
+            model.set_smoothing(smoothing);
+            num_errors += check_predictions("dynamic", model, contexts,
+                                            precision, e);
+        }
+        num_errors += check_predictions("kneser-ney", model_kn, contexts,
+                                        precision, e);
+        num_errors += check_predictions("cached", model_cached, contexts,
+                                        precision, e);
+        model_frozen.freeze(model);
+        num_errors += check_predictions("frozen", model_frozen, contexts,
+                                        precision, e);
+    }
+    set_simd_level(SIMD_AVX2);
+    set_simd_precision(SIMD_DOUBLE);
+
+    for (int p=0; p<ALEN(simd_precisions); p++)
+        printf("precision %d: largest relative error %g in kernels, "
+               "%g in predictions\n", simd_precisions[p],
+               kernel_errors[p], prediction_errors[p]);
+    printf("simd level %d: %s\n", get_simd_level(),
+           num_errors ? "FAILED" : "ok");
+    return num_errors ? 1 : 0;
+}
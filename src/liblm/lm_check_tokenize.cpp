@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <memory>
+#include <random>
+
+#include "tools/string_helpers.h"
+#include "tools/ustringmain.h"
+#include "tools/ustringregex.h"
+
+#include "lm_tokenize.h"
+
+// Check the tokenizer against the regular expressions it was made of,
+// kept here as they were. Compared are tokens and spans of all entry
+// points for random strings of edge cases, for every code point in
+// a few positions, and for the lines and paragraphs of a corpus.
+// Context tails are compared with the end of the whole context.
+//
+// usage: lm_check_tokenize [corpus.txt [num_random]]
+
+using namespace lm;
+
+// The former regex tokenizer.
+namespace regex {
+
+std::unique_ptr<UStringPattern> sentence_pattern{std::make_unique<UStringPattern>(
+    " .*?                                     "
+    "     (?:                                 "
+    "           (?:[.;:!?](?:(?=[\\s]) | \")) "   // punctuation
+    "         | (?:\\s*\\n\\s*)+(?=[\\n])     "   // multiples newlines
+    "         | <s>                           "   // sentence end mark
+    "     )                                   "
+    "   | .+$                                 ",   // last sentence fragment
+    UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL)};
+
+void split_sentences(std::vector<UString>& sentences,
+                     std::vector<Span>& spans,
+                     const UString& text, bool disambiguate)
+{
+    static UStringPattern disambiguate_pattern {"[.;:!?]\"?$"};
+
+    // Remove carriage returns from Moby Dick.
+    // Don't change the text's length, keep it in sync with spans.
+    UString filtered = replace_all(text, "\r", " ");
+
+    // split into sentence fragments
+    UStringMatcher matcher(sentence_pattern.get(), filtered);
+    while (matcher.find())
+    {
+        auto sentence = matcher.group();
+        TextPos begin = matcher.begin();
+        TextPos end   = matcher.end();
+
+        // strip whitespace including newlines
+        auto l = sentence.size();
+        sentence = sentence.lstrip();
+        begin += l - sentence.size();
+
+        l = sentence.size();
+        sentence = sentence.rstrip();
+        end -= l - sentence.size();
+
+        // remove <s>
+        sentence = replace_all(sentence, "<s>", "   ");
+
+        // strip whitespace from the cuts, remove carriage returns
+        l = sentence.size();
+        sentence = sentence.rstrip();
+        end -= l - sentence.size();
+        l = sentence.size();
+        sentence = sentence.lstrip();
+        begin += l - sentence.size();
+
+        // add <s> sentence separators if the end of the sentence is
+        // ambiguous
+        if (disambiguate)
+        {
+            UStringMatcher dmatcher(&disambiguate_pattern, sentence);
+            if (dmatcher.find())
+                sentence += " <s>";
+        }
+
+        sentences.emplace_back(sentence);
+        spans.emplace_back(begin, end-begin);
+    }
+}
+
+static std::string get_text_pattern(const std::string& trailing_characters,
+                                    const std::string& standalone_operators)
+{
+    std::string s = R"(
+    (                                     (?# <unk>)
+      (?:^|(?<=\s))
+        \S*(\S)\2{3,}+\S*              (?# char repeated more than 3 times)
+        | [-]{3}                          (?# dash repeated more than 2 times)
+      (?=\s|$)
+      | :[^\s:@]+?@                       (?# password in URL)
+    ) |
+    (                                     (?# <num>)
+      (?:[-+]?\d+(?:[.,]\d+)*)            (?# anything numeric looking)
+      | (?:[.,]\d+)
+    ) |
+    (                                     (?# word)
+      (?:[-]{0,2}                         (?# allow command line options)
+        [^\W\d]\w*(?:[-'´΄][\w]+)*        (?# word, not starting with a digit)
+        [{trailing_characters}'´΄]?)
+      | <unk> | <s> | </s> | <num>        (?# pass through control words)
+      | <bot:[a-z]*>                      (?# pass through begin of text merkers)
+      | (?:^|(?<=\s))
+          (?:
+            \| {standalone_operators}     (?# common space delimited operators)
+          )
+        (?=\s|$)
+    )
+    )";
+
+    s = replace_all(s, "{trailing_characters}", trailing_characters);
+    s = replace_all(s, "{standalone_operators}", standalone_operators);
+
+    return s;
+}
+
+void tokenize_sentence(std::vector<UString>& tokens,
+                       std::vector<Span>& spans,
+                       const UString& sentence, bool is_context)
+{
+    // Don't learn "-" or "--" as standalone tokens...
+    static UStringPattern text_pattern {
+        get_text_pattern("", "").c_str(),
+        UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
+
+    // ...but recognize them in a prediction context as start
+    // of a cmd line option.
+    static UStringPattern context_pattern {
+        get_text_pattern("-", "| [-]{1,2}").c_str(),
+        UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
+
+    UStringPattern* pattern = is_context ? &context_pattern : &text_pattern;
+    UStringMatcher matcher(pattern, sentence);
+    while (matcher.find())
+    {
+        TextPos begin = matcher.begin();
+        TextPos end   = matcher.end();
+        if (auto group = matcher.group(4);
+            !group.empty())
+        {
+            tokens.emplace_back(group);
+            spans.emplace_back(begin, end-begin);
+        }
+        else if (group = matcher.group(3);
+                 !group.empty())
+        {
+            tokens.emplace_back("<num>");
+            spans.emplace_back(begin, end-begin);
+        }
+        else if (group = matcher.group(1);
+                 !group.empty())
+        {
+            tokens.emplace_back("<unk>");
+            spans.emplace_back(begin, end-begin);
+        }
+    }
+}
+
+void tokenize_text(std::vector<UString>& tokens,
+                   std::vector<Span>& spans,
+                   const UString& text, bool is_context)
+{
+    std::vector<UString> sentences;
+    std::vector<Span> sentence_spans;
+    split_sentences(sentences, sentence_spans, text, false);
+    for (size_t i=0; i<sentences.size(); i++)
+    {
+        const auto& sentence = sentences[i];
+        std::vector<UString> ts;
+        std::vector<Span> ss;
+        tokenize_sentence(ts, ss, sentence, is_context);
+
+        TextPos sbegin = sentence_spans[i].begin;
+        for (auto& span : ss)
+            span.begin += sbegin;
+
+        // sentence begin?
+        if (i > 0)
+        {
+            tokens.emplace_back("<s>");      // prepend sentence begin marker
+            spans.emplace_back(sbegin, 0); // empty span
+        }
+        tokens.insert(tokens.end(), ts.begin(), ts.end());
+        spans.insert(spans.end(), ss.begin(), ss.end());
+    }
+}
+
+void tokenize_context(std::vector<UString>& tokens,
+                      std::vector<Span>& spans,
+                      const UString& text)
+{
+    static UStringPattern pattern{R"(
+                  ^$                             # empty string?
+                | .*[-'´΄\w]$                    # word at the end?
+                | (?:^|.*\s)[|]=?$               # recognized operator?
+                | .*(\S)\\1{3,}$                 # anything repeated > 3 times?
+            )",
+            UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
+
+    tokenize_text(tokens, spans, text, true);
+
+    // filter matches
+    if (!pattern.matches(text))
+    {
+        tokens.emplace_back();
+        TextPos tend = static_cast<TextPos>(text.size());
+        spans.emplace_back(tend, 0);  // empty span
+    }
+}
+
+}  // namespace regex
+
+struct Result
+{
+    std::vector<UString> tokens;
+    std::vector<Span> spans;
+
+    bool operator==(const Result& r) const
+    {
+        return tokens == r.tokens && spans == r.spans;
+    }
+    bool operator!=(const Result& r) const {return !operator==(r);}
+
+    // the last n tokens
+    Result tail(size_t n) const
+    {
+        Result r;
+        size_t begin = tokens.size() - std::min(n, tokens.size());
+        r.tokens.assign(tokens.begin() + begin, tokens.end());
+        r.spans.assign(spans.begin() + begin, spans.end());
+        return r;
+    }
+
+    void print(const char* name) const
+    {
+        printf("  %s:", name);
+        for (size_t i=0; i<tokens.size(); i++)
+            printf(" [%s](%d,%d)", tokens[i].to_utf8().c_str(),
+                   spans[i].begin, spans[i].length);
+        printf("\n");
+    }
+};
+
+static int num_checks = 0;
+static int num_errors = 0;
+
+static void compare(const char* what, const std::string& text,
+                    const Result& expected, const Result& result)
+{
+    num_checks++;
+    if (result == expected)
+        return;
+
+    // report only the first few
+    if (num_errors++ < 10)
+    {
+        printf("%s differs for \"%s\"\n", what, text.c_str());
+        expected.print("regex");
+        result.print("now");
+    }
+}
+
+static void check(const std::string& text)
+{
+    UString s(text);
+    Result expected;
+    Result result;
+
+    for (bool is_context : {false, true})
+    {
+        expected = result = {};
+        regex::tokenize_text(expected.tokens, expected.spans, s, is_context);
+        tokenize_text(result.tokens, result.spans, s, is_context);
+        compare("tokenize_text", text, expected, result);
+
+        expected = result = {};
+        regex::tokenize_sentence(expected.tokens, expected.spans, s,
+                                 is_context);
+        tokenize_sentence(result.tokens, result.spans, s, is_context);
+        compare("tokenize_sentence", text, expected, result);
+    }
+
+    for (bool disambiguate : {false, true})
+    {
+        expected = result = {};
+        regex::split_sentences(expected.tokens, expected.spans, s,
+                               disambiguate);
+        split_sentences(result.tokens, result.spans, s, disambiguate);
+        compare("split_sentences", text, expected, result);
+    }
+
+    expected = result = {};
+    regex::tokenize_context(expected.tokens, expected.spans, s);
+    tokenize_context(result.tokens, result.spans, s);
+    compare("tokenize_context", text, expected, result);
+
+    for (size_t n : {1, 2, 4})
+    {
+        result = {};
+        tokenize_context_tail(result.tokens, result.spans, s, n);
+        compare("tokenize_context_tail", text, expected.tail(n), result);
+    }
+}
+
+// Random strings of characters and fragments around the edge cases of
+// the regexes.
+static void check_random(int num_strings)
+{
+    static const char* const alphabet[] = {
+        "a", "b", "Z", "é", "ß", "中", "😀", "𝟎", "٣", "1", "2", "0",
+        " ", "  ", "\t", "\n", "\n\n", "\r", " ", " ", "\u0085", "　",
+        ".", ";", ":", "!", "?", "\"", "'", "´", "΄", "-", "--", "---", "+",
+        ",", "@", "|", "=", "<", ">", "/", "s", "u", "n", "k",
+        "<s>", "<unk>", "</s>", "<num>", "<bot:ab>", "<bot:",
+        "́", "‍", "aaaa", "....", "x", "_", "#", "%", "::x@",
+        "1.5", "-3", ".5",
+    };
+
+    std::mt19937 rng(1);
+    for (int i=0; i<num_strings; i++)
+    {
+        std::string text;
+        int length = rng() % 30;
+        for (int j=0; j<length; j++)
+            text += alphabet[rng() % ALEN(alphabet)];
+        check(text);
+    }
+}
+
+// Every code point between letters, digits, spaces and punctuation,
+// for the character classes \s, \w and \d. The regex engine takes the
+// noncharacter U+FFFF for the end of the text, it is left out.
+static void check_code_points()
+{
+    for (UChar32 c=1; c<0x110000; c++)
+    {
+        if (U_IS_SURROGATE(c) || c == 0xffff)
+            continue;
+        std::string u;
+        icu::UnicodeString(c).toUTF8String(u);
+        check("a" + u + "b " + u + "1 ." + u + " " + u + u + u + u + "\n");
+    }
+}
+
+// Lines of a text file, and paragraphs of up to 20 of them.
+static bool check_corpus(const char* filename)
+{
+    std::ifstream f(filename);
+    if (!f)
+    {
+        perror(filename);
+        return false;
+    }
+
+    std::string line;
+    std::string paragraph;
+    for (int i=1; std::getline(f, line); i++)
+    {
+        check(line);
+        paragraph += line + "\n";
+        if (i % 20 == 0)
+        {
+            check(paragraph);
+            paragraph.clear();
+        }
+    }
+    check(paragraph);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    int num_random = argc > 2 ? atoi(argv[2]) : 100000;
+
+    check_random(num_random);
+    check_code_points();
+    if (argc > 1 && !check_corpus(argv[1]))
+        return 2;
+
+    printf("%d comparisons, %d differences\n", num_checks, num_errors);
+    printf("tokenizer: %s\n", num_errors ? "FAILED" : "ok");
+    return num_errors ? 1 : 0;
+}
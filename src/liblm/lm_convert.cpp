@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+#include <memory>
+
+#include "lm_dynamic.h"
+#include "lm_unigram.h"
+#include "lm_mapped.h"
+
+// Convert language models in ARPA-like text format
+// to the binary format for memory mapping.
+//
+// usage: lm_convert <model.lm> <model.lmb>
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <model.lm> <model.lmb>\n", argv[0]);
+        return 2;
+    }
+    const char* src = argv[1];
+    const char* dst = argv[2];
+
+    std::unique_ptr<lm::DynamicModelBase> model;
+    if (lm::read_order(src) == 1)
+        model = std::make_unique<lm::UnigramModel>();
+    else
+        model = std::make_unique<lm::DynamicModel>();
+
+    try
+    {
+        model->load(src);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    lm::LMError error = lm::MappedModel::convert(*model, dst, src);
+    if (error)
+    {
+        fprintf(stderr, "%s\n", lm::get_error_msg(error, dst).c_str());
+        return 1;
+    }
+
+    return 0;
+}
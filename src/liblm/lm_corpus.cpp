@@ -0,0 +1,222 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "tools/ustringmain.h"
+
+#include "lm_corpus.h"
+#include "lm_dynamic.h"
+#include "lm_threadpool.h"
+#include "lm_tokenize.h"
+
+namespace lm {
+
+struct CorpusTrainer::Shard
+{
+    std::string text;
+    bool cut_begin{false};   // text starts at a sentence begin
+    bool cut_end{false};     // text ends at a sentence begin
+
+    // Counts of the distinct n-grams per level, sorted by the
+    // shard-local word ids, which index words.
+    std::vector<std::string> words;   // in order of first occurrence
+    std::vector<std::vector<WordId>> wids;
+    std::vector<std::vector<int>> counts;
+    uint64_t num_tokens{0};
+};
+
+namespace {
+
+// Move the next shard of f, or of what is left over from the previous
+// call in pending, to text. Shards are cut at the last sentence begin
+// in their first shard_size bytes. Without one there, the search goes
+// on in twice as many bytes, until the end of the file. cut_end tells
+// if text ends at a sentence begin. Returns false at the end of the file.
+bool read_shard(FILE* f, std::string& pending, size_t shard_size,
+                std::string& text, bool& cut_end)
+{
+    size_t cut = 0;
+    for (size_t limit = shard_size; !cut; limit *= 2)
+    {
+        while (pending.size() <= limit && !feof(f) && !ferror(f))
+        {
+            size_t size = pending.size();
+            pending.resize(size + shard_size);
+            size_t n = fread(&pending[size], 1, shard_size, f);
+            pending.resize(size + n);
+        }
+        if (pending.size() <= limit)
+            break;   // the rest of the file
+
+        cut = find_sentence_begin(std::string_view(pending.data(), limit));
+    }
+    if (pending.empty())
+        return false;
+
+    cut_end = cut != 0;
+    if (!cut)
+        cut = pending.size();
+
+    text.assign(pending, 0, cut);
+    pending.erase(0, cut);
+    return true;
+}
+
+}
+
+void CorpusTrainer::count_shard(Shard& shard)
+{
+    std::vector<UString> utokens;
+    std::vector<Span> spans;
+    tokenize_text_part(utokens, spans, UString(shard.text.c_str()),
+                       shard.cut_begin, shard.cut_end);
+    std::string().swap(shard.text);
+
+    std::vector<std::string> tokens;
+    to_string(tokens, utokens);
+    shard.num_tokens = tokens.size();
+
+    // Assign word ids in the order learn_tokens() would add
+    // the words to the dictionary.
+    int order = m_model.get_order();
+    std::unordered_map<std::string_view, WordId> word_ids;
+    std::vector<std::vector<WordId>> level_wids(order);
+    std::vector<const char*> ngram;
+    auto add_ngram = [&]
+    {
+        size_t n = ngram.size();
+        for (size_t i=0; i<n; i++)
+        {
+            auto it = word_ids.emplace(ngram[i], shard.words.size());
+            if (it.second)
+                shard.words.emplace_back(ngram[i]);
+            level_wids[n-1].push_back(it.first->second);
+        }
+    };
+    for_each_ngram_in(tokens, order, ngram, add_ngram);
+
+    // A trailing "<s>" is followed by the one the next shard starts
+    // with. for_each_ngram_in() counts such a lone sentence begin,
+    // except at the end of its tokens.
+    if (shard.cut_end && !tokens.empty() && tokens.back() == "<s>")
+    {
+        ngram.assign(1, tokens.back().c_str());
+        add_ngram();
+    }
+
+    shard.wids.resize(order);
+    shard.counts.resize(order);
+    std::vector<uint32_t> ngram_order;
+    std::vector<uint32_t> group_ends;
+    for (int i=0; i<order; i++)
+    {
+        size_t num_ngrams = level_wids[i].size() / (i+1);
+        std::vector<int> increments(num_ngrams, 1);
+        DynamicModelBase::sum_ngrams(level_wids[i].data(), i+1,
+                                     increments.data(), num_ngrams,
+                                     shard.wids[i], shard.counts[i],
+                                     ngram_order, group_ends);
+    }
+}
+
+LMError CorpusTrainer::merge_shard(Shard& shard)
+{
+    std::vector<WordId> word_map(shard.words.size());
+    for (size_t i=0; i<shard.words.size(); i++)
+    {
+        word_map[i] = m_model.m_dictionary.query_add_word(
+                                      shard.words[i].c_str(), true);
+        if (word_map[i] == WIDNONE)
+            return ERR_MEMORY;
+    }
+
+    int order = m_model.get_order();
+    for (int i=0; i<order; i++)
+    {
+        std::vector<WordId>& wids = shard.wids[i];
+        for (auto& wid : wids)
+            wid = word_map[wid];
+
+        LMError error = m_model.count_ngrams(wids.data(), i+1,
+                                             shard.counts[i].data(),
+                                             shard.counts[i].size());
+        if (error)
+            return error;
+    }
+    m_model.set_modified(true);
+
+    m_num_tokens += shard.num_tokens;
+    m_num_shards++;
+
+    return ERR_NONE;
+}
+
+LMError CorpusTrainer::train_file(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return ERR_FILE;
+
+    int num_threads = m_num_threads;
+    if (num_threads <= 0)
+        num_threads = std::max(
+            static_cast<int>(std::thread::hardware_concurrency()), 1);
+    ThreadPool pool(num_threads - 1);
+
+    std::string pending;
+    bool cut_begin = false;
+    bool first = true;
+    LMError error = ERR_NONE;
+
+    // One batch of shards is counted while the previous one is merged.
+    std::vector<std::unique_ptr<Shard>> counted;
+    while (!error)
+    {
+        std::vector<std::unique_ptr<Shard>> batch;
+        while (static_cast<int>(batch.size()) < num_threads)
+        {
+            auto shard = std::make_unique<Shard>();
+            if (!read_shard(f, pending, m_shard_size,
+                            shard->text, shard->cut_end))
+                break;
+
+            if (first)
+            {
+                // skip the byte order mark
+                if (shard->text.compare(0, 3, "\xef\xbb\xbf") == 0)
+                    shard->text.erase(0, 3);
+                first = false;
+            }
+            m_num_bytes += shard->text.size();
+            shard->cut_begin = cut_begin;
+            cut_begin = shard->cut_end;
+            batch.emplace_back(std::move(shard));
+        }
+        if (batch.empty() && counted.empty())
+            break;
+
+        pool.run(batch.size() + 1, [&](int i)
+        {
+            if (i == 0)
+            {
+                for (auto& shard : counted)
+                    if (!error)
+                        error = merge_shard(*shard);
+            }
+            else
+                count_shard(*batch[i-1]);
+        });
+        counted = std::move(batch);
+    }
+
+    if (ferror(f))
+        error = ERR_FILE;
+    fclose(f);
+
+    return error;
+}
+
+}  // namespace
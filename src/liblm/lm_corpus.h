@@ -0,0 +1,62 @@
+#ifndef LM_CORPUS_H
+#define LM_CORPUS_H
+
+#include "lm.h"
+
+namespace lm {
+
+class DynamicModelBase;
+
+//------------------------------------------------------------------------
+// CorpusTrainer - count the n-grams of large text corpora in parallel
+//------------------------------------------------------------------------
+// The corpus is streamed in shards of about get_shard_size() bytes, cut
+// only where the tokenizer begins a sentence, e.g. after sentence
+// punctuation or at blank lines. Worker threads tokenize the shards and
+// count their n-grams with shard-local word ids, the calling thread
+// merges these counts into the model in corpus order, while the workers
+// go on with the next shards. No n-gram crosses a cut, the result is
+// the same as learning the tokens of the whole corpus with
+// learn_tokens(), whatever the number of threads. Recency models get
+// no n-gram times.
+class CorpusTrainer
+{
+    public:
+        static const size_t DEFAULT_SHARD_SIZE = 1 << 20;
+
+        // num_threads 0 uses one thread per cpu core.
+        CorpusTrainer(DynamicModelBase& model, int num_threads=0) :
+            m_model(model),
+            m_num_threads(num_threads)
+        {
+        }
+
+        void set_shard_size(size_t size) {m_shard_size = size;}
+        size_t get_shard_size() {return m_shard_size;}
+
+        // Learn the UTF-8 encoded text file filename.
+        LMError train_file(const char* filename);
+
+        // Statistics of all corpora learned so far.
+        uint64_t get_num_bytes() {return m_num_bytes;}
+        uint64_t get_num_tokens() {return m_num_tokens;}
+        int get_num_shards() {return m_num_shards;}
+
+    private:
+        struct Shard;
+        void count_shard(Shard& shard);
+        LMError merge_shard(Shard& shard);
+
+    private:
+        DynamicModelBase& m_model;
+        int m_num_threads;
+        size_t m_shard_size{DEFAULT_SHARD_SIZE};
+
+        uint64_t m_num_bytes{0};
+        uint64_t m_num_tokens{0};
+        int m_num_shards{0};
+};
+
+}  // namespace
+
+#endif
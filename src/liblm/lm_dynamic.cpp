@@ -19,9 +19,14 @@
 
 #include <error.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "tools/ustringmain.h"
 
+#include "lm_arpa.h"
 #include "lm_dynamic.h"
+#include "lm_threadpool.h"
 
 namespace lm {
 
@@ -29,12 +34,123 @@ namespace lm {
 // DynamicModelBase
 //------------------------------------------------------------------------
 
+// Load the n-gram lines [begin, end) of a section of level 2 or higher.
+// Chunks of lines are tokenized and their word ids looked up in a
+// read-only index in parallel, then the calling thread adds them chunk
+// by chunk to the trie with count_ngrams().
+LMError DynamicModelBase::load_arpac_ngrams(const char* begin, const char* end,
+                                            int level, int line_number,
+                                            int& num_expected, int& num_lines)
+{
+    ThreadPool& pool = ThreadPool::get_shared();
+    int chunks_per_batch = 2 * (pool.get_num_threads() + 1);
+
+    // Only worth building for many more lookups than words.
+    WordIndex index;
+    int num_words = m_dictionary.get_num_word_types();
+    if (static_cast<size_t>(end - begin) / 32 > static_cast<size_t>(num_words))
+    {
+        index.reserve(num_words);
+        for (WordId wid=0; wid<static_cast<WordId>(num_words); wid++)
+            index.emplace(m_dictionary.id_to_word_utf8(wid), wid);
+    }
+
+    // Workers only read the index, through a const reference. The
+    // dictionary isn't made for concurrent lookups, sections without an
+    // index are parsed in the calling thread, which also adds all new
+    // words below, in between batches.
+    const WordIndex& const_index = index;
+    auto lookup_index = [&const_index](const char* word)
+    {
+        auto it = const_index.find(word);
+        return it == const_index.end() ? WIDNONE : it->second;
+    };
+    auto lookup_dictionary = [this](const char* word)
+    {
+        return m_dictionary.word_to_id(word);
+    };
+
+    std::vector<ArpaChunk> chunks;
+    std::vector<BaseNode*> nodes;
+    num_lines = 0;
+    for (const char* p = begin; p < end; )
+    {
+        // split the next batch at line boundaries
+        split_arpac_chunks(p, end, chunks_per_batch, chunks);
+
+        if (index.empty())
+        {
+            for (auto& chunk : chunks)
+                parse_arpac_chunk(chunk, level, lookup_dictionary);
+        }
+        else
+        {
+            size_t index_size = index.size();
+            int dictionary_size = m_dictionary.get_num_word_types();
+            pool.run(chunks.size(), [&](int i)
+            {
+                parse_arpac_chunk(chunks[i], level, lookup_index);
+            });
+            assert(index.size() == index_size);
+            assert(m_dictionary.get_num_word_types() == dictionary_size);
+            (void)index_size;
+            (void)dictionary_size;
+        }
+
+        // Add them in file order. N-grams with unknown words come first,
+        // so new words get the same ids as when loading line by line.
+        // Words added here aren't in the index, later n-grams with them
+        // take this slower path too.
+        for (auto& chunk : chunks)
+        {
+            if (chunk.error)
+            {
+                error (0, 0, "too few tokens for n-gram level %d: "
+                      "line %d, tokens found %d/%d",
+                      level,
+                      line_number + num_lines + chunk.error_line,
+                      chunk.error_ntoks, level+1);
+                return chunk.error;
+            }
+            num_lines += chunk.num_lines;
+
+            // Expect fewer n-grams for this level.
+            num_expected -= chunk.num_removed;
+
+            for (size_t i=0; i<chunk.unknown_counts.size(); i++)
+            {
+                std::vector<const char*> words;
+                for (int j=0; j<level; j++)
+                    words.push_back(chunk.unknown_words[i*level+j].c_str());
+                BaseNode* node = count_ngram(words.data(), level,
+                                             chunk.unknown_counts[i]);
+                if (!node)
+                    return ERR_MEMORY; // out of memory
+                set_node_time(node, chunk.unknown_times[i]);
+            }
+
+            size_t num_ngrams = chunk.counts.size();
+            nodes.resize(num_ngrams);
+            LMError err = count_ngrams(chunk.wids.data(), level,
+                                       chunk.counts.data(), num_ngrams,
+                                       nodes.data());
+            if (err)
+                return err;
+            for (size_t i=0; i<num_ngrams; i++)
+                set_node_time(nodes[i], chunk.times[i]);
+        }
+    }
+
+    return ERR_NONE;
+}
+
 // Load from ARPA-like format, expects counts instead of log probabilities
 // and no back-off values. N-grams don't have to be sorted alphabetically.
-// State machine driven version, still the fastest.
+// State machine driven version, still the fastest. The file is memory
+// mapped, n-grams of order 2 and up are parsed in parallel by
+// load_arpac_ngrams().
 LMError DynamicModelBase::load_arpac(const char* filename)
 {
-    int i;
     int new_order = 0;
     int current_level = 0;
     int line_number = -1;
@@ -48,30 +164,25 @@ LMError DynamicModelBase::load_arpac(const char* filename)
 
     clear();
 
-    FILE* f = fopen(filename, "r");
-    if (!f)
+    FileContents file;
+    err_code = file.load(filename);
+    if (err_code)
     {
         #ifdef LMDEBUG
         printf( "Error opening %s\n", filename);
         #endif
-        return ERR_FILE;
+        return err_code;
     }
 
-    while(1)
+    const char* end = file.end();
+    for (const char* line = file.begin(); line < end; )
     {
-        // read line
+        // read line and chop it into tokens
         char buf[4096];
-        if (fgets(buf, ALEN(buf), f) == NULL)
-            break;
+        char* tokens[32];
+        int ntoks = split_line(line, end, line,
+                               buf, ALEN(buf), tokens, ALEN(tokens));
         line_number++;
-
-        // chop line into tokens
-        char *tstate;
-        char* tokens[32] = {strtok_r(buf, " \n", &tstate)};
-        for (i=0; tokens[i] && i < ALEN(tokens)-1; i++)
-            tokens[i+1] = strtok_r(NULL, " \n", &tstate);
-        int ntoks = i;
-
         if (ntoks)  // any tokens there?
         {
             // check for n-grams first, this is by far the most frequent case
@@ -210,6 +321,23 @@ LMError DynamicModelBase::load_arpac(const char* filename)
                         break;
                     }
                     state = NGRAMS;
+
+                    // Higher order n-grams make up the bulk of the file,
+                    // load the whole section at once.
+                    if (current_level >= 2)
+                    {
+                        const char* section_end = find_section_end(line, end);
+                        int num_lines;
+                        err_code = load_arpac_ngrams(line, section_end,
+                                                     current_level,
+                                                     line_number+1,
+                                                     counts[current_level-1],
+                                                     num_lines);
+                        if (err_code)
+                            break;
+                        line_number += num_lines;
+                        line = section_end;
+                    }
                 }
                 else
                 if (strncmp(tokens[0], "\\end\\", 5) == 0)
@@ -297,6 +425,109 @@ LMError DynamicModelBase::write_arpa_ngrams(FILE* f)
     return ERR_NONE;
 }
 
+void DynamicModelBase::take_snapshot(ModelSnapshot& snapshot)
+{
+    snapshot.clear();
+
+    int num_words = m_dictionary.get_num_word_types();
+    snapshot.word_offsets.reserve(num_words);
+    for (WordId wid=0; wid<static_cast<WordId>(num_words); wid++)
+    {
+        snapshot.word_offsets.emplace_back(snapshot.word_blob.size());
+        snapshot.word_blob += m_dictionary.id_to_word_utf8(wid);
+        snapshot.word_blob += '\0';
+    }
+
+    int nv = get_num_arpa_values();
+    snapshot.num_values = nv;
+    snapshot.ngrams.resize(m_order);
+    for (int i=0; i<m_order; i++)
+    {
+        int n = get_num_ngrams(i);
+        snapshot.num_ngrams.emplace_back(n);
+        snapshot.ngrams[i].reserve(static_cast<size_t>(n * (nv + i + 1)));
+    }
+
+    std::vector<WordId> wids;
+    for (auto it = ngrams_begin(); ; (*it)++)
+    {
+        const BaseNode* node = *(*it);
+        if (!node)
+            break;
+
+        int level = it->get_level();
+        if (level < 1 || level > m_order)
+            continue;
+
+        it->get_ngram(wids);
+        auto& v = snapshot.ngrams[level-1];
+        size_t k = v.size();
+        v.resize(k + nv);
+        get_arpa_values(node, &v[k]);
+        v.insert(v.end(), wids.begin(), wids.end());
+    }
+}
+
+void ModelSnapshot::clear()
+{
+    word_blob.clear();
+    word_offsets.clear();
+    num_ngrams.clear();
+    num_values = 1;
+    ngrams.clear();
+}
+
+void ModelSnapshot::save(const char* filename) const
+{
+    LMError error = do_save(filename);
+    throw_on_error(error, filename);
+}
+
+// Same output as DynamicModelBase::save_arpac(), but the words are
+// already utf-8, no conversion needed.
+LMError ModelSnapshot::do_save(const char* filename) const
+{
+    FILE* f = fopen(filename, "w");
+    if (!f)
+        return ERR_FILE;
+
+    fprintf(f, "\n");
+    fprintf(f, "\\data\\\n");
+
+    int order = static_cast<int>(num_ngrams.size());
+    for (int i=0; i<order; i++)
+        fprintf(f, "ngram %d=%d\n", i+1, num_ngrams[i]);
+
+    const char* words = word_blob.data();
+    for (int i=0; i<order; i++)
+    {
+        fprintf(f, "\n");
+        fprintf(f, "\\%d-grams:\n", i+1);
+
+        const auto& v = ngrams[i];
+        size_t step = static_cast<size_t>(num_values + i + 1);
+        for (size_t k=0; k+step <= v.size(); k += step)
+        {
+            for (int j=0; j<num_values; j++)
+                fprintf(f, j ? " %d" : "%d", static_cast<int>(v[k+j]));
+            for (size_t j=static_cast<size_t>(num_values); j<step; j++)
+            {
+                fputc(' ', f);
+                fputs(words + word_offsets[v[k+j]], f);
+            }
+            fputc('\n', f);
+        }
+    }
+
+    fprintf(f, "\n");
+    fprintf(f, "\\end\\\n");
+
+    if (fclose(f) != 0)
+        return ERR_FILE;
+
+    return ERR_NONE;
+}
+
 // add unigrams in bulk
 LMError DynamicModelBase::set_unigrams(const std::vector<Unigram>& unigrams)
 {
@@ -376,6 +607,155 @@ void DynamicModelBase::copy_contents(const DynamicModelBase* model)
     }
 }
 
+void DynamicModelBase::sum_ngrams(const WordId* wids, int n,
+                                  const int* increments, size_t num_ngrams,
+                                  std::vector<WordId>& unique_wids,
+                                  std::vector<int>& unique_increments,
+                                  std::vector<uint32_t>& order,
+                                  std::vector<uint32_t>& group_ends)
+{
+    order.resize(num_ngrams);
+    WordId max_wid = 0;
+    for (size_t i=0; i<num_ngrams * n; i++)
+        max_wid = std::max(max_wid, wids[i]);
+    int bits = 1;
+    while (bits < 32 && (WordId(1) << bits) <= max_wid)
+        bits++;
+    if (bits * n <= 64)
+    {
+        // Usually all word ids of an n-gram fit into a single
+        // integer key, much faster to sort.
+        std::vector<std::pair<uint64_t, uint32_t>> keys(num_ngrams);
+        for (size_t i=0; i<num_ngrams; i++)
+        {
+            uint64_t key = 0;
+            for (int j=0; j<n; j++)
+                key = (key << bits) | wids[i*n+j];
+            keys[i] = {key, i};
+        }
+        std::sort(keys.begin(), keys.end());
+        for (size_t i=0; i<num_ngrams; i++)
+            order[i] = keys[i].second;
+    }
+    else
+    {
+        for (size_t i=0; i<num_ngrams; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [wids, n](uint32_t a, uint32_t b)
+        {
+            return std::lexicographical_compare(wids + a*n, wids + (a+1)*n,
+                                                wids + b*n, wids + (b+1)*n);
+        });
+    }
+
+    unique_wids.clear();
+    unique_increments.clear();
+    group_ends.clear();
+    unique_wids.reserve(num_ngrams * n);
+    for (size_t i=0; i<num_ngrams; i++)
+    {
+        const WordId* ngram = wids + order[i]*n;
+        if (i && std::equal(ngram, ngram+n, &unique_wids.back()-(n-1)))
+            unique_increments.back() += increments[order[i]];
+        else
+        {
+            unique_wids.insert(unique_wids.end(), ngram, ngram+n);
+            unique_increments.push_back(increments[order[i]]);
+            if (i)
+                group_ends.push_back(i);
+        }
+    }
+    group_ends.push_back(num_ngrams);
+}
+
+LMError DynamicModelBase::count_ngrams(const WordId* wids, int n,
+                                       const int* increments,
+                                       size_t num_ngrams,
+                                       BaseNode** nodes)
+{
+    // Sorted, node creation and lookups walk the trie in order
+    // and duplicates become neighbors.
+    std::vector<WordId> unique_wids;
+    std::vector<int> unique_increments;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> group_ends;
+    sum_ngrams(wids, n, increments, num_ngrams,
+               unique_wids, unique_increments, order, group_ends);
+
+    size_t num_unique = unique_increments.size();
+    LMError error = add_ngram_nodes(unique_wids.data(), n, num_unique);
+    if (error)
+        return error;
+
+    size_t i = 0;
+    for (size_t k=0; k<num_unique; k++)
+    {
+        BaseNode* node = count_ngram(&unique_wids[k*n], n,
+                                     unique_increments[k]);
+        if (!node)
+            return ERR_MEMORY; // out of memory
+        if (nodes)
+            for (; i<group_ends[k]; i++)
+                nodes[order[i]] = node;
+    }
+    return ERR_NONE;
+}
+
+// Like learn_tokens(), but n-grams are counted level by level with
+// count_ngrams(), repeated ones only once. Recency models get the
+// time of the last occurrence of each n-gram, as if counted one by one.
+void DynamicModelBase::learn_tokens_bulk(const std::vector<std::string>& tokens,
+                                         bool allow_new_words)
+{
+    int order = get_order();
+    uint32_t time = get_current_time();
+    std::vector<std::vector<WordId>> level_wids(order);
+    std::vector<std::vector<uint32_t>> level_times(order);
+
+    // Words repeat a lot, look each one up only once.
+    std::unordered_map<std::string_view, WordId> word_ids;
+
+    std::vector<const char*> ngram;
+    std::vector<WordId> wids(order);
+    for_each_ngram_in(tokens, order, ngram, [&]
+    {
+        size_t n = ngram.size();
+        for (size_t i=0; i<n; i++)
+        {
+            auto it = word_ids.find(ngram[i]);
+            if (it != word_ids.end())
+                wids[i] = it->second;
+            else
+            {
+                wids[i] = m_dictionary.query_add_word(ngram[i],
+                                                      allow_new_words);
+                if (wids[i] == WIDNONE)
+                    return;
+                word_ids.emplace(ngram[i], wids[i]);
+            }
+        }
+        level_wids[n-1].insert(level_wids[n-1].end(),
+                               wids.begin(), wids.begin()+n);
+        level_times[n-1].push_back(++time);
+    });
+
+    std::vector<BaseNode*> nodes;
+    for (int i=0; i<order; i++)
+    {
+        size_t num_ngrams = level_times[i].size();
+        std::vector<int> increments(num_ngrams, 1);
+        nodes.resize(num_ngrams);
+        if (count_ngrams(level_wids[i].data(), i+1, increments.data(),
+                         num_ngrams, nodes.data()))
+            return;  // out of memory
+
+        // times increase, the last occurrence wins
+        for (size_t k=0; k<num_ngrams; k++)
+            set_node_time(nodes[k], level_times[i][k]);
+    }
+    set_current_time(time);
+}
+
 void DynamicModelBase::learn_tokens(const std::vector<UString>& utokens,
                                     bool allow_new_words)
 {
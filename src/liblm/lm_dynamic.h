@@ -22,11 +22,14 @@
 
 #include <math.h>
 #include <assert.h>
+#include <stdlib.h>  // malloc
+#include <algorithm>
 #include <cstring>   // memcpy
 #include <memory>
 #include <string>
 
 #include "lm.h"
+#include "lm_kernels.h"
 #include "lm_tokenize.h"
 
 #define HONOR_REMOVED_NODES true
@@ -99,38 +102,259 @@ class inplace_vector
             return buffer()[size()-1];
         }
 
-        void push_back(T& item)
+        void push_back(WordId wid)
         {
-            buffer()[size()] = item;
+            buffer()[size()] = T(wid);
             num_items++;
             ASSERT(size() <= capacity());
         }
 
-        void insert(int index, T& item)
+        void insert(int index, WordId wid)
         {
             T* p = buffer();
             for (int i=size()-1; i>=index; --i)
                 p[i+1] = p[i];
-            p[index] = item;
+            p[index] = T(wid);
             num_items++;
             ASSERT(size() <= capacity());
         }
 
+        // Merge in new elements for k sorted word ids, none of them
+        // present yet. Expects room for size()+k elements.
+        void merge_sorted(const WordId* new_wids, int k)
+        {
+            T* p = buffer();
+            int i = size()-1;
+            for (int j=k-1, dst=size()+k-1; j>=0; dst--)
+            {
+                if (i >= 0 && p[i].m_word_id > new_wids[j])
+                    p[dst] = p[i--];
+                else
+                    p[dst] = T(new_wids[j--]);
+            }
+            num_items += k;
+            ASSERT(size() <= capacity());
+        }
+
+        WordId get_word_id(int index) const
+        {
+            return buffer()[index].m_word_id;
+        }
+
+        // binary search like lower_bound()
+        int search_index(WordId wid) const
+        {
+            int lo = 0;
+            int hi = size();
+            while (lo < hi)
+            {
+                int mid = (lo+hi)>>1;
+                if (buffer()[mid].m_word_id < wid)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo;
+        }
+
+        // bytes of the elements following the vector
+        static int get_buffer_size(int capacity)
+        {
+            return capacity * sizeof(T);
+        }
+
+        // Copy the elements to dst with room for capacity elements,
+        // dst->num_items must be set already.
+        void move_buffer_to(inplace_vector<T>& dst, int capacity) const
+        {
+            (void)capacity;
+            memcpy(dst.buffer(), buffer(), size() * sizeof(T));
+        }
+
     public:
         InplaceSize num_items;
 };
 
+//------------------------------------------------------------------------
+// inplace_wid_vector - inplace_vector with the word ids of its elements
+// in a separate array, in front of the elements
+//------------------------------------------------------------------------
+// Searches only touch the dense id array, not the elements. The elements
+// don't keep their word ids themselves, see BaseNode.
+
+template <class T>
+class inplace_wid_vector
+{
+    public:
+        inplace_wid_vector()
+        {
+            num_items = 0;
+        }
+
+        int capacity() const
+        {
+            return capacity(num_items);
+        }
+
+        // About the growth of inplace_vector, but cheap to compute, the
+        // offset of the elements depends on it. Rounds up to a quarter
+        // of the highest power of two below n.
+        static int capacity(int n)
+        {
+            if (n <= 4)
+                return n ? n : 1;
+            int step = 1 << (29 - __builtin_clz(n-1));
+            return (n + step-1) & ~(step-1);
+        }
+
+        int size() const
+        {
+            return num_items;
+        }
+
+        WordId* wids()
+        {
+            return (WordId*) (((uint8_t*)(this) + sizeof(inplace_wid_vector<T>)));
+        }
+        const WordId* wids() const
+        {
+            return const_cast<inplace_wid_vector<T>*>(this)->wids();
+        }
+
+        T* buffer()
+        {
+            return buffer(capacity());
+        }
+        const T* buffer() const
+        {
+            return const_cast<inplace_wid_vector<T>*>(this)->buffer();
+        }
+
+        T& operator [](int index)
+        {
+            ASSERT(index >= 0 && index <= capacity());
+            return buffer()[index];
+        }
+        const T& operator [](int index) const
+        {
+            ASSERT(index >= 0 && index <= capacity());
+            return buffer()[index];
+        }
+
+        T& back()
+        {
+            ASSERT(size() > 0);
+            return buffer()[size()-1];
+        }
+
+        void push_back(WordId wid)
+        {
+            wids()[size()] = wid;
+            buffer(capacity(size()+1))[size()] = T(wid);
+            num_items++;
+            ASSERT(size() <= capacity());
+        }
+
+        void insert(int index, WordId wid)
+        {
+            WordId* w = wids();
+            T* p = buffer(capacity(size()+1));
+            for (int i=size()-1; i>=index; --i)
+            {
+                w[i+1] = w[i];
+                p[i+1] = p[i];
+            }
+            w[index] = wid;
+            p[index] = T(wid);
+            num_items++;
+            ASSERT(size() <= capacity());
+        }
+
+        // Merge in new elements for k sorted word ids, none of them
+        // present yet. Expects room for size()+k elements.
+        void merge_sorted(const WordId* new_wids, int k)
+        {
+            WordId* w = wids();
+            T* p = buffer(capacity(size()+k));
+            int i = size()-1;
+            for (int j=k-1, dst=size()+k-1; j>=0; dst--)
+            {
+                if (i >= 0 && w[i] > new_wids[j])
+                {
+                    w[dst] = w[i];
+                    p[dst] = p[i--];
+                }
+                else
+                {
+                    w[dst] = new_wids[j];
+                    p[dst] = T(new_wids[j--]);
+                }
+            }
+            num_items += k;
+            ASSERT(size() <= capacity());
+        }
+
+        WordId get_word_id(int index) const
+        {
+            return wids()[index];
+        }
+
+        // branchless lower_bound()
+        int search_index(WordId wid) const
+        {
+            const WordId* w = wids();
+            const WordId* base = w;
+            int n = size();
+            if (n == 0)
+                return 0;
+            while (n > 1)
+            {
+                int half = n >> 1;
+                base = base[half-1] < wid ? base + half : base;
+                n -= half;
+            }
+            return (base - w) + (*base < wid);
+        }
+
+        // bytes of the ids and elements following the vector
+        static int get_buffer_size(int capacity)
+        {
+            return capacity * (sizeof(WordId) + sizeof(T));
+        }
+
+        // Copy ids and elements to dst with room for capacity elements,
+        // dst->num_items must be set already.
+        void move_buffer_to(inplace_wid_vector<T>& dst, int capacity) const
+        {
+            memcpy(dst.wids(), wids(), size() * sizeof(WordId));
+            memcpy(dst.buffer(capacity), buffer(), size() * sizeof(T));
+        }
+
+    private:
+        // Elements of a vector with room for capacity of them. Growing
+        // ones are laid out for their new size before it is set.
+        T* buffer(int capacity)
+        {
+            return (T*) (wids() + capacity);
+        }
+
+    public:
+        InplaceSize num_items;
+};
 
 //------------------------------------------------------------------------
 // BaseNode - base class of all trie nodes
 //------------------------------------------------------------------------
+// Nodes don't know their own word ids, the parent's child array keeps
+// them, either as part of the child nodes (WordNode) or in a separate,
+// dense array (child_wid_vector, inplace_wid_vector).
 
 class BaseNode
 {
     public:
         BaseNode(WordId wid = -1)
         {
-            m_word_id = wid;
+            (void)wid;
             m_count = 0;
         }
 
@@ -151,10 +375,247 @@ class BaseNode
 
 
     public:
-        WordId m_word_id;
         CountType m_count;
 };
 
+//------------------------------------------------------------------------
+// WordNode - trie node that keeps its word id in the node itself
+//------------------------------------------------------------------------
+// Base of the nodes in child_vector and inplace_vector.
+
+class WordNode : public BaseNode
+{
+    public:
+        WordNode(WordId wid = -1)
+        {
+            m_word_id = wid;
+        }
+
+    public:
+        WordId m_word_id;
+};
+
+//------------------------------------------------------------------------
+// child_vector - child pointers of a TrieNode
+//------------------------------------------------------------------------
+
+class child_vector
+{
+    public:
+        int size() const {return m_nodes.size();}
+
+        BaseNode*& operator [](int index) {return m_nodes[index];}
+        BaseNode* operator [](int index) const {return m_nodes[index];}
+
+        WordId get_word_id(int index) const
+        {
+            return static_cast<const WordNode*>(m_nodes[index])->m_word_id;
+        }
+
+        // The word id is the node's own here.
+        void insert(int index, WordId wid, BaseNode* node)
+        {
+            (void)wid;
+            m_nodes.insert(m_nodes.begin()+index, node);
+        }
+        void push_back(WordId wid, BaseNode* node)
+        {
+            (void)wid;
+            m_nodes.push_back(node);
+        }
+
+        // Merge in k new nodes for k sorted word ids, none of them
+        // present yet, growing the array exactly once.
+        void merge_sorted(const WordId* wids, BaseNode* const* nodes, int k)
+        {
+            int i = size()-1;
+            int new_size = size()+k;
+            m_nodes.reserve(new_size);
+            m_nodes.resize(new_size);
+            for (int j=k-1, dst=new_size-1; j>=0; dst--)
+            {
+                if (i >= 0 && get_word_id(i) > wids[j])
+                    m_nodes[dst] = m_nodes[i--];
+                else
+                    m_nodes[dst] = nodes[j--];
+            }
+        }
+
+        void reserve(int n)
+        {
+            m_nodes.reserve(n);
+        }
+
+        // clear and really free the memory
+        void free()
+        {
+            std::vector<BaseNode*>().swap(m_nodes);
+        }
+
+        // binary search like lower_bound()
+        int search_index(WordId wid) const
+        {
+            int lo = 0;
+            int hi = m_nodes.size();
+            while (lo < hi)
+            {
+                int mid = (lo+hi)>>1;
+                if (get_word_id(mid) < wid)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            return lo;
+        }
+
+        uint64_t get_memory_size() const
+        {
+            return sizeof(BaseNode*) * m_nodes.capacity();
+        }
+
+    private:
+        std::vector<BaseNode*> m_nodes;
+};
+
+//------------------------------------------------------------------------
+// child_wid_vector - child pointers of a TrieNode with a separate array
+// of their word ids
+//------------------------------------------------------------------------
+// Searches only touch the dense id array, not the child nodes. Pointers
+// and ids share a single allocation, the ids following the pointers,
+// and grow like std::vector.
+
+class child_wid_vector
+{
+    public:
+        child_wid_vector()
+        {
+        }
+        child_wid_vector(const child_wid_vector&) = delete;
+        child_wid_vector& operator=(const child_wid_vector&) = delete;
+
+        ~child_wid_vector()
+        {
+            free();
+        }
+
+        int size() const {return m_size;}
+
+        BaseNode*& operator [](int index) {return nodes()[index];}
+        BaseNode* operator [](int index) const {return nodes()[index];}
+
+        WordId get_word_id(int index) const {return wids()[index];}
+
+        void insert(int index, WordId wid, BaseNode* node)
+        {
+            if (m_size >= m_capacity)
+                reserve(std::max(m_size+1, m_capacity*2));
+            BaseNode** n = nodes();
+            WordId* w = wids();
+            memmove(n+index+1, n+index, (m_size-index) * sizeof(BaseNode*));
+            memmove(w+index+1, w+index, (m_size-index) * sizeof(WordId));
+            n[index] = node;
+            w[index] = wid;
+            m_size++;
+        }
+        void push_back(WordId wid, BaseNode* node)
+        {
+            insert(m_size, wid, node);
+        }
+
+        // Merge in k new nodes for k sorted word ids, none of them
+        // present yet, growing the arrays exactly once.
+        void merge_sorted(const WordId* new_wids, BaseNode* const* new_nodes,
+                          int k)
+        {
+            int i = size()-1;
+            int new_size = size()+k;
+            reserve(new_size);
+            BaseNode** n = nodes();
+            WordId* w = wids();
+            for (int j=k-1, dst=new_size-1; j>=0; dst--)
+            {
+                if (i >= 0 && w[i] > new_wids[j])
+                {
+                    w[dst] = w[i];
+                    n[dst] = n[i--];
+                }
+                else
+                {
+                    w[dst] = new_wids[j];
+                    n[dst] = new_nodes[j--];
+                }
+            }
+            m_size = new_size;
+        }
+
+        // Like std::vector::reserve(), room for exactly n children
+        // if there isn't enough yet.
+        void reserve(int n)
+        {
+            if (n <= m_capacity)
+                return;
+            void* buffer = malloc(n * (sizeof(BaseNode*) + sizeof(WordId)));
+            if (!buffer)
+                throw std::bad_alloc();
+            BaseNode** new_nodes = static_cast<BaseNode**>(buffer);
+            if (m_size)
+            {
+                memcpy(new_nodes, nodes(), m_size * sizeof(BaseNode*));
+                memcpy(new_nodes + n, wids(), m_size * sizeof(WordId));
+            }
+            ::free(m_buffer);
+            m_buffer = buffer;
+            m_capacity = n;
+        }
+
+        // clear and really free the memory
+        void free()
+        {
+            ::free(m_buffer);
+            m_buffer = NULL;
+            m_size = 0;
+            m_capacity = 0;
+        }
+
+        // branchless lower_bound()
+        int search_index(WordId wid) const
+        {
+            const WordId* w = wids();
+            const WordId* base = w;
+            int n = m_size;
+            if (n == 0)
+                return 0;
+            while (n > 1)
+            {
+                int half = n >> 1;
+                base = base[half-1] < wid ? base + half : base;
+                n -= half;
+            }
+            return (base - w) + (*base < wid);
+        }
+
+        uint64_t get_memory_size() const
+        {
+            return (sizeof(BaseNode*) + sizeof(WordId)) * m_capacity;
+        }
+
+    private:
+        BaseNode** nodes() const
+        {
+            return static_cast<BaseNode**>(m_buffer);
+        }
+        WordId* wids() const
+        {
+            return reinterpret_cast<WordId*>(nodes() + m_capacity);
+        }
+
+    private:
+        void* m_buffer{};       // m_capacity pointers, then as many ids
+        int m_size{};
+        int m_capacity{};
+};
+
 //------------------------------------------------------------------------
 // LastNode - leaf node of the ngram trie, trigram for order 3
 //------------------------------------------------------------------------
@@ -171,7 +632,10 @@ class LastNode : public TBASE
 //------------------------------------------------------------------------
 // BeforeLastNode - second to last node of the ngram trie, bigram for order 3
 //------------------------------------------------------------------------
-template <class TBASE, class TLASTNODE>
+// TCHILDREN selects the layout of the inplace child nodes, inplace_vector
+// or inplace_wid_vector.
+template <class TBASE, class TLASTNODE,
+          class TCHILDREN = inplace_vector<TLASTNODE> >
 class BeforeLastNode : public TBASE
 {
     public:
@@ -180,31 +644,50 @@ class BeforeLastNode : public TBASE
         {
         }
 
+        // Bytes to allocate for a node with room for capacity children.
+        static int get_alloc_size(int capacity)
+        {
+            return sizeof(BeforeLastNode) + TCHILDREN::get_buffer_size(capacity);
+        }
+
+        // Copy the node to dst, allocated for capacity children.
+        void move_to(BeforeLastNode* dst, int capacity) const
+        {
+            memcpy(static_cast<void*>(dst), this, sizeof(BeforeLastNode));
+            m_children.move_buffer_to(dst->m_children, capacity);
+        }
+
         TLASTNODE* add_child(WordId wid)
         {
-            TLASTNODE node(wid);
             if (m_children.size())
             {
                 int index = search_index(wid);
-                m_children.insert(index, node);
+                m_children.insert(index, wid);
                 //printf("insert: index=%d wid=%d\n",index, wid);
                 return &m_children[index];
             }
             else
             {
-                m_children.push_back(node);
+                m_children.push_back(wid);
                 //printf("push_back: size=%d wid=%d\n",(int)children.size(), wid);
                 return &m_children.back();
             }
         }
 
+        // Add children for k sorted word ids, none of them present yet.
+        // Expects room for all of them.
+        void add_children(const WordId* wids, int k)
+        {
+            m_children.merge_sorted(wids, k);
+        }
+
         BaseNode* get_child(WordId wid)
         {
             if (m_children.size())
             {
                 int index = search_index(wid);
                 if (index < (int)m_children.size())
-                    if (m_children[index].m_word_id == wid)
+                    if (m_children.get_word_id(index) == wid)
                         return &m_children[index];
             }
             return NULL;
@@ -217,17 +700,7 @@ class BeforeLastNode : public TBASE
 
         int search_index(WordId wid) const
         {
-            int lo = 0;
-            int hi = m_children.size();
-            while (lo < hi)
-            {
-                int mid = (lo+hi)>>1;
-                if (m_children[mid].m_word_id < wid)
-                    lo = mid + 1;
-                else
-                    hi = mid;
-            }
-            return lo;
+            return m_children.search_index(wid);
         }
 
         int get_N1prx() const
@@ -256,13 +729,15 @@ class BeforeLastNode : public TBASE
             return sum;
         }
     public:
-        inplace_vector<TLASTNODE> m_children;  // has to be last
+        TCHILDREN m_children;  // has to be last
 };
 
 //------------------------------------------------------------------------
 // TrieNode - node for all lower levels of the ngram trie, unigrams for order 3
 //------------------------------------------------------------------------
-template <class TBASE>
+// TCHILDREN selects the layout of the child pointers, child_vector
+// or child_wid_vector.
+template <class TBASE, class TCHILDREN = child_vector>
 class TrieNode : public TBASE
 {
     public:
@@ -271,28 +746,34 @@ class TrieNode : public TBASE
         {
         }
 
-        void add_child(BaseNode* node)
+        void add_child(WordId wid, BaseNode* node)
         {
             if (m_children.size())
             {
-                int index = search_index(node->m_word_id);
-                m_children.insert(m_children.begin()+index, node);
+                int index = search_index(wid);
+                m_children.insert(index, wid, node);
                 //printf("insert: index=%d wid=%d\n",index, wid);
             }
             else
             {
-                m_children.push_back(node);
+                m_children.push_back(wid, node);
                 //printf("push_back: size=%d wid=%d\n",(int)children.size(), wid);
             }
         }
 
+        // Add k new nodes for k sorted word ids, none of them present yet.
+        void add_children(const WordId* wids, BaseNode* const* nodes, int k)
+        {
+            m_children.merge_sorted(wids, nodes, k);
+        }
+
         BaseNode* get_child(WordId wid, int& index)
         {
             if (m_children.size())
             {
                 index = search_index(wid);
                 if (index < (int)m_children.size())
-                    if (m_children[index]->m_word_id == wid)
+                    if (m_children.get_word_id(index) == wid)
                         return m_children[index];
             }
             return NULL;
@@ -303,20 +784,9 @@ class TrieNode : public TBASE
             return m_children[index];
         }
 
-        int search_index(WordId wid)
+        int search_index(WordId wid) const
         {
-            // binary search like lower_bound()
-            int lo = 0;
-            int hi = m_children.size();
-            while (lo < hi)
-            {
-                int mid = (lo+hi)>>1;
-                if (m_children[mid]->m_word_id < wid)
-                    lo = mid + 1;
-                else
-                    hi = mid;
-            }
-            return lo;
+            return m_children.search_index(wid);
         }
 
         int get_N1prx() const
@@ -344,12 +814,12 @@ class TrieNode : public TBASE
         int sum_child_counts() const
         {
             int sum = 0;
-            for (const auto& child : m_children)
-                sum += child->get_count();
+            for (int i=0; i<m_children.size(); i++)
+                sum += m_children[i]->get_count();
             return sum;
         }
     public:
-        std::vector<BaseNode*> m_children;
+        TCHILDREN m_children;
 };
 
 //------------------------------------------------------------------------
@@ -429,7 +899,8 @@ class NGramTrie : public TNODE
                 {
                     ngram.resize(m_nodes.size()-1);
                     for(int i=1; i<(int)m_nodes.size(); i++)
-                        ngram[i-1] = m_nodes[i]->m_word_id;
+                        ngram[i-1] = m_root->get_child_word_id(m_nodes[i-1],
+                                                    i-1, m_indexes[i-1]);
                 }
 
                 int get_level()
@@ -505,16 +976,22 @@ class NGramTrie : public TNODE
         {return add_node(&wids[0], wids.size());}
         BaseNode* add_node(const WordId* wids, int n);
 
+        // Create the missing nodes of count n-grams of length n at once,
+        // wids holds n word ids per n-gram, in any order.
+        bool add_nodes(const WordId* wids, int n, size_t count);
+
         void get_probs_witten_bell_i(const std::vector<WordId>& history,
                                      const std::vector<WordId>& words,
                                      std::vector<double>& vp,
-                                     int num_word_types);
+                                     int num_word_types,
+                                     NodeValueCache* cache = nullptr);
 
         void get_probs_abs_disc_i(const std::vector<WordId>& history,
                                   const std::vector<WordId>& words,
                                   std::vector<double>& vp,
                                   int num_word_types,
-                                  const std::vector<double>& Ds);
+                                  const std::vector<double>& Ds,
+                                  NodeValueCache* cache = nullptr);
 
         // Get number of unique ngrams per level, excluding removed ones
         // with count==0.
@@ -583,6 +1060,15 @@ class NGramTrie : public TNODE
             return static_cast<const TNODE*>(parent)->m_children[index];
         }
 
+        WordId get_child_word_id(const BaseNode* parent, int level, int index) const
+        {
+            if (level == m_order)
+                return (WordId)-1;
+            if (level == m_order - 1)
+                return static_cast<const TBEFORELASTNODE*>(parent)->m_children.get_word_id(index);
+            return static_cast<const TNODE*>(parent)->m_children.get_word_id(index);
+        }
+
         // Return the word ids of all direct child nodes,
         // excluding removed n-grams, i.g. count == 0.
         void get_child_wordids(const std::vector<WordId>& wids,
@@ -597,7 +1083,7 @@ class NGramTrie : public TNODE
                 {
                     BaseNode* child = get_child_at(node, level, i);
                     if (child->m_count)
-                        child_wids.push_back(child->m_word_id);
+                        child_wids.push_back(get_child_word_id(node, level, i));
                 }
             }
         }
@@ -638,24 +1124,27 @@ class NGramTrie : public TNODE
 
 
     protected:
+        // Allocate a childless node for any level but the last.
+        BaseNode* new_node(int level, WordId wid);
+
         void clear(BaseNode* node, int level)
         {
             if (level < m_order-1)
             {
                 TNODE* tn = static_cast<TNODE*>(node);
-                std::vector<BaseNode*>::iterator it;
-                for (it=tn->m_children.begin(); it<tn->m_children.end(); it++)
+                for (int i=0; i<tn->m_children.size(); i++)
                 {
-                    clear(*it, level+1);
+                    BaseNode* child = tn->m_children[i];
+                    clear(child, level+1);
                     if (level < m_order-2)
-                        static_cast<TNODE*>(*it)->~TNODE();
+                        static_cast<TNODE*>(child)->~TNODE();
                     else
                     if (level < m_order-1)
-                        static_cast<TBEFORELASTNODE*>(*it)->~TBEFORELASTNODE();
-                    MemFree(*it);
+                        static_cast<TBEFORELASTNODE*>(child)->~TBEFORELASTNODE();
+                    MemFree(child);
 
                 }
-                std::vector<BaseNode*>().swap(tn->m_children);  // really free the memory
+                tn->m_children.free();  // really free the memory
             }
             TNODE::set_count(0);
         }
@@ -677,14 +1166,12 @@ class NGramTrie : public TNODE
             if (level == m_order - 1)
             {
                 const TBEFORELASTNODE* nd = static_cast<const TBEFORELASTNODE*>(node);
-                return sizeof(TBEFORELASTNODE) +
-                       sizeof(TLASTNODE) *
-                       (nd->m_children.capacity() - nd->m_children.size());
+                return TBEFORELASTNODE::get_alloc_size(nd->m_children.capacity()) -
+                       sizeof(TLASTNODE) * nd->m_children.size();
             }
 
             const TNODE* nd = static_cast<const TNODE*>(node);
-            return sizeof(TNODE) +
-                   sizeof(TNODE*) * nd->m_children.capacity();
+            return sizeof(TNODE) + nd->m_children.get_memory_size();
         }
 
 
@@ -704,6 +1191,33 @@ class NGramTrie : public TNODE
 #pragma pack()
 
 
+//------------------------------------------------------------------------
+// ModelSnapshot - frozen copy of a dynamic model's contents for saving
+//------------------------------------------------------------------------
+// Taking a snapshot only copies words and n-gram values into flat arrays,
+// which is a lot faster than formatting the model file. The snapshot can
+// then be written while the model continues learning.
+class ModelSnapshot
+{
+    public:
+        void clear();
+
+        // Write the snapshot in the same format as DynamicModelBase::save().
+        void save(const char* filename) const;
+        LMError do_save(const char* filename) const;
+
+    public:
+        std::string word_blob;               // zero-terminated utf-8 words
+        std::vector<uint32_t> word_offsets;  // into word_blob, by word id
+        std::vector<int> num_ngrams;         // per level, excluding removed
+        int num_values{1};                   // count [time], per n-gram
+
+        // Per level: num_values values followed by the word ids,
+        // for each n-gram.
+        std::vector<std::vector<uint32_t>> ngrams;
+};
+
+
 //------------------------------------------------------------------------
 // DynamicModelBase - non-template abstract base class of all DynamicModels
 //------------------------------------------------------------------------
@@ -753,6 +1267,9 @@ class DynamicModelBase : public NGramModel
         virtual void get_node_values(const BaseNode* node, int level,
                                      std::vector<int>& values) const = 0;
 
+        // Discounting parameters per level, as estimated while counting.
+        virtual const std::vector<double>& get_discounts() const = 0;
+
         BaseNode* count_ngram(const std::vector<std::wstring>& ngram,
                               int increment=1, bool allow_new_words=true)
         {
@@ -783,6 +1300,38 @@ class DynamicModelBase : public NGramModel
         virtual BaseNode* count_ngram(const WordId* wids,
                                       int n, int increment) = 0;
 
+        // Add increments[i] to the count of the i-th of num_ngrams n-grams
+        // of length n in wids, like count_ngram() does for each of them.
+        // Missing trie nodes are created in bulk first and increments of
+        // repeated n-grams are summed up. nodes, if given, receives the
+        // node of each n-gram.
+        LMError count_ngrams(const WordId* wids, int n,
+                             const int* increments, size_t num_ngrams,
+                             BaseNode** nodes = NULL);
+
+        // Sort num_ngrams n-grams of length n and sum up the increments
+        // of repeated ones. order receives the sorted order of the input
+        // n-grams, group_ends the end of each distinct n-gram in order.
+        static void sum_ngrams(const WordId* wids, int n,
+                               const int* increments, size_t num_ngrams,
+                               std::vector<WordId>& unique_wids,
+                               std::vector<int>& unique_increments,
+                               std::vector<uint32_t>& order,
+                               std::vector<uint32_t>& group_ends);
+
+        // Create the trie nodes of many n-grams of length n up front, so
+        // that counting them only has to look them up. Their histories
+        // have to exist. Optional, count_ngram() adds missing nodes one by
+        // one otherwise.
+        virtual LMError add_ngram_nodes(const WordId* wids, int n,
+                                        size_t num_ngrams)
+        {
+            (void)wids;
+            (void)n;
+            (void)num_ngrams;
+            return ERR_NONE;
+        }
+
         virtual Smoothing get_smoothing() = 0;
         virtual void set_smoothing(Smoothing s) = 0;
 
@@ -811,6 +1360,13 @@ class DynamicModelBase : public NGramModel
         virtual void set_modified(bool modified) override
         {m_modified = modified;}
 
+        // Copy the contents to be saved by ModelSnapshot::save(),
+        // e.g. in another thread.
+        // Not incremental, this copies all words and n-grams. The model
+        // has to be held for a pause proportional to its size, roughly
+        // 3ms per MB of n-gram memory, i.e. 0.3s for a 100MB trie.
+        virtual void take_snapshot(ModelSnapshot& snapshot);
+
         // Debug output, dump all n-grams.
         virtual void dump();
 
@@ -887,11 +1443,18 @@ class DynamicModelBase : public NGramModel
         // Extract n-grams from tokens and count them.
         virtual void learn_tokens(const std::vector<std::string>& tokens, bool allow_new_words=true)
         {
-            std::vector<const char*> ngram;
-            for_each_ngram_in(tokens, get_order(), ngram, [&]
+            // Large texts, e.g. pasted or imported ones,
+            // build the trie in bulk.
+            if (tokens.size() >= BULK_LEARN_MIN_TOKENS)
+                learn_tokens_bulk(tokens, allow_new_words);
+            else
             {
-                count_ngram(ngram, 1, allow_new_words);
-            });
+                std::vector<const char*> ngram;
+                for_each_ngram_in(tokens, get_order(), ngram, [&]
+                {
+                    count_ngram(ngram, 1, allow_new_words);
+                });
+            }
 
             this->m_modified = true;
         }
@@ -990,14 +1553,35 @@ class DynamicModelBase : public NGramModel
         }
         virtual LMError write_arpa_ngrams(FILE* f);
 
+        // Values of an n-gram written before its words, e.g. the count.
+        virtual int get_num_arpa_values() {return 1;}
+        virtual void get_arpa_values(const BaseNode* node, uint32_t* values)
+        {
+            values[0] = static_cast<uint32_t>(node->get_count());
+        }
+
         virtual LMError load_arpac(const char* filename);
         virtual LMError save_arpac(const char* filename);
+        LMError load_arpac_ngrams(const char* begin, const char* end,
+                                  int level, int line_number,
+                                  int& num_expected, int& num_lines);
+
+        // Token count from which learn_tokens() builds the trie in bulk.
+        static const size_t BULK_LEARN_MIN_TOKENS = 1000;
+        void learn_tokens_bulk(const std::vector<std::string>& tokens,
+                               bool allow_new_words);
 
         virtual void set_node_time(BaseNode* node, uint32_t time)
         {
             (void) node;
             (void) time;
         }
+        // Time of recency models, the number of counted n-grams.
+        virtual uint32_t get_current_time() {return 0;}
+        virtual void set_current_time(uint32_t time)
+        {
+            (void) time;
+        }
         virtual int get_num_ngrams(int level) = 0;
         virtual void reserve_unigrams(int count) = 0;
 
@@ -1077,7 +1661,12 @@ class _DynamicModel : public DynamicModelBase
         virtual void clear();
         virtual void set_order(int n);
         virtual Smoothing get_smoothing() override {return m_smoothing;}
-        virtual void set_smoothing(Smoothing s) override {m_smoothing = s;}
+        virtual void set_smoothing(Smoothing s) override
+        {
+            if (s != m_smoothing)
+                invalidate_prediction_cache();
+            m_smoothing = s;
+        }
 
         virtual std::vector<Smoothing> get_smoothings()
         {
@@ -1129,6 +1718,11 @@ class _DynamicModel : public DynamicModelBase
                                 int increment=1, bool allow_new_words=true) override;
 
         virtual BaseNode* count_ngram(const WordId* wids, int n, int increment)  override;
+        virtual LMError add_ngram_nodes(const WordId* wids, int n,
+                                        size_t num_ngrams) override
+        {
+            return ngrams.add_nodes(wids, n, num_ngrams) ? ERR_NONE : ERR_MEMORY;
+        }
         virtual int get_ngram_count(const char* const* ngram, int n);
         virtual int get_ngram_count(const wchar_t* const* ngram, int n);
 
@@ -1138,6 +1732,10 @@ class _DynamicModel : public DynamicModelBase
             values.push_back(node->m_count);
             values.push_back(ngrams.get_N1prx(node, level));
         }
+        virtual const std::vector<double>& get_discounts() const override
+        {
+            return m_Ds;
+        }
         virtual void get_memory_sizes(std::vector<long>& values)
         {
             values.push_back(m_dictionary.get_memory_size());
@@ -1157,7 +1755,8 @@ class _DynamicModel : public DynamicModelBase
 
         virtual void get_probs(const std::vector<WordId>& history,
                                const std::vector<WordId>& words,
-                               std::vector<double>& probabilities);
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr);
 
         virtual int increment_node_count(BaseNode* node, const WordId* wids,
                                          int n, int increment)
@@ -1173,7 +1772,10 @@ class _DynamicModel : public DynamicModelBase
 
         virtual void reserve_unigrams(int count)
         {
+            // drops the control words, forget their counts too
             ngrams.reserve_unigrams(count);
+            std::fill(m_n1s.begin(), m_n1s.end(), 0);
+            std::fill(m_n2s.begin(), m_n2s.end(), 0);
         }
 
    private:
@@ -1209,9 +1811,17 @@ class _DynamicModel : public DynamicModelBase
         std::vector<double> m_Ds;
 };
 
-typedef _DynamicModel<NGramTrie<TrieNode<BaseNode>,
-                      BeforeLastNode<BaseNode, LastNode<BaseNode> >,
-                      LastNode<BaseNode> > > DynamicModel;
+typedef _DynamicModel<NGramTrie<TrieNode<WordNode>,
+                      BeforeLastNode<WordNode, LastNode<WordNode> >,
+                      LastNode<WordNode> > > DynamicModel;
+
+// Structure of arrays layout: the word ids of child nodes are kept
+// apart from the nodes, searches don't touch counts and pointers.
+// Nodes don't store their word ids, so there is no memory overhead.
+typedef _DynamicModel<NGramTrie<TrieNode<BaseNode, child_wid_vector>,
+                      BeforeLastNode<BaseNode, LastNode<BaseNode>,
+                                     inplace_wid_vector<LastNode<BaseNode> > >,
+                      LastNode<BaseNode> > > DynamicModelSoA;
 
 } // namespace
 
@@ -24,17 +24,85 @@
 
 namespace lm {
 
+//------------------------------------------------------------------------
+// RecencyDecay - lookup table for the exponential decay of recency weights
+//------------------------------------------------------------------------
+// weight(t) = 2^(-t/halflife), evaluated as 2^(-q) * 2^(-k/TABLE_SIZE) *
+// 2^(-d/TABLE_SIZE) with t/halflife = q + (k + d)/TABLE_SIZE, q and k
+// whole numbers and 0 <= d < 1. 2^(-q) is an exact power of two, the
+// table of fixed size holds 2^(-k/TABLE_SIZE) and the last factor,
+// close to 1, is a short series.
+class RecencyDecay
+{
+    public:
+        static const int TABLE_SIZE = 1024;
+
+        RecencyDecay(uint32_t halflife = 0)
+        {
+            set_halflife(halflife);
+        }
+
+        void set_halflife(uint32_t halflife)
+        {
+            m_halflife = halflife;
+            m_scale = halflife ? TABLE_SIZE / static_cast<double>(halflife) :
+                                 0.0;
+        }
+        uint32_t get_halflife() const {return m_halflife;}
+
+        double get_weight(uint32_t t) const
+        {
+            if (!m_halflife)
+                return pow(2, -static_cast<double>(t)/m_halflife);
+
+            // beyond 2^-1100 the result underflows to 0 anyway
+            uint32_t q = std::min(t / m_halflife, 1100u);
+            double x = (t % m_halflife) * m_scale;
+            int k = std::min(static_cast<int>(x), TABLE_SIZE-1);
+
+            // e^-y for y < ln(2)/TABLE_SIZE, exact to double precision
+            double y = (x - k) * (M_LN2 / TABLE_SIZE);
+            double rest = 1.0 - y*(1.0 - y*(0.5 - y*(1.0/6 - y*(1.0/24))));
+
+            return ldexp(get_table()[k] * rest, -static_cast<int>(q));
+        }
+
+    private:
+        static const double* get_table()
+        {
+            static const struct Table
+            {
+                double values[TABLE_SIZE];
+                Table()
+                {
+                    for (int k=0; k<TABLE_SIZE; k++)
+                        values[k] = pow(2, -static_cast<double>(k)/TABLE_SIZE);
+                }
+            } table;
+            return table.values;
+        }
+
+    private:
+        uint32_t m_halflife;
+        double m_scale;     // TABLE_SIZE / halflife
+};
+
 #pragma pack(2)
 
 //------------------------------------------------------------------------
 // RecencyNode - tracks time of last use
 //------------------------------------------------------------------------
+// Base of the nodes of all levels, TBASE is WordNode or BaseNode,
+// depending on the layout of the child arrays.
 
-class RecencyNode : public BaseNode
+template <class TBASE>
+class RecencyNode : public TBASE
 {
     public:
+        typedef RecencyNode<TBASE> RecencyBase;
+
         RecencyNode(WordId wid = -1)
-        : BaseNode(wid)
+        : TBASE(wid)
         {
             m_time = 0;
         }
@@ -54,19 +122,14 @@ class RecencyNode : public BaseNode
             m_time = t;
         }
 
-        double get_recency_weight(uint32_t current_time, double halflife) const
+        double get_recency_weight(uint32_t current_time,
+                                  const RecencyDecay& decay) const
         {
             // exponential decay,
             // halflife is the number of time steps to halfed weight,
             // or in other words the number of recently used ngrams before
             // the weight drops below 0.5.
-            double t = current_time - get_time();
-//            return time -5;
-//            return get_time();
-//            return floor(1e9 * pow(2, -t/halflife));
-//            return current_time * pow(2, -t/halflife);
-//            return floor(1e9 * pow(2, -t/halflife));
-            return pow(2, -t/halflife);
+            return decay.get_weight(current_time - get_time());
         }
 
     public:
@@ -75,13 +138,14 @@ class RecencyNode : public BaseNode
 
 template <class TNODE>
 double sum_child_recency_weights(TNODE* node, uint32_t current_time,
-                                 double halflife)
+                                 const RecencyDecay& decay)
 {
     double sum = 0;
     for (int i=0; i<(int)node->m_children.size(); i++)
     {
-        RecencyNode* nd = static_cast<RecencyNode*>(node->get_child_at(i));
-        sum += nd->get_recency_weight(current_time, halflife);
+        typedef typename TNODE::RecencyBase RNode;
+        RNode* nd = static_cast<RNode*>(node->get_child_at(i));
+        sum += nd->get_recency_weight(current_time, decay);
     }
     return sum;
 }
@@ -95,6 +159,7 @@ class NGramTrieRecency : public NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>
 {
     private:
         typedef NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE> Base;
+        typedef typename TNODE::RecencyBase RNode;
 
     public:
         NGramTrieRecency(WordId wid = (WordId)-1)
@@ -109,6 +174,10 @@ class NGramTrieRecency : public NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>
             Base::clear();
         }
 
+        uint32_t get_current_time()
+        {
+            return m_current_time;
+        }
         void set_current_time(int t)
         {
             m_current_time = t;
@@ -119,24 +188,25 @@ class NGramTrieRecency : public NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>
 
         double sum_child_recency_weights(BaseNode* node, int level,
                                            uint32_t current_time,
-                                           double halflife)
+                                           const RecencyDecay& decay)
         {
             if (level == this->m_order)
                 return -1;  // undefined for leaf nodes
             if (level == this->m_order - 1)
                 return lm::sum_child_recency_weights(
                    static_cast<TBEFORELASTNODE*>(node),
-                   current_time, halflife);
+                   current_time, decay);
             return lm::sum_child_recency_weights(
-               static_cast<TNODE*>(node), current_time, halflife);
+               static_cast<TNODE*>(node), current_time, decay);
         }
 
         void get_probs_recency_jelinek_mercer_i(const std::vector<WordId>& history,
                                     const std::vector<WordId>& words,
                                     std::vector<double>& vp,
                                     int num_word_types,
-                                    uint32_t recency_halflife,
-                                    std::vector<double>& lamdas);
+                                    const RecencyDecay& recency_decay,
+                                    std::vector<double>& lamdas,
+                                    NodeValueCache* cache = nullptr);
 
     protected:
         uint32_t m_current_time;      // time is an ever increasing integer
@@ -149,7 +219,7 @@ int NGramTrieRecency<TNODE, TBEFORELASTNODE, TLASTNODE>::
                          int increment)
 {
     this->m_current_time++;        // time is an ever increasing integer
-    static_cast<RecencyNode*>(node)->m_time = this->m_current_time;
+    static_cast<RNode*>(node)->m_time = this->m_current_time;
 
     return Base::increment_node_count(node, wids, n, increment);
 }
@@ -162,10 +232,11 @@ void NGramTrieRecency<TNODE, TBEFORELASTNODE, TLASTNODE>::
                           const std::vector<WordId>& words,
                           std::vector<double>& vp,
                           int num_word_types,
-                          uint32_t recency_halflife,
-                          std::vector<double>& lamdas)
+                          const RecencyDecay& recency_decay,
+                          std::vector<double>& lamdas,
+                          NodeValueCache* cache)
 {
-    int i,j;
+    int j;
     int n = history.size() + 1;
     int size = words.size();        // number of candidate words
     std::vector<double> vt(size);   // vector of times, reused for order 1..n
@@ -181,34 +252,41 @@ void NGramTrieRecency<TNODE, TBEFORELASTNODE, TLASTNODE>::
         BaseNode* hnode = this->get_node(h);
         if (hnode)
         {
-            int N1prx = this->get_N1prx(hnode, j);   // number of word types following the history
+            // number of word types following the history
+            int N1prx = get_node_value(cache, hnode, NodeValueCache::N1PRX,
+                                 [&] {return this->get_N1prx(hnode, j);});
             if (!N1prx)  // break early, don't reset probabilities to 0
                 break;   // for unknown histories
 
             // total number of occurences of the history
-            double cs = sum_child_recency_weights(hnode, j, m_current_time,
-                                                    recency_halflife);
+            double cs = get_node_value(cache, hnode,
+                                       NodeValueCache::RECENCY_WEIGHTS, [&]
+                {return sum_child_recency_weights(hnode, j, m_current_time,
+                                                  recency_decay);});
             if (cs)
             {
                 // get ngram times
                 fill(vt.begin(), vt.end(), 0);
                 int num_children = this->get_num_children(hnode, j);
-                for(i=0; i<num_children; i++)
+                auto child_at = [&](int c)
                 {
-                    RecencyNode* child = static_cast<RecencyNode*>
-                                              (this->get_child_at(hnode, j, i));
-                    int index = binsearch(words, child->m_word_id); // word_indices have to be sorted by index
-                    if (index >= 0)
-                        vt[index] = child->get_recency_weight(m_current_time,
-                                                              recency_halflife);
-                }
+                    return static_cast<RNode*>
+                                      (this->get_child_at(hnode, j, c));
+                };
+
+                // children and candidate words are both sorted by word id
+                merge_join(num_children,
+                    [&](int c) {return this->get_child_word_id(hnode, j, c);},
+                    size, [&](int k) {return words[k];},
+                    [&](int c, int k)
+                    {
+                        vt[k] = child_at(c)->get_recency_weight(m_current_time,
+                                                                recency_decay);
+                    });
 
                 double lambda = lamdas[j]; // normalization factor
-                for(i=0; i<size; i++)
-                {
-                    double pmle = vt[i] / cs;
-                    vp[i] = lambda * pmle + (1.0 - lambda) * vp[i];
-                }
+                interpolate_linear(vp.data(), vt.data(), size,
+                                   cs, lambda, 1.0 - lambda);
             }
         }
     }
@@ -225,7 +303,9 @@ class _CachedDynamicModel : public _DynamicModelKN<TNGRAMS>
 {
     public:
         typedef _DynamicModelKN<TNGRAMS> Base;
+        typedef typename TNGRAMS::RecencyBase RNode;
         static const Smoothing DEFAULT_SMOOTHING = ABS_DISC_I;
+        static const uint32_t MAX_RECENCY_HALFLIFE = 0xffffffff;
         const double DEFAULT_LAMBDA;  // default for Jelinek-Mercer weights
 
     public:
@@ -237,6 +317,7 @@ class _CachedDynamicModel : public _DynamicModelKN<TNGRAMS>
             m_recency_smoothing = JELINEK_MERCER_I;
             m_recency_ratio = 0.8;
             m_recency_halflife = 100;     // 100 words until recency_weight=0.5
+            m_recency_decay.set_halflife(m_recency_halflife);
         }
 
         virtual void set_order(int order);
@@ -246,21 +327,49 @@ class _CachedDynamicModel : public _DynamicModelKN<TNGRAMS>
                                      std::vector<int>& values) const override
         {
             Base::get_node_values(node, level, values);
-            values.push_back(static_cast<const RecencyNode*>(node)->get_time());
+            values.push_back(static_cast<const RNode*>(node)->get_time());
         }
 
         virtual void set_node_time(BaseNode* node, uint32_t time)
         {
-            static_cast<RecencyNode*>(node)->set_time(time);
+            static_cast<RNode*>(node)->set_time(time);
+        }
+        virtual uint32_t get_current_time() override
+        {
+            return this->ngrams.get_current_time();
+        }
+        virtual void set_current_time(uint32_t time) override
+        {
+            this->ngrams.set_current_time(time);
         }
 
-        void set_recency_halflife(double hl) {m_recency_halflife = hl;}
+        // Halflives are clamped to the range of the model's time.
+        void set_recency_halflife(double hl)
+        {
+            hl = std::min(hl, static_cast<double>(MAX_RECENCY_HALFLIFE));
+            if (static_cast<uint32_t>(hl) != m_recency_halflife)
+            {
+                this->invalidate_prediction_cache();
+                m_recency_halflife = hl;
+                m_recency_decay.set_halflife(m_recency_halflife);
+            }
+        }
         uint32_t get_recency_halflife() {return m_recency_halflife;}
 
-        void set_recency_ratio(double ratio) {m_recency_ratio = ratio;}
+        void set_recency_ratio(double ratio)
+        {
+            if (ratio != m_recency_ratio)
+                this->invalidate_prediction_cache();
+            m_recency_ratio = ratio;
+        }
         double get_recency_ratio() {return m_recency_ratio;}
 
-        void set_recency_smoothing(Smoothing sm) {m_recency_smoothing = sm;}
+        void set_recency_smoothing(Smoothing sm)
+        {
+            if (sm != m_recency_smoothing)
+                this->invalidate_prediction_cache();
+            m_recency_smoothing = sm;
+        }
         Smoothing get_recency_smoothing() {return m_recency_smoothing;}
 
         virtual std::vector<Smoothing> get_recency_smoothings()
@@ -272,8 +381,11 @@ class _CachedDynamicModel : public _DynamicModelKN<TNGRAMS>
 
         void set_recency_lambdas(const std::vector<double>& lambdas)
         {
-            m_recency_lambdas = lambdas;
-            m_recency_lambdas.resize(this->m_order, DEFAULT_LAMBDA);
+            std::vector<double> l = lambdas;
+            l.resize(this->m_order, DEFAULT_LAMBDA);
+            if (l != m_recency_lambdas)
+                this->invalidate_prediction_cache();
+            m_recency_lambdas = l;
         }
         void get_recency_lambdas(std::vector<double>& lambdas)
         {
@@ -283,24 +395,41 @@ class _CachedDynamicModel : public _DynamicModelKN<TNGRAMS>
     protected:
         virtual void get_probs(const std::vector<WordId>& history,
                                const std::vector<WordId>& words,
-                               std::vector<double>& probabilities);
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr);
 
         virtual LMError write_arpa_ngram(
             FILE* f, const BaseNode* node, const std::vector<WordId>& wids);
 
+        virtual int get_num_arpa_values() {return 2;}
+        virtual void get_arpa_values(const BaseNode* _node, uint32_t* values)
+        {
+            const RNode* node = static_cast<const RNode*>(_node);
+            values[0] = static_cast<uint32_t>(node->get_count());
+            values[1] = node->get_time();
+        }
+
     protected:
         uint32_t m_recency_halflife;            // Halflife of exponential falloff
                                                 // in number of recently used words
                                                 // until recency weight=0.5.
+        RecencyDecay m_recency_decay;           // weights by age, for m_recency_halflife
         double m_recency_ratio;                 // linear interpolation ratio
         Smoothing m_recency_smoothing;
         std::vector<double> m_recency_lambdas;  // jelinek_mercer smoothing weights
 };
 
-typedef _CachedDynamicModel<NGramTrieRecency<TrieNode<TrieNodeKNBase<RecencyNode> >,
-                                  BeforeLastNode<BeforeLastNodeKNBase<RecencyNode>,
-                                                 LastNode<RecencyNode> >,
-                                  LastNode<RecencyNode> > > CachedDynamicModel;
+typedef _CachedDynamicModel<NGramTrieRecency<TrieNode<TrieNodeKNBase<RecencyNode<WordNode> > >,
+                                  BeforeLastNode<BeforeLastNodeKNBase<RecencyNode<WordNode> >,
+                                                 LastNode<RecencyNode<WordNode> > >,
+                                  LastNode<RecencyNode<WordNode> > > > CachedDynamicModel;
+
+// structure of arrays layout, see DynamicModelSoA
+typedef _CachedDynamicModel<NGramTrieRecency<TrieNode<TrieNodeKNBase<RecencyNode<BaseNode> >, child_wid_vector>,
+                                  BeforeLastNode<BeforeLastNodeKNBase<RecencyNode<BaseNode> >,
+                                                 LastNode<RecencyNode<BaseNode> >,
+                                                 inplace_wid_vector<LastNode<RecencyNode<BaseNode> > > >,
+                                  LastNode<RecencyNode<BaseNode> > > > CachedDynamicModelSoA;
 
 template <class TNGRAMS>
 void _CachedDynamicModel<TNGRAMS>::
@@ -321,7 +450,7 @@ do_load(const char* filename)
     typename TNGRAMS::iterator it ;
     for (it = this->ngrams.begin(); *it; it++)
     {
-        const RecencyNode* node = static_cast<const RecencyNode*>(*it);
+        const RNode* node = static_cast<const RNode*>(*it);
         if (max_time < node->get_time())
             max_time = node->get_time();
     }
@@ -337,7 +466,8 @@ do_load(const char* filename)
 template <class TNGRAMS>
 void _CachedDynamicModel<TNGRAMS>::get_probs(const std::vector<WordId>& history,
                             const std::vector<WordId>& words,
-                            std::vector<double>& probabilities)
+                            std::vector<double>& probabilities,
+                            NodeValueCache* cache)
 {
     // pad/cut history so it's always of length order-1
     int n = std::min((int)history.size(), this->m_order-1);
@@ -345,7 +475,7 @@ void _CachedDynamicModel<TNGRAMS>::get_probs(const std::vector<WordId>& history,
     copy_backward(history.end()-n, history.end(), h.end());
 
     // get probabilities based on counts
-    Base::get_probs(history, words, probabilities);
+    Base::get_probs(history, words, probabilities, cache);
     if (m_recency_ratio)
     {
         // get probabilities based on recency
@@ -355,7 +485,7 @@ void _CachedDynamicModel<TNGRAMS>::get_probs(const std::vector<WordId>& history,
             case JELINEK_MERCER_I:
                 this->ngrams.get_probs_recency_jelinek_mercer_i(h, words,
                                vpr, this->get_num_word_types(),
-                               m_recency_halflife, m_recency_lambdas);
+                               m_recency_decay, m_recency_lambdas, cache);
                 break;
 
             default:
@@ -381,7 +511,7 @@ template <class TNGRAMS>
 LMError _CachedDynamicModel<TNGRAMS>::
 write_arpa_ngram(FILE* f, const BaseNode* _node, const std::vector<WordId>& wids)
 {
-    const RecencyNode* node = static_cast<const RecencyNode*>(_node);
+    const RNode* node = static_cast<const RNode*>(_node);
 
     fwprintf(f, L"%d %d", node->get_count(), node->get_time());
 
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <algorithm>
 #include <cstring>
 #include <set>
 #include <iostream>
@@ -64,16 +65,13 @@ BaseNode* NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
                 {
                     // grow the memory block of the parent node
                     int new_capacity = p->m_children.capacity(size + 1);
-                    int old_bytes = sizeof(TBEFORELASTNODE) +
-                               old_capacity*sizeof(TLASTNODE);
-                    int new_bytes = sizeof(TBEFORELASTNODE) +
-                               new_capacity*sizeof(TLASTNODE);
+                    int new_bytes = TBEFORELASTNODE::get_alloc_size(new_capacity);
                     TBEFORELASTNODE* pnew = (TBEFORELASTNODE*) MemAlloc(new_bytes);
                     if (!pnew)
                         return NULL;
 
                     // copy the data over, no need for constructor calls
-                    memcpy(pnew, p, old_bytes);
+                    p->move_to(pnew, new_capacity);
 
                     // replace grand_parent pointer
                     ASSERT(p == grand_parent->m_children[grand_parent_index]);
@@ -86,24 +84,11 @@ BaseNode* NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
                 node = p->add_child(wid);
             }
             else
-            if (i == m_order-2)
             {
-                int bytes = sizeof(TBEFORELASTNODE) +
-                        inplace_vector<TLASTNODE>::capacity(0)*sizeof(TLASTNODE);
-                TBEFORELASTNODE* nd = (TBEFORELASTNODE*)MemAlloc(bytes);
-                //node = new TBEFORELASTNODE(wid);
-                if (!nd)
+                node = new_node(i+1, wid);
+                if (!node)
                     return NULL;
-                node = new(nd) TBEFORELASTNODE(wid);
-                static_cast<TNODE*>(parent)->add_child(node);
-            }
-            else
-            {
-                TNODE* nd = (TNODE*)MemAlloc(sizeof(TNODE));
-                if (!nd)
-                    return NULL;
-                node = new(nd) TNODE(wid);
-                static_cast<TNODE*>(parent)->add_child(node);
+                static_cast<TNODE*>(parent)->add_child(wid, node);
             }
 
             // Create only a single node per call. For a valid model we
@@ -117,14 +102,140 @@ BaseNode* NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
     return node;
 }
 
+// Create the missing nodes of many n-grams at once. Sorted by history,
+// the new children of each parent are merged into its child array in a
+// single pass, which is reallocated at most once, to the capacity of its
+// final size. One at a time, add_node() shifts the children for almost
+// every new n-gram and grows them in many small steps.
+// Histories have to exist already, n-grams without are skipped and left
+// to add_node(). Returns false when out of memory.
+template <class TNODE, class TBEFORELASTNODE, class TLASTNODE>
+bool NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
+    add_nodes(const WordId* wids, int n, size_t count)
+{
+    if (n < 1 || n > m_order)
+        return true;
+
+    std::vector<uint32_t> order(count);
+    for (size_t i=0; i<count; i++)
+        order[i] = i;
+    auto less = [wids, n](uint32_t a, uint32_t b)
+    {
+        return std::lexicographical_compare(wids + a*n, wids + (a+1)*n,
+                                            wids + b*n, wids + (b+1)*n);
+    };
+    if (!std::is_sorted(order.begin(), order.end(), less))
+        std::sort(order.begin(), order.end(), less);
+
+    int level = n-1;   // level of the parents
+    std::vector<WordId> new_wids;
+    std::vector<BaseNode*> new_nodes;
+    for (size_t begin=0, end; begin<count; begin=end)
+    {
+        // range of n-grams with the same history
+        const WordId* history = wids + order[begin]*n;
+        for (end = begin+1; end<count; end++)
+            if (!std::equal(history, history+level, wids + order[end]*n))
+                break;
+
+        BaseNode* parent = this;
+        TNODE* grand_parent = NULL;
+        int parent_index = 0;
+        for (int i=0; i<level && parent; i++)
+        {
+            grand_parent = static_cast<TNODE*>(parent);
+            parent = get_child(parent, i, history[i], parent_index);
+        }
+        if (!parent)
+            continue;
+
+        // word ids of the missing children, unique and sorted
+        new_wids.clear();
+        int num_children = get_num_children(parent, level);
+        int c = 0;
+        for (size_t k=begin; k<end; k++)
+        {
+            WordId wid = wids[order[k]*n + level];
+            if (!new_wids.empty() && new_wids.back() == wid)
+                continue;
+            while (c < num_children &&
+                   get_child_word_id(parent, level, c) < wid)
+                c++;
+            if (c < num_children &&
+                get_child_word_id(parent, level, c) == wid)
+                continue;
+            new_wids.push_back(wid);
+        }
+        if (new_wids.empty())
+            continue;
+
+        if (n == m_order)
+        {
+            TBEFORELASTNODE* p = static_cast<TBEFORELASTNODE*>(parent);
+            int new_size = p->m_children.size() + new_wids.size();
+            if (new_size > p->m_children.capacity())
+            {
+                int new_capacity = p->m_children.capacity(new_size);
+                int new_bytes = TBEFORELASTNODE::get_alloc_size(new_capacity);
+                TBEFORELASTNODE* pnew = (TBEFORELASTNODE*) MemAlloc(new_bytes);
+                if (!pnew)
+                    return false;
+                p->move_to(pnew, new_capacity);
+
+                ASSERT(p == grand_parent->m_children[parent_index]);
+                grand_parent->m_children[parent_index] = pnew;
+                MemFree(p);
+                p = pnew;
+            }
+            p->add_children(new_wids.data(), new_wids.size());
+        }
+        else
+        {
+            new_nodes.clear();
+            for (WordId wid : new_wids)
+            {
+                BaseNode* node = new_node(n, wid);
+                if (!node)
+                    return false;
+                new_nodes.push_back(node);
+            }
+            static_cast<TNODE*>(parent)->add_children(new_wids.data(),
+                                                      new_nodes.data(),
+                                                      new_nodes.size());
+        }
+    }
+    return true;
+}
+
+template <class TNODE, class TBEFORELASTNODE, class TLASTNODE>
+BaseNode* NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
+    new_node(int level, WordId wid)
+{
+    if (level == m_order-1)
+    {
+        int bytes = TBEFORELASTNODE::get_alloc_size(
+                decltype(TBEFORELASTNODE::m_children)::capacity(0));
+        TBEFORELASTNODE* nd = (TBEFORELASTNODE*)MemAlloc(bytes);
+        if (!nd)
+            return NULL;
+        return new(nd) TBEFORELASTNODE(wid);
+    }
+
+    TNODE* nd = (TNODE*)MemAlloc(sizeof(TNODE));
+    if (!nd)
+        return NULL;
+    return new(nd) TNODE(wid);
+}
+
 template <class TNODE, class TBEFORELASTNODE, class TLASTNODE>
 void NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
     get_probs_witten_bell_i(const std::vector<WordId>& history,
                             const std::vector<WordId>& words,
                             std::vector<double>& vp,
-                            int num_word_types)
+                            int num_word_types,
+                            NodeValueCache* cache)
 {
-    int i,j;
+    int j;
     int n = history.size() + 1;
     int size = words.size();   // number of candidate words
     std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
@@ -140,32 +251,30 @@ void NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
         BaseNode* hnode = get_node(h);
         if (hnode)
         {
-            int N1prx = get_N1prx(hnode, j);   // number of word types following the history
+            // number of word types following the history
+            int N1prx = get_node_value(cache, hnode, NodeValueCache::N1PRX,
+                                       [&] {return get_N1prx(hnode, j);});
             if (!N1prx)  // break early, don't reset probabilities to 0
                 break;   // for unknown histories
 
             // total number of occurences of the history
-            int cs = sum_child_counts(hnode, j);
+            int cs = get_node_value(cache, hnode, NodeValueCache::CHILD_COUNTS,
+                                    [&] {return sum_child_counts(hnode, j);});
             if (cs)
             {
                 // get ngram counts
                 fill(vc.begin(), vc.end(), 0);
                 int num_children = get_num_children(hnode, j);
-                for(i=0; i<num_children; i++)
-                {
-                    BaseNode* child = get_child_at(hnode, j, i);
-                    int index = binsearch(words, child->m_word_id); // word_indices have to be sorted by index
-                    if (index >= 0)
-                        vc[index] = child->get_count();
-                }
+                // children and candidate words are both sorted by word id
+                merge_join(num_children,
+                    [&](int c) {return get_child_word_id(hnode, j, c);},
+                    size, [&](int k) {return words[k];},
+                    [&](int c, int k) {vc[k] = get_child_at(hnode, j, c)->get_count();});
 
                 double l1 = N1prx / (N1prx + float(cs)); // normalization factor
                                                          // 1 - lambda
-                for(i=0; i<size; i++)
-                {
-                    double pmle = vc[i] / float(cs);
-                    vp[i] = (1.0 - l1) * pmle + l1 * vp[i];
-                }
+                interpolate_linear(vp.data(), vc.data(), size,
+                                   float(cs), 1.0 - l1, l1);
             }
         }
     }
@@ -178,9 +287,10 @@ void NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
                           const std::vector<WordId>& words,
                           std::vector<double>& vp,
                           int num_word_types,
-                          const std::vector<double>& Ds)
+                          const std::vector<double>& Ds,
+                          NodeValueCache* cache)
 {
-    int i,j;
+    int j;
     int n = history.size() + 1;
     int size = words.size();   // number of candidate words
     std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
@@ -196,35 +306,31 @@ void NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>::
         BaseNode* hnode = get_node(h);
         if (hnode)
         {
-            int N1prx = get_N1prx(hnode, j);   // number of word types following the history
+            // number of word types following the history
+            int N1prx = get_node_value(cache, hnode, NodeValueCache::N1PRX,
+                                       [&] {return get_N1prx(hnode, j);});
             if (!N1prx)  // break early, don't reset probabilities to 0
                 break;   // for unknown histories
 
             // total number of occurences of the history
-            int cs = sum_child_counts(hnode, j);
+            int cs = get_node_value(cache, hnode, NodeValueCache::CHILD_COUNTS,
+                                    [&] {return sum_child_counts(hnode, j);});
             if (cs)
             {
                 // get ngram counts
                 fill(vc.begin(), vc.end(), 0);
                 int num_children = get_num_children(hnode, j);
-                for(i=0; i<num_children; i++)
-                {
-                    BaseNode* child = get_child_at(hnode, j, i);
-                    int index = binsearch(words, child->m_word_id); // word_indices have to be sorted by index
-                    if (index >= 0)
-                        vc[index] = child->get_count();
-                }
+                // children and candidate words are both sorted by word id
+                merge_join(num_children,
+                    [&](int c) {return get_child_word_id(hnode, j, c);},
+                    size, [&](int k) {return words[k];},
+                    [&](int c, int k) {vc[k] = get_child_at(hnode, j, c)->get_count();});
 
                 double D = Ds[j];
                 double l1 = D / float(cs) * N1prx; // normalization factor
                                                    // 1 - lambda
-                for(i=0; i<size; i++)
-                {
-                    double a = vc[i] - D;
-                    if (a < 0)
-                        a = 0;
-                    vp[i] = a / float(cs) + l1 * vp[i];
-                }
+                interpolate_abs_disc(vp.data(), vc.data(), size,
+                                     D, float(cs), l1);
             }
         }
     }
@@ -310,6 +416,8 @@ BaseNode* _DynamicModel<TNGRAMS>::count_ngram(const WordId* wids, int n,
 {
     int i;
 
+    invalidate_prediction_cache();
+
     // get/add node for ngram
     BaseNode* node = ngrams.add_node(wids, n);
     if (!node)
@@ -369,7 +477,8 @@ int _DynamicModel<TNGRAMS>::get_ngram_count(const wchar_t* const* ngram, int n)
 template <class TNGRAMS>
 void _DynamicModel<TNGRAMS>::get_probs(const std::vector<WordId>& history,
                                        const std::vector<WordId>& words,
-                                       std::vector<double>& probabilities)
+                                       std::vector<double>& probabilities,
+                                       NodeValueCache* cache)
 {
     // pad/cut history so it's always of length order-1
     int n = std::min((int)history.size(), m_order-1);
@@ -386,12 +495,12 @@ void _DynamicModel<TNGRAMS>::get_probs(const std::vector<WordId>& history,
     {
         case WITTEN_BELL_I:
             ngrams.get_probs_witten_bell_i(h, words, probabilities,
-                                              get_num_word_types());
+                                              get_num_word_types(), cache);
             break;
 
         case ABS_DISC_I:
             ngrams.get_probs_abs_disc_i(h, words, probabilities,
-                                           get_num_word_types(), m_Ds);
+                                           get_num_word_types(), m_Ds, cache);
             break;
 
          default:
@@ -107,7 +107,8 @@ class NGramTrieKN : public NGramTrie<TNODE, TBEFORELASTNODE, TLASTNODE>
                                     const std::vector<WordId>& words,
                                     std::vector<double>& vp,
                                     int num_word_types,
-                                    const std::vector<double>& Ds);
+                                    const std::vector<double>& Ds,
+                                    NodeValueCache* cache = nullptr);
 };
 
 // Add increment to node->count and incrementally update kneser-ney counts
@@ -199,7 +200,8 @@ void NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>::
                             const std::vector<WordId>& words,
                             std::vector<double>& vp,
                             int num_word_types,
-                            const std::vector<double>& Ds)
+                            const std::vector<double>& Ds,
+                            NodeValueCache* cache)
 {
     // only fixed history size allowed; don't remove unknown words
     // from the history, mark them with UNKNOWN_WORD_ID instead.
@@ -221,7 +223,9 @@ void NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>::
         BaseNode* hnode = this->get_node(h);
         if (hnode)
         {
-            int N1prx = this->get_N1prx(hnode, j);   // number of word types following the history
+            // number of word types following the history
+            int N1prx = get_node_value(cache, hnode, NodeValueCache::N1PRX,
+                                 [&] {return this->get_N1prx(hnode, j);});
             if (!N1prx)  // break early, don't reset probabilities to 0
                 break;   // for unknown histories
 
@@ -235,20 +239,25 @@ void NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>::
                 // successors. This happenes by default with the predefined
                 // control words <unk>, <s>, ..., but can also happen when
                 // incrementally adding text fragments to a language model.
-                int num_children = this->get_num_children(hnode, j);
-                for(i=0; i<num_children; i++)
+                N1prx = get_node_value(cache, hnode, NodeValueCache::N1PRX_KN, [&]
                 {
-                    // children here may be of type TrieNode or BeforeLastNode,
-                    // play safe and cast to the latter.
-                    TBEFORELASTNODE* child = static_cast<TBEFORELASTNODE*>
-                                    (this->get_child_at(hnode, j, i));
-
-                    if (child->get_N1pxr() == 0 &&  // no predecessors?
-                        child->get_count())         // not removed?
+                    int N1prx_kn = N1prx;
+                    int num_children = this->get_num_children(hnode, j);
+                    for(int c=0; c<num_children; c++)
                     {
-                        N1prx--;  // exclude it from the count of successors
+                        // children here may be of type TrieNode or BeforeLastNode,
+                        // play safe and cast to the latter.
+                        TBEFORELASTNODE* child = static_cast<TBEFORELASTNODE*>
+                                        (this->get_child_at(hnode, j, c));
+
+                        if (child->get_N1pxr() == 0 &&  // no predecessors?
+                            child->get_count())         // not removed?
+                        {
+                            N1prx_kn--;  // exclude it from the count of successors
+                        }
                     }
-                }
+                    return N1prx_kn;
+                });
 
                 // number of permutations around history h
                 int N1pxrx = get_N1pxrx(hnode, j);
@@ -279,30 +288,27 @@ void NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>::
                         // in the candidate words.
                         fill(vc.begin(), vc.end(), 0);
                         int num_children_ = this->get_num_children(hnode, j);
-                        for(i=0; i<num_children_; i++)
+
+                        // children here may be of type TrieNode or BeforeLastNode,
+                        // play safe and cast to the latter.
+                        auto child_at = [&](int c)
                         {
-                            // children here may be of type TrieNode or BeforeLastNode,
-                            // play safe and cast to the latter.
-                            TBEFORELASTNODE* child = static_cast<TBEFORELASTNODE*>
-                                            (this->get_child_at(hnode, j, i));
-
-                            // word_indices have to be sorted by index
-                            int index = binsearch(words, child->m_word_id);
-                            if (index != -1)
-                                vc[index] = child->m_N1pxr;
-                        }
+                            return static_cast<TBEFORELASTNODE*>
+                                            (this->get_child_at(hnode, j, c));
+                        };
+
+                        // children and candidate words are both sorted by word id
+                        merge_join(num_children_,
+                            [&](int c) {return this->get_child_word_id(hnode, j, c);},
+                            size, [&](int k) {return words[k];},
+                            [&](int c, int k) {vc[k] = child_at(c)->m_N1pxr;});
                     }
 
                     double D = Ds[j];
                     double l1 = D / static_cast<double>(N1pxrx) * N1prx; // normalization factor
                                                            // 1 - lambda
-                    for(i=0; i<size; i++)
-                    {
-                        double a = vc[i] - D;
-                        if (a < 0)
-                            a = 0;
-                        vp[i] = a / N1pxrx + l1 * vp[i];
-                    }
+                    interpolate_abs_disc(vp.data(), vc.data(), size,
+                                         D, N1pxrx, l1);
                 }
 
             }
@@ -310,30 +316,24 @@ void NGramTrieKN<TNODE, TBEFORELASTNODE, TLASTNODE>::
             else
             {
                 // total number of occurences of the history
-                int cs = this->sum_child_counts(hnode, j);
+                int cs = get_node_value(cache, hnode, NodeValueCache::CHILD_COUNTS,
+                                  [&] {return this->sum_child_counts(hnode, j);});
                 if (cs)
                 {
                     // get ngram counts
                     fill(vc.begin(), vc.end(), 0);
                     int num_children = this->get_num_children(hnode, j);
-                    for(i=0; i<num_children; i++)
-                    {
-                        BaseNode* child = this->get_child_at(hnode, j, i);
-                        int index = binsearch(words, child->m_word_id); // word_indices have to be sorted by index
-                        if (index >= 0)
-                            vc[index] = child->get_count();
-                    }
+                    // children and candidate words are both sorted by word id
+                    merge_join(num_children,
+                        [&](int c) {return this->get_child_word_id(hnode, j, c);},
+                        size, [&](int k) {return words[k];},
+                        [&](int c, int k) {vc[k] = this->get_child_at(hnode, j, c)->get_count();});
 
                     double D = Ds[j];
                     double l1 = D / float(cs) * N1prx; // normalization factor
                                                            // 1 - lambda
-                    for(i=0; i<size; i++)
-                    {
-                        double a = vc[i] - D;
-                        if (a < 0)
-                            a = 0;
-                        vp[i] = a / float(cs) + l1 * vp[i];
-                    }
+                    interpolate_abs_disc(vp.data(), vc.data(), size,
+                                         D, float(cs), l1);
                 }
             }
         }
@@ -386,7 +386,8 @@ class _DynamicModelKN : public _DynamicModel<TNGRAMS>
     protected:
         virtual void get_probs(const std::vector<WordId>& history,
                                     const std::vector<WordId>& words,
-                                    std::vector<double>& probabilities);
+                                    std::vector<double>& probabilities,
+                                    NodeValueCache* cache = nullptr);
 
     private:
         virtual int increment_node_count(BaseNode* node, const WordId* wids,
@@ -394,10 +395,17 @@ class _DynamicModelKN : public _DynamicModel<TNGRAMS>
         {return this->ngrams.increment_node_count(node, wids, n, increment);}
 };
 
-typedef _DynamicModelKN<NGramTrieKN<TrieNode<TrieNodeKNBase<BaseNode> >,
+typedef _DynamicModelKN<NGramTrieKN<TrieNode<TrieNodeKNBase<WordNode> >,
+                                  BeforeLastNode<BeforeLastNodeKNBase<WordNode>,
+                                                 LastNode<WordNode> >,
+                                  LastNode<WordNode> > > DynamicModelKN;
+
+// structure of arrays layout, see DynamicModelSoA
+typedef _DynamicModelKN<NGramTrieKN<TrieNode<TrieNodeKNBase<BaseNode>, child_wid_vector>,
                                   BeforeLastNode<BeforeLastNodeKNBase<BaseNode>,
-                                                 LastNode<BaseNode> >,
-                                  LastNode<BaseNode> > > DynamicModelKN;
+                                                 LastNode<BaseNode>,
+                                                 inplace_wid_vector<LastNode<BaseNode> > >,
+                                  LastNode<BaseNode> > > DynamicModelKNSoA;
 
 // Calculate a vector of probabilities for the ngrams formed
 // by history + word[i], for all i.
@@ -406,7 +414,8 @@ typedef _DynamicModelKN<NGramTrieKN<TrieNode<TrieNodeKNBase<BaseNode> >,
 template <class TNGRAMS>
 void _DynamicModelKN<TNGRAMS>::get_probs(const std::vector<WordId>& history,
                                          const std::vector<WordId>& words,
-                                         std::vector<double>& probabilities)
+                                         std::vector<double>& probabilities,
+                                         NodeValueCache* cache)
 {
     // pad/cut history so it's always of length order-1
     int n = std::min((int)history.size(), this->m_order-1);
@@ -417,11 +426,12 @@ void _DynamicModelKN<TNGRAMS>::get_probs(const std::vector<WordId>& history,
     {
         case KNESER_NEY_I:
             this->ngrams.get_probs_kneser_ney_i(h, words, probabilities,
-                                          this->get_num_word_types(), this->m_Ds);
+                                          this->get_num_word_types(), this->m_Ds,
+                                          cache);
             break;
 
         default:
-            Base::get_probs(history, words, probabilities);
+            Base::get_probs(history, words, probabilities, cache);
             break;
     }
 }
@@ -0,0 +1,535 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "lm_dynamic.h"
+#include "lm_kernels.h"
+#include "lm_mapped.h"
+#include "lm_frozen.h"
+
+using namespace std;
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// PackedArray - unsigned integers of fixed bit width
+//------------------------------------------------------------------------
+
+void PackedArray::assign(const std::vector<uint32_t>& values, int width)
+{
+    m_width = width;
+    m_mask = width ? ~uint64_t(0) >> (64 - width) : 0;
+
+    // one spare word, reads of the last value may straddle the end
+    m_bits.assign((uint64_t(values.size()) * width + 63) / 64 + 1, 0);
+    m_bits.shrink_to_fit();
+    for (size_t i=0; i<values.size(); i++)
+    {
+        uint64_t pos = i * width;
+        size_t w = pos >> 6;
+        int shift = pos & 63;
+        m_bits[w] |= uint64_t(values[i]) << shift;
+        if (shift + width > 64)
+            m_bits[w+1] |= uint64_t(values[i]) >> (64 - shift);
+    }
+}
+
+int PackedArray::get_width(uint32_t max_value)
+{
+    int width = 0;
+    while (width < 32 && (max_value >> width))
+        width++;
+    return width;
+}
+
+//------------------------------------------------------------------------
+// CodedArray - values replaced by their index into a table of
+// distinct values
+//------------------------------------------------------------------------
+
+void CodedArray::assign(const std::vector<uint32_t>& values)
+{
+    m_table = values;
+    std::sort(m_table.begin(), m_table.end());
+    m_table.erase(std::unique(m_table.begin(), m_table.end()),
+                  m_table.end());
+    m_table.shrink_to_fit();
+
+    std::vector<uint32_t> codes(values.size());
+    for (size_t i=0; i<values.size(); i++)
+        codes[i] = std::lower_bound(m_table.begin(), m_table.end(), values[i]) -
+                   m_table.begin();
+
+    m_codes.assign(codes, m_table.empty() ?
+                          0 : PackedArray::get_width(m_table.size()-1));
+}
+
+void quantize_log(std::vector<uint32_t>& values, int bits)
+{
+    std::vector<uint32_t> distinct = values;
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                   distinct.end());
+
+    size_t num_codes = size_t(1) << bits;
+    if (bits <= 0 || bits >= 32 || distinct.size() <= num_codes)
+        return;   // nothing to lose
+
+    bool has_zero = distinct[0] == 0;
+    uint32_t lo = distinct[has_zero ? 1 : 0];
+    uint32_t hi = distinct.back();
+    size_t max_size = num_codes - has_zero;
+
+    // Log-spaced grid from lo to hi, rounded to integers. Rounding
+    // merges points at the low end, so keep adding points while the
+    // codebook still fits.
+    auto make_grid = [&](size_t n, std::vector<uint32_t>& grid)
+    {
+        grid.clear();
+        if (has_zero)
+            grid.push_back(0);
+        double step = n > 1 ? std::log(double(hi) / lo) / (n - 1) : 0.0;
+        for (size_t i=0; i<n; i++)
+            grid.push_back(static_cast<uint32_t>(
+                           std::lround(lo * std::exp(step * i))));
+        grid.back() = hi;
+        grid.erase(std::unique(grid.begin(), grid.end()), grid.end());
+    };
+    std::vector<uint32_t> table;
+    std::vector<uint32_t> grid;
+    for (size_t n=max_size; ; n += n / 8 + 1)
+    {
+        make_grid(n, grid);
+        if (grid.size() - has_zero > max_size)
+            break;
+        table.swap(grid);
+    }
+
+    // replace each value by its nearest code in the log domain
+    for (auto& value : values)
+    {
+        auto it = std::lower_bound(table.begin(), table.end(), value);
+        if (it != table.begin() && *it != value)  // table ends with hi
+        {
+            uint32_t upper = *it;
+            uint32_t lower = *(it-1);
+            value = double(value) * value < double(lower) * upper ?
+                    lower : upper;
+        }
+    }
+}
+
+//------------------------------------------------------------------------
+// EliasFano - non-decreasing sequence of unsigned integers
+//------------------------------------------------------------------------
+
+void EliasFano::assign(const std::vector<uint32_t>& values)
+{
+    size_t n = values.size();
+    uint32_t u = n ? values.back() : 0;
+
+    // low bits: floor(log2(u/n))
+    m_low_width = 0;
+    while (n && (uint64_t(n) << (m_low_width+1)) <= u)
+        m_low_width++;
+    uint32_t low_mask = (uint64_t(1) << m_low_width) - 1;
+
+    // high bits: value i sets bit (values[i] >> low_width) + i
+    std::vector<uint32_t> low(n);
+    m_high.assign(((u >> m_low_width) + n + 63) / 64 + 1, 0);
+    m_high.shrink_to_fit();
+    m_samples.clear();
+    for (size_t i=0; i<n; i++)
+    {
+        low[i] = values[i] & low_mask;
+        uint64_t pos = (values[i] >> m_low_width) + i;
+        m_high[pos >> 6] |= uint64_t(1) << (pos & 63);
+        if (i % SELECT_SAMPLE == 0)
+            m_samples.push_back(pos);
+    }
+    m_samples.shrink_to_fit();
+    m_low.assign(low, m_low_width);
+}
+
+//------------------------------------------------------------------------
+// FrozenModel - compact read-only language model
+//------------------------------------------------------------------------
+
+void FrozenModel::clear()
+{
+    Super::clear();   // clears dictionary, which points into m_word_blob
+
+    std::string().swap(m_word_blob);
+    m_num_word_types = 0;
+    std::vector<Level>().swap(m_levels);
+    m_Ds.clear();
+}
+
+void FrozenModel::load(const char* filename)
+{
+    m_load_error_msg = "";
+    m_load_error = do_load(filename);
+    if (m_load_error)
+    {
+        m_load_error_msg = get_error_msg(m_load_error, filename);
+        throw_on_error(m_load_error, filename);
+    }
+}
+
+void FrozenModel::save(const char* filename)
+{
+    throw_on_error(do_save(filename), filename);
+}
+
+LMError FrozenModel::do_load(const char* filename)
+{
+    clear();
+
+    NGramArrays arrays;
+    LMError err = arrays.load_arpac(filename);
+    if (err)
+        return err;
+
+    return freeze(arrays);
+}
+
+LMError FrozenModel::freeze(DynamicModelBase& model)
+{
+    clear();
+
+    NGramArrays arrays;
+    LMError err = arrays.build(model);
+    if (err)
+        return err;
+
+    return freeze(arrays);
+}
+
+LMError FrozenModel::freeze(NGramArrays& arrays)
+{
+    clear();
+
+    int order = arrays.order;
+    if (m_count_bits)
+    {
+        // quantize per level, then sum up the histories' counts again
+        for (int i=1; i<=order; i++)
+        {
+            quantize_log(arrays.counts[i], m_count_bits);
+
+            const auto& begins = arrays.child_begins[i-1];
+            auto& sums = arrays.child_sums[i-1];
+            for (size_t p=0; p<sums.size(); p++)
+            {
+                sums[p] = 0;
+                for (uint32_t c=begins[p]; c<begins[p+1]; c++)
+                    sums[p] += arrays.counts[i][c];
+            }
+        }
+    }
+
+    int wid_width = PackedArray::get_width(arrays.num_words-1);
+    m_levels.resize(order+1);
+    for (int i=0; i<=order; i++)
+    {
+        Level& level = m_levels[i];
+        level.num_nodes = i ? arrays.wids[i].size() : 1;
+        if (i > 0)
+        {
+            level.wids.assign(arrays.wids[i], wid_width);
+            level.counts.assign(arrays.counts[i]);
+            std::vector<uint32_t>().swap(arrays.wids[i]);
+            std::vector<uint32_t>().swap(arrays.counts[i]);
+        }
+        if (i < order)
+        {
+            level.child_begin.assign(arrays.child_begins[i]);
+            level.N1prxs.assign(arrays.N1prxs[i]);
+            level.child_sums.assign(arrays.child_sums[i]);
+            std::vector<uint32_t>().swap(arrays.child_begins[i]);
+            std::vector<uint32_t>().swap(arrays.N1prxs[i]);
+            std::vector<uint32_t>().swap(arrays.child_sums[i]);
+        }
+    }
+
+    // The dictionary only keeps offsets into the word blob.
+    m_word_blob = std::move(arrays.word_blob);
+    LMError err = m_dictionary.set_external_words(m_word_blob.data(),
+                                                  m_word_blob.size(),
+                                                  arrays.word_offsets.data(),
+                                                  arrays.num_words);
+    if (err)
+    {
+        clear();
+        return err;
+    }
+
+    m_Ds = arrays.Ds;
+    m_order = order;
+    m_num_word_types = arrays.num_word_types;
+
+    return ERR_NONE;
+}
+
+void FrozenModel::get_memory_sizes(std::vector<long>& values)
+{
+    uint64_t sum = 0;
+    for (const auto& level : m_levels)
+        sum += level.get_memory_size();
+    values.push_back(m_dictionary.get_memory_size());
+    values.push_back(sum);
+}
+
+int FrozenModel::get_node(const WordId* wids, int n)
+{
+    if (n < 1)
+        return 0;   // root
+
+    // Every word has a unigram, its index on level 1 is its word id.
+    if (wids[0] >= m_levels[1].num_nodes)
+        return -1;
+    int index = wids[0];
+
+    for (int i=1; i<n; i++)
+    {
+        const PackedArray& child_wids = m_levels[i+1].wids;
+        uint32_t lo, end;
+        m_levels[i].child_begin.get_pair(index, lo, end);
+
+        // binary search like lower_bound()
+        uint32_t hi = end;
+        while (lo < hi)
+        {
+            uint32_t mid = (lo+hi)>>1;
+            if (child_wids[mid] < wids[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == end || child_wids[lo] != wids[i])
+            return -1;
+        index = lo;
+    }
+    return index;
+}
+
+void FrozenModel::get_child_counts(int j, int index,
+                                   const std::vector<WordId>& words,
+                                   std::vector<int32_t>& vc)
+{
+    const Level& child_level = m_levels[j+1];
+    uint32_t begin, end;
+    m_levels[j].child_begin.get_pair(index, begin, end);
+
+    // children and candidate words are both sorted by word id
+    fill(vc.begin(), vc.end(), 0);
+    merge_join(static_cast<int>(end - begin),
+               [&](int c) {return child_level.wids[begin+c];},
+               words.size(), [&](int k) {return words[k];},
+               [&](int c, int k) {vc[k] = child_level.counts[begin+c];});
+}
+
+int FrozenModel::get_ngram_count(const wchar_t* const* ngram, int n)
+{
+    if (m_levels.empty() || n < 1 || n > m_order)
+        return 0;
+
+    std::vector<WordId> wids(n);
+    for (int i=0; i<n; i++)
+    {
+        wids[i] = m_dictionary.word_to_id(ngram[i]);
+        if (wids[i] == WIDNONE)
+            return 0;
+    }
+
+    int index = get_node(&wids[0], n);
+    return index >= 0 ? m_levels[n].counts[index] : 0;
+}
+
+void FrozenModel::get_words_with_predictions(
+                                const std::vector<WordId>& history,
+                                std::vector<WordId>& wids)
+{
+    if (m_levels.empty() || m_order < 2 || history.empty())
+        return;
+
+    // bigram history
+    int index = get_node(&history.back(), 1);
+    if (index >= 0)
+    {
+        const Level& child_level = m_levels[2];
+        uint32_t begin, end;
+        m_levels[1].child_begin.get_pair(index, begin, end);
+        for (uint32_t i=begin; i<end; i++)
+            if (child_level.counts[i])
+                wids.push_back(child_level.wids[i]);
+    }
+}
+
+void FrozenModel::filter_candidates(const std::vector<WordId>& in,
+                                          std::vector<WordId>& out)
+{
+    if (m_levels.empty())
+        return;
+
+    // filter out removed unigrams
+    const Level& level = m_levels[1];
+    int num_candidates = in.size();
+    out.reserve(num_candidates);
+    for (int i=0; i<num_candidates; i++)
+    {
+        WordId wid = in[i];
+        if (wid < level.num_nodes && level.counts[wid])
+            out.push_back(wid);
+    }
+}
+
+// Calculate a vector of probabilities for the ngrams formed
+// by history + word[i], for all i.
+// input:  constant history and a vector of candidate words
+// output: vector of probabilities, one value per candidate word
+void FrozenModel::get_probs(const std::vector<WordId>& history,
+                            const std::vector<WordId>& words,
+                            std::vector<double>& probabilities,
+                            NodeValueCache* cache)
+{
+    (void)cache;  // sums are stored per node
+
+    if (m_levels.empty())
+        return;
+
+    if (m_order < 2)
+    {
+        get_probs_unigram(words, probabilities);
+        return;
+    }
+
+    // pad/cut history so it's always of length order-1
+    int n = std::min((int)history.size(), m_order-1);
+    std::vector<WordId> h(m_order-1, UNKNOWN_WORD_ID);
+    std::copy_backward(history.end()-n, history.end(), h.end());
+
+    switch(m_smoothing)
+    {
+        case WITTEN_BELL_I:
+            get_probs_witten_bell_i(h, words, probabilities);
+            break;
+
+        case ABS_DISC_I:
+            get_probs_abs_disc_i(h, words, probabilities);
+            break;
+
+         default:
+            break;
+    }
+}
+
+// Same as NGramTrie::get_probs_witten_bell_i, on the frozen arrays.
+void FrozenModel::get_probs_witten_bell_i(const std::vector<WordId>& history,
+                                          const std::vector<WordId>& words,
+                                          std::vector<double>& vp)
+{
+    int j;
+    int n = history.size() + 1;
+    int size = words.size();   // number of candidate words
+    std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
+
+    // order 0
+    vp.resize(size);
+    fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+
+    // order 1..n
+    for(j=0; j<n; j++)
+    {
+        int index = get_node(history.data()+(n-j-1), j);
+        if (index >= 0)
+        {
+            const Level& level = m_levels[j];
+
+            int N1prx = level.N1prxs[index];   // number of word types following the history
+            if (!N1prx)  // break early, don't reset probabilities to 0
+                break;   // for unknown histories
+
+            // total number of occurences of the history
+            int cs = level.child_sums[index];
+            if (cs)
+            {
+                // get ngram counts
+                get_child_counts(j, index, words, vc);
+
+                double l1 = N1prx / (N1prx + float(cs)); // normalization factor
+                                                         // 1 - lambda
+                interpolate_linear(vp.data(), vc.data(), size,
+                                   float(cs), 1.0 - l1, l1);
+            }
+        }
+    }
+}
+
+// Same as NGramTrie::get_probs_abs_disc_i, on the frozen arrays.
+void FrozenModel::get_probs_abs_disc_i(const std::vector<WordId>& history,
+                                       const std::vector<WordId>& words,
+                                       std::vector<double>& vp)
+{
+    int j;
+    int n = history.size() + 1;
+    int size = words.size();   // number of candidate words
+    std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
+
+    // order 0
+    vp.resize(size);
+    fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+
+    // order 1..n
+    for(j=0; j<n; j++)
+    {
+        int index = get_node(history.data()+(n-j-1), j);
+        if (index >= 0)
+        {
+            const Level& level = m_levels[j];
+
+            int N1prx = level.N1prxs[index];   // number of word types following the history
+            if (!N1prx)  // break early, don't reset probabilities to 0
+                break;   // for unknown histories
+
+            // total number of occurences of the history
+            int cs = level.child_sums[index];
+            if (cs)
+            {
+                // get ngram counts
+                get_child_counts(j, index, words, vc);
+
+                double D = m_Ds[j];
+                double l1 = D / float(cs) * N1prx; // normalization factor
+                                                   // 1 - lambda
+                interpolate_abs_disc(vp.data(), vc.data(), size,
+                                     D, float(cs), l1);
+            }
+        }
+    }
+}
+
+// Same as UnigramModel::get_probs.
+void FrozenModel::get_probs_unigram(const std::vector<WordId>& words,
+                                    std::vector<double>& vp)
+{
+    const Level& level = m_levels[1];
+    int size = words.size();   // number of candidate words
+    int cs = m_levels[0].child_sums[0]; // total number of occurences
+    vp.resize(size);
+    if (cs)
+    {
+        for(int i=0; i<size; i++)
+        {
+            WordId wid = words[i];
+            CountType count = level.counts[wid];
+            vp[i] = count / (double) cs;
+        }
+    }
+    else
+    {
+        fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+    }
+}
+
+}  // namespace
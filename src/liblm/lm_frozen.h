@@ -0,0 +1,309 @@
+#ifndef LM_FROZEN_H
+#define LM_FROZEN_H
+
+#include "lm.h"
+
+namespace lm {
+
+class DynamicModelBase;
+struct NGramArrays;
+
+//------------------------------------------------------------------------
+// PackedArray - unsigned integers of fixed bit width
+//------------------------------------------------------------------------
+class PackedArray
+{
+    public:
+        void assign(const std::vector<uint32_t>& values, int width);
+
+        uint32_t operator[](size_t index) const
+        {
+            if (!m_width)
+                return 0;
+            uint64_t pos = index * m_width;
+            size_t i = pos >> 6;
+            int shift = pos & 63;
+            uint64_t bits = m_bits[i] >> shift;
+            if (shift + m_width > 64)
+                bits |= m_bits[i+1] << (64 - shift);
+            return bits & m_mask;
+        }
+
+        uint64_t get_memory_size() const
+        {
+            return sizeof(uint64_t) * m_bits.capacity();
+        }
+
+        // number of bits needed for values up to max_value
+        static int get_width(uint32_t max_value);
+
+    private:
+        std::vector<uint64_t> m_bits;
+        int m_width{0};
+        uint64_t m_mask{0};
+};
+
+//------------------------------------------------------------------------
+// CodedArray - values replaced by their index into a table of
+// distinct values
+//------------------------------------------------------------------------
+// Counts take few distinct values; the index needs far fewer bits
+// than the counts themselves, without losing precision.
+class CodedArray
+{
+    public:
+        void assign(const std::vector<uint32_t>& values);
+
+        uint32_t operator[](size_t index) const
+        {
+            return m_table[m_codes[index]];
+        }
+
+        uint64_t get_memory_size() const
+        {
+            return sizeof(uint32_t) * m_table.capacity() +
+                   m_codes.get_memory_size();
+        }
+
+    private:
+        std::vector<uint32_t> m_table;  // distinct values, sorted
+        PackedArray m_codes;
+};
+
+// Reduce values to at most 2^bits distinct values, spaced on a log
+// scale between the smallest non-zero and the largest value. Zero stays
+// zero, small values, where the log scale is denser than the integers,
+// stay exact.
+void quantize_log(std::vector<uint32_t>& values, int bits);
+
+//------------------------------------------------------------------------
+// EliasFano - non-decreasing sequence of unsigned integers
+//------------------------------------------------------------------------
+// Low bits of each value in a PackedArray, high bits unary coded in a
+// bit vector, about 2 + log2(u/n) bits per value. Positions of every
+// SELECT_SAMPLE-th set bit are sampled to find the i-th value quickly.
+class EliasFano
+{
+    public:
+        void assign(const std::vector<uint32_t>& values);
+
+        uint32_t operator[](size_t index) const
+        {
+            return get_high(select(index), index) | m_low[index];
+        }
+
+        // values at index and index+1, cheaper than two lookups
+        void get_pair(size_t index, uint32_t& first, uint32_t& second) const
+        {
+            uint64_t pos = select(index);
+            first = get_high(pos, index) | m_low[index];
+            second = get_high(next_one(pos+1), index+1) | m_low[index+1];
+        }
+
+        uint64_t get_memory_size() const
+        {
+            return sizeof(uint64_t) * m_high.capacity() +
+                   sizeof(uint64_t) * m_samples.capacity() +
+                   m_low.get_memory_size();
+        }
+
+    private:
+        static const int SELECT_SAMPLE = 64;
+
+        // position of the set bit for value index
+        uint64_t select(size_t index) const
+        {
+            uint64_t pos = m_samples[index / SELECT_SAMPLE];
+            size_t n = index % SELECT_SAMPLE;   // set bits to skip
+            size_t i = pos >> 6;
+            uint64_t bits = m_high[i] & (~uint64_t(0) << (pos & 63));
+            while (true)
+            {
+                size_t c = __builtin_popcountll(bits);
+                if (n < c)
+                    break;
+                n -= c;
+                bits = m_high[++i];
+            }
+            for (; n; n--)
+                bits &= bits - 1;
+            return (uint64_t(i) << 6) + __builtin_ctzll(bits);
+        }
+
+        // position of the first set bit at or after pos
+        uint64_t next_one(uint64_t pos) const
+        {
+            size_t i = pos >> 6;
+            uint64_t bits = m_high[i] & (~uint64_t(0) << (pos & 63));
+            while (!bits)
+                bits = m_high[++i];
+            return (uint64_t(i) << 6) + __builtin_ctzll(bits);
+        }
+
+        uint32_t get_high(uint64_t pos, size_t index) const
+        {
+            return static_cast<uint32_t>(pos - index) << m_low_width;
+        }
+
+    private:
+        std::vector<uint64_t> m_high;
+        std::vector<uint64_t> m_samples;
+        PackedArray m_low;
+        int m_low_width{0};
+};
+
+//------------------------------------------------------------------------
+// FrozenModel - compact read-only language model
+//------------------------------------------------------------------------
+// Loads a model file straight into sorted arrays, without the trie
+// of a DynamicModel, then compresses the n-grams into bit-packed
+// arrays per level, the layout of
+// MappedModel with succinct encodings. Child ranges are Elias-Fano
+// coded, word ids bit-packed and all counts losslessly coded.
+// Probabilities are the same as for the DynamicModel it was
+// built from, unless counts are quantized with set_count_bits().
+// Order 1 models are better served by UnigramModel.
+class FrozenModel : public NGramModel
+{
+    public:
+        using Super = NGramModel;
+        static const Smoothing DEFAULT_SMOOTHING = ABS_DISC_I;
+
+        FrozenModel()
+        {
+            m_smoothing = DEFAULT_SMOOTHING;
+        }
+
+        virtual ~FrozenModel()
+        {
+            clear();
+        }
+
+        virtual void clear() override;
+
+        virtual bool is_model_valid() override
+        {
+            return !m_levels.empty();
+        }
+
+        virtual Smoothing get_smoothing() {return m_smoothing;}
+        virtual void set_smoothing(Smoothing s)
+        {
+            if (s != m_smoothing)
+                invalidate_prediction_cache();
+            m_smoothing = s;
+        }
+
+        // Number of occurrences of the given n-gram, 0 if unknown.
+        int get_ngram_count(const wchar_t* const* ngram, int n);
+
+        // Replace the contents with the n-grams of model.
+        LMError freeze(DynamicModelBase& model);
+
+        // Replace the contents with arrays, emptying them.
+        LMError freeze(NGramArrays& arrays);
+
+        // Quantize counts to at most 2^bits values per level on the
+        // next load() or freeze(), 0 keeps them exact (default).
+        // History counts are summed up from the quantized counts, so
+        // probabilities stay normalized, only less accurate.
+        // Only frozen models quantize, dynamic and Kneser-Ney models,
+        // with their N1+ statistics, and binary models keep exact counts.
+        void set_count_bits(int bits) {m_count_bits = bits;}
+        int get_count_bits() {return m_count_bits;}
+
+        // throw exceptions, record errors
+        void load(const std::string& filename) {load(filename.c_str());}
+        void save(const std::string& filename) {save(filename.c_str());}
+        virtual void load(const char* filename) override;
+        virtual void save(const char* filename) override;
+
+        // don't throw exceptions, low level
+        virtual LMError do_load(const char* filename) override;
+        virtual LMError do_save(const char* filename) override
+        {
+            (void)filename;
+            return ERR_NOT_IMPL;   // read-only
+        }
+
+        virtual LMError get_load_error() override
+        {return m_load_error;}
+
+        virtual std::string get_load_error_msg() override
+        {return m_load_error_msg;}
+        virtual void set_load_error_msg(const std::string& msg) override
+        {m_load_error_msg = msg;}
+
+        virtual bool is_modified() override
+        {return false;}
+        virtual void set_modified(bool modified) override
+        {(void)modified;}
+
+        virtual void get_memory_sizes(std::vector<long>& values);
+
+    protected:
+        virtual void get_words_with_predictions(
+                                       const std::vector<WordId>& history,
+                                       std::vector<WordId>& wids) override;
+        virtual void filter_candidates(const std::vector<WordId>& in,
+                                             std::vector<WordId>& out) override;
+        virtual void get_probs(const std::vector<WordId>& history,
+                               const std::vector<WordId>& words,
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr) override;
+
+    private:
+        struct Level
+        {
+            uint32_t num_nodes;
+            PackedArray wids;
+            CodedArray counts;
+            EliasFano child_begin;
+            CodedArray N1prxs;
+            CodedArray child_sums;
+
+            uint64_t get_memory_size() const
+            {
+                return sizeof(Level) +
+                       wids.get_memory_size() +
+                       counts.get_memory_size() +
+                       child_begin.get_memory_size() +
+                       N1prxs.get_memory_size() +
+                       child_sums.get_memory_size();
+            }
+        };
+
+        // Index of the node for the n-gram wids on level n, -1 if unknown.
+        int get_node(const WordId* wids, int n);
+
+        // Fill vc with the counts of the children of node index on
+        // level j for all candidate words.
+        void get_child_counts(int j, int index,
+                              const std::vector<WordId>& words,
+                              std::vector<int32_t>& vc);
+
+        void get_probs_witten_bell_i(const std::vector<WordId>& history,
+                                     const std::vector<WordId>& words,
+                                     std::vector<double>& vp);
+        void get_probs_abs_disc_i(const std::vector<WordId>& history,
+                                  const std::vector<WordId>& words,
+                                  std::vector<double>& vp);
+        void get_probs_unigram(const std::vector<WordId>& words,
+                               std::vector<double>& vp);
+
+    private:
+        std::string m_word_blob;      // storage of the dictionary's words
+        int m_num_word_types{0};
+        int m_count_bits{0};
+        std::vector<Level> m_levels;
+        std::vector<double> m_Ds;     // discounting parameters, per level
+
+        Smoothing m_smoothing;
+
+        LMError m_load_error{ERR_NONE};
+        std::string m_load_error_msg;
+};
+
+}  // namespace
+
+#endif
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "lm_heapalloc.h"
 
 namespace lm {
@@ -12,4 +14,17 @@ void HeapFree(void* p)
     delete [] (reinterpret_cast<char*>(p));
 }
 
+void* HeapAllocAligned(size_t alignment, size_t size)
+{
+    void* p;
+    if (posix_memalign(&p, alignment, size))
+        return NULL;
+    return p;
+}
+
+void HeapFreeAligned(void* p)
+{
+    free(p);
+}
+
 }  // namespace
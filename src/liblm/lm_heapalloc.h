@@ -9,6 +9,10 @@ namespace lm {
 extern void* HeapAlloc(size_t size);
 extern void HeapFree(void* p);
 
+// alignment must be a power of two multiple of sizeof(void*)
+extern void* HeapAllocAligned(size_t alignment, size_t size);
+extern void HeapFreeAligned(void* p);
+
 } // namespace
 
 #endif // LM_HEAPALLOC_H
@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "lm_dynamic.h"
+#include "lm_journal.h"
+
+using namespace std;
+
+namespace lm {
+
+static const uint32_t JOURNAL_BYTE_ORDER = 0x01020304;
+
+// Records larger than this are considered damaged.
+static const uint32_t MAX_RECORD_SIZE = 1<<24;
+
+// CRC-32 (IEEE 802.3), table driven
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t size)
+{
+    static const struct Table
+    {
+        uint32_t values[256];
+        Table()
+        {
+            for (uint32_t i=0; i<256; i++)
+            {
+                uint32_t c = i;
+                for (int k=0; k<8; k++)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                values[i] = c;
+            }
+        }
+    } table;
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i=0; i<size; i++)
+        crc = table.values[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size)
+    {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool read_all(FILE* f, void* data, size_t size)
+{
+    return fread(data, 1, size, f) == size;
+}
+
+// Read and check the header, return false if it doesn't
+// belong to a journal of the model file with identity base.
+static bool read_header(FILE* f, const JournalBase& base)
+{
+    JournalHeader header;
+    if (!read_all(f, &header, sizeof(header)))
+        return false;
+    return memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+           header.byte_order == JOURNAL_BYTE_ORDER &&
+           header.version == JOURNAL_VERSION &&
+           header.base == base;
+}
+
+// Call func(type, tokens) for every intact record ending at or
+// before offset end, return the offset behind the last one.
+template <class F>
+static size_t for_each_record(FILE* f, const F& func, size_t end=SIZE_MAX)
+{
+    size_t offset = sizeof(JournalHeader);
+    std::vector<char> payload;
+    std::vector<std::string> tokens;
+    while (true)
+    {
+        uint32_t head[2];  // type, size
+        uint32_t crc;
+        if (!read_all(f, head, sizeof(head)) ||
+            head[1] > MAX_RECORD_SIZE ||
+            offset + sizeof(head) + head[1] + sizeof(crc) > end)
+            break;
+
+        payload.resize(head[1]);
+        if (!read_all(f, payload.data(), payload.size()) ||
+            !read_all(f, &crc, sizeof(crc)))
+            break;
+
+        if (crc != crc32_update(crc32_update(0, head, sizeof(head)),
+                                payload.data(), payload.size()))
+            break;
+
+        tokens.clear();
+        for (size_t i=0; i<payload.size(); )
+        {
+            const char* token = payload.data() + i;
+            size_t len = strnlen(token, payload.size() - i);
+            tokens.emplace_back(token, len);
+            i += len + 1;
+        }
+
+        func(head[0], tokens);
+        offset += sizeof(head) + payload.size() + sizeof(crc);
+    }
+    return offset;
+}
+
+// Finish a compaction that was interrupted between replacing the
+// model file and replacing the journal.
+static void resolve_next(const char* filename, const JournalBase& base)
+{
+    std::string next_filename = ModelJournal::get_next_filename(filename);
+    FILE* f = fopen(next_filename.c_str(), "rb");
+    if (f)
+    {
+        bool valid = read_header(f, base);
+        fclose(f);
+        if (valid)
+            rename(next_filename.c_str(), filename);
+        else
+            unlink(next_filename.c_str());
+    }
+}
+
+JournalBase ModelJournal::get_base(const char* model_filename)
+{
+    JournalBase base;
+    struct stat st;
+    if (stat(model_filename, &st) == 0)
+    {
+        base.size = static_cast<uint64_t>(st.st_size);
+        base.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                        st.st_mtim.tv_nsec;
+        base.inode = static_cast<uint64_t>(st.st_ino);
+    }
+    return base;
+}
+
+LMError ModelJournal::replay(DynamicModelBase& model, const char* filename,
+                             const JournalBase& base, int* num_records,
+                             size_t end)
+{
+    resolve_next(filename, base);
+
+    if (num_records)
+        *num_records = 0;
+
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return errno == ENOENT ? ERR_NONE : ERR_FILE;
+
+    if (!read_header(f, base))
+    {
+        fclose(f);
+        return ERR_FORMAT;
+    }
+
+    int n = 0;
+    for_each_record(f, [&](uint32_t type, const std::vector<std::string>& tokens)
+    {
+        if (type == LEARN_TOKENS)
+            model.learn_tokens(tokens);
+        else if (type == REMOVE_CONTEXT)
+            model.remove_context(tokens);
+        n++;
+    }, end);
+    fclose(f);
+
+    if (num_records)
+        *num_records = n;
+
+    return ERR_NONE;
+}
+
+int ModelJournal::create(const char* filename, const JournalBase& base)
+{
+    int fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    JournalHeader header{};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.byte_order = JOURNAL_BYTE_ORDER;
+    header.version = JOURNAL_VERSION;
+    header.base = base;
+    if (!write_all(fd, &header, sizeof(header)))
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+LMError ModelJournal::open(const char* filename, const JournalBase& base)
+{
+    close();
+    resolve_next(filename, base);
+
+    // keep the intact records of an existing journal
+    size_t size = 0;
+    FILE* f = fopen(filename, "rb");
+    if (f)
+    {
+        if (read_header(f, base))
+            size = for_each_record(f, [](uint32_t, const std::vector<std::string>&){});
+        fclose(f);
+    }
+
+    int fd;
+    if (size)
+    {
+        fd = ::open(filename, O_RDWR | O_CLOEXEC);
+        if (fd >= 0 &&
+            (ftruncate(fd, static_cast<off_t>(size)) != 0 ||
+             lseek(fd, static_cast<off_t>(size), SEEK_SET) < 0))
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        fd = create(filename, base);
+        size = sizeof(JournalHeader);
+    }
+
+    if (fd < 0)
+        return ERR_FILE;
+
+    m_filename = filename;
+    m_fd = fd;
+    m_size = size;
+    return ERR_NONE;
+}
+
+void ModelJournal::close()
+{
+    abort_rebase();
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+    m_size = 0;
+}
+
+LMError ModelJournal::append(RecordType type, const std::vector<std::string>& tokens)
+{
+    if (m_fd < 0)
+        return ERR_FILE;
+
+    // Assemble the whole record for a single write, so a crash
+    // leaves at most this record incomplete.
+    const size_t head_size = 2 * sizeof(uint32_t);
+    std::vector<char> record(head_size);
+    for (const auto& token : tokens)
+        record.insert(record.end(), token.c_str(), token.c_str() + token.size() + 1);
+
+    uint32_t head[2] = {static_cast<uint32_t>(type),
+                        static_cast<uint32_t>(record.size() - head_size)};
+    memcpy(record.data(), head, sizeof(head));
+    uint32_t crc = crc32_update(0, record.data(), record.size());
+    const char* p = reinterpret_cast<const char*>(&crc);
+    record.insert(record.end(), p, p + sizeof(crc));
+
+    if (!write_all(m_fd, record.data(), record.size()))
+    {
+        // drop the partial record
+        if (ftruncate(m_fd, static_cast<off_t>(m_size)) == 0)
+            lseek(m_fd, static_cast<off_t>(m_size), SEEK_SET);
+        return ERR_FILE;
+    }
+
+    m_size += record.size();
+    return ERR_NONE;
+}
+
+LMError ModelJournal::sync()
+{
+    if (m_fd < 0)
+        return ERR_FILE;
+    if (fdatasync(m_fd) != 0)
+        return ERR_FILE;
+    return ERR_NONE;
+}
+
+LMError ModelJournal::prepare_rebase(const JournalBase& base, size_t offset)
+{
+    abort_rebase();
+    if (m_fd < 0 || offset > m_size)
+        return ERR_FILE;
+
+    std::string next_filename = get_next_filename(m_filename);
+    int fd = create(next_filename.c_str(), base);
+    if (fd < 0)
+        return ERR_FILE;
+
+    // copy the records added since the snapshot was taken
+    std::vector<char> tail(m_size - offset);
+    size_t n = 0;
+    while (n < tail.size())
+    {
+        ssize_t r = pread(m_fd, tail.data() + n, tail.size() - n,
+                          static_cast<off_t>(offset + n));
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        n += static_cast<size_t>(r);
+    }
+
+    if (n != tail.size() ||
+        !write_all(fd, tail.data(), tail.size()) ||
+        fdatasync(fd) != 0)
+    {
+        ::close(fd);
+        unlink(next_filename.c_str());
+        return ERR_FILE;
+    }
+
+    m_next_fd = fd;
+    m_next_size = sizeof(JournalHeader) + tail.size();
+    return ERR_NONE;
+}
+
+LMError ModelJournal::commit_rebase()
+{
+    if (m_next_fd < 0)
+        return ERR_FILE;
+
+    std::string next_filename = get_next_filename(m_filename);
+    if (rename(next_filename.c_str(), m_filename.c_str()) != 0)
+    {
+        // Leave the new journal for the next open() to pick up,
+        // it belongs to the model file on disk now.
+        ::close(m_next_fd);
+        m_next_fd = -1;
+        m_next_size = 0;
+        return ERR_FILE;
+    }
+
+    ::close(m_fd);
+    m_fd = m_next_fd;
+    m_size = m_next_size;
+    m_next_fd = -1;
+    m_next_size = 0;
+    return ERR_NONE;
+}
+
+void ModelJournal::abort_rebase()
+{
+    if (m_next_fd >= 0)
+    {
+        ::close(m_next_fd);
+        unlink(get_next_filename(m_filename).c_str());
+    }
+    m_next_fd = -1;
+    m_next_size = 0;
+}
+
+}  // namespace
@@ -0,0 +1,130 @@
+#ifndef LM_JOURNAL_H
+#define LM_JOURNAL_H
+
+#include <string>
+#include <vector>
+
+#include "lm.h"
+
+namespace lm {
+
+class DynamicModelBase;
+
+//------------------------------------------------------------------------
+// Journal file format
+//------------------------------------------------------------------------
+// Append-only log of the changes made to a dynamic model since its
+// file was last written. All values are in native byte order.
+//
+//   JournalHeader
+//   records                  uint32 type, uint32 size,
+//                            size bytes of zero-terminated utf-8 tokens,
+//                            uint32 crc32 of type, size and tokens
+//
+// The header identifies the model file the journal applies to, so
+// a journal is never replayed on top of a file that already
+// contains its changes.
+
+const char JOURNAL_MAGIC[8] = {'O', 'B', 'L', 'M', 'J', 'N', 'L', '\0'};
+const uint32_t JOURNAL_VERSION = 1;
+
+// Identity of a model file: size, modification time and inode.
+// All zero if the file doesn't exist.
+struct JournalBase
+{
+    uint64_t size{0};
+    int64_t mtime_ns{0};
+    uint64_t inode{0};
+
+    bool operator==(const JournalBase& other) const
+    {
+        return size == other.size &&
+               mtime_ns == other.mtime_ns &&
+               inode == other.inode;
+    }
+    bool operator!=(const JournalBase& other) const
+    {return !(*this == other);}
+};
+
+struct JournalHeader
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    JournalBase base;
+};
+
+//------------------------------------------------------------------------
+// ModelJournal - records learn_tokens and remove_context operations
+//------------------------------------------------------------------------
+class ModelJournal
+{
+    public:
+        enum RecordType
+        {
+            LEARN_TOKENS = 1,
+            REMOVE_CONTEXT = 2,
+        };
+
+        ModelJournal() {}
+        ~ModelJournal()
+        {
+            close();
+        }
+
+        static JournalBase get_base(const char* model_filename);
+
+        // Apply all intact records of the journal file to model, only
+        // those before offset end if given. A damaged tail, e.g. from a
+        // crash while appending, is ignored and cut off by the next
+        // open(). Returns ERR_FORMAT if the journal belongs to a
+        // different model file.
+        static LMError replay(DynamicModelBase& model, const char* filename,
+                              const JournalBase& base, int* num_records=NULL,
+                              size_t end=SIZE_MAX);
+
+        // Open the journal of the model file with identity base,
+        // keeping all of its intact records, or create a new one.
+        LMError open(const char* filename, const JournalBase& base);
+        void close();
+        bool is_open() {return m_fd >= 0;}
+
+        LMError append_learn_tokens(const std::vector<std::string>& tokens)
+        {return append(LEARN_TOKENS, tokens);}
+        LMError append_remove_context(const std::vector<std::string>& context)
+        {return append(REMOVE_CONTEXT, context);}
+
+        // Flush appended records to disk.
+        LMError sync();
+
+        // Size of the journal in bytes, offset of the next record.
+        size_t get_size() {return m_size;}
+
+        // Compaction: once the model file has been rewritten with all
+        // records up to offset, prepare_rebase() writes the remaining
+        // records to a new journal for the new file with identity base.
+        // commit_rebase() then replaces the old journal, to be called
+        // right after the model file was replaced.
+        LMError prepare_rebase(const JournalBase& base, size_t offset);
+        LMError commit_rebase();
+        void abort_rebase();
+
+        // Journal replacing the current one during compaction.
+        static std::string get_next_filename(const std::string& filename)
+        {return filename + ".next";}
+
+    private:
+        LMError append(RecordType type, const std::vector<std::string>& tokens);
+        static int create(const char* filename, const JournalBase& base);
+
+    private:
+        std::string m_filename;
+        int m_fd{-1};
+        size_t m_size{0};
+        int m_next_fd{-1};       // pending journal of prepare_rebase
+        size_t m_next_size{0};
+};
+
+}  // namespace
+
+#endif
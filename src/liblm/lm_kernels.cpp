@@ -0,0 +1,498 @@
+#include "lm_kernels.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define LM_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// scalar
+//------------------------------------------------------------------------
+
+static void interpolate_abs_disc_scalar(double* vp, const int32_t* vc,
+                                        int begin, int n,
+                                        double D, double denom, double l1)
+{
+    for (int i=begin; i<n; i++)
+    {
+        double a = vc[i] - D;
+        if (a < 0)
+            a = 0;
+        vp[i] = a / denom + l1 * vp[i];
+    }
+}
+
+template <class T, class TDENOM>
+static void interpolate_linear_scalar(double* vp, const T* vc,
+                                      int begin, int n, TDENOM denom,
+                                      double w_mle, double w_lower)
+{
+    for (int i=begin; i<n; i++)
+    {
+        double pmle = vc[i] / denom;
+        vp[i] = w_mle * pmle + w_lower * vp[i];
+    }
+}
+
+// single precision updates, the reference for the vectorized ones
+static void interpolate_abs_disc_scalar_f(double* vp, const int32_t* vc,
+                                          int begin, int n,
+                                          float D, float denom, float l1)
+{
+    for (int i=begin; i<n; i++)
+    {
+        float a = vc[i] - D;
+        if (a < 0)
+            a = 0;
+        vp[i] = a / denom + l1 * static_cast<float>(vp[i]);
+    }
+}
+
+template <class T>
+static void interpolate_linear_scalar_f(double* vp, const T* vc,
+                                        int begin, int n, float denom,
+                                        float w_mle, float w_lower)
+{
+    for (int i=begin; i<n; i++)
+    {
+        float pmle = static_cast<float>(vc[i]) / denom;
+        vp[i] = w_mle * pmle + w_lower * static_cast<float>(vp[i]);
+    }
+}
+
+#ifdef LM_KERNELS_X86
+
+//------------------------------------------------------------------------
+// SSE2, 2 doubles at a time
+//------------------------------------------------------------------------
+
+static void interpolate_abs_disc_sse2(double* vp, const int32_t* vc, int n,
+                                      double D, double denom, double l1)
+{
+    const __m128d vD = _mm_set1_pd(D);
+    const __m128d vdenom = _mm_set1_pd(denom);
+    const __m128d vl1 = _mm_set1_pd(l1);
+    const __m128d zero = _mm_setzero_pd();
+
+    int i = 0;
+    for (; i+2<=n; i+=2)
+    {
+        __m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(vc+i));
+        __m128d a = _mm_max_pd(_mm_sub_pd(_mm_cvtepi32_pd(c), vD), zero);
+        __m128d p = _mm_loadu_pd(vp+i);
+        p = _mm_add_pd(_mm_div_pd(a, vdenom), _mm_mul_pd(vl1, p));
+        _mm_storeu_pd(vp+i, p);
+    }
+    interpolate_abs_disc_scalar(vp, vc, i, n, D, denom, l1);
+}
+
+static void interpolate_linear_sse2(double* vp, const int32_t* vc, int n,
+                                    float denom, double w_mle, double w_lower)
+{
+    const __m128 vdenom = _mm_set1_ps(denom);
+    const __m128d vw_mle = _mm_set1_pd(w_mle);
+    const __m128d vw_lower = _mm_set1_pd(w_lower);
+
+    int i = 0;
+    for (; i+2<=n; i+=2)
+    {
+        __m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(vc+i));
+        __m128d pmle = _mm_cvtps_pd(_mm_div_ps(_mm_cvtepi32_ps(c), vdenom));
+        __m128d p = _mm_loadu_pd(vp+i);
+        p = _mm_add_pd(_mm_mul_pd(vw_mle, pmle), _mm_mul_pd(vw_lower, p));
+        _mm_storeu_pd(vp+i, p);
+    }
+    interpolate_linear_scalar(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+static void interpolate_linear_sse2(double* vp, const double* vc, int n,
+                                    double denom, double w_mle, double w_lower)
+{
+    const __m128d vdenom = _mm_set1_pd(denom);
+    const __m128d vw_mle = _mm_set1_pd(w_mle);
+    const __m128d vw_lower = _mm_set1_pd(w_lower);
+
+    int i = 0;
+    for (; i+2<=n; i+=2)
+    {
+        __m128d pmle = _mm_div_pd(_mm_loadu_pd(vc+i), vdenom);
+        __m128d p = _mm_loadu_pd(vp+i);
+        p = _mm_add_pd(_mm_mul_pd(vw_mle, pmle), _mm_mul_pd(vw_lower, p));
+        _mm_storeu_pd(vp+i, p);
+    }
+    interpolate_linear_scalar(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+//------------------------------------------------------------------------
+// SSE2, 4 floats at a time
+//------------------------------------------------------------------------
+
+static inline __m128 load_pd_as_ps(const double* p)
+{
+    return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)),
+                         _mm_cvtpd_ps(_mm_loadu_pd(p+2)));
+}
+
+static inline void store_ps_as_pd(double* p, __m128 x)
+{
+    _mm_storeu_pd(p, _mm_cvtps_pd(x));
+    _mm_storeu_pd(p+2, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+}
+
+static void interpolate_abs_disc_sse2_f(double* vp, const int32_t* vc, int n,
+                                        float D, float denom, float l1)
+{
+    const __m128 vD = _mm_set1_ps(D);
+    const __m128 vdenom = _mm_set1_ps(denom);
+    const __m128 vl1 = _mm_set1_ps(l1);
+    const __m128 zero = _mm_setzero_ps();
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vc+i));
+        __m128 a = _mm_max_ps(_mm_sub_ps(_mm_cvtepi32_ps(c), vD), zero);
+        __m128 p = load_pd_as_ps(vp+i);
+        p = _mm_add_ps(_mm_div_ps(a, vdenom), _mm_mul_ps(vl1, p));
+        store_ps_as_pd(vp+i, p);
+    }
+    interpolate_abs_disc_scalar_f(vp, vc, i, n, D, denom, l1);
+}
+
+static void interpolate_linear_sse2_f(double* vp, const int32_t* vc, int n,
+                                      float denom, float w_mle, float w_lower)
+{
+    const __m128 vdenom = _mm_set1_ps(denom);
+    const __m128 vw_mle = _mm_set1_ps(w_mle);
+    const __m128 vw_lower = _mm_set1_ps(w_lower);
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vc+i));
+        __m128 pmle = _mm_div_ps(_mm_cvtepi32_ps(c), vdenom);
+        __m128 p = load_pd_as_ps(vp+i);
+        p = _mm_add_ps(_mm_mul_ps(vw_mle, pmle), _mm_mul_ps(vw_lower, p));
+        store_ps_as_pd(vp+i, p);
+    }
+    interpolate_linear_scalar_f(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+static void interpolate_linear_sse2_f(double* vp, const double* vc, int n,
+                                      float denom, float w_mle, float w_lower)
+{
+    const __m128 vdenom = _mm_set1_ps(denom);
+    const __m128 vw_mle = _mm_set1_ps(w_mle);
+    const __m128 vw_lower = _mm_set1_ps(w_lower);
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m128 pmle = _mm_div_ps(load_pd_as_ps(vc+i), vdenom);
+        __m128 p = load_pd_as_ps(vp+i);
+        p = _mm_add_ps(_mm_mul_ps(vw_mle, pmle), _mm_mul_ps(vw_lower, p));
+        store_ps_as_pd(vp+i, p);
+    }
+    interpolate_linear_scalar_f(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+//------------------------------------------------------------------------
+// AVX2, 4 doubles at a time
+//------------------------------------------------------------------------
+// Only avx2, no fma, multiply and add must round separately like
+// the scalar code does.
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void interpolate_abs_disc_avx2(double* vp, const int32_t* vc, int n,
+                                      double D, double denom, double l1)
+{
+    const __m256d vD = _mm256_set1_pd(D);
+    const __m256d vdenom = _mm256_set1_pd(denom);
+    const __m256d vl1 = _mm256_set1_pd(l1);
+    const __m256d zero = _mm256_setzero_pd();
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vc+i));
+        __m256d a = _mm256_max_pd(_mm256_sub_pd(_mm256_cvtepi32_pd(c), vD), zero);
+        __m256d p = _mm256_loadu_pd(vp+i);
+        p = _mm256_add_pd(_mm256_div_pd(a, vdenom), _mm256_mul_pd(vl1, p));
+        _mm256_storeu_pd(vp+i, p);
+    }
+    interpolate_abs_disc_scalar(vp, vc, i, n, D, denom, l1);
+}
+
+static void interpolate_linear_avx2(double* vp, const int32_t* vc, int n,
+                                    float denom, double w_mle, double w_lower)
+{
+    const __m128 vdenom = _mm_set1_ps(denom);
+    const __m256d vw_mle = _mm256_set1_pd(w_mle);
+    const __m256d vw_lower = _mm256_set1_pd(w_lower);
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vc+i));
+        __m256d pmle = _mm256_cvtps_pd(_mm_div_ps(_mm_cvtepi32_ps(c), vdenom));
+        __m256d p = _mm256_loadu_pd(vp+i);
+        p = _mm256_add_pd(_mm256_mul_pd(vw_mle, pmle), _mm256_mul_pd(vw_lower, p));
+        _mm256_storeu_pd(vp+i, p);
+    }
+    interpolate_linear_scalar(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+static void interpolate_linear_avx2(double* vp, const double* vc, int n,
+                                    double denom, double w_mle, double w_lower)
+{
+    const __m256d vdenom = _mm256_set1_pd(denom);
+    const __m256d vw_mle = _mm256_set1_pd(w_mle);
+    const __m256d vw_lower = _mm256_set1_pd(w_lower);
+
+    int i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m256d pmle = _mm256_div_pd(_mm256_loadu_pd(vc+i), vdenom);
+        __m256d p = _mm256_loadu_pd(vp+i);
+        p = _mm256_add_pd(_mm256_mul_pd(vw_mle, pmle), _mm256_mul_pd(vw_lower, p));
+        _mm256_storeu_pd(vp+i, p);
+    }
+    interpolate_linear_scalar(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+// 8 floats at a time
+
+static inline __m256 load_pd_as_ps_avx(const double* p)
+{
+    return _mm256_insertf128_ps(
+               _mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_loadu_pd(p))),
+               _mm256_cvtpd_ps(_mm256_loadu_pd(p+4)), 1);
+}
+
+static inline void store_ps_as_pd_avx(double* p, __m256 x)
+{
+    _mm256_storeu_pd(p, _mm256_cvtps_pd(_mm256_castps256_ps128(x)));
+    _mm256_storeu_pd(p+4, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+}
+
+static void interpolate_abs_disc_avx2_f(double* vp, const int32_t* vc, int n,
+                                        float D, float denom, float l1)
+{
+    const __m256 vD = _mm256_set1_ps(D);
+    const __m256 vdenom = _mm256_set1_ps(denom);
+    const __m256 vl1 = _mm256_set1_ps(l1);
+    const __m256 zero = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vc+i));
+        __m256 a = _mm256_max_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(c), vD), zero);
+        __m256 p = load_pd_as_ps_avx(vp+i);
+        p = _mm256_add_ps(_mm256_div_ps(a, vdenom), _mm256_mul_ps(vl1, p));
+        store_ps_as_pd_avx(vp+i, p);
+    }
+    interpolate_abs_disc_scalar_f(vp, vc, i, n, D, denom, l1);
+}
+
+static void interpolate_linear_avx2_f(double* vp, const int32_t* vc, int n,
+                                      float denom, float w_mle, float w_lower)
+{
+    const __m256 vdenom = _mm256_set1_ps(denom);
+    const __m256 vw_mle = _mm256_set1_ps(w_mle);
+    const __m256 vw_lower = _mm256_set1_ps(w_lower);
+
+    int i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(vc+i));
+        __m256 pmle = _mm256_div_ps(_mm256_cvtepi32_ps(c), vdenom);
+        __m256 p = load_pd_as_ps_avx(vp+i);
+        p = _mm256_add_ps(_mm256_mul_ps(vw_mle, pmle), _mm256_mul_ps(vw_lower, p));
+        store_ps_as_pd_avx(vp+i, p);
+    }
+    interpolate_linear_scalar_f(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+static void interpolate_linear_avx2_f(double* vp, const double* vc, int n,
+                                      float denom, float w_mle, float w_lower)
+{
+    const __m256 vdenom = _mm256_set1_ps(denom);
+    const __m256 vw_mle = _mm256_set1_ps(w_mle);
+    const __m256 vw_lower = _mm256_set1_ps(w_lower);
+
+    int i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        __m256 pmle = _mm256_div_ps(load_pd_as_ps_avx(vc+i), vdenom);
+        __m256 p = load_pd_as_ps_avx(vp+i);
+        p = _mm256_add_ps(_mm256_mul_ps(vw_mle, pmle), _mm256_mul_ps(vw_lower, p));
+        store_ps_as_pd_avx(vp+i, p);
+    }
+    interpolate_linear_scalar_f(vp, vc, i, n, denom, w_mle, w_lower);
+}
+
+#pragma GCC pop_options
+
+#endif
+
+
+//------------------------------------------------------------------------
+// dispatch
+//------------------------------------------------------------------------
+
+static SimdLevel detect_simd_level()
+{
+    #ifdef LM_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+    #endif
+    return SIMD_NONE;
+}
+
+static SimdLevel& simd_level()
+{
+    static SimdLevel level = detect_simd_level();
+    return level;
+}
+
+SimdLevel get_simd_level()
+{
+    return simd_level();
+}
+
+void set_simd_level(SimdLevel level)
+{
+    SimdLevel supported = detect_simd_level();
+    simd_level() = level < supported ? level : supported;
+}
+
+static SimdPrecision& simd_precision()
+{
+    static SimdPrecision precision = SIMD_DOUBLE;
+    return precision;
+}
+
+SimdPrecision get_simd_precision()
+{
+    return simd_precision();
+}
+
+void set_simd_precision(SimdPrecision precision)
+{
+    simd_precision() = precision;
+}
+
+static void interpolate_abs_disc_f(double* vp, const int32_t* vc, int n,
+                                   float D, float denom, float l1)
+{
+    switch (simd_level())
+    {
+        #ifdef LM_KERNELS_X86
+        case SIMD_AVX2:
+            interpolate_abs_disc_avx2_f(vp, vc, n, D, denom, l1);
+            break;
+        case SIMD_SSE2:
+            interpolate_abs_disc_sse2_f(vp, vc, n, D, denom, l1);
+            break;
+        #endif
+        default:
+            interpolate_abs_disc_scalar_f(vp, vc, 0, n, D, denom, l1);
+            break;
+    }
+}
+
+template <class T>
+static void interpolate_linear_f(double* vp, const T* vc, int n,
+                                 float denom, float w_mle, float w_lower)
+{
+    switch (simd_level())
+    {
+        #ifdef LM_KERNELS_X86
+        case SIMD_AVX2:
+            interpolate_linear_avx2_f(vp, vc, n, denom, w_mle, w_lower);
+            break;
+        case SIMD_SSE2:
+            interpolate_linear_sse2_f(vp, vc, n, denom, w_mle, w_lower);
+            break;
+        #endif
+        default:
+            interpolate_linear_scalar_f(vp, vc, 0, n, denom, w_mle, w_lower);
+            break;
+    }
+}
+
+void interpolate_abs_disc(double* vp, const int32_t* vc, int n,
+                          double D, double denom, double l1)
+{
+    if (simd_precision() == SIMD_FLOAT)
+    {
+        interpolate_abs_disc_f(vp, vc, n, static_cast<float>(D),
+                               static_cast<float>(denom),
+                               static_cast<float>(l1));
+        return;
+    }
+
+    switch (simd_level())
+    {
+        #ifdef LM_KERNELS_X86
+        case SIMD_AVX2:
+            interpolate_abs_disc_avx2(vp, vc, n, D, denom, l1);
+            break;
+        case SIMD_SSE2:
+            interpolate_abs_disc_sse2(vp, vc, n, D, denom, l1);
+            break;
+        #endif
+        default:
+            interpolate_abs_disc_scalar(vp, vc, 0, n, D, denom, l1);
+            break;
+    }
+}
+
+template <class T, class TDENOM>
+static void interpolate_linear_dispatch(double* vp, const T* vc, int n,
+                                        TDENOM denom, double w_mle, double w_lower)
+{
+    if (simd_precision() == SIMD_FLOAT)
+    {
+        interpolate_linear_f(vp, vc, n, static_cast<float>(denom),
+                             static_cast<float>(w_mle),
+                             static_cast<float>(w_lower));
+        return;
+    }
+
+    switch (simd_level())
+    {
+        #ifdef LM_KERNELS_X86
+        case SIMD_AVX2:
+            interpolate_linear_avx2(vp, vc, n, denom, w_mle, w_lower);
+            break;
+        case SIMD_SSE2:
+            interpolate_linear_sse2(vp, vc, n, denom, w_mle, w_lower);
+            break;
+        #endif
+        default:
+            interpolate_linear_scalar(vp, vc, 0, n, denom, w_mle, w_lower);
+            break;
+    }
+}
+
+void interpolate_linear(double* vp, const int32_t* vc, int n,
+                        float denom, double w_mle, double w_lower)
+{
+    interpolate_linear_dispatch(vp, vc, n, denom, w_mle, w_lower);
+}
+
+void interpolate_linear(double* vp, const double* vc, int n,
+                        double denom, double w_mle, double w_lower)
+{
+    interpolate_linear_dispatch(vp, vc, n, denom, w_mle, w_lower);
+}
+
+}  // namespace
@@ -0,0 +1,59 @@
+#ifndef LM_KERNELS_H
+#define LM_KERNELS_H
+
+#include <stdint.h>
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// Interpolation kernels
+//------------------------------------------------------------------------
+// Per-order update steps of the smoothing loops, run over all candidate
+// words. Vectorized with SSE2 or AVX2, picked at runtime, with a scalar
+// fallback. All variants evaluate the same expressions, without
+// fused multiply-add, and return identical results.
+// Optionally the updates are computed in single precision, with twice
+// as many words per vector. Probabilities then differ from the double
+// precision ones by about 1e-6 relative, across all levels alike.
+
+enum SimdLevel
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+};
+
+// Best instruction set supported by the cpu, or the one forced
+// with set_simd_level().
+SimdLevel get_simd_level();
+
+// Limit the kernels to level, for testing and benchmarking.
+// Levels the cpu doesn't support are ignored.
+void set_simd_level(SimdLevel level);
+
+enum SimdPrecision
+{
+    SIMD_DOUBLE,    // default
+    SIMD_FLOAT,     // single precision updates, faster
+};
+
+SimdPrecision get_simd_precision();
+void set_simd_precision(SimdPrecision precision);
+
+// Absolute discounting, Kneser-Ney:
+// vp[i] = max(vc[i] - D, 0) / denom + l1 * vp[i]
+void interpolate_abs_disc(double* vp, const int32_t* vc, int n,
+                          double D, double denom, double l1);
+
+// Linear interpolation, Witten-Bell, Jelinek-Mercer:
+// vp[i] = w_mle * (vc[i] / denom) + w_lower * vp[i]
+// Integer counts are divided in single precision, like
+// witten-bell smoothing always did.
+void interpolate_linear(double* vp, const int32_t* vc, int n,
+                        float denom, double w_mle, double w_lower);
+void interpolate_linear(double* vp, const double* vc, int n,
+                        double denom, double w_mle, double w_lower);
+
+}  // namespace
+
+#endif
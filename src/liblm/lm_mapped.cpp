@@ -0,0 +1,1082 @@
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <numeric>
+
+#include "lm_arpa.h"
+#include "lm_dynamic.h"
+#include "lm_kernels.h"
+#include "lm_mapped.h"
+#include "lm_threadpool.h"
+
+using namespace std;
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// MappedModel - read-only language model in a memory mapped file
+//------------------------------------------------------------------------
+
+void MappedModel::clear()
+{
+    Super::clear();   // clears dictionary, which may point into the mapping
+
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = NULL;
+    m_size = 0;
+    m_num_word_types = 0;
+    m_levels.clear();
+    m_Ds = NULL;
+}
+
+void MappedModel::load(const char* filename)
+{
+    m_load_error_msg = "";
+    m_load_error = do_load(filename);
+    if (m_load_error)
+    {
+        m_load_error_msg = get_error_msg(m_load_error, filename);
+        throw_on_error(m_load_error, filename);
+    }
+}
+
+void MappedModel::save(const char* filename)
+{
+    throw_on_error(do_save(filename), filename);
+}
+
+// Size and 64 bit FNV-1a hash of the contents of a file.
+static bool get_file_identity(const char* filename,
+                              uint64_t& size, uint64_t& hash)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    size = 0;
+    hash = 0xcbf29ce484222325;
+    std::vector<uint8_t> buf(1<<16);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), f)) > 0)
+    {
+        for (size_t i=0; i<n; i++)
+            hash = (hash ^ buf[i]) * 0x100000001b3;
+        size += n;
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+bool MappedModel::is_converted_from(const char* source_filename)
+{
+    const MappedHeader* header = get_section<MappedHeader>(0, 1);
+    uint64_t size, hash;
+    return header &&
+           get_file_identity(source_filename, size, hash) &&
+           header->source_size == size &&
+           header->source_hash == hash;
+}
+
+// Pointer to num_items consecutive T at offset into the mapping,
+// NULL if they don't fit or are misaligned.
+template <class T>
+const T* MappedModel::get_section(uint64_t offset, uint64_t num_items)
+{
+    if (offset % alignof(T) ||
+        offset > m_size ||
+        num_items > (m_size - offset) / sizeof(T))
+        return NULL;
+    return reinterpret_cast<const T*>(m_data + offset);
+}
+
+LMError MappedModel::do_load(const char* filename)
+{
+    clear();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return ERR_FILE;
+
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);   // the mapping stays valid
+    if (p == MAP_FAILED)
+    {
+        errno = err;
+        return ERR_FILE;
+    }
+    m_data = static_cast<const uint8_t*>(p);
+    m_size = st.st_size;
+
+    // Check the header and the extent of the sections. The contents
+    // aren't verified beyond that, the file is trusted as written
+    // by convert().
+    const MappedHeader* header = get_section<MappedHeader>(0, 1);
+    if (!header ||
+        memcmp(header->magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0 ||
+        header->byte_order != MAPPED_BYTE_ORDER ||
+        header->version != MAPPED_VERSION ||
+        header->order < 1 ||
+        header->num_words < NUM_CONTROL_WORDS)
+    {
+        clear();
+        return ERR_FORMAT;
+    }
+
+    int order = header->order;
+    const MappedLevel* levels = get_section<MappedLevel>(sizeof(MappedHeader),
+                                                         order+1);
+    const uint32_t* offsets = get_section<uint32_t>(header->word_offsets,
+                                                    header->num_words+1);
+    const char* blob = get_section<char>(header->word_blob,
+                                         header->word_blob_size);
+    m_Ds = get_section<double>(header->discounts, order);
+    if (!levels || !offsets || !blob || !m_Ds ||
+        !header->word_blob_size || blob[header->word_blob_size-1] != '\0')
+    {
+        clear();
+        return ERR_FORMAT;
+    }
+
+    for (int i=0; i<=order; i++)
+    {
+        const MappedLevel& ml = levels[i];
+        Level level = {ml.num_nodes, NULL, NULL, NULL, NULL, NULL};
+        if (i > 0)
+        {
+            level.wids = get_section<uint32_t>(ml.wids, ml.num_nodes);
+            level.counts = get_section<uint32_t>(ml.counts, ml.num_nodes);
+            if (!level.wids || !level.counts)
+                break;
+        }
+        if (i < order)
+        {
+            level.child_begin = get_section<uint32_t>(ml.child_begin,
+                                                      ml.num_nodes+1);
+            level.N1prxs = get_section<uint32_t>(ml.N1prxs, ml.num_nodes);
+            level.child_sums = get_section<uint32_t>(ml.child_sums,
+                                                     ml.num_nodes);
+            if (!level.child_begin || !level.N1prxs || !level.child_sums ||
+                level.child_begin[ml.num_nodes] != levels[i+1].num_nodes)
+                break;
+        }
+        m_levels.push_back(level);
+    }
+    if ((int)m_levels.size() != order+1 ||
+        m_levels[0].num_nodes != 1 ||
+        m_levels[1].num_nodes != header->num_words)
+    {
+        clear();
+        return ERR_FORMAT;
+    }
+
+    // The vocabulary stays in the mapping, the dictionary
+    // only copies the offsets of its words.
+    for (uint32_t i=0; i<header->num_words; i++)
+    {
+        if (offsets[i] >= header->word_blob_size)
+        {
+            clear();
+            return ERR_FORMAT;
+        }
+    }
+    LMError error = m_dictionary.set_external_words(blob,
+                                                    header->word_blob_size,
+                                                    offsets,
+                                                    header->num_words);
+    if (error)
+    {
+        clear();
+        return error;
+    }
+
+    m_order = order;
+    m_num_word_types = header->num_word_types;
+
+    return ERR_NONE;
+}
+
+int MappedModel::get_node(const WordId* wids, int n)
+{
+    int index = 0;   // root
+    for (int i=0; i<n; i++)
+    {
+        const Level& level = m_levels[i];
+        const uint32_t* child_wids = m_levels[i+1].wids;
+        const uint32_t* begin = child_wids + level.child_begin[index];
+        const uint32_t* end   = child_wids + level.child_begin[index+1];
+        const uint32_t* it = lower_bound(begin, end, wids[i]);
+        if (it == end || *it != wids[i])
+            return -1;
+        index = it - child_wids;
+    }
+    return index;
+}
+
+int MappedModel::get_ngram_count(const wchar_t* const* ngram, int n)
+{
+    if (!m_data || n < 1 || n > m_order)
+        return 0;
+
+    std::vector<WordId> wids(n);
+    for (int i=0; i<n; i++)
+    {
+        wids[i] = m_dictionary.word_to_id(ngram[i]);
+        if (wids[i] == WIDNONE)
+            return 0;
+    }
+
+    int index = get_node(&wids[0], n);
+    return index >= 0 ? m_levels[n].counts[index] : 0;
+}
+
+void MappedModel::get_words_with_predictions(
+                                const std::vector<WordId>& history,
+                                std::vector<WordId>& wids)
+{
+    if (!m_data || m_order < 2 || history.empty())
+        return;
+
+    // bigram history
+    int index = get_node(&history.back(), 1);
+    if (index >= 0)
+    {
+        const Level& level = m_levels[1];
+        const Level& child_level = m_levels[2];
+        for (uint32_t i=level.child_begin[index];
+             i<level.child_begin[index+1]; i++)
+            if (child_level.counts[i])
+                wids.push_back(child_level.wids[i]);
+    }
+}
+
+void MappedModel::filter_candidates(const std::vector<WordId>& in,
+                                          std::vector<WordId>& out)
+{
+    if (!m_data)
+        return;
+
+    // filter out removed unigrams
+    const Level& level = m_levels[1];
+    int num_candidates = in.size();
+    out.reserve(num_candidates);
+    for (int i=0; i<num_candidates; i++)
+    {
+        WordId wid = in[i];
+        if (wid < level.num_nodes && level.counts[wid])
+            out.push_back(wid);
+    }
+}
+
+// Calculate a vector of probabilities for the ngrams formed
+// by history + word[i], for all i.
+// input:  constant history and a vector of candidate words
+// output: vector of probabilities, one value per candidate word
+void MappedModel::get_probs(const std::vector<WordId>& history,
+                            const std::vector<WordId>& words,
+                            std::vector<double>& probabilities,
+                            NodeValueCache* cache)
+{
+    (void)cache;  // sums are stored per node
+
+    if (!m_data)
+        return;
+
+    if (m_order < 2)
+    {
+        get_probs_unigram(words, probabilities);
+        return;
+    }
+
+    // pad/cut history so it's always of length order-1
+    int n = std::min((int)history.size(), m_order-1);
+    std::vector<WordId> h(m_order-1, UNKNOWN_WORD_ID);
+    std::copy_backward(history.end()-n, history.end(), h.end());
+
+    switch(m_smoothing)
+    {
+        case WITTEN_BELL_I:
+            get_probs_witten_bell_i(h, words, probabilities);
+            break;
+
+        case ABS_DISC_I:
+            get_probs_abs_disc_i(h, words, probabilities);
+            break;
+
+         default:
+            break;
+    }
+}
+
+// Same as NGramTrie::get_probs_witten_bell_i, on the mapped arrays.
+void MappedModel::get_probs_witten_bell_i(const std::vector<WordId>& history,
+                                          const std::vector<WordId>& words,
+                                          std::vector<double>& vp)
+{
+    int j;
+    int n = history.size() + 1;
+    int size = words.size();   // number of candidate words
+    std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
+
+    // order 0
+    vp.resize(size);
+    fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+
+    // order 1..n
+    for(j=0; j<n; j++)
+    {
+        int index = get_node(history.data()+(n-j-1), j);
+        if (index >= 0)
+        {
+            const Level& level = m_levels[j];
+            const Level& child_level = m_levels[j+1];
+
+            int N1prx = level.N1prxs[index];   // number of word types following the history
+            if (!N1prx)  // break early, don't reset probabilities to 0
+                break;   // for unknown histories
+
+            // total number of occurences of the history
+            int cs = level.child_sums[index];
+            if (cs)
+            {
+                // get ngram counts
+                fill(vc.begin(), vc.end(), 0);
+                // children and candidate words are both sorted by word id
+                uint32_t begin = level.child_begin[index];
+                int num_children = static_cast<int>(level.child_begin[index+1] - begin);
+                const uint32_t* wids = child_level.wids + begin;
+                const uint32_t* counts = child_level.counts + begin;
+                merge_join(num_children, [&](int c) {return wids[c];},
+                           size, [&](int k) {return words[k];},
+                           [&](int c, int k) {vc[k] = counts[c];});
+
+                double l1 = N1prx / (N1prx + float(cs)); // normalization factor
+                                                         // 1 - lambda
+                interpolate_linear(vp.data(), vc.data(), size,
+                                   float(cs), 1.0 - l1, l1);
+            }
+        }
+    }
+}
+
+// Same as NGramTrie::get_probs_abs_disc_i, on the mapped arrays.
+void MappedModel::get_probs_abs_disc_i(const std::vector<WordId>& history,
+                                       const std::vector<WordId>& words,
+                                       std::vector<double>& vp)
+{
+    int j;
+    int n = history.size() + 1;
+    int size = words.size();   // number of candidate words
+    std::vector<int32_t> vc(size);  // vector of counts, reused for order 1..n
+
+    // order 0
+    vp.resize(size);
+    fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+
+    // order 1..n
+    for(j=0; j<n; j++)
+    {
+        int index = get_node(history.data()+(n-j-1), j);
+        if (index >= 0)
+        {
+            const Level& level = m_levels[j];
+            const Level& child_level = m_levels[j+1];
+
+            int N1prx = level.N1prxs[index];   // number of word types following the history
+            if (!N1prx)  // break early, don't reset probabilities to 0
+                break;   // for unknown histories
+
+            // total number of occurences of the history
+            int cs = level.child_sums[index];
+            if (cs)
+            {
+                // get ngram counts
+                fill(vc.begin(), vc.end(), 0);
+                // children and candidate words are both sorted by word id
+                uint32_t begin = level.child_begin[index];
+                int num_children = static_cast<int>(level.child_begin[index+1] - begin);
+                const uint32_t* wids = child_level.wids + begin;
+                const uint32_t* counts = child_level.counts + begin;
+                merge_join(num_children, [&](int c) {return wids[c];},
+                           size, [&](int k) {return words[k];},
+                           [&](int c, int k) {vc[k] = counts[c];});
+
+                double D = m_Ds[j];
+                double l1 = D / float(cs) * N1prx; // normalization factor
+                                                   // 1 - lambda
+                interpolate_abs_disc(vp.data(), vc.data(), size,
+                                     D, float(cs), l1);
+            }
+        }
+    }
+}
+
+// Same as UnigramModel::get_probs.
+void MappedModel::get_probs_unigram(const std::vector<WordId>& words,
+                                    std::vector<double>& vp)
+{
+    const Level& level = m_levels[1];
+    int size = words.size();   // number of candidate words
+    int cs = m_levels[0].child_sums[0]; // total number of occurences
+    vp.resize(size);
+    if (cs)
+    {
+        for(int i=0; i<size; i++)
+        {
+            WordId wid = words[i];
+            CountType count = level.counts[wid];
+            vp[i] = count / (double) cs;
+        }
+    }
+    else
+    {
+        fill(vp.begin(), vp.end(), 1.0/m_num_word_types); // uniform distribution
+    }
+}
+
+
+//------------------------------------------------------------------------
+// Conversion to the binary format
+//------------------------------------------------------------------------
+
+namespace {
+
+// N-grams of one level, the word ids of each n-gram consecutively.
+struct NGramList
+{
+    std::vector<WordId> wids;
+    std::vector<CountType> counts;
+};
+
+// Sort the n-grams of the given level by their word ids and sum up
+// the counts of duplicates.
+void sort_ngrams(NGramList& ngrams, int level)
+{
+    size_t n = ngrams.counts.size();
+    const WordId* w = ngrams.wids.data();
+    std::vector<uint32_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return std::lexicographical_compare(w + a*level, w + (a+1)*level,
+                                            w + b*level, w + (b+1)*level);
+    });
+
+    // Move the n-grams into place, following the cycles of the
+    // permutation, to avoid a second copy of the level in memory.
+    WordId* wids = ngrams.wids.data();
+    CountType* counts = ngrams.counts.data();
+    std::vector<WordId> ngram(level);
+    for (size_t i=0; i<n; i++)
+    {
+        if (order[i] == i)
+            continue;
+        std::copy(wids + i*level, wids + (i+1)*level, ngram.begin());
+        CountType count = counts[i];
+        size_t j = i;
+        while (order[j] != i)
+        {
+            size_t k = order[j];
+            std::copy(wids + k*level, wids + (k+1)*level, wids + j*level);
+            counts[j] = counts[k];
+            order[j] = j;
+            j = k;
+        }
+        std::copy(ngram.begin(), ngram.end(), wids + j*level);
+        counts[j] = count;
+        order[j] = j;
+    }
+
+    // sum up duplicates
+    size_t num_unique = 0;
+    for (size_t i=0; i<n; i++)
+    {
+        if (num_unique &&
+            std::equal(wids + i*level, wids + (i+1)*level,
+                       wids + (num_unique-1)*level))
+            counts[num_unique-1] += counts[i];
+        else
+        {
+            std::copy(wids + i*level, wids + (i+1)*level,
+                      wids + num_unique*level);
+            counts[num_unique] = counts[i];
+            num_unique++;
+        }
+    }
+    ngrams.wids.resize(num_unique * level);
+    ngrams.counts.resize(num_unique);
+}
+
+// Fill arrays with words and the n-grams of all levels, whose word ids
+// index words. Level 1 holds the counts of all words by word id, the
+// higher levels must be free of duplicates. Word ids are renumbered,
+// control words first, then all words sorted. Levels already in that
+// order needn't be sorted again.
+LMError build_arrays(NGramArrays& arrays,
+                     const std::vector<const char*>& words,
+                     std::vector<NGramList>& ngrams)
+{
+    int order = static_cast<int>(ngrams.size()) - 1;
+    int num_words = static_cast<int>(words.size());
+    if (order < 1 || num_words < NUM_CONTROL_WORDS)
+        return ERR_COUNT;
+    arrays.order = order;
+    arrays.num_words = num_words;
+
+    // new word ids: control words first, then all words sorted
+    std::vector<WordId> new_to_old(num_words);
+    std::iota(new_to_old.begin(), new_to_old.end(), 0);
+    std::sort(new_to_old.begin() + NUM_CONTROL_WORDS, new_to_old.end(),
+              [&](WordId a, WordId b)
+              { return strcmp(words[a], words[b]) < 0; });
+    bool renumber = false;
+    for (int i=0; i<num_words; i++)
+        renumber |= new_to_old[i] != static_cast<WordId>(i);
+    if (renumber)
+    {
+        std::vector<WordId> old_to_new(num_words);
+        for (int i=0; i<num_words; i++)
+            old_to_new[new_to_old[i]] = i;
+
+        std::vector<CountType> unigram_counts(num_words);
+        for (int i=0; i<num_words; i++)
+            unigram_counts[i] = ngrams[1].counts[new_to_old[i]];
+        ngrams[1].counts.swap(unigram_counts);
+
+        for (int i=2; i<=order; i++)
+        {
+            for (auto& wid : ngrams[i].wids)
+                wid = old_to_new[wid];
+            sort_ngrams(ngrams[i], i);
+        }
+    }
+    ngrams[1].wids.resize(num_words);
+    std::iota(ngrams[1].wids.begin(), ngrams[1].wids.end(), 0);
+
+    // Children ranges and statistics of the inner levels.
+    // Both levels are sorted, so each child's parent comes
+    // at or after the parent of the previous child.
+    arrays.child_begins.assign(order, {});
+    arrays.N1prxs.assign(order, {});
+    arrays.child_sums.assign(order, {});
+    for (int i=0; i<order; i++)
+    {
+        size_t num_parents = i ? ngrams[i].counts.size() : 1;
+        const WordId* parents = ngrams[i].wids.data();
+        const NGramList& children = ngrams[i+1];
+        auto& begins = arrays.child_begins[i];
+        auto& N1prxs = arrays.N1prxs[i];
+        auto& sums = arrays.child_sums[i];
+        begins.assign(num_parents+1, 0);
+        N1prxs.assign(num_parents, 0);
+        sums.assign(num_parents, 0);
+
+        size_t p = 0;
+        for (size_t c=0; c<children.counts.size(); c++)
+        {
+            // is the history of the child the n-gram p?
+            const WordId* child = children.wids.data() + c*(i+1);
+            while (p < num_parents &&
+                   !std::equal(child, child + i, parents + p*i))
+                p++;
+            if (p >= num_parents)
+                return ERR_COUNT;  // n-gram without history
+            begins[p+1]++;
+            if (children.counts[c] > 0)
+                N1prxs[p]++;
+            sums[p] += children.counts[c];
+        }
+        std::partial_sum(begins.begin(), begins.end(), begins.begin());
+    }
+
+    // vocabulary
+    arrays.word_offsets.clear();
+    arrays.word_blob.clear();
+    for (int i=0; i<num_words; i++)
+    {
+        arrays.word_offsets.push_back(arrays.word_blob.size());
+        arrays.word_blob += words[new_to_old[i]];
+        arrays.word_blob += '\0';
+    }
+    arrays.word_offsets.push_back(arrays.word_blob.size());
+
+    arrays.num_word_types = std::count_if(ngrams[1].counts.begin(),
+                                          ngrams[1].counts.end(),
+                                          [](CountType count)
+                                          { return count > 0; });
+
+    // only the last word of each n-gram, the others are implied
+    // by the parent's child range
+    arrays.wids.assign(order+1, {});
+    arrays.counts.assign(order+1, {});
+    for (int i=1; i<=order; i++)
+    {
+        NGramList& level = ngrams[i];
+        auto& wids = arrays.wids[i];
+        wids.resize(level.counts.size());
+        for (size_t j=0; j<wids.size(); j++)
+            wids[j] = level.wids[j*i + i-1];
+        std::vector<WordId>().swap(level.wids);
+        arrays.counts[i].swap(level.counts);
+    }
+
+    return ERR_NONE;
+}
+
+class SectionWriter
+{
+    public:
+        SectionWriter(FILE* f) : m_f(f) {}
+
+        // file offset of the next section, aligned to 8 bytes
+        uint64_t reserve(uint64_t bytes)
+        {
+            uint64_t offset = m_size;
+            m_size = (m_size + bytes + 7) & ~uint64_t(7);
+            return offset;
+        }
+
+        bool write(const void* data, uint64_t bytes)
+        {
+            static const char zeros[8] = {};
+            uint64_t padding = ((bytes + 7) & ~uint64_t(7)) - bytes;
+            return fwrite(data, 1, bytes, m_f) == bytes &&
+                   fwrite(zeros, 1, padding, m_f) == padding;
+        }
+
+        template <class T>
+        bool write(const std::vector<T>& v)
+        {
+            return write(v.data(), v.size() * sizeof(T));
+        }
+
+    private:
+        FILE* m_f;
+        uint64_t m_size{0};
+};
+
+}
+
+LMError NGramArrays::build(DynamicModelBase& model)
+{
+    Dictionary& dictionary = model.m_dictionary;
+    int model_order = model.get_order();
+    if (model_order < 1 || !model.is_model_valid())
+        return ERR_COUNT;
+
+    std::vector<const char*> words(dictionary.get_num_word_types());
+    for (size_t i=0; i<words.size(); i++)
+        words[i] = dictionary.id_to_word_utf8(i);
+
+    // collect the n-grams of all levels, level 0 is the root
+    std::vector<NGramList> ngrams(model_order+1);
+    ngrams[1].counts.assign(words.size(), 0);
+    std::vector<WordId> ngram;
+    for (auto it = model.ngrams_begin(); ; (*it)++)
+    {
+        const BaseNode* node = *(*it);
+        if (!node)
+            break;
+
+        it->get_ngram(ngram);
+        int level = static_cast<int>(ngram.size());
+        if (level == 1)
+            ngrams[1].counts[ngram[0]] = node->get_count();
+        else
+        if (level <= model_order)
+        {
+            ngrams[level].wids.insert(ngrams[level].wids.end(),
+                                      ngram.begin(), ngram.end());
+            ngrams[level].counts.push_back(node->get_count());
+        }
+    }
+
+    LMError err = build_arrays(*this, words, ngrams);
+    if (err)
+        return err;
+
+    // Discounting parameters, as estimated by _DynamicModel::count_ngram.
+    // Taken from the model, they needn't match the final counts exactly.
+    Ds = model.get_discounts();
+    Ds.resize(order, 0.1);
+
+    return ERR_NONE;
+}
+
+// Same state machine as DynamicModelBase::load_arpac(), and the same
+// parallel parsing of the higher levels, but the n-grams go into flat
+// arrays per level instead of a trie. They are sorted and checked for
+// duplicates at the end of each section.
+LMError NGramArrays::load_arpac(const char* filename)
+{
+    int new_order = 0;
+    int current_level = 0;
+    int line_number = -1;
+    std::vector<int> num_expected;
+    LMError err_code = ERR_NONE;
+
+    enum {BEGIN, COUNTS, NGRAMS_HEAD, NGRAMS, DONE}
+    state = BEGIN;
+
+    // Vocabulary, control words first. The deque keeps the
+    // words in place for the index's keys.
+    std::deque<std::string> words;
+    WordIndex index;
+    std::vector<NGramList> ngrams(2);
+    int num_unigrams = 0;   // distinct words of the unigram section
+
+    auto add_word = [&](const char* word)
+    {
+        WordId wid = words.size();
+        words.emplace_back(word);
+        index.emplace(words.back(), wid);
+        ngrams[1].counts.push_back(0);
+        return wid;
+    };
+    const WordIndex& const_index = index;
+    auto lookup = [&const_index](const char* word)
+    {
+        auto it = const_index.find(word);
+        return it == const_index.end() ? WIDNONE : it->second;
+    };
+
+    for (const char* word : {"<unk>", "<s>", "</s>", "<num>"})
+        add_word(word);
+
+    FileContents file;
+    err_code = file.load(filename);
+    if (err_code)
+        return err_code;
+
+    ThreadPool& pool = ThreadPool::get_shared();
+    int chunks_per_batch = 2 * (pool.get_num_threads() + 1);
+    std::vector<ArpaChunk> chunks;
+
+    const char* end = file.end();
+    for (const char* line = file.begin(); line < end; )
+    {
+        // read line and chop it into tokens
+        char buf[4096];
+        char* tokens[32];
+        int ntoks = split_line(line, end, line,
+                               buf, ALEN(buf), tokens, ALEN(tokens));
+        line_number++;
+        if (!ntoks)
+            continue;
+
+        // unigrams, higher levels are read a section at a time below
+        if (state == NGRAMS)
+        {
+            if (tokens[0][0] == '\\')  // end of section?
+            {
+                int ngrams_read = num_unigrams;
+                if (current_level >= 2)
+                {
+                    sort_ngrams(ngrams[current_level], current_level);
+                    ngrams_read = ngrams[current_level].counts.size();
+                }
+                else
+                {
+                    // Sort the words now, then the higher levels
+                    // usually needn't be sorted again in build_arrays().
+                    std::vector<WordId> new_to_old(words.size());
+                    std::iota(new_to_old.begin(), new_to_old.end(), 0);
+                    std::sort(new_to_old.begin() + NUM_CONTROL_WORDS,
+                              new_to_old.end(), [&](WordId a, WordId b)
+                              { return words[a] < words[b]; });
+                    std::deque<std::string> sorted_words;
+                    std::vector<CountType> sorted_counts;
+                    for (WordId wid : new_to_old)
+                    {
+                        sorted_words.emplace_back(std::move(words[wid]));
+                        sorted_counts.push_back(ngrams[1].counts[wid]);
+                    }
+                    words.swap(sorted_words);
+                    ngrams[1].counts.swap(sorted_counts);
+                    index.clear();
+                    for (size_t i=0; i<words.size(); i++)
+                        index.emplace(words[i], i);
+                }
+
+                // check count
+                int ngrams_expected = num_expected[current_level-1];
+                if (ngrams_read != ngrams_expected)
+                {
+                    error (0, 0, "unexpected n-gram count for level %d: "
+                                 "expected %d n-grams, but read %d",
+                          current_level,
+                          ngrams_expected, ngrams_read);
+                    err_code = ERR_COUNT; // count doesn't match number of unique ngrams
+                    break;
+                }
+                state = NGRAMS_HEAD;
+            }
+            else
+            {
+                if (ntoks < 2)
+                {
+                    err_code = ERR_NUMTOKENS; // too few tokens for cur. level
+                    error (0, 0, "too few tokens for n-gram level %d: "
+                          "line %d, tokens found %d/%d",
+                          current_level,
+                          line_number, ntoks, 2);
+                    break;
+                }
+
+                // optional time stamp in between, frozen models have none
+                int count = strtol(tokens[0], NULL, 10);
+                const char* word = tokens[ntoks >= 3 ? 2 : 1];
+
+                // ignore n-grams with count 0, see
+                // DynamicModelBase::load_arpac()
+                if (count <= 0)
+                    num_expected[0]--;
+                else
+                {
+                    WordId wid = lookup(word);
+                    if (wid == WIDNONE)
+                        wid = add_word(word);
+                    if (ngrams[1].counts[wid] == 0)
+                        num_unigrams++;
+                    ngrams[1].counts[wid] += count;
+                }
+                continue;
+            }
+        }
+        else
+        if (state == BEGIN)
+        {
+            if (strncmp(tokens[0], "\\data\\", 6) == 0)
+            {
+                state = COUNTS;
+            }
+        }
+        else
+        if (state == COUNTS)
+        {
+            if (strncmp(tokens[0], "ngram", 5) == 0 && ntoks >= 2)
+            {
+                int level;
+                int count;
+                if (sscanf(tokens[1], "%d=%d", &level, &count) == 2 &&
+                    level >= 1)
+                {
+                    new_order = std::max(new_order, level);
+                    num_expected.resize(new_order);
+                    num_expected[level-1] = count;
+                }
+            }
+            else
+            {
+                ngrams.resize(new_order+1);
+                state = NGRAMS_HEAD;
+            }
+        }
+
+        if (state == NGRAMS_HEAD)
+        {
+            if (sscanf(tokens[0], "\\%d-grams", &current_level) == 1)
+            {
+                if (current_level < 1 || current_level > new_order)
+                {
+                    err_code = ERR_ORDER_UNEXPECTED;
+                    break;
+                }
+                state = NGRAMS;
+
+                // Higher order n-grams make up the bulk of the file,
+                // parse the whole section in parallel chunks. Workers
+                // only read the index, unknown words are added here,
+                // in between batches.
+                if (current_level >= 2)
+                {
+                    const char* section_end = find_section_end(line, end);
+                    NGramList& level = ngrams[current_level];
+                    for (const char* p = line; p < section_end; )
+                    {
+                        split_arpac_chunks(p, section_end, chunks_per_batch,
+                                           chunks);
+                        size_t index_size = index.size();
+                        pool.run(chunks.size(), [&](int i)
+                        {
+                            parse_arpac_chunk(chunks[i], current_level,
+                                              lookup);
+                        });
+                        assert(index.size() == index_size);
+                        (void)index_size;
+
+                        for (auto& chunk : chunks)
+                        {
+                            if (chunk.error)
+                            {
+                                error (0, 0, "too few tokens for n-gram level %d: "
+                                      "line %d, tokens found %d/%d",
+                                      current_level,
+                                      line_number + 1 + chunk.error_line,
+                                      chunk.error_ntoks, current_level+1);
+                                return chunk.error;
+                            }
+                            line_number += chunk.num_lines;
+
+                            // Expect fewer n-grams for this level.
+                            num_expected[current_level-1] -= chunk.num_removed;
+
+                            for (size_t i=0; i<chunk.unknown_counts.size(); i++)
+                            {
+                                for (int j=0; j<current_level; j++)
+                                {
+                                    const char* word =
+                                        chunk.unknown_words[i*current_level+j].c_str();
+                                    WordId wid = lookup(word);
+                                    if (wid == WIDNONE)
+                                        wid = add_word(word);
+                                    level.wids.push_back(wid);
+                                }
+                                level.counts.push_back(chunk.unknown_counts[i]);
+                            }
+
+                            level.wids.insert(level.wids.end(),
+                                              chunk.wids.begin(),
+                                              chunk.wids.end());
+                            level.counts.insert(level.counts.end(),
+                                                chunk.counts.begin(),
+                                                chunk.counts.end());
+                        }
+                    }
+                    line = section_end;
+                }
+            }
+            else
+            if (strncmp(tokens[0], "\\end\\", 5) == 0)
+            {
+                state = DONE;
+                break;
+            }
+        }
+    }
+
+    // didn't make it until the end?
+    if (state != DONE && !err_code)
+        err_code = ERR_UNEXPECTED_EOF;  // unexpected end of file
+    if (err_code)
+        return err_code;
+
+    // Control words exist with at least count 1,
+    // see DynamicModelBase::assure_valid_control_words().
+    for (int i=0; i<NUM_CONTROL_WORDS; i++)
+        ngrams[1].counts[i] = std::max(ngrams[1].counts[i], CountType(1));
+
+    std::vector<const char*> word_ptrs;
+    for (const auto& word : words)
+        word_ptrs.push_back(word.c_str());
+    index.clear();
+
+    // Discounting parameters from the counts of counts,
+    // as _DynamicModel::count_ngram estimates them while loading.
+    Ds.assign(new_order, 0.1);
+    for (int i=1; i<=new_order; i++)
+    {
+        const auto& level_counts = ngrams[i].counts;
+        int n1 = std::count(level_counts.begin(), level_counts.end(), 1);
+        int n2 = std::count(level_counts.begin(), level_counts.end(), 2);
+        if (n1 && n2)
+            Ds[i-1] = n1 / (n1 + 2.0*n2);
+    }
+
+    return build_arrays(*this, word_ptrs, ngrams);
+}
+
+// Write the model in the binary format read by MappedModel::do_load.
+// Word ids are renumbered so that the dictionary needs no sorted index.
+LMError MappedModel::convert(DynamicModelBase& model, const char* filename,
+                             const char* source_filename)
+{
+    NGramArrays arrays;
+    LMError err = arrays.build(model);
+    if (err)
+        return err;
+    int order = arrays.order;
+
+    uint64_t source_size = 0;
+    uint64_t source_hash = 0;
+    if (source_filename &&
+        !get_file_identity(source_filename, source_size, source_hash))
+        return ERR_FILE;
+
+    // layout
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+        return ERR_FILE;
+    SectionWriter writer(f);
+
+    MappedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+    header.byte_order = MAPPED_BYTE_ORDER;
+    header.version = MAPPED_VERSION;
+    header.order = order;
+    header.num_words = arrays.num_words;
+    header.num_word_types = arrays.num_word_types;
+    header.source_size = source_size;
+    header.source_hash = source_hash;
+
+    std::vector<MappedLevel> levels(order+1);
+    writer.reserve(sizeof(header));
+    writer.reserve(sizeof(MappedLevel) * levels.size());
+    header.word_offsets = writer.reserve(arrays.word_offsets.size() * sizeof(uint32_t));
+    header.word_blob = writer.reserve(arrays.word_blob.size());
+    header.word_blob_size = arrays.word_blob.size();
+    header.discounts = writer.reserve(arrays.Ds.size() * sizeof(double));
+
+    for (int i=0; i<=order; i++)
+    {
+        MappedLevel& level = levels[i];
+        memset(&level, 0, sizeof(level));
+        level.num_nodes = i ? arrays.wids[i].size() : 1;
+        if (i > 0)
+        {
+            level.wids = writer.reserve(arrays.wids[i].size() * sizeof(uint32_t));
+            level.counts = writer.reserve(arrays.counts[i].size() * sizeof(uint32_t));
+        }
+    }
+    for (int i=0; i<order; i++)
+    {
+        MappedLevel& level = levels[i];
+        level.child_begin = writer.reserve(arrays.child_begins[i].size() * sizeof(uint32_t));
+        level.N1prxs = writer.reserve(arrays.N1prxs[i].size() * sizeof(uint32_t));
+        level.child_sums = writer.reserve(arrays.child_sums[i].size() * sizeof(uint32_t));
+    }
+
+    // write sections in the order they were reserved
+    bool ok = writer.write(&header, sizeof(header)) &&
+              writer.write(levels) &&
+              writer.write(arrays.word_offsets) &&
+              writer.write(arrays.word_blob.data(), arrays.word_blob.size()) &&
+              writer.write(arrays.Ds);
+    for (int i=1; ok && i<=order; i++)
+        ok = writer.write(arrays.wids[i]) &&
+             writer.write(arrays.counts[i]);
+    for (int i=0; ok && i<order; i++)
+        ok = writer.write(arrays.child_begins[i]) &&
+             writer.write(arrays.N1prxs[i]) &&
+             writer.write(arrays.child_sums[i]);
+
+    if (fclose(f) != 0)
+        ok = false;
+
+    return ok ? ERR_NONE : ERR_FILE;
+}
+
+}  // namespace
@@ -0,0 +1,225 @@
+#ifndef LM_MAPPED_H
+#define LM_MAPPED_H
+
+#include "lm.h"
+
+namespace lm {
+
+class DynamicModelBase;
+
+//------------------------------------------------------------------------
+// Binary model format
+//------------------------------------------------------------------------
+// Read-only n-gram counts laid out as sorted arrays per level, ready
+// to be memory mapped. All values are in native byte order.
+//
+//   MappedHeader
+//   MappedLevel[order+1]     level 0 is the root, level n holds n-grams
+//   word offsets             uint32[num_words+1] into the word blob
+//   word blob                zero-terminated utf-8 words by word id
+//   discounts                double[order], abs. discounting parameters
+//   per level 1..order       wids uint32[n], counts uint32[n]
+//   per level 0..order-1     child_begin uint32[n+1] into the next level,
+//                            N1prx uint32[n], child_sums uint32[n]
+//
+// The n-grams of a level are sorted by their word ids, so the children
+// of each node form a range of the next level, sorted by word id.
+// Word ids are control words first, then all words sorted by strcmp.
+// Every word has a unigram and its index on level 1 is its word id.
+
+const char MAPPED_MAGIC[8] = {'O', 'B', 'L', 'M', 'B', 'I', 'N', '\0'};
+const uint32_t MAPPED_BYTE_ORDER = 0x01020304;
+const uint32_t MAPPED_VERSION = 2;
+
+struct MappedHeader
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t order;
+    uint32_t num_words;
+    uint32_t num_word_types;   // unigrams with count > 0
+    uint32_t reserved;
+    uint64_t word_offsets;     // file offsets of the sections
+    uint64_t word_blob;
+    uint64_t word_blob_size;
+    uint64_t discounts;
+    uint64_t source_size;      // text model converted from, 0 if unknown
+    uint64_t source_hash;      // FNV-1a of its contents
+};
+
+struct MappedLevel
+{
+    uint32_t num_nodes;
+    uint32_t reserved;
+    uint64_t wids;             // file offsets of the arrays, 0 if missing
+    uint64_t counts;
+    uint64_t child_begin;
+    uint64_t N1prxs;
+    uint64_t child_sums;
+};
+
+//------------------------------------------------------------------------
+// NGramArrays - n-grams of a model in the layout of the binary format
+//------------------------------------------------------------------------
+// Intermediate step when converting a DynamicModel to a MappedModel
+// or FrozenModel, or when loading a FrozenModel from a model file.
+struct NGramArrays
+{
+    int order{0};
+    int num_words{0};
+    int num_word_types{0};          // unigrams with count > 0
+
+    std::vector<uint32_t> word_offsets;  // num_words+1 into word_blob
+    std::string word_blob;               // zero-terminated utf-8 words
+    std::vector<double> Ds;              // abs. discounting parameters
+
+    // per level, level 0 is the root
+    std::vector<std::vector<uint32_t>> wids;          // levels 1..order
+    std::vector<std::vector<uint32_t>> counts;
+    std::vector<std::vector<uint32_t>> child_begins;  // levels 0..order-1
+    std::vector<std::vector<uint32_t>> N1prxs;
+    std::vector<std::vector<uint32_t>> child_sums;
+
+    // Collect the n-grams of model. Word ids are renumbered, control
+    // words first, then all words sorted, as the binary format expects.
+    LMError build(DynamicModelBase& model);
+
+    // Read the n-grams of an ARPA-like file with counts directly, with
+    // the same results as building from a DynamicModel loaded from it,
+    // in less time and a fraction of the memory.
+    LMError load_arpac(const char* filename);
+};
+
+//------------------------------------------------------------------------
+// MappedModel - read-only language model in a memory mapped file
+//------------------------------------------------------------------------
+// Loads in constant time, apart from the vocabulary's pointer array,
+// and shares its pages with all other processes mapping the same file.
+// Probabilities are the same as for the DynamicModel (or UnigramModel)
+// it was converted from.
+class MappedModel : public NGramModel
+{
+    public:
+        using Super = NGramModel;
+        static const Smoothing DEFAULT_SMOOTHING = ABS_DISC_I;
+
+        MappedModel()
+        {
+            m_smoothing = DEFAULT_SMOOTHING;
+        }
+
+        virtual ~MappedModel()
+        {
+            clear();
+        }
+
+        virtual void clear() override;
+
+        virtual bool is_model_valid() override
+        {
+            return m_data != NULL;
+        }
+
+        virtual Smoothing get_smoothing() {return m_smoothing;}
+        virtual void set_smoothing(Smoothing s)
+        {
+            if (s != m_smoothing)
+                invalidate_prediction_cache();
+            m_smoothing = s;
+        }
+
+        // Number of occurrences of the given n-gram, 0 if unknown.
+        int get_ngram_count(const wchar_t* const* ngram, int n);
+
+        // Write model in the binary format, the input for MappedModel.
+        // The size and hash of source_filename, the text model it was
+        // loaded from, are recorded for is_converted_from().
+        static LMError convert(DynamicModelBase& model, const char* filename,
+                               const char* source_filename=NULL);
+
+        // True if the loaded model was converted from source_filename
+        // with its current contents. Reads the whole text model, still
+        // a lot faster than loading it.
+        bool is_converted_from(const char* source_filename);
+
+        // throw exceptions, record errors
+        void load(const std::string& filename) {load(filename.c_str());}
+        void save(const std::string& filename) {save(filename.c_str());}
+        virtual void load(const char* filename) override;
+        virtual void save(const char* filename) override;
+
+        // don't throw exceptions, low level
+        virtual LMError do_load(const char* filename) override;
+        virtual LMError do_save(const char* filename) override
+        {
+            (void)filename;
+            return ERR_NOT_IMPL;   // read-only
+        }
+
+        virtual LMError get_load_error() override
+        {return m_load_error;}
+
+        virtual std::string get_load_error_msg() override
+        {return m_load_error_msg;}
+        virtual void set_load_error_msg(const std::string& msg) override
+        {m_load_error_msg = msg;}
+
+        virtual bool is_modified() override
+        {return false;}
+        virtual void set_modified(bool modified) override
+        {(void)modified;}
+
+    protected:
+        virtual void get_words_with_predictions(
+                                       const std::vector<WordId>& history,
+                                       std::vector<WordId>& wids) override;
+        virtual void filter_candidates(const std::vector<WordId>& in,
+                                             std::vector<WordId>& out) override;
+        virtual void get_probs(const std::vector<WordId>& history,
+                               const std::vector<WordId>& words,
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr) override;
+
+    private:
+        struct Level
+        {
+            uint32_t num_nodes;
+            const uint32_t* wids;
+            const uint32_t* counts;
+            const uint32_t* child_begin;
+            const uint32_t* N1prxs;
+            const uint32_t* child_sums;
+        };
+
+        template <class T>
+        const T* get_section(uint64_t offset, uint64_t num_items);
+
+        // Index of the node for the n-gram wids on level n, -1 if unknown.
+        int get_node(const WordId* wids, int n);
+
+        void get_probs_witten_bell_i(const std::vector<WordId>& history,
+                                     const std::vector<WordId>& words,
+                                     std::vector<double>& vp);
+        void get_probs_abs_disc_i(const std::vector<WordId>& history,
+                                  const std::vector<WordId>& words,
+                                  std::vector<double>& vp);
+        void get_probs_unigram(const std::vector<WordId>& words,
+                               std::vector<double>& vp);
+
+    private:
+        const uint8_t* m_data{NULL};  // start of the mapping
+        size_t m_size{0};
+        int m_num_word_types{0};
+        std::vector<Level> m_levels;
+        const double* m_Ds{NULL};     // discounting parameters, per level
+
+        Smoothing m_smoothing;
+
+        LMError m_load_error{ERR_NONE};
+        std::string m_load_error_msg;
+};
+
+}  // namespace
+
+#endif
@@ -21,40 +21,104 @@
 #include <cmath>
 
 #include "lm_merged.h"
+#include "lm_threadpool.h"
 
 using namespace std;
 using namespace lm;
 
+// Models with fewer words predict faster than threads wake up.
+static const int PARALLEL_MIN_WORDS = 10000;
+
 
 //------------------------------------------------------------------------
-// MergedModel - abstract container for one or more component language models
+// SharedVocabulary - one word id space for several language models
 //------------------------------------------------------------------------
 
-struct cmp_results_desc
+void SharedVocabulary::clear()
 {
-    bool operator() (const PredictResult& x,
-                     const PredictResult& y)
-    { return (y.p < x.p);}
-};
+    m_ids.clear();
+    m_words.clear();
+    m_components.clear();
+    m_slots.clear();
+    m_generation = Dictionary::new_generation();
+}
 
-struct cmp_results_word
+void SharedVocabulary::map_ids(LanguageModel* model, std::vector<WordId>& wids)
 {
-    bool operator() (const PredictResult& x,
-                     const PredictResult& y)
-    { return (x.word < y.word);}
-};
+    // forget the mapping when the model's word ids were reassigned
+    ComponentIds& component = m_components[model];
+    uint64_t generation = model->get_word_id_generation();
+    if (component.generation != generation)
+    {
+        component.generation = generation;
+        component.ids.clear();
+    }
+
+    for (auto& wid : wids)
+    {
+        if (wid >= component.ids.size())
+            component.ids.resize(wid + 1, WIDNONE);
+
+        WordId& id = component.ids[wid];
+        if (id == WIDNONE)
+        {
+            const char* word = model->get_predicted_word(wid);
+            id = add_word(word ? word : "");
+        }
+        wid = id;
+    }
+}
+
+WordId SharedVocabulary::add_word(const char* word)
+{
+    // Nodes of unordered_map don't move, the keys can serve as
+    // storage for the words.
+    auto it = m_ids.emplace(word, static_cast<WordId>(m_words.size()));
+    if (it.second)
+        m_words.push_back(it.first->first.c_str());
+    return it.first->second;
+}
+
+
+//------------------------------------------------------------------------
+// MergedModel - abstract container for one or more component language models
+//------------------------------------------------------------------------
 
 void MergedModel::predict(std::vector<PredictResult>& results,
                           const std::vector<const wchar_t*>& context,
                           int limit, PredictOptions options)
+{
+    vector<WordId> wids;
+    vector<double> probabilities;
+    predict_ids(wids, probabilities, context, limit, options);
+
+    // Only the final results are turned into strings.
+    results.clear();
+    results.reserve(wids.size());
+    for (int i=0; i<(int)wids.size(); i++)
+    {
+        const wchar_t* word = m_vocabulary->get_word_w(wids[i]);
+        if (word)
+        {
+            PredictResult result = {word, probabilities[i]};
+            results.push_back(result);
+        }
+    }
+}
+
+void MergedModel::predict_ids(std::vector<WordId>& wids,
+                              std::vector<double>& probabilities,
+                              const std::vector<const wchar_t*>& context,
+                              int limit, PredictOptions options)
 {
     int i;
 
     init_merge();
 
-    // merge prediction results of all component models
-    ResultsMap m;
-    for (i=0; i<(int)components.size(); i++)
+    // get prediction results of all component models
+    vector<vector<WordId>> component_wids(components.size());
+    vector<vector<double>> component_probs(components.size());
+    auto predict_component = [&](int index)
     {
         // Ask the derived class if a limit on the number of results
         // is allowed. Otherwise assume a limit would change the
@@ -68,58 +132,155 @@ void MergedModel::predict(std::vector<PredictResult>& results,
             opt |= NO_SORT;
 
         // get predictions from the component model
-        vector<PredictResult> rs;
-        components[i]->predict(rs, context,
-                           can_limit ? limit : -1, // limit number of results
-                           options);
-
-        merge(m, rs, i);
-    }
-
-    // copy the map to the results vector
-    results.resize(0);
-    results.reserve(m.size());
-    ResultsMap::iterator mit;
-    for (mit=m.begin(); mit != m.end(); mit++)
+        components[index]->predict_ids(component_wids[index],
+                                       component_probs[index],
+                                       context,
+                                       can_limit ? limit : -1, // limit number of results
+                                       static_cast<PredictOptions>(opt));
+    };
+
+    // Components mutate nothing but their own state while predicting,
+    // once lazily built indexes exist.
+    if (can_predict_in_parallel())
     {
-        PredictResult result = {mit->first, mit->second};
-        results.push_back(result);
+        prepare_predict(options);
+        ThreadPool::get_shared().run(components.size(), predict_component);
     }
+    else
+        for (i=0; i<(int)components.size(); i++)
+            predict_component(i);
+
+    // translate to the shared word id space
+    for (i=0; i<(int)components.size(); i++)
+        m_vocabulary->map_ids(components[i], component_wids[i]);
+
+    // merge prediction results by shared word id
+    ResultsMap m(*m_vocabulary);
+    for (i=0; i<(int)components.size(); i++)
+        merge(m, component_wids[i], component_probs[i], i);
+
+    const vector<WordId>& merged_wids = m.get_wids();
+    const vector<double>& merged_probs = m.get_values();
+    int num_results = m.size();
+
+    int result_size = num_results;
+    if (limit >= 0 && limit < num_results)
+        result_size = limit;
+
+    vector<int32_t> argsort(num_results);
+    for (i=0; i<num_results; i++)
+        argsort[i] = i;
 
     if (!(options & NO_SORT))
     {
-        // sort by descending probabilities
-        // Use stable sort to keep words of equal probabilities in a fixed
-        // order with little by little changing contexts.
-        cmp_results_desc cmp_results;
-        std::stable_sort(results.begin(), results.end(), cmp_results);
+        // Sort by descending probabilities, words of equal probabilities
+        // by word, to keep them in a fixed order with little by little
+        // changing contexts. With a limit, only the top results need
+        // to be in order.
+        SharedVocabulary& vocabulary = *m_vocabulary;
+        auto cmp = [&](int32_t a, int32_t b)
+        {
+            if (merged_probs[a] != merged_probs[b])
+                return merged_probs[b] < merged_probs[a];
+            return strcmp(vocabulary.get_word(merged_wids[a]),
+                          vocabulary.get_word(merged_wids[b])) < 0;
+        };
+        if (result_size < num_results)
+            std::partial_sort(argsort.begin(), argsort.begin() + result_size,
+                              argsort.end(), cmp);
+        else
+            std::sort(argsort.begin(), argsort.end(), cmp);
     }
 
-    int result_size = results.size();
-    if (limit >= 0 && limit < (int)results.size())
-        result_size = limit;
+    // limit results, can't really do this earlier
+    wids.resize(result_size);
+    probabilities.resize(result_size);
+    for (i=0; i<result_size; i++)
+    {
+        wids[i] = merged_wids[argsort[i]];
+        probabilities[i] = merged_probs[argsort[i]];
+    }
 
     // normalize the final probabilities as needed
     // Only works as expected with all words included, no filtering, no prefix
     if (options & NORMALIZE && needs_normalization())
-        normalize(results, result_size);
+    {
+        double psum = 0.0;
+        for (i=0; i<num_results; i++)
+            psum += merged_probs[argsort[i]];
+        normalize(probabilities, result_size, psum);
+    }
+}
 
-    // limit results, can't really do this earlier
-    if (result_size < (int)results.size())
-        results.resize(result_size);
+// Probability of the last word of ngram in a prediction over all words,
+// unsorted and without converting the results to strings.
+double MergedModel::get_probability(const wchar_t* const* ngram, int n)
+{
+    if (!n)
+        return 0.0;
+
+    vector<const wchar_t*> context(ngram, ngram+n-1);
+    context.push_back(L"");
+    vector<WordId> wids;
+    vector<double> probabilities;
+    predict_ids(wids, probabilities, context, -1,
+                NORMALIZE | INCLUDE_CONTROL_WORDS | NO_SORT);
+
+    // unknown words score as <unk>
+    WideToUtf8 word(ngram[n-1]);
+    for (const char* w : {word.c_str(), "<unk>"})
+    {
+        WordId wid = w ? m_vocabulary->find_word(w) : WIDNONE;
+        if (wid == WIDNONE)
+            continue;
+        for (int i=0; i<(int)wids.size(); i++)
+            if (wids[i] == wid)
+                return probabilities[i];
+    }
+    return 0.0;
 }
 
-void MergedModel::normalize(std::vector<PredictResult>& results, int result_size)
+void MergedModel::get_probabilities(std::vector<double>& probabilities,
+                                    const wchar_t* const* tokens,
+                                    int num_tokens, int order)
+{
+    probabilities.assign(num_tokens, 0.0);
+    for (int i=0; order>0 && i<num_tokens; i++)
+    {
+        int begin = std::max(0, i+1 - order);
+        probabilities[i] = get_probability(tokens+begin, i+1 - begin);
+    }
+}
+
+// Components may only predict concurrently if they are independent
+// models. Parallel predictions pay off only with at least two large ones.
+bool MergedModel::can_predict_in_parallel()
+{
+    if (!m_parallel)
+        return false;
+
+    int num_large = 0;
+    for (int i=0; i<(int)components.size(); i++)
+    {
+        LanguageModel* model = components[i];
+        if (dynamic_cast<MergedModel*>(model) ||
+            std::find(components.begin(), components.begin() + i, model) !=
+                components.begin() + i)
+            return false;
+
+        if (model->get_num_word_types() >= PARALLEL_MIN_WORDS)
+            num_large++;
+    }
+    return num_large >= 2;
+}
+
+void MergedModel::normalize(std::vector<double>& probabilities,
+                            int result_size, double psum)
 {
     // The normalization factors for overlay and log-linear interpolation
     // are hard to come by -> Normalize the final limited results instead.
-    double psum = 0.0;
-    vector<PredictResult>::iterator it;
-    for(it=results.begin(); it!=results.end(); it++)
-        psum += (*it).p;
-
-    for(it=results.begin(); it!=results.begin()+result_size; it++)
-        (*it).p *= 1.0/psum;
+    for (int i=0; i<result_size; i++)
+        probabilities[i] *= 1.0/psum;
 }
 
 //------------------------------------------------------------------------
@@ -131,19 +292,13 @@ void MergedModel::normalize(std::vector<PredictResult>& results, int result_size
 // the last probability found for a word wins.
 
 // merge vector of ngram probabilities
-void OverlayModel::merge(ResultsMap& dst, const std::vector<PredictResult>& values,
+void OverlayModel::merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                         const std::vector<double>& probabilities,
                          int model_index)
 {
     (void) model_index;
-    vector<PredictResult>::const_iterator it;
-    ResultsMap::iterator mit = dst.begin();
-    for (it=values.begin(); it != values.end(); it++)
-    {
-        const wstring& word = it->word;
-        double p = it->p;
-        mit = dst.insert(dst.begin(), pair<wstring, double>(word, 0.0));
-        mit->second = p;
-    }
+    for (size_t i=0; i<wids.size(); i++)
+        dst.insert(wids[i], 0.0) = probabilities[i];
 }
 
 
@@ -163,20 +318,14 @@ void LinintModel::init_merge()
 }
 
 // interpolate vector of ngrams
-void LinintModel::merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                              int model_index)
+void LinintModel::merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                        const std::vector<double>& probabilities,
+                        int model_index)
 {
     double weight = m_weights[model_index] / m_weight_sum;
 
-    vector<PredictResult>::const_iterator it;
-    ResultsMap::iterator mit;
-    for (it=values.begin(); it != values.end(); it++)
-    {
-        const wstring& word = it->word;
-        double p = it->p;
-        mit = dst.insert(dst.begin(), pair<wstring, double>(word, 0.0));
-        mit->second += weight * p;
-    }
+    for (size_t i=0; i<wids.size(); i++)
+        dst.insert(wids[i], 0.0) += weight * probabilities[i];
 }
 
 // interpolate probabilities of a single ngram
@@ -195,6 +344,25 @@ double LinintModel::get_probability(const wchar_t* const* ngram, int n)
     return p;
 }
 
+// interpolate the scores of the components for a whole text
+void LinintModel::get_probabilities(std::vector<double>& probabilities,
+                                    const wchar_t* const* tokens,
+                                    int num_tokens, int order)
+{
+    init_merge();
+
+    probabilities.assign(num_tokens, 0.0);
+    vector<double> component_probs;
+    for (int i=0; i<(int)components.size(); i++)
+    {
+        double weight = m_weights[i] / m_weight_sum;
+        components[i]->get_probabilities(component_probs, tokens,
+                                         num_tokens, order);
+        for (int j=0; j<num_tokens; j++)
+            probabilities[j] += weight * component_probs[j];
+    }
+}
+
 
 //------------------------------------------------------------------------
 // LoglinintModel - log-linear interpolation of language models
@@ -206,21 +374,14 @@ void LoglinintModel::init_merge()
 }
 
 // interpolate prediction results vector
-void LoglinintModel::merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                              int model_index)
+void LoglinintModel::merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                           const std::vector<double>& probabilities,
+                           int model_index)
 {
     double weight = m_weights[model_index];
 
-    vector<PredictResult>::const_iterator it;
-    ResultsMap::iterator mit;
-    for (it=values.begin(); it != values.end(); it++)
-    {
-        const wstring& word = it->word;
-        double p = it->p;
-
-        mit = dst.insert(dst.begin(), pair<wstring, double>(word, 1.0));
-        mit->second *= pow(p, weight);
-    }
+    for (size_t i=0; i<wids.size(); i++)
+        dst.insert(wids[i], 1.0) *= pow(probabilities[i], weight);
 }
 
 
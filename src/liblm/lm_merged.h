@@ -20,29 +20,136 @@
 #ifndef LM_MERGED_H
 #define LM_MERGED_H
 
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include "lm.h"
 
 namespace lm {
 
 //------------------------------------------------------------------------
-// MergedModel - abstract container for one or more component language models
+// SharedVocabulary - one word id space for several language models
 //------------------------------------------------------------------------
+// Interns the words of component models, so merged models can combine
+// predictions by word id instead of by string. The ids of a component
+// stay mapped until its word ids change, e.g. when it is reloaded.
+// Not thread-safe.
+class SharedVocabulary
+{
+    public:
+        SharedVocabulary()
+        {
+            clear();
+        }
+
+        void clear();
+
+        // Replace word ids returned by model->predict_ids() with
+        // shared ids, adding words that weren't seen before.
+        void map_ids(LanguageModel* model, std::vector<WordId>& wids);
 
-struct map_wstr_cmp
+        WordId add_word(const char* word);  // utf-8
+
+        // Shared id of word, WIDNONE if it wasn't seen yet.
+        WordId find_word(const char* word) const  // utf-8
+        {
+            auto it = m_ids.find(word);
+            return it != m_ids.end() ? it->second : WIDNONE;
+        }
+
+        const char* get_word(WordId wid) const
+        {
+            if (wid < (WordId)m_words.size())
+                return m_words[wid];
+            return NULL;
+        }
+        // The result lives in a per-thread buffer until the next call.
+        const wchar_t* get_word_w(WordId wid) const
+        {
+            const char* word = get_word(wid);
+            return word ? utf8_to_wide_tls(word) : NULL;
+        }
+
+        int get_num_words() const {return m_words.size();}
+
+        // Changes on clear(), see Dictionary::get_generation().
+        uint64_t get_generation() const {return m_generation;}
+
+        // Index into merged results by shared id, -1 for none,
+        // reused between predictions, see ResultsMap.
+        std::vector<int32_t>& get_slots()
+        {
+            m_slots.resize(m_words.size(), -1);
+            return m_slots;
+        }
+
+    private:
+        struct ComponentIds
+        {
+            uint64_t generation{0};
+            std::vector<WordId> ids;  // shared id by component id
+        };
+
+        std::unordered_map<std::string, WordId> m_ids;
+        std::vector<const char*> m_words;  // keys of m_ids by shared id
+        std::map<LanguageModel*, ComponentIds> m_components;
+        std::vector<int32_t> m_slots;
+        uint64_t m_generation;
+};
+
+//------------------------------------------------------------------------
+// ResultsMap - merged probabilities by shared word id
+//------------------------------------------------------------------------
+class ResultsMap
 {
-  bool operator() (const std::wstring& lhs, const std::wstring& rhs) const
-  { return lhs < rhs; }
+    public:
+        ResultsMap(SharedVocabulary& vocabulary) :
+            m_slots(vocabulary.get_slots())
+        {}
+
+        ~ResultsMap()
+        {
+            // leave the slots unused for the next prediction
+            for (auto wid : m_wids)
+                m_slots[wid] = -1;
+        }
+
+        // Value of wid, inserted with initial_value if wid is new.
+        double& insert(WordId wid, double initial_value)
+        {
+            int32_t& slot = m_slots[wid];
+            if (slot < 0)
+            {
+                slot = m_wids.size();
+                m_wids.push_back(wid);
+                m_values.push_back(initial_value);
+            }
+            return m_values[slot];
+        }
+
+        int size() const {return m_wids.size();}
+        const std::vector<WordId>& get_wids() const {return m_wids;}
+        const std::vector<double>& get_values() const {return m_values;}
+
+    private:
+        std::vector<int32_t>& m_slots;
+        std::vector<WordId> m_wids;
+        std::vector<double> m_values;
 };
-typedef std::map<std::wstring, double, map_wstr_cmp> ResultsMap;
-//#include <unordered_map>
-//typedef std::unordered_map<const wchar_t*, double> ResultsMap;
+
+//------------------------------------------------------------------------
+// MergedModel - abstract container for one or more component language models
+//------------------------------------------------------------------------
 
 class MergedModel : public LanguageModel
 {
     public:
         using Super = LanguageModel;
 
+        MergedModel() :
+            m_vocabulary(std::make_shared<SharedVocabulary>())
+        {}
+
         // language model overloads
         virtual bool is_model_valid() override
         {
@@ -63,6 +170,28 @@ class MergedModel : public LanguageModel
                              const std::vector<const wchar_t*>& context,
                              int limit=-1,
                              PredictOptions options = DEFAULT_OPTIONS) override;
+        virtual void predict_ids(std::vector<WordId>& wids,
+                                 std::vector<double>& probabilities,
+                                 const std::vector<const wchar_t*>& context,
+                                 int limit=-1,
+                                 PredictOptions options = DEFAULT_OPTIONS) override;
+
+        virtual const char* get_predicted_word(WordId wid) override
+        {
+            return m_vocabulary->get_word(wid);
+        }
+
+        // Overlay and log-linear interpolation are normalized over all
+        // words, only a full prediction of the history can tell.
+        virtual double get_probability(const wchar_t* const* ngram,
+                                       int n) override;
+        virtual void get_probabilities(std::vector<double>& probabilities,
+                                       const wchar_t* const* tokens,
+                                       int num_tokens, int order) override;
+        virtual uint64_t get_word_id_generation() override
+        {
+            return m_vocabulary->get_generation();
+        }
 
         virtual LMError get_load_error() override
         {
@@ -111,19 +240,41 @@ class MergedModel : public LanguageModel
         virtual void set_models(const std::vector<LanguageModel*>& models)
         { components = models;}
 
+        // Share the word id space with other merged models, e.g. to keep
+        // it between predictions of short-lived merged models.
+        void set_vocabulary(const std::shared_ptr<SharedVocabulary>& vocabulary)
+        { m_vocabulary = vocabulary;}
+
+        virtual void prepare_predict(PredictOptions options) override
+        {
+            for (auto model : components)
+                model->prepare_predict(options);
+        }
+
+        // Predict components concurrently in the shared ThreadPool.
+        // Results are the same as with serial predictions.
+        void set_parallel(bool parallel)
+        { m_parallel = parallel;}
+        bool get_parallel() {return m_parallel;}
+
     protected:
         // merged model interface
         virtual void init_merge() {}
         virtual bool can_limit_components() {return false;}
-        virtual void merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                                      int model_index) = 0;
+        virtual void merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                           const std::vector<double>& probabilities,
+                           int model_index) = 0;
         virtual bool needs_normalization() {return false;}
 
     private:
-        void normalize(std::vector<PredictResult>& results, int result_size);
+        bool can_predict_in_parallel();
+        void normalize(std::vector<double>& probabilities, int result_size,
+                       double psum);
 
     protected:
         std::vector<LanguageModel*> components;
+        std::shared_ptr<SharedVocabulary> m_vocabulary;
+        bool m_parallel{false};
 };
 
 //------------------------------------------------------------------------
@@ -133,8 +284,9 @@ class MergedModel : public LanguageModel
 class OverlayModel : public MergedModel
 {
     protected:
-        virtual void merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                                      int model_index);
+        virtual void merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                           const std::vector<double>& probabilities,
+                           int model_index);
 
         // overlay can safely use a limit on prediction results
         // for component models
@@ -154,9 +306,14 @@ class LinintModel : public MergedModel
         { m_weights = weights; }
 
         virtual void init_merge();
-        virtual void merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                                      int model_index);
-        virtual double get_probability(const wchar_t* const* ngram, int n);
+        virtual void merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                           const std::vector<double>& probabilities,
+                           int model_index);
+        virtual double get_probability(const wchar_t* const* ngram,
+                                       int n) override;
+        virtual void get_probabilities(std::vector<double>& probabilities,
+                                       const wchar_t* const* tokens,
+                                       int num_tokens, int order) override;
 
     protected:
         std::vector<double> m_weights;
@@ -175,8 +332,9 @@ class LoglinintModel : public MergedModel
         { this->m_weights = weights; }
 
         virtual void init_merge();
-        virtual void merge(ResultsMap& dst, const std::vector<PredictResult>& values,
-                                      int model_index);
+        virtual void merge(ResultsMap& dst, const std::vector<WordId>& wids,
+                           const std::vector<double>& probabilities,
+                           int model_index);
 
         // there appears to be no simply way to for direct normalized results
         // -> run normalization explicitly
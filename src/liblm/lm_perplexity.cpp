@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "lm_dynamic.h"
+#include "lm_frozen.h"
+#include "lm_tokenize.h"
+
+// Report entropy and perplexity of a language model on held-out text,
+// with exact and with quantized counts, to choose the bit widths for
+// FrozenModel::set_count_bits(). Quantization is a FrozenModel feature,
+// so all entropies are those of the frozen model with its smoothing.
+//
+// usage: lm_perplexity <model.lm> <text> [bits...]
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <model.lm> <text> [bits...]\n", argv[0]);
+        return 2;
+    }
+    const char* model_filename = argv[1];
+    const char* text_filename = argv[2];
+
+    std::vector<int> bit_widths = {0};   // 0: exact counts
+    for (int i=3; i<argc; i++)
+        bit_widths.push_back(atoi(argv[i]));
+
+    std::ifstream f(text_filename);
+    if (!f)
+    {
+        fprintf(stderr, "%s\n", lm::get_error_msg(lm::ERR_FILE, text_filename).c_str());
+        return 1;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+
+    std::vector<UString> utokens;
+    std::vector<Span> spans;
+    lm::tokenize_text(utokens, spans, UString(ss.str().c_str()));
+    std::vector<std::wstring> tokens;
+    lm::to_wstring(tokens, utokens);
+
+    // The text model is loaded once, then frozen for each bit width.
+    lm::DynamicModel model;
+    try
+    {
+        model.load(model_filename);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+    int order = model.get_order();
+
+    std::vector<const wchar_t*> token_ptrs;
+    for (const auto& token : tokens)
+        token_ptrs.push_back(token.c_str());
+
+    printf("%d tokens, order %d\n", static_cast<int>(tokens.size()), order);
+    printf("%6s %12s %10s %12s %8s\n",
+           "bits", "ngram bytes", "entropy", "perplexity", "change");
+
+    double base_perplexity = 0.0;
+    for (int bits : bit_widths)
+    {
+        lm::FrozenModel frozen;
+        frozen.set_count_bits(bits);
+        lm::LMError error = frozen.freeze(model);
+        if (error)
+        {
+            fprintf(stderr, "%s\n", lm::get_error_msg(error, model_filename).c_str());
+            return 1;
+        }
+
+        // Predict every word from its history, sentence
+        // begin markers only serve as history.
+        std::vector<double> probabilities;
+        frozen.get_probabilities(probabilities, token_ptrs.data(),
+                                 token_ptrs.size(), order);
+        double sum = 0.0;
+        int n = 0;
+        for (size_t i=0; i<tokens.size(); i++)
+        {
+            double p = probabilities[i];
+            if (tokens[i] != L"<s>" && p > 0.0)
+            {
+                sum += log2(p);
+                n++;
+            }
+        }
+        double entropy = n ? -sum / n : 0.0;
+        double perplexity = pow(2.0, entropy);
+        if (!base_perplexity)
+            base_perplexity = perplexity;
+
+        std::vector<long> sizes;
+        frozen.get_memory_sizes(sizes);
+
+        char label[16];
+        snprintf(label, sizeof(label), bits ? "%d" : "exact", bits);
+        printf("%6s %12ld %10.4f %12.3f %7.2f%%\n",
+               label, sizes.at(1), entropy, perplexity,
+               (perplexity / base_perplexity - 1.0) * 100.0);
+    }
+
+    return 0;
+}
@@ -456,6 +456,8 @@ bool check_error(const LMError err, const char* filename = NULL)
                     msg = "error encoding to UTF-8"; break;
                 case ERR_MD2WC:
                     msg = "error decoding to Unicode"; break;
+                case ERR_FORMAT:
+                    msg = "unknown format or version"; break;
                 default:
                     PyErr_SetString(PyExc_ValueError, "Unknown Error");
                     return true;
@@ -587,6 +589,33 @@ LanguageModel_get_probability(PyLanguageModel* self, PyObject* args)
     return result;
 }
 
+// get_probabilities(tokens, order) scores every token of a text
+static PyObject *
+LanguageModel_get_probabilities(PyLanguageModel* self, PyObject* args)
+{
+    int n;
+    int order;
+    PyObject *result = NULL;
+    PyObject *otokens = NULL;
+    wchar_t** tokens = NULL;
+
+    if (PyArg_ParseTuple(args, "Oi:get_probabilities", &otokens, &order))
+    {
+        tokens = pyseqence_to_strings(otokens, &n);
+        if (!tokens)
+            return NULL;
+
+        std::vector<double> probabilities;
+        (*self)->get_probabilities(probabilities, tokens, n, order);
+        result = PyList_New(probabilities.size());
+        for (int i=0; result && i<(int)probabilities.size(); i++)
+            PyList_SetItem(result, i, PyFloat_FromDouble(probabilities[i]));
+
+        free_strings(tokens, n);
+    }
+    return result;
+}
+
 static PyObject *
 LanguageModel_lookup_word(PyLanguageModel* self, PyObject* value)
 {
@@ -652,6 +681,9 @@ static PyMethodDef LanguageModel_methods[] = {
     {"get_probability", (PyCFunction)LanguageModel_get_probability, METH_VARARGS,
      ""
     },
+    {"get_probabilities", (PyCFunction)LanguageModel_get_probabilities, METH_VARARGS,
+     ""
+    },
     {"lookup_word", (PyCFunction)LanguageModel_lookup_word, METH_O,
      ""
     },
@@ -1498,6 +1530,12 @@ CachedDynamicModel_set_recency_halflife(PyCachedDynamicModel *self, PyObject *va
                          "The value must be greater than zero");
         return -1;
     }
+    if (static_cast<unsigned long>(halflife) >
+        CachedDynamicModel::MAX_RECENCY_HALFLIFE)
+    {
+        PyErr_SetString(PyExc_ValueError, "The value is too large");
+        return -1;
+    }
 
     (*self)->set_recency_halflife(halflife);
 
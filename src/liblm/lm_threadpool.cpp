@@ -0,0 +1,93 @@
+#include <algorithm>
+
+#include "lm_threadpool.h"
+
+namespace lm {
+
+// Parallel loops here have few iterations, e.g. one per component
+// model, more threads would only sit idle.
+static const int MAX_SHARED_THREADS = 7;
+
+ThreadPool::ThreadPool(int num_threads)
+{
+    for (int i=0; i<num_threads; i++)
+        m_threads.emplace_back([this]{run_worker();});
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+    }
+    m_work_cv.notify_all();
+
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+ThreadPool& ThreadPool::get_shared()
+{
+    static ThreadPool pool(std::min(
+        std::max(static_cast<int>(std::thread::hardware_concurrency()) - 1, 0),
+        MAX_SHARED_THREADS));
+    return pool;
+}
+
+void ThreadPool::run(int n, const std::function<void(int)>& func)
+{
+    if (n <= 1 ||
+        m_threads.empty() ||
+        !m_busy_mutex.try_lock())
+    {
+        for (int i=0; i<n; i++)
+            func(i);
+        return;
+    }
+    std::lock_guard<std::mutex> busy(m_busy_mutex, std::adopt_lock);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_func = &func;
+    m_num_tasks = n;
+    m_next_task = 0;
+    m_num_done = 0;
+    m_work_cv.notify_all();
+
+    run_tasks(lock);
+    m_done_cv.wait(lock, [this]{return m_num_done == m_num_tasks;});
+
+    m_func = NULL;
+    m_num_tasks = 0;
+    m_next_task = 0;
+}
+
+void ThreadPool::run_worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_work_cv.wait(lock, [this]
+            {return m_exit || m_next_task < m_num_tasks;});
+        if (m_exit)
+            break;
+        run_tasks(lock);
+    }
+}
+
+void ThreadPool::run_tasks(std::unique_lock<std::mutex>& lock)
+{
+    while (m_next_task < m_num_tasks)
+    {
+        int i = m_next_task++;
+        const std::function<void(int)>& func = *m_func;
+
+        lock.unlock();
+        func(i);
+        lock.lock();
+
+        if (++m_num_done == m_num_tasks)
+            m_done_cv.notify_all();
+    }
+}
+
+}  // namespace
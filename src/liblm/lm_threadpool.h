@@ -0,0 +1,56 @@
+#ifndef LM_THREADPOOL_H
+#define LM_THREADPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// ThreadPool - persistent worker threads for small parallel loops
+//------------------------------------------------------------------------
+class ThreadPool
+{
+    public:
+        // num_threads workers in addition to the calling thread
+        ThreadPool(int num_threads);
+        ~ThreadPool();
+
+        int get_num_threads() {return m_threads.size();}
+
+        // Call func(i) for all i in [0, n) and return when all calls are
+        // done. The calling thread takes part. Runs serially while the
+        // pool is busy, e.g. for nested calls from within func.
+        // func must not throw.
+        void run(int n, const std::function<void(int)>& func);
+
+        // Pool shared by the whole process, one worker per additional
+        // cpu core, created on first use.
+        static ThreadPool& get_shared();
+
+    private:
+        void run_worker();
+
+        // Call func for the remaining indices, with m_mutex locked.
+        void run_tasks(std::unique_lock<std::mutex>& lock);
+
+    private:
+        std::vector<std::thread> m_threads;
+        std::mutex m_busy_mutex;     // held by the current run()
+
+        std::mutex m_mutex;          // guards all members below
+        std::condition_variable m_work_cv;
+        std::condition_variable m_done_cv;
+        const std::function<void(int)>* m_func{NULL};
+        int m_num_tasks{0};
+        int m_next_task{0};
+        int m_num_done{0};
+        bool m_exit{false};
+};
+
+}  // namespace
+
+#endif
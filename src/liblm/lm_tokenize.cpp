@@ -1,196 +1,724 @@
-#include <memory>
-#include <sstream>
+#include <algorithm>
+#include <cstring>
 
-#define U_CHARSET_IS_UTF8 1
-#include <unicode/regex.h> // icu
-#include <unicode/schriter.h>
+#include <unicode/uchar.h> // icu
+#include <unicode/utf16.h>
+#include <unicode/utf8.h>
 
-#include "tools/string_helpers.h"
 #include "tools/ustringmain.h"
-#include "tools/ustringregex.h"
 
 #include "lm_tokenize.h"
 
 namespace lm {
 
-std::unique_ptr<UStringPattern> sentence_pattern{std::make_unique<UStringPattern>(
-    " .*?                                     "
-    "     (?:                                 "
-    "           (?:[.;:!?](?:(?=[\\s]) | \")) "   // punctuation
-    "         | (?:\\s*\\n\\s*)+(?=[\\n])     "   // multiples newlines
-    "         | <s>                           "   // sentence end mark
-    "     )                                   "
-    "   | .+$                                 ",   // last sentence fragment
-    UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL)};
+// The tokenizer scans the UTF-16 text of UStrings directly. It follows
+// the regular expressions it was once made of, quoted below, and keeps
+// their results, including the ICU definitions of \s, \w and \d.
+namespace {
 
+class CharClasses
+{
+    public:
+        enum
+        {
+            SPACE = 1,  // \s
+            WORD  = 2,  // \w
+            DIGIT = 4,  // \d
+        };
 
-void split_sentences(std::vector<UString>& sentences,
-                     std::vector<Span>& spans,
-                     const UString& text, bool disambiguate)
+        static const CharClasses& get()
+        {
+            static const CharClasses instance;
+            return instance;
+        }
+
+        uint8_t operator[](UChar32 c) const
+        {
+            if (c >= 0 && c < 0x10000)
+                return m_bmp[c];
+            return lookup(c);
+        }
+
+    private:
+        CharClasses()
+        {
+            for (UChar32 c=0; c<0x10000; c++)
+                m_bmp[c] = lookup(c);
+        }
+
+        static uint8_t lookup(UChar32 c)
+        {
+            uint8_t flags = 0;
+            if (u_hasBinaryProperty(c, UCHAR_WHITE_SPACE))
+                flags |= SPACE;
+            if (u_hasBinaryProperty(c, UCHAR_ALPHABETIC) ||
+                (U_GET_GC_MASK(c) & (U_GC_M_MASK | U_GC_ND_MASK | U_GC_PC_MASK)) ||
+                c == 0x200c || c == 0x200d)
+                flags |= WORD;
+            if (u_charType(c) == U_DECIMAL_DIGIT_NUMBER)
+                flags |= DIGIT;
+            return flags;
+        }
+
+    private:
+        uint8_t m_bmp[0x10000];
+};
+
+// Range [begin, end) of UTF-16 text, ^ and $ of the former regexes
+// match at its ends.
+class TextRange
 {
+    public:
+        TextRange(const UChar* s, int32_t begin, int32_t end) :
+            m_s(s),
+            m_begin(begin),
+            m_end(end),
+            m_classes(CharClasses::get())
+        {
+        }
 
-    static UStringPattern disambiguate_pattern {"[.;:!?]\"?$"};
+        int32_t begin() const {return m_begin;}
+        int32_t end() const {return m_end;}
 
-    // Remove carriage returns from Moby Dick.
-    // Don't change the text's length, keep it in sync with spans.
-    UString filtered = replace_all(text, "\r", " ");
+        TextRange slice(int32_t begin, int32_t end) const
+        {
+            return TextRange(m_s, begin, end);
+        }
 
-    // split into sentence fragments
-    UStringMatcher matcher(sentence_pattern.get(), filtered);
-    while (matcher.find())
-    {
-        // filter matches
-        auto sentence = matcher.group();
+        UChar operator[](int32_t i) const {return m_s[i];}
 
-        // not only newlines? remove fragments with only double newlines
-        if (true) //not re.match("^\s*\n+\s*$", sentence, re.UNICODE):
+        // Is the text at i equal to the ASCII string str?
+        bool equals_at(int32_t i, const char* str) const
         {
-            TextPos begin = matcher.begin();
-            TextPos end   = matcher.end();
+            for (; *str; str++, i++)
+                if (i >= m_end || m_s[i] != *str)
+                    return false;
+            return true;
+        }
 
-            // strip whitespace including newlines
-            auto l = sentence.size();
-            sentence = sentence.lstrip();
-            begin += l - sentence.size();
+        // Code point at i, U_SENTINEL at the end.
+        UChar32 at(int32_t i) const
+        {
+            if (i >= m_end)
+                return U_SENTINEL;
+            UChar32 c;
+            U16_NEXT(m_s, i, m_end, c);
+            return c;
+        }
 
-            l = sentence.size();
-            sentence = sentence.rstrip();
-            end -= l - sentence.size();
+        // Index of the code point after the one at i.
+        int32_t next(int32_t i) const
+        {
+            U16_FWD_1(m_s, i, m_end);
+            return i;
+        }
 
-            // remove <s>
-            sentence = replace_all(sentence, "<s>", "   ");
+        // Index after the code points at i with all of the given flags.
+        int32_t skip(int32_t i, uint8_t flags) const
+        {
+            while (i < m_end)
+            {
+                int32_t j = i;
+                UChar32 c;
+                U16_NEXT(m_s, j, m_end, c);
+                if ((m_classes[c] & flags) != flags)
+                    break;
+                i = j;
+            }
+            return i;
+        }
 
-            // remove newlines and double spaces - no, invalidates spans
-            //sentence = re.sub(u"\s+", u" ", sentence)
+        bool is(UChar32 c, uint8_t flags) const
+        {
+            return c != U_SENTINEL && (m_classes[c] & flags) == flags;
+        }
+        bool is_space(UChar32 c) const {return is(c, CharClasses::SPACE);}
+        bool is_word(UChar32 c) const {return is(c, CharClasses::WORD);}
+        bool is_digit(UChar32 c) const {return is(c, CharClasses::DIGIT);}
+
+        // (?:^|(?<=\s)), white space is never a surrogate pair
+        bool at_token_begin(int32_t i) const
+        {
+            return i == m_begin || is_space(m_s[i-1]);
+        }
 
-            // strip whitespace from the cuts, remove carriage returns
-            l = sentence.size();
-            sentence = sentence.rstrip();
-            end -= l - sentence.size();
-            l = sentence.size();
-            sentence = sentence.lstrip();
-            begin += l - sentence.size();
+        // (?=\s|$)
+        bool at_token_end(int32_t i) const
+        {
+            return i == m_end || is_space(at(i));
+        }
 
-            // add <s> sentence separators if the end of the sentence is
-            // ambiguous - required by the split_corpus tool where the
-            // result of split_sentences is saved to a text file and later
-            // fed back to split_sentences again.
-            if (disambiguate)
+    private:
+        const UChar* m_s;
+        int32_t m_begin;
+        int32_t m_end;
+        const CharClasses& m_classes;
+};
+
+bool is_sentence_punctuation(UChar c)
+{
+    return c == '.' || c == ';' || c == ':' || c == '!' || c == '?';
+}
+
+// Find the sentences of text, the former regex with DOTALL and VERBOSE:
+//   .*?
+//       (?:
+//             (?:[.;:!?](?:(?=[\s]) | "))    # punctuation
+//           | (?:\s*\n\s*)+(?=[\n])          # multiples newlines
+//           | <s>                            # sentence end mark
+//       )
+//     | .+$                                  # last sentence fragment
+// The fragments are stripped of white space and sentence end marks.
+void find_sentences(std::vector<Span>& spans, const TextRange& text)
+{
+    int32_t end = text.end();
+    for (int32_t pos = text.begin(); pos < end; )
+    {
+        int32_t fragment_end = end;
+        bool end_mark = false;
+        for (int32_t i = pos; i < end; )
+        {
+            UChar c = text[i];
+            if (is_sentence_punctuation(c))
+            {
+                if (text.is_space(text.at(i+1)))
+                {
+                    fragment_end = i + 1;
+                    break;
+                }
+                if (i+1 < end && text[i+1] == '"')
+                {
+                    fragment_end = i + 2;
+                    break;
+                }
+                i++;
+            }
+            else if (text.is_space(c))
             {
-                UStringMatcher dmatcher(&disambiguate_pattern, sentence);
-                if (dmatcher.find())
-                    sentence += " <s>";
+                // Up to the last of at least two newlines
+                // in this stretch of white space.
+                int32_t run_end = text.skip(i, CharClasses::SPACE);
+                int32_t last_newline = -1;
+                int num_newlines = 0;
+                for (int32_t j = i; j < run_end; j++)
+                    if (text[j] == '\n')
+                    {
+                        last_newline = j;
+                        num_newlines++;
+                    }
+                if (num_newlines >= 2)
+                {
+                    fragment_end = last_newline;
+                    break;
+                }
+                i = run_end;
             }
+            else if (c == '<' && text.equals_at(i, "<s>"))
+            {
+                fragment_end = i + 3;
+                end_mark = true;
+                break;
+            }
+            else
+                i++;
+        }
 
-            sentences.emplace_back(sentence);
-            spans.emplace_back(begin, end-begin);
-        }
-    }
-}
-
-static std::string get_text_pattern(const std::string& trailing_characters,
-                                    const std::string& standalone_operators)
-{  // \S*(\S)\2{3,}+\S*
-    std::string s = R"(
-    (                                     (?# <unk>)
-      (?:^|(?<=\s))
-        \S*(\S)\2{3,}+\S*              (?# char repeated more than 3 times)
-        | [-]{3}                          (?# dash repeated more than 2 times)
-      (?=\s|$)
-      | :[^\s:@]+?@                       (?# password in URL)
-    ) |
-    (                                     (?# <num>)
-      (?:[-+]?\d+(?:[.,]\d+)*)            (?# anything numeric looking)
-      | (?:[.,]\d+)
-    ) |
-    (                                     (?# word)
-      (?:[-]{0,2}                         (?# allow command line options)
-        [^\W\d]\w*(?:[-'´΄][\w]+)*        (?# word, not starting with a digit)
-        [{trailing_characters}'´΄]?)
-      | <unk> | <s> | </s> | <num>        (?# pass through control words)
-      | <bot:[a-z]*>                      (?# pass through begin of text merkers)
-      | (?:^|(?<=\s))
-          (?:
-            \| {standalone_operators}     (?# common space delimited operators)
-          )
-        (?=\s|$)
-    )
-    )";
-
-    s = replace_all(s, "{trailing_characters}", trailing_characters);
-    s = replace_all(s, "{standalone_operators}", standalone_operators);
-
-    return s;
+        // White space is never a surrogate pair.
+        int32_t begin = pos;
+        int32_t sentence_end = fragment_end;
+        while (begin < sentence_end && u_isspace(text[begin]))
+            begin++;
+        while (sentence_end > begin && u_isspace(text[sentence_end-1]))
+            sentence_end--;
+        if (end_mark)
+        {
+            sentence_end -= 3;
+            while (sentence_end > begin && u_isspace(text[sentence_end-1]))
+                sentence_end--;
+        }
+        spans.emplace_back(begin, sentence_end - begin);
+
+        pos = fragment_end;
+    }
 }
 
-void tokenize_sentence(std::vector<UString>& tokens,
-                       std::vector<Span>& spans,
-                       const UString& sentence, bool is_context)
+enum TokenType
 {
-    // Don't learn "-" or "--" as standalone tokens...
-    static UStringPattern text_pattern {
-        get_text_pattern("", "").c_str(),
-        UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
+    TOKEN_NONE,
+    TOKEN_UNK,
+    TOKEN_NUM,
+    TOKEN_WORD,
+};
+
+// <unk>
+//   (?:^|(?<=\s))
+//     \S*(\S)\2{3,}+\S*                # char repeated more than 3 times
+//   | [-]{3}(?=\s|$)                   # dash repeated more than 2 times
+//   | :[^\s:@]+?@                      # password in URL
+int32_t match_unknown(const TextRange& text, int32_t i)
+{
+    if (text.at_token_begin(i))
+    {
+        int32_t run = 0;
+        UChar32 prev = U_SENTINEL;
+        int32_t j = i;
+        bool repeated = false;
+        while (j < text.end())
+        {
+            UChar32 c = text.at(j);
+            if (text.is_space(c))
+                break;
+            run = c == prev ? run + 1 : 1;
+            if (run > 3)
+                repeated = true;
+            prev = c;
+            j = text.next(j);
+        }
+        if (repeated)
+            return j;
+    }
 
-    // ...but recognize them in a prediction context as start
-    // of a cmd line option.
-    static UStringPattern context_pattern {
-        get_text_pattern("-", "| [-]{1,2}").c_str(),
-        UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
+    if (text.equals_at(i, "---") &&
+        text.at_token_end(i+3))
+        return i + 3;
 
-    UStringPattern* pattern = is_context ? &context_pattern : &text_pattern;
-    UStringMatcher matcher(pattern, sentence);
-    while (matcher.find())
+    if (text[i] == ':')
     {
-        TextPos begin = matcher.begin();
-        TextPos end   = matcher.end();
-        if (auto group = matcher.group(4);
-            !group.empty())
+        int32_t j = i + 1;
+        while (j < text.end())
         {
-            tokens.emplace_back(group);
-            spans.emplace_back(begin, end-begin);
+            UChar32 c = text.at(j);
+            if (c == ':' || c == '@' || text.is_space(c))
+                break;
+            j = text.next(j);
         }
-        else if (group = matcher.group(3);
-                 !group.empty())
+        if (j > i + 1 && j < text.end() && text[j] == '@')
+            return j + 1;
+    }
+
+    return -1;
+}
+
+// <num>
+//   (?:[-+]?\d+(?:[.,]\d+)*)           # anything numeric looking
+//   | (?:[.,]\d+)
+int32_t match_number(const TextRange& text, int32_t i)
+{
+    int32_t j = i;
+    if (text[j] == '-' || text[j] == '+')
+        j++;
+    if (text.is_digit(text.at(j)))
+    {
+        j = text.skip(j, CharClasses::DIGIT);
+        while (j < text.end() &&
+               (text[j] == '.' || text[j] == ',') &&
+               text.is_digit(text.at(j+1)))
+            j = text.skip(j+1, CharClasses::DIGIT);
+        return j;
+    }
+
+    if ((text[i] == '.' || text[i] == ',') &&
+        text.is_digit(text.at(i+1)))
+        return text.skip(i+1, CharClasses::DIGIT);
+
+    return -1;
+}
+
+bool is_word_separator(UChar32 c)
+{
+    return c == '-' || c == '\'' || c == 0xb4 || c == 0x384;  // -'´΄
+}
+
+// word
+//   (?:[-]{0,2}                        # allow command line options
+//     [^\W\d]\w*(?:[-'´΄][\w]+)*       # word, not starting with a digit
+//     [{trailing_characters}'´΄]?)
+//   | <unk> | <s> | </s> | <num>       # pass through control words
+//   | <bot:[a-z]*>                     # pass through begin of text markers
+//   | (?:^|(?<=\s))
+//       (?:
+//         \| {standalone_operators}    # common space delimited operators
+//       )
+//     (?=\s|$)
+// Trailing characters are "-" and the standalone operators
+// "| [-]{1,2}" in a prediction context, else none.
+int32_t match_word(const TextRange& text, int32_t i, bool is_context)
+{
+    int32_t j = i;
+    if (text[j] == '-')
+    {
+        j++;
+        if (j < text.end() && text[j] == '-')
+            j++;
+    }
+    UChar32 c = text.at(j);
+    if (text.is_word(c) && !text.is_digit(c))
+    {
+        j = text.skip(text.next(j), CharClasses::WORD);
+        while (j < text.end() &&
+               is_word_separator(text.at(j)) &&
+               text.is_word(text.at(j+1)))
+            j = text.skip(j+1, CharClasses::WORD);
+
+        c = text.at(j);
+        if (is_word_separator(c) && (c != '-' || is_context))
+            j++;
+        return j;
+    }
+
+    for (auto word : {"<unk>", "<s>", "</s>", "<num>"})
+        if (text.equals_at(i, word))
+            return i + static_cast<int32_t>(strlen(word));
+
+    if (text.equals_at(i, "<bot:"))
+    {
+        j = i + 5;
+        while (j < text.end() && text[j] >= 'a' && text[j] <= 'z')
+            j++;
+        if (j < text.end() && text[j] == '>')
+            return j + 1;
+    }
+
+    if (text.at_token_begin(i))
+    {
+        j = -1;
+        if (text[i] == '|')
+            j = i + 1;
+        else if (is_context && text[i] == '-')
+            j = i+1 < text.end() && text[i+1] == '-' ? i + 2 : i + 1;
+        if (j >= 0 && text.at_token_end(j))
+            return j;
+    }
+
+    return -1;
+}
+
+// Type and end of the token at i.
+TokenType match_token(const TextRange& text, int32_t i,
+                      bool is_context, int32_t& end)
+{
+    if ((end = match_unknown(text, i)) >= 0)
+        return TOKEN_UNK;
+    if ((end = match_number(text, i)) >= 0)
+        return TOKEN_NUM;
+    if ((end = match_word(text, i, is_context)) >= 0)
+        return TOKEN_WORD;
+    return TOKEN_NONE;
+}
+
+// Tokenize the range text of s.
+void tokenize_range(std::vector<UString>& tokens,
+                    std::vector<Span>& spans,
+                    const UString& s, const TextRange& text,
+                    bool is_context)
+{
+    for (int32_t i = text.begin(); i < text.end(); )
+    {
+        int32_t end;
+        TokenType type = match_token(text, i, is_context, end);
+        if (type == TOKEN_NONE)
         {
+            i = text.next(i);
+            continue;
+        }
+
+        if (type == TOKEN_WORD)
+            tokens.emplace_back(s.slice_code_units(i, end));
+        else if (type == TOKEN_NUM)
             tokens.emplace_back("<num>");
-            spans.emplace_back(begin, end-begin);
+        else
+            tokens.emplace_back("<unk>");
+        spans.emplace_back(i, end - i);
+
+        i = end;
+    }
+}
+
+// Tokens never contain white space and sentence ends depend only on
+// the text around them. Tokenizing text from a word start on gives the
+// same tokens there as tokenizing all of it. Characters u_isspace()
+// strips off sentences don't start words, nor do sentence end marks,
+// both would change where sentences around them begin or end.
+bool is_word_start(const TextRange& text, int32_t i)
+{
+    return i == text.begin() ||
+           (text.is_space(text[i-1]) &&
+            !u_isspace(text[i]) &&
+            !text.equals_at(i, "<s>"));
+}
+
+// Last word start before i, the begin of text if there is none.
+int32_t find_word_start(const TextRange& text, int32_t i)
+{
+    for (i--; i > text.begin(); i--)
+        if (is_word_start(text, i))
+            break;
+    return std::max(i, text.begin());
+}
+
+// Does a sentence begin at the word start i? It does if a sentence
+// ends in the characters before i that u_isspace() strips off, or right
+// before them, as found by find_sentences().
+bool starts_sentence(const TextRange& text, int32_t i)
+{
+    int32_t j = i;
+    while (j > text.begin() && u_isspace(text[j-1]))
+        j--;
+
+    if (j > text.begin())
+    {
+        UChar c = text[j-1];
+        if (is_sentence_punctuation(c) && text.is_space(text[j]))
+            return true;
+        if (c == '"' && j - 2 >= text.begin() &&
+            is_sentence_punctuation(text[j-2]))
+            return true;
+        if (c == '>' && j - 3 >= text.begin() &&
+            text.equals_at(j-3, "<s>"))
+            return true;
+    }
+
+    // multiple newlines in a stretch of white space
+    int num_newlines = 0;
+    for (; j < i; j++)
+    {
+        if (!text.is_space(text[j]))
+            num_newlines = 0;
+        else if (text[j] == '\n' && ++num_newlines >= 2)
+            return true;
+    }
+    return false;
+}
+
+// Tokenize text of s from the word start begin to the word start or
+// text end end, with the results tokenize_text() gets there for all
+// of text.
+void tokenize_segment(std::vector<UString>& tokens,
+                      std::vector<Span>& spans,
+                      const UString& s, const TextRange& text,
+                      int32_t begin, int32_t end, bool is_context)
+{
+    if (begin == end)
+        return;
+
+    if (begin > text.begin() && starts_sentence(text, begin))
+    {
+        tokens.emplace_back("<s>");
+        spans.emplace_back(begin, 0);
+    }
+
+    std::vector<Span> sentence_spans;
+    find_sentences(sentence_spans, text.slice(begin, end));
+    for (size_t i=0; i<sentence_spans.size(); i++)
+    {
+        const Span& span = sentence_spans[i];
+        bool is_last = i == sentence_spans.size() - 1;
+        bool is_cut = end < text.end();
+
+        if (i > 0)
+        {
+            // A sentence starting at end belongs to the next segment.
+            if (is_cut && is_last && span.begin == end)
+                break;
+
+            tokens.emplace_back("<s>");
+            spans.emplace_back(span.begin, 0);
         }
-        else if (group = matcher.group(1);
-                 !group.empty())
+
+        // The last sentence continues after end, don't strip it.
+        int32_t sentence_end = is_cut && is_last ? end : span.end();
+        tokenize_range(tokens, spans, s,
+                       text.slice(span.begin, sentence_end),
+                       is_context);
+    }
+}
+
+// Tokenize the text of s before the word start end backwards, word by
+// word, until there are at least num_tokens tokens, and append the last
+// num_tokens of them. Returns true if those are all tokens before end.
+bool tokenize_backwards(std::vector<UString>& tokens,
+                        std::vector<Span>& spans,
+                        const UString& s, const TextRange& text,
+                        int32_t end, size_t num_tokens)
+{
+    std::vector<UString> reversed_tokens;
+    std::vector<Span> reversed_spans;
+    std::vector<UString> segment_tokens;
+    std::vector<Span> segment_spans;
+    while (end > text.begin() &&
+           reversed_tokens.size() < num_tokens)
+    {
+        int32_t begin = find_word_start(text, end);
+        segment_tokens.clear();
+        segment_spans.clear();
+        tokenize_segment(segment_tokens, segment_spans, s, text,
+                         begin, end, true);
+        for (size_t i = segment_tokens.size(); i-- > 0; )
         {
-            tokens.emplace_back("<unk>");
-            spans.emplace_back(begin, end-begin);
+            reversed_tokens.emplace_back(std::move(segment_tokens[i]));
+            reversed_spans.emplace_back(segment_spans[i]);
+        }
+        end = begin;
+    }
+
+    size_t n = std::min(reversed_tokens.size(), num_tokens);
+    for (size_t i = n; i-- > 0; )
+    {
+        tokens.emplace_back(std::move(reversed_tokens[i]));
+        spans.emplace_back(reversed_spans[i]);
+    }
+    return end == text.begin() && n == reversed_tokens.size();
+}
+
+// Does the context end with a complete word, or does it need an empty
+// completion prefix? Complete are texts that end with
+//     ^$                             # empty string?
+//   | .*[-'´΄\w]$                    # word at the end?
+//   | (?:^|.*\s)[|]=?$               # recognized operator?
+//   | .*(\S)\\1{3,}$                 # anything repeated > 3 times?
+// The doubled backslash of the last alternative made it match
+// "\111" at the end, a word already, not repetitions.
+bool is_context_complete(const TextRange& text)
+{
+    if (text.end() == text.begin())
+        return true;
+
+    int32_t last = text.end() - 1;
+    if (U16_IS_TRAIL(text[last]) && last > text.begin() &&
+        U16_IS_LEAD(text[last-1]))
+        last--;
+    UChar32 c = text.at(last);
+    int32_t bar = c == '=' ? last - 1 : last;
+    return is_word_separator(c) ||
+           text.is_word(c) ||
+           (bar >= text.begin() && text[bar] == '|' &&
+            text.at_token_begin(bar));
+}
+
+}
+
+void split_sentences(std::vector<UString>& sentences,
+                     std::vector<Span>& spans,
+                     const UString& text, bool disambiguate)
+{
+    const icu::UnicodeString& us = text.to_us();
+    TextRange range(us.getBuffer(), 0, us.length());
+
+    size_t first = spans.size();
+    find_sentences(spans, range);
+
+    for (size_t i = first; i < spans.size(); i++)
+    {
+        const Span& span = spans[i];
+
+        // Remove carriage returns from Moby Dick.
+        // Don't change the text's length, keep it in sync with spans.
+        UString sentence = replace_all(
+            text.slice_code_units(span.begin, span.end()), "\r", " ");
+
+        // add <s> sentence separators if the end of the sentence is
+        // ambiguous - required by the split_corpus tool where the
+        // result of split_sentences is saved to a text file and later
+        // fed back to split_sentences again.
+        if (disambiguate && span.length)
+        {
+            TextPos end = span.end();
+            if (range[end-1] == '"' && end-1 > span.begin)
+                end--;
+            if (is_sentence_punctuation(range[end-1]))
+                sentence += " <s>";
         }
+
+        sentences.emplace_back(sentence);
     }
 }
 
+void tokenize_sentence(std::vector<UString>& tokens,
+                       std::vector<Span>& spans,
+                       const UString& sentence, bool is_context)
+{
+    const icu::UnicodeString& us = sentence.to_us();
+    TextRange range(us.getBuffer(), 0, us.length());
+    tokenize_range(tokens, spans, sentence, range, is_context);
+}
+
 void tokenize_text(std::vector<UString>& tokens,
                    std::vector<Span>& spans,
                    const UString& text, bool is_context)
 {
-    std::vector<UString> sentences;
+    const icu::UnicodeString& us = text.to_us();
+    const UChar* s = us.getBuffer();
+
     std::vector<Span> sentence_spans;
-    split_sentences(sentences, sentence_spans, text);
-    for (size_t i=0; i<sentences.size(); i++)
+    find_sentences(sentence_spans, TextRange(s, 0, us.length()));
+    for (size_t i=0; i<sentence_spans.size(); i++)
     {
-        const auto& sentence = sentences[i];
-        std::vector<UString> ts;
-        std::vector<Span> ss;
-        tokenize_sentence(ts, ss, sentence, is_context);
-
-        TextPos sbegin = sentence_spans[i].begin;
-        for (auto& span : ss)
-            span.begin += sbegin;
+        const Span& span = sentence_spans[i];
 
         // sentence begin?
         if (i > 0)
         {
             tokens.emplace_back("<s>");      // prepend sentence begin marker
-            spans.emplace_back(sbegin, 0); // empty span
+            spans.emplace_back(span.begin, 0); // empty span
         }
-        tokens.insert(tokens.end(), ts.begin(), ts.end());
-        spans.insert(spans.end(), ss.begin(), ss.end());
+
+        // Spans stay relative to text, tokenizing the sentence
+        // in place spares copying it.
+        tokenize_range(tokens, spans, text,
+                       TextRange(s, span.begin, span.end()),
+                       is_context);
+    }
+}
+
+size_t find_sentence_begin(std::string_view text)
+{
+    icu::UnicodeString us = icu::UnicodeString::fromUTF8(
+                      icu::StringPiece(text.data(), text.size()));
+    TextRange range(us.getBuffer(), 0, us.length());
+
+    // is_word_start() looks ahead for sentence end marks, which
+    // may be cut off in the last two code units.
+    int32_t i;
+    for (i = us.length() - 3; i > 0; i--)
+        if (is_word_start(range, i) && starts_sentence(range, i))
+            break;
+    if (i <= 0)
+        return 0;
+
+    // Back to UTF-8, with the decoding of fromUTF8(), where
+    // each ill-formed sequence became one U+FFFD.
+    int32_t offset = 0;
+    for (int32_t j = 0; j < i; )
+    {
+        UChar32 c;
+        U8_NEXT(text.data(), offset, static_cast<int32_t>(text.size()), c);
+        j += c < 0 ? 1 : U16_LENGTH(c);
+    }
+    return offset;
+}
+
+void tokenize_text_part(std::vector<UString>& tokens,
+                        std::vector<Span>& spans,
+                        const UString& text, bool cut_begin, bool cut_end)
+{
+    // The sentence beginning at the cut is marked in the part after it,
+    // like tokenize_segment() does.
+    if (cut_begin)
+    {
+        tokens.emplace_back("<s>");
+        spans.emplace_back(0, 0);
+    }
+
+    tokenize_text(tokens, spans, text);
+
+    // The white space before the cut ends in an empty sentence
+    // that belongs to the next part.
+    int32_t end = text.to_us().length();
+    if (cut_end && !tokens.empty() && tokens.back() == "<s>" &&
+        spans.back().begin == end)
+    {
+        tokens.pop_back();
+        spans.pop_back();
     }
 }
 
@@ -198,18 +726,10 @@ void tokenize_context(std::vector<UString>& tokens,
                       std::vector<Span>& spans,
                       const UString& text)
 {
-    static UStringPattern pattern{R"(
-                  ^$                             # empty string?
-                | .*[-'´΄\w]$                    # word at the end?
-                | (?:^|.*\s)[|]=?$               # recognized operator?
-                | .*(\S)\\1{3,}$                 # anything repeated > 3 times?
-            )",
-            UStringRegexFlag::VERBOSE | UStringRegexFlag::DOTALL};
-
     tokenize_text(tokens, spans, text, true);
 
-    // filter matches
-    if (!pattern.matches(text))
+    const icu::UnicodeString& us = text.to_us();
+    if (!is_context_complete(TextRange(us.getBuffer(), 0, us.length())))
     {
         tokens.emplace_back();
         TextPos tend = static_cast<TextPos>(text.size());
@@ -217,6 +737,92 @@ void tokenize_context(std::vector<UString>& tokens,
     }
 }
 
+void tokenize_context_tail(std::vector<UString>& tokens,
+                           std::vector<Span>& spans,
+                           const UString& text, size_t num_tokens)
+{
+    ContextTokenizer tokenizer;
+    tokenizer.tokenize(tokens, spans, text, num_tokens);
+}
+
+void ContextTokenizer::tokenize(std::vector<UString>& tokens,
+                                std::vector<Span>& spans,
+                                const UString& text, size_t num_tokens)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    const icu::UnicodeString& us = text.to_us();
+    TextRange range(us.getBuffer(), 0, us.length());
+
+    bool complete = is_context_complete(range);
+    if (!complete && num_tokens)
+        num_tokens--;   // room for the completion prefix
+
+    // The tokens before the last word are those of the previous call
+    // if the text up to and including the first character of its last
+    // word is unchanged, plus the ones of the words typed since.
+    int32_t word_begin = find_word_start(range, range.end());
+    int32_t n = m_word_begin > 0 ? m_word_begin + 1 : 0;
+    bool valid = m_word_begin >= 0 &&
+                 m_word_begin <= word_begin &&
+                 us.compare(0, n, m_text, 0, n) == 0;
+    if (valid)
+    {
+        tokenize_segment(m_tokens, m_spans, text, range,
+                         m_word_begin, word_begin, true);
+        valid = m_tokens.size() >= num_tokens || m_all_tokens;
+    }
+    if (valid)
+    {
+        m_num_chars += us.countChar32(m_word_begin, word_begin - m_word_begin);
+        if (m_tokens.size() > num_tokens)
+        {
+            size_t excess = m_tokens.size() - num_tokens;
+            m_tokens.erase(m_tokens.begin(), m_tokens.begin() + excess);
+            m_spans.erase(m_spans.begin(), m_spans.begin() + excess);
+            m_all_tokens = false;
+        }
+    }
+    else
+    {
+        m_tokens.clear();
+        m_spans.clear();
+        m_all_tokens = tokenize_backwards(m_tokens, m_spans, text, range,
+                                          word_begin, num_tokens);
+        m_num_chars = us.countChar32(0, word_begin);
+    }
+    m_text = us;
+    m_word_begin = word_begin;
+
+    // Tokenize the last word and take the tokens needed.
+    std::vector<UString> word_tokens;
+    std::vector<Span> word_spans;
+    tokenize_segment(word_tokens, word_spans, text, range,
+                     word_begin, range.end(), true);
+
+    size_t num_word_tokens = std::min(word_tokens.size(), num_tokens);
+    size_t num_cached = std::min(m_tokens.size(),
+                                 num_tokens - num_word_tokens);
+    tokens.insert(tokens.end(), m_tokens.end() - num_cached, m_tokens.end());
+    spans.insert(spans.end(), m_spans.end() - num_cached, m_spans.end());
+    for (size_t i = word_tokens.size() - num_word_tokens;
+         i < word_tokens.size(); i++)
+    {
+        tokens.emplace_back(std::move(word_tokens[i]));
+        spans.emplace_back(word_spans[i]);
+    }
+
+    // Like tokenize_context(), the span of the completion prefix
+    // begins at the number of code points, not code units, of text.
+    if (!complete)
+    {
+        tokens.emplace_back();
+        TextPos tend = static_cast<TextPos>(m_num_chars +
+            us.countChar32(word_begin, range.end() - word_begin));
+        spans.emplace_back(tend, 0);  // empty span
+    }
+}
+
 void extract_ngrams(NGrams& ngrams,
                     const std::vector<std::string>& tokens, OrderType order)
 {
@@ -2,7 +2,9 @@
 #define LM_TOKENIZE_H
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cassert>
 
@@ -11,13 +13,10 @@
 #include "lm.h"
 
 class UString;
-class UStringPattern;
 
 namespace lm {
 
-extern std::unique_ptr<UStringPattern> sentence_pattern;
-
-    // Split text into sentences.
+// Split text into sentences.
 void split_sentences(std::vector<UString>& sentences,
                      std::vector<Span>& spans,
                      const UString& text, bool disambiguate=false);
@@ -45,12 +44,55 @@ void tokenize_text(std::vector<UString>& tokens,
                    std::vector<Span>& spans,
                    const UString& text, bool is_context = false);
 
+// Byte offset of the last word start in the UTF-8 text at which
+// tokenize_text() begins a sentence, 0 if there is none. Only the text
+// up to a word start decides that, text may be cut off anywhere.
+size_t find_sentence_begin(std::string_view text);
+
+// Tokenize a part of a longer text, cut at sentence begins found by
+// find_sentence_begin(). cut_begin tells if text starts at such a cut,
+// cut_end if it ends at one. The tokens of all parts, one after the
+// other, are the tokens tokenize_text() gets for the whole text.
+void tokenize_text_part(std::vector<UString>& tokens,
+                        std::vector<Span>& spans,
+                        const UString& text, bool cut_begin, bool cut_end);
+
 // Split text into word tokens + completion prefix.
 // The result is ready for use in predict().
 void tokenize_context(std::vector<UString>& tokens,
                       std::vector<Span>& spans,
                       const UString& text);
 
+// The last num_tokens tokens of tokenize_context(), the completion
+// prefix always included. Prediction looks only at the last few words
+// of the context; the text is tokenized backwards from its end, word by
+// word, until enough tokens are found, at a cost independent of its
+// length.
+void tokenize_context_tail(std::vector<UString>& tokens,
+                           std::vector<Span>& spans,
+                           const UString& text, size_t num_tokens);
+
+// Tokenize contexts like tokenize_context_tail(), keeping the tokens
+// before the last word for the next call. While the text before the
+// word at the caret stays unchanged, only that word is tokenized again
+// on each keystroke. Thread-safe.
+class ContextTokenizer
+{
+    public:
+        void tokenize(std::vector<UString>& tokens,
+                      std::vector<Span>& spans,
+                      const UString& text, size_t num_tokens);
+
+    private:
+        std::mutex m_mutex;
+        icu::UnicodeString m_text;      // text of the previous call
+        int32_t m_word_begin{-1};       // begin of its last word
+        int32_t m_num_chars{0};         // code points before m_word_begin
+        std::vector<UString> m_tokens;  // last tokens before m_word_begin
+        std::vector<Span> m_spans;
+        bool m_all_tokens{false};       // m_tokens reach back to the begin
+};
+
 // similar to python slicing, but only positive indices here.
 template<class TInString, class TOutString>
 void slice_tokens(std::vector<TOutString>& results,
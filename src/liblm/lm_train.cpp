@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <memory>
+
+#include "lm_corpus.h"
+#include "lm_dynamic.h"
+
+// Train a language model on a UTF-8 text corpus with all cpu cores
+// and optionally prune n-grams with low counts, the system models
+// in models/ are made this way.
+//
+// usage: lm_train <corpus.txt> <model.lm> <order> [threads [prune_count...]]
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <corpus.txt> <model.lm> <order> "
+                        "[threads [prune_count...]]\n", argv[0]);
+        return 2;
+    }
+    const char* src = argv[1];
+    const char* dst = argv[2];
+    int order = atoi(argv[3]);
+    int num_threads = argc > 4 ? atoi(argv[4]) : 0;
+
+    std::vector<int> prune_counts;
+    for (int i=5; i<argc; i++)
+        prune_counts.push_back(atoi(argv[i]));
+
+    if (order < 1)
+    {
+        fprintf(stderr, "%s\n", lm::get_error_msg(lm::ERR_ORDER_UNSUPPORTED,
+                                                  dst).c_str());
+        return 1;
+    }
+
+    std::unique_ptr<lm::DynamicModelBase> model =
+        std::make_unique<lm::DynamicModel>();
+    model->set_order(order);
+
+    auto start = std::chrono::steady_clock::now();
+
+    lm::CorpusTrainer trainer(*model, num_threads);
+    lm::LMError error = trainer.train_file(src);
+    if (error)
+    {
+        fprintf(stderr, "%s\n", lm::get_error_msg(error, src).c_str());
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start).count();
+    printf("%d shards, %llu tokens, %.1f MB/s\n",
+           trainer.get_num_shards(),
+           static_cast<unsigned long long>(trainer.get_num_tokens()),
+           trainer.get_num_bytes() / 1e6 / seconds);
+
+    if (!prune_counts.empty())
+        model = model->prune(prune_counts);
+
+    try
+    {
+        model->save(dst);
+    }
+    catch (const lm::Exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -35,14 +35,16 @@ namespace lm {
 // Output: vector of probabilities, one value per candidate word
 void UnigramModel::get_probs(const std::vector<WordId>& history,
                              const std::vector<WordId>& words,
-                             std::vector<double>& probabilities)
+                             std::vector<double>& probabilities,
+                             NodeValueCache* cache)
 {
     (void)history;
 
     std::vector<double>& vp = probabilities;
     int size = words.size();   // number of candidate words
     int num_word_types = get_num_word_types(); 
-    int cs = accumulate(m_counts.begin(), m_counts.end(), 0); // total number of occurencess
+    int cs = get_node_value(cache, this, NodeValueCache::CHILD_COUNTS,
+                [&] {return accumulate(m_counts.begin(), m_counts.end(), 0);}); // total number of occurencess
     if (cs)
     {
         vp.resize(size);
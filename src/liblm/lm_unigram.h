@@ -160,6 +160,8 @@ class UnigramModel : public DynamicModelBase
             if (n != 1)
                 return NULL;
 
+            invalidate_prediction_cache();
+
             WordId wid = wids[0];
             if (m_counts.size() <= wid)
                 m_counts.push_back(0);
@@ -193,6 +195,13 @@ class UnigramModel : public DynamicModelBase
             values.push_back(node->m_count);
         }
 
+        // no discounting, unigrams are plain relative frequencies
+        virtual const std::vector<double>& get_discounts() const override
+        {
+            static const std::vector<double> Ds;
+            return Ds;
+        }
+
         virtual bool is_model_valid() override
         {
             int num_unigrams = get_num_ngrams(0);
@@ -215,7 +224,8 @@ class UnigramModel : public DynamicModelBase
         }
         virtual void get_probs(const std::vector<WordId>& history,
                                const std::vector<WordId>& words,
-                               std::vector<double>& probabilities);
+                               std::vector<double>& probabilities,
+                               NodeValueCache* cache = nullptr);
 
         virtual int get_num_ngrams(int level)
         {
@@ -233,7 +243,7 @@ class UnigramModel : public DynamicModelBase
 
     protected:
         std::vector<CountType> m_counts;
-        BaseNode m_node;  // dummy node to satisfy the count_ngram interface
+        WordNode m_node;  // dummy node to satisfy the count_ngram interface
 };
 
 }  // namespace
@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lm_utf8.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace lm {
+
+static_assert(sizeof(wchar_t) == 4, "wchar_t must hold UTF-32");
+
+// Widen the ASCII prefix of s, 16 bytes at a time, return its length
+// in whole blocks. The scalar loop takes care of the rest.
+static size_t decode_ascii(wchar_t* out, const char* s, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i+16<=len; i+=16)
+    {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s+i));
+        if (_mm_movemask_epi8(b))
+            break;
+        __m128i lo = _mm_unpacklo_epi8(b, zero);
+        __m128i hi = _mm_unpackhi_epi8(b, zero);
+        __m128i* p = reinterpret_cast<__m128i*>(out+i);
+        _mm_storeu_si128(p,   _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(p+1, _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(p+2, _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(p+3, _mm_unpackhi_epi16(hi, zero));
+    }
+#else
+    (void)out;
+    (void)s;
+    (void)len;
+#endif
+    return i;
+}
+
+// Narrow the ASCII prefix of s, 16 wide chars at a time.
+static size_t encode_ascii(char* out, const wchar_t* s, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i non_ascii = _mm_set1_epi32(~0x7f);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i+16<=len; i+=16)
+    {
+        const __m128i* p = reinterpret_cast<const __m128i*>(s+i);
+        __m128i a = _mm_loadu_si128(p);
+        __m128i b = _mm_loadu_si128(p+1);
+        __m128i c = _mm_loadu_si128(p+2);
+        __m128i d = _mm_loadu_si128(p+3);
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, non_ascii),
+                                              zero)) != 0xffff)
+            break;
+        __m128i ab = _mm_packs_epi32(a, b);
+        __m128i cd = _mm_packs_epi32(c, d);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out+i),
+                         _mm_packus_epi16(ab, cd));
+    }
+#else
+    (void)out;
+    (void)s;
+    (void)len;
+#endif
+    return i;
+}
+
+ptrdiff_t decode_utf8(wchar_t* out, const char* s, size_t len)
+{
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+    size_t i = decode_ascii(out, s, len);
+    wchar_t* o = out + i;
+    while (i < len)
+    {
+        uint32_t c = u[i];
+        if (c < 0x80)
+        {
+            *o++ = c;
+            i++;
+            continue;
+        }
+
+        int n;            // continuation bytes
+        uint32_t min;     // smallest code point, no overlong forms
+        if (c >= 0xc2 && c <= 0xdf)
+        {
+            n = 1;
+            min = 0x80;
+            c &= 0x1f;
+        }
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            n = 2;
+            min = 0x800;
+            c &= 0x0f;
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            n = 3;
+            min = 0x10000;
+            c &= 0x07;
+        }
+        else
+            return -1;
+
+        if (i + n >= len)   // incomplete at the end?
+        {
+            for (size_t j = i+1; j < len; j++)
+                if ((u[j] & 0xc0) != 0x80)
+                    return -1;
+            break;
+        }
+        for (int j=1; j<=n; j++)
+        {
+            uint32_t b = u[i+j];
+            if ((b & 0xc0) != 0x80)
+                return -1;
+            c = (c << 6) | (b & 0x3f);
+        }
+        if (c < min || c > 0x10ffff ||
+            (c >= 0xd800 && c < 0xe000))
+            return -1;
+
+        *o++ = c;
+        i += n + 1;
+    }
+    *o = 0;
+    return o - out;
+}
+
+ptrdiff_t encode_utf8(char* out, const wchar_t* s, size_t len)
+{
+    size_t i = encode_ascii(out, s, len);
+    char* o = out + i;
+    for (; i < len; i++)
+    {
+        uint32_t c = s[i];
+        if (c < 0x80)
+            *o++ = c;
+        else if (c < 0x800)
+        {
+            *o++ = 0xc0 | (c >> 6);
+            *o++ = 0x80 | (c & 0x3f);
+        }
+        else if (c < 0x10000)
+        {
+            if (c >= 0xd800 && c < 0xe000)
+                return -1;
+            *o++ = 0xe0 | (c >> 12);
+            *o++ = 0x80 | ((c >> 6) & 0x3f);
+            *o++ = 0x80 | (c & 0x3f);
+        }
+        else if (c <= 0x10ffff)
+        {
+            *o++ = 0xf0 | (c >> 18);
+            *o++ = 0x80 | ((c >> 12) & 0x3f);
+            *o++ = 0x80 | ((c >> 6) & 0x3f);
+            *o++ = 0x80 | (c & 0x3f);
+        }
+        else
+            return -1;
+    }
+    *o = 0;
+    return o - out;
+}
+
+const wchar_t* utf8_to_wide_tls(const char* s)
+{
+    static thread_local wchar_t buffer[1024];
+    size_t len = strlen(s);
+    if (len >= 1024 || decode_utf8(buffer, s, len) < 0)
+        return nullptr;
+    return buffer;
+}
+
+bool utf8_to_wide(std::wstring& out, const char* s)
+{
+    size_t len = strlen(s);
+    out.resize(len + 1);
+    ptrdiff_t n = decode_utf8(&out[0], s, len);
+    out.resize(n >= 0 ? n : 0);
+    return n >= 0;
+}
+
+bool wide_to_utf8(std::string& out, const wchar_t* s)
+{
+    size_t len = wcslen(s);
+    out.resize(4 * len + 1);
+    ptrdiff_t n = encode_utf8(&out[0], s, len);
+    out.resize(n >= 0 ? n : 0);
+    return n >= 0;
+}
+
+}  // namespace
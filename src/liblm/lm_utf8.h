@@ -0,0 +1,82 @@
+#ifndef LM_UTF8_H
+#define LM_UTF8_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+#include <memory>
+#include <string>
+
+namespace lm {
+
+//------------------------------------------------------------------------
+// UTF-8 <-> UTF-32 conversion
+//------------------------------------------------------------------------
+// Converts between the UTF-8 words of dictionaries and wchar_t strings,
+// UTF-32 on all supported platforms. Reentrant, without iconv
+// descriptors or buffers shared between threads. Runs of ASCII are
+// converted 16 characters at a time with SSE2.
+
+// Decode len bytes of UTF-8 from s into out, which needs room for
+// len+1 wide chars. Returns the length of the zero terminated result,
+// -1 for invalid UTF-8. An incomplete sequence at the end is dropped,
+// as iconv did.
+ptrdiff_t decode_utf8(wchar_t* out, const char* s, size_t len);
+
+// Encode len wide chars from s into out, which needs room for
+// 4*len+1 bytes. Returns the length of the zero terminated result,
+// -1 for surrogates and values beyond U+10FFFF.
+ptrdiff_t encode_utf8(char* out, const wchar_t* s, size_t len);
+
+// Convert into strings reused by the caller, allocating only when
+// they grow. Return false for invalid input and leave out empty.
+bool utf8_to_wide(std::wstring& out, const char* s);
+bool wide_to_utf8(std::string& out, const wchar_t* s);
+
+// Decode s into a buffer of the calling thread, valid until the next
+// call in that thread. Returns nullptr for invalid UTF-8 and for
+// strings of 1024 bytes and more.
+const wchar_t* utf8_to_wide_tls(const char* s);
+
+// Converted string, short ones, like most words, stored inline.
+template <class TIn, class TOut, size_t N>
+class ConvertedString
+{
+    public:
+        explicit ConvertedString(const TIn* s)
+        {
+            size_t len = std::char_traits<TIn>::length(s);
+            size_t size = MAX_PER_CHAR * len + 1;
+            TOut* out = m_buf;
+            if (size > N)
+            {
+                m_heap.reset(new TOut[size]);
+                out = m_heap.get();
+            }
+            if (convert(out, s, len) >= 0)
+                m_str = out;
+        }
+
+        // nullptr if s was invalid
+        const TOut* c_str() const {return m_str;}
+
+    private:
+        static const size_t MAX_PER_CHAR = sizeof(TIn) < sizeof(TOut) ? 1 : 4;
+
+        static ptrdiff_t convert(wchar_t* out, const char* s, size_t len)
+        {return decode_utf8(out, s, len);}
+        static ptrdiff_t convert(char* out, const wchar_t* s, size_t len)
+        {return encode_utf8(out, s, len);}
+
+    private:
+        TOut m_buf[N];
+        std::unique_ptr<TOut[]> m_heap;
+        const TOut* m_str{nullptr};
+};
+
+using Utf8ToWide = ConvertedString<char, wchar_t, 64>;
+using WideToUtf8 = ConvertedString<wchar_t, char, 256>;
+
+}  // namespace
+
+#endif
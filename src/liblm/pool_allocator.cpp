@@ -21,9 +21,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <cstring>
-#include <set>
-#include <map>
-#include <algorithm>
+#include <mutex>
+#include <new>
 
 #include "lm_heapalloc.h"
 #include "pool_allocator.h"
@@ -39,22 +38,88 @@ using namespace std;
 
 namespace lm {
 
-#pragma pack(2)
-class Slab
-{
-};
+// Every block handed out by the PoolAllocator lives inside a
+// SLAB_SIZE-aligned memory block with a SlabCtl header at its start.
+// Masking any item pointer with ~(SLAB_SIZE-1) yields that header,
+// which knows the owning ItemPool. No search is needed to free items.
+// Must be a power of two.
+static const size_t SLAB_SIZE = 16384;
 
 class SlabCtl
 {
     public:
+        class ItemPool* item_pool;  // NULL for large heap blocks
+        void* free_list;
+        SlabCtl* prev;              // intrusive partial/full slab list
+        SlabCtl* next;
+        uint32_t num_used;
         #ifdef LMSAFETYCHECKS
         size_t item_size;
-        class ItemPool* item_pool;
+        uint64_t tag;               // bound to the address, see get_slab_tag()
         #endif
-        void* free_list;
-        uint32_t num_used;
 };
-#pragma pack()
+
+// items start right after the header, keeping 16 byte alignment
+static const size_t SLAB_HEADER_SIZE = (sizeof(SlabCtl) + 15) & ~size_t(15);
+
+static inline SlabCtl* get_slab_ctl(void* p)
+{
+    return (SlabCtl*)(((uintptr_t)p) & ~(uintptr_t)(SLAB_SIZE-1));
+}
+
+static inline uint8_t* get_slab_items(SlabCtl* slab)
+{
+    return ((uint8_t*)slab) + SLAB_HEADER_SIZE;
+}
+
+#ifdef LMSAFETYCHECKS
+// Tag of live slab headers, checked by assertions on free. Stray
+// pointers and double frees are unlikely to find it.
+static const uint64_t SLAB_MAGIC = 0x4c4d534c41424331ULL;
+
+static inline uint64_t get_slab_tag(SlabCtl* slab)
+{
+    return SLAB_MAGIC ^ (uint64_t)(uintptr_t)slab;
+}
+#endif
+
+
+// doubly linked list of slabs, links are stored in the slabs themselves
+class SlabList
+{
+    public:
+        SlabList()
+        {
+            head = NULL;
+        }
+
+        bool empty()
+        {
+            return head == NULL;
+        }
+
+        void push_front(SlabCtl* slab)
+        {
+            slab->prev = NULL;
+            slab->next = head;
+            if (head)
+                head->prev = slab;
+            head = slab;
+        }
+
+        void remove(SlabCtl* slab)
+        {
+            if (slab->prev)
+                slab->prev->next = slab->next;
+            else
+                head = slab->next;
+            if (slab->next)
+                slab->next->prev = slab->prev;
+            slab->prev = slab->next = NULL;
+        }
+
+        SlabCtl* head;
+};
 
 
 // pool of items of a single size
@@ -65,128 +130,89 @@ class ItemPool
         ItemPool()
         {
             item_size = 0;
-            slab_size = 0;
             items_per_slab = 0;
         }
 
-        ItemPool(size_t size, size_t _slab_size)
+        ItemPool(size_t size)
         {
             item_size = size;
-            slab_size = _slab_size;
-            items_per_slab = (slab_size - sizeof(SlabCtl)) / item_size;
+            items_per_slab = (SLAB_SIZE - SLAB_HEADER_SIZE) / item_size;
         }
 
-        void* alloc_item(map<Slab*, ItemPool*>& slabmap)
+        void* alloc_item()
         {
-            Slab* slab = NULL;
-            if (partial.empty())   // no partial slabs there?
+            SlabCtl* slab = partial.head;
+            if (!slab)   // no partial slabs there?
             {
                 // allocate a new slab
                 slab = new_slab();
                 if (!slab)
                     return NULL;
-                partial.insert(slab);
-                slabmap[slab] = this;
-            }
-            else
-            {
-                slab = *partial.begin();
+                partial.push_front(slab);
             }
 
             // allocate item in slab
             void* p = alloc_slab_item(slab);  // always succeeds
 
             // slab full?
-            if (!*get_free_list(slab))
+            if (!slab->free_list)
             {
                 // move slab from partial to full list
-                partial.erase(slab);
-                full.insert(slab);
-                //printf("slab full: slab=%p item_size=%zu items=%zu\n", slab, item_size, items_per_slab);
+                partial.remove(slab);
+                full.push_front(slab);
             }
 
             return p;
         }
 
-        void free_item(void* p, map<Slab*, ItemPool*>& slabmap)
+        void free_item(SlabCtl* slab, void* p)
         {
-            Slab* slab = NULL;
-            set<Slab*>::iterator it;
-
-            // try full slabs first
-            if(!full.empty())
-            {
-                it = full.upper_bound((Slab*)p);
-                if (it != full.begin())
-                {
-                    it--; // upper_bound: previous slab contains the address
-                    if ((((uint8_t*)*it) + slab_size) >= p)
-                        slab = *it;
-                }
-            }
-
-            // then partial slabs
-            if(!slab && !partial.empty())
-            {
-                it = partial.upper_bound((Slab*)p);
-                if (it != partial.begin())
-                {
-                    it--; // upper_bound: previous slab contains the address
-                    if ((((uint8_t*)*it) + slab_size) >= p)
-                        slab = *it;
-                }
-            }
-
-            if(!slab)
-            {
-                printf("PoolAllocator: no slab found for item size %zd while freeing %p\n", item_size, p);
-                assert(false);
-                return;
-            }
-
             // slab full?
-            SlabCtl* ctl = get_slab_ctl(slab);
-            if (!ctl->free_list)
+            if (!slab->free_list)
             {
                 // move slab from full to partial list
-                full.erase(slab);
-                partial.insert(slab);
-                #ifdef LMDEBUG
-                //printf("full slab becomes partially full: slab=%p item_size=%zu items=%zu\n", slab, item_size, items_per_slab);
-                #endif
+                full.remove(slab);
+                partial.push_front(slab);
             }
 
             // free item
             if (free_slab_item(slab, p) == 0)
             {
-                // all items freed -> delete slab
-                #ifdef LMDEBUG
-                printf("freeing slab %p item_size=%zu items=%zu\n",
-                       reinterpret_cast<void*>(slab), item_size, items_per_slab);
-                #endif
-                partial.erase(slab);
-                slabmap.erase(slab);
-                HeapFree(slab);
+                // All items freed -> delete slab, unless it is the last
+                // partial one. Keeping it avoids allocating and freeing
+                // slabs over and over when a single item comes and goes.
+                if (slab->prev || slab->next)
+                {
+                    #ifdef LMDEBUG
+                    printf("freeing slab %p item_size=%zu items=%zu\n",
+                           reinterpret_cast<void*>(slab), item_size, items_per_slab);
+                    #endif
+                    partial.remove(slab);
+                    #ifdef LMSAFETYCHECKS
+                    slab->tag = 0;
+                    #endif
+                    HeapFreeAligned(slab);
+                }
             }
         }
 
-        Slab* new_slab()
+        SlabCtl* new_slab()
         {
             // item_size must be large enough for an item pointer
             // -> minimum item size = 8 byte on amd_64
             assert(item_size >= sizeof(void*));
 
-            // Slabs are allocated from the heap
-            Slab* slab = (Slab*) HeapAlloc(slab_size);
+            // Slabs are allocated from the heap, aligned to their size
+            SlabCtl* slab = (SlabCtl*) HeapAllocAligned(SLAB_SIZE, SLAB_SIZE);
             if (!slab)
                 return NULL;
 
-            // SlabCtl is a small structure at the very end of each slab
-            SlabCtl* ctl = get_slab_ctl(slab);
-            ctl->num_used = 0;
+            slab->item_pool = this;
+            slab->prev = slab->next = NULL;
+            slab->num_used = 0;
             #ifdef LMSAFETYCHECKS
-            ctl->item_size = item_size;
-            ctl->item_pool = this;
+            slab->item_size = item_size;
+            slab->tag = get_slab_tag(slab);
             #endif
 
             // Initialize the free list
@@ -194,10 +220,11 @@ class ItemPool
             // a linked list of free items. The nodes of the
             // list are single pointers at the very beginning
             // each item.
-            void** p = &ctl->free_list; // start of free list
+            uint8_t* items = get_slab_items(slab);
+            void** p = &slab->free_list; // start of free list
             for (size_t i=0; i<items_per_slab; i++)
             {
-                *p = ((uint8_t*)slab) + item_size*i;
+                *p = items + item_size*i;
                 p = (void**)*p;
             }
             *p = NULL;  // end of the free list
@@ -205,30 +232,31 @@ class ItemPool
             return slab;
         }
 
-        void* alloc_slab_item(Slab* slab)
+        void* alloc_slab_item(SlabCtl* slab)
         {
-            SlabCtl* ctl = get_slab_ctl(slab);
-            void** plist = &ctl->free_list;
+            void** plist = &slab->free_list;
             void* p = *plist;
             *plist = *(void**)p;
-            ctl->num_used++;
+            slab->num_used++;
             return p;
         }
 
-        size_t free_slab_item(Slab* slab, void* item)
+        size_t free_slab_item(SlabCtl* slab, void* item)
         {
-            // must be from the address range of the slab
-            assert((uint8_t*)slab <= item &&
-                    item < ((uint8_t*)slab) + slab_size - sizeof(SlabCtl));
+            uint8_t* items = get_slab_items(slab);
+
+            // must be from the item range of the slab
+            assert(items <= item &&
+                   item < items + items_per_slab * item_size);
 
             // must be start of an item
-            assert(size_t((uint8_t*)item - (uint8_t*)slab)/item_size*item_size ==
-                   size_t((uint8_t*)item - (uint8_t*)slab));
+            assert(size_t((uint8_t*)item - items)/item_size*item_size ==
+                   size_t((uint8_t*)item - items));
 
             // must be the right type of slab
             #ifdef LMSAFETYCHECKS
-            assert(get_slab_ctl(slab)->item_size == item_size);
-            assert(get_slab_ctl(slab)->item_pool == this);
+            assert(slab->item_size == item_size);
+            assert(slab->item_pool == this);
             #endif
 
             #ifdef LMDEBUG
@@ -237,46 +265,25 @@ class ItemPool
             memset(item, 0x55, item_size);
             #endif
 
-            SlabCtl* ctl = get_slab_ctl(slab);
-            void** plist = &ctl->free_list;
+            void** plist = &slab->free_list;
             *(void**)item = *plist;
             *plist = item;  // insert item into the free list
-            ctl->num_used--;
-            return ctl->num_used;
-        }
-
-        // is address of p part of this slab?
-        bool is_in_slab(Slab* slab, void* p)
-        {
-            return (uint8_t*)slab <= p &&
-                    p < ((uint8_t*)slab) + slab_size - sizeof(SlabCtl);
-        }
-
-        // SlabCtl is a small structure at the very end of each slab
-        SlabCtl* get_slab_ctl(Slab* slab)
-        {
-            return (SlabCtl*)(((uint8_t*)slab) + slab_size - sizeof(SlabCtl));
-        }
-
-        // get start of free list
-        void** get_free_list(Slab* slab)
-        {
-            //return (void**)(((uint8_t*)slab) + slab_size - sizeof(uint32_t*));
-            return &get_slab_ctl(slab)->free_list;
+            slab->num_used--;
+            return slab->num_used;
         }
 
     private:
         friend class PoolAllocator;
         size_t item_size;
         size_t items_per_slab;
-        size_t slab_size;
-        set<Slab*> partial;
-        set<Slab*> full;
+        SlabList partial;
+        SlabList full;
 };
 
 // Manages multiple fixed size pools for arbitrary allocation sizes.
 // Uses ItemPools for smallish items and falls back to heap
-// allocation for larger ones.
+// allocation for larger ones. Thread-safe, models may be built
+// in a worker thread while others are learned into.
 class PoolAllocator
 {
     public:
@@ -307,6 +314,8 @@ class PoolAllocator
             size_t bin = size;          // items of any size allowed
             if (bin < ALEN(pools))
             {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
                 // Minimum allocation size is the size of a pointer.
                 // (ItemPool uses pointers to store the free list)
                 // Wasteful for the smallest items, but still
@@ -318,48 +327,62 @@ class PoolAllocator
                 ItemPool*& pool = pools[bin];
                 if (!pool)
                 {
-                    size_t page = 4096;    // assumed vm page size
-                    size_t n = size * 10;  // at least 10 items per slab
-                    size_t slab_size = ((n + page-1) / page * page);
                     pool = (ItemPool*)HeapAlloc(sizeof(ItemPool));
-                    pool = new(pool) ItemPool(size, slab_size);
+                    pool = new(pool) ItemPool(size);
                 }
-                return pool->alloc_item(slabmap);
+                return pool->alloc_item();
             }
             else
             {
-                // allocate large items from the heap
+                // Allocate large items from the heap. They get a slab
+                // header too, so that free() can tell them apart
+                // from pool items.
                 //printf("HeapAlloc size=%zd\n", size);
-                return HeapAlloc(size);
+                SlabCtl* slab = (SlabCtl*)HeapAllocAligned(SLAB_SIZE,
+                                                   SLAB_HEADER_SIZE + size);
+                if (!slab)
+                    return NULL;
+                slab->item_pool = NULL;
+                #ifdef LMSAFETYCHECKS
+                slab->item_size = size;
+                slab->tag = get_slab_tag(slab);
+                #endif
+                return get_slab_items(slab);
             }
         }
 
+        // p must come from alloc(), its masked header is trusted.
         void free(void* p)
         {
-            // try to find a slab containing the address p
-            if(!slabmap.empty())
+            if (!p)
+                return;
+
+            // find the slab containing the address p
+            SlabCtl* slab = get_slab_ctl(p);
+            #ifdef LMSAFETYCHECKS
+            assert(slab->tag == get_slab_tag(slab));
+            #endif
+
+            ItemPool* pool = slab->item_pool;
+            if (pool)
             {
-                map<Slab*, ItemPool*>::iterator it;
-                it = slabmap.upper_bound((Slab*)p);
-                if (it != slabmap.begin())
-                {
-                    it--; // upper_bound: previous slab contains the address
-                    ItemPool* pool = it->second;
-                    if (pool->is_in_slab(it->first, p))
-                    {
-                        pool->free_item(p, slabmap);
-                        return;
-                    }
-                }
+                std::lock_guard<std::mutex> lock(m_mutex);
+                pool->free_item(slab, p);
+            }
+            else
+            {
+                // large block, delegate to heap free()
+                #ifdef LMSAFETYCHECKS
+                assert(p == get_slab_items(slab));
+                slab->tag = 0;    // catch double frees
+                #endif
+                HeapFreeAligned(slab);
             }
-
-            // hope it's a large block and delegate to heap free()
-            HeapFree(p);
         }
 
     private:
-        ItemPool* pools[4096];  // max number of bins
-        map<Slab*, ItemPool*> slabmap;  // find slab from pointer
+        ItemPool* pools[SLAB_SIZE/8];  // max number of bins, >= 7 items per slab
+        std::mutex m_mutex;            // guards the pools
 };
 
 #ifdef USE_POOL_ALLOCATOR
@@ -822,8 +822,13 @@ void WordSuggestions::update_prediction_choices()
     auto key_logic = get_key_logic();
     auto text_context = get_text_context();
 
-    auto& choices = m_prediction_choices;
-    choices.clear();
+    // Choices of an earlier request have arrived.
+    if (m_received_prediction_choices)
+    {
+        m_prediction_choices = std::move(*m_received_prediction_choices);
+        m_received_prediction_choices.reset();
+        return;
+    }
 
     if (m_wpengine)
     {
@@ -856,42 +861,78 @@ void WordSuggestions::update_prediction_choices()
             if (ignore_non_caps)
                 options |= lm::PredictOptions::IGNORE_NON_CAPITALIZED;
 
-            std::vector<UString> choices_;
-            m_wpengine->predict(choices_,
-                bot_context,
-                static_cast<size_t>(
-                    config()->word_suggestions->max_word_choices * 8),
-                options);
-
-            for (const auto& choice : choices_)
+            // Keep showing the current choices, let the key press redraw
+            // right away and update the word lists once predictions arrive.
+            auto on_predictions = [this, capitalize, drop_capitalized]
+                                  (std::vector<UString>& choices_,
+                                   const std::vector<bool>& lower_case_exists)
             {
-                // Filter out begin-of-text-markers that sneak in as
-                // high frequency unigrams.
-                if (choice.startswith("<bot:"))
-                    continue;
-
-                // Drop upper caps spelling in favor of a lower caps one.
-                // Auto-capitalization may later elect to upper caps on insertion.
-                if (drop_capitalized)
+                m_received_prediction_choices =
+                    filter_prediction_choices(choices_, lower_case_exists,
+                                              capitalize, drop_capitalized);
+                if (!m_requesting_predictions)
                 {
-                    UString choice_lower = choice.lower();
-                    if (choice != choice_lower &&
-                        m_wpengine->word_exists(choice_lower))
-                        continue;
+                    auto keyboard = get_keyboard();
+                    keyboard->invalidate_context_ui();
+                    keyboard->commit_ui_updates();
                 }
+            };
 
-                choices.emplace_back(choice);
-            }
+            m_requesting_predictions = true;
+            m_wpengine->predict_async(bot_context,
+                static_cast<size_t>(
+                    config()->word_suggestions->max_word_choices * 8),
+                options, on_predictions);
+            m_requesting_predictions = false;
 
-            // Make all words start upper case
-            if (capitalize)
-                choices = capitalize_choices(choices);
+            // predicted synchronously?
+            if (m_received_prediction_choices)
+            {
+                m_prediction_choices = std::move(*m_received_prediction_choices);
+                m_received_prediction_choices.reset();
+            }
+            return;
         }
 
+        m_wpengine->cancel_predictions();
+
         // update word information for the input line display
         // this->word_infos =
         //    this->get_word_infos(m_text_context->get_line())
     }
+
+    m_prediction_choices.clear();
+}
+
+std::vector<UString> WordSuggestions::filter_prediction_choices(
+        const std::vector<UString>& choices_,
+        const std::vector<bool>& lower_case_exists,
+        bool capitalize, bool drop_capitalized)
+{
+    std::vector<UString> choices;
+    for (size_t i=0; i<choices_.size(); i++)
+    {
+        const auto& choice = choices_[i];
+
+        // Filter out begin-of-text-markers that sneak in as
+        // high frequency unigrams.
+        if (choice.startswith("<bot:"))
+            continue;
+
+        // Drop upper caps spelling in favor of a lower caps one.
+        // Auto-capitalization may later elect to upper caps on insertion.
+        if (drop_capitalized &&
+            i < lower_case_exists.size() && lower_case_exists[i])
+            continue;
+
+        choices.emplace_back(choice);
+    }
+
+    // Make all words start upper case
+    if (capitalize)
+        choices = capitalize_choices(choices);
+
+    return choices;
 }
 
 std::tuple<int, bool, bool, bool> WordSuggestions::get_prediction_options(
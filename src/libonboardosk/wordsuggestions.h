@@ -162,8 +162,17 @@ class WordSuggestions : public ContextBase
                 bool auto_capitalize);
 
         // word prediction: find choices, only once per key press
+        // Choices are computed asynchronously, the current ones remain
+        // until the new ones arrive and trigger another ui update.
         void update_prediction_choices();
 
+        // Apply display preferences to the raw prediction choices.
+        // lower_case_exists comes with the choices from the WPEngine.
+        std::vector<UString> filter_prediction_choices(
+                const std::vector<UString>& choices,
+                const std::vector<bool>& lower_case_exists,
+                bool capitalize, bool drop_capitalized);
+
         std::tuple<int, bool, bool, bool> get_prediction_options(
                 std::vector<UString> tokens,
                 bool shift,
@@ -289,6 +298,8 @@ class WordSuggestions : public ContextBase
         std::vector<UString> m_correction_choices;
         TextSpanPtr m_correction_span;
         std::vector<UString> m_prediction_choices;
+        std::optional<std::vector<UString>> m_received_prediction_choices;
+        bool m_requesting_predictions{false};
 
         TextSpanPtr m_separator_before_key_press;
 
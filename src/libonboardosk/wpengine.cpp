@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iomanip>      // put_time, setw
 #include <map>
+#include <optional>
 #include <string>
 #include <vector>
 #include <experimental/filesystem>
@@ -9,6 +10,9 @@ namespace fs = std::experimental::filesystem;
 
 #include "lm_unigram.h"
 #include "lm_dynamic_cached.h"
+#include "lm_frozen.h"
+#include "lm_journal.h"
+#include "lm_mapped.h"
 #include "lm_merged.h"
 #include "lm_tokenize.h"
 
@@ -22,6 +26,7 @@ namespace fs = std::experimental::filesystem;
 #include "tools/xdgdirs.h"
 
 #include "configuration.h"
+#include "onboardoskcallbacks.h"
 #include "timer.h"
 #include "wpengine.h"
 
@@ -31,7 +36,8 @@ using lm::LanguageModel;
 
 
 ModelCache::ModelCache(const ContextBase& context) :
-    Super(context)
+    Super(context),
+    m_vocabulary(std::make_shared<lm::SharedVocabulary>())
 {}
 
 ModelCache::~ModelCache()
@@ -40,6 +46,8 @@ ModelCache::~ModelCache()
 void ModelCache::clear()
 {
     m_language_models.clear();
+    m_journals.clear();
+    m_vocabulary->clear();
 }
 
 std::vector<lm::LanguageModel*> ModelCache::get_models(const LMIDs& lmids)
@@ -159,6 +167,9 @@ std::tuple<std::string, std::string, std::string> ModelCache::split_lmid(const L
     return class_ == "user";
 }
 
+// Rewrite user models once their journal grows beyond this.
+static const size_t JOURNAL_COMPACTION_SIZE = 256 * 1024;
+
 std::unique_ptr<lm::LanguageModel> ModelCache::load_model(const LMID& lmid)
 {
     std::unique_ptr<lm::LanguageModel> model;
@@ -172,10 +183,19 @@ std::unique_ptr<lm::LanguageModel> ModelCache::load_model(const LMID& lmid)
     {
         if (class_ == "system")
         {
+            // Prefer the binary model, it loads almost instantly
+            // and its pages are shared between all sessions.
+            model = load_mapped_model(filename);
+            if (model)
+                return model;
+
+            // System models are never learned into, freeze them
+            // into compact read-only arrays. They load straight into
+            // the arrays, faster than into a DynamicModel's trie.
             if (lm::read_order(filename) == 1)
                 model = std::make_unique<lm::UnigramModel>();
             else
-                model = std::make_unique<lm::DynamicModel>();
+                model = std::make_unique<lm::FrozenModel>();
         }
         else if (class_ == "user")
         {
@@ -200,8 +220,52 @@ std::unique_ptr<lm::LanguageModel> ModelCache::load_model(const LMID& lmid)
     }
 
     if (!filename.empty())
+    {
         do_load_model(model.get(), filename, class_);
 
+        auto dm = dynamic_cast<lm::DynamicModelBase*>(model.get());
+        if (class_ == "user" && dm &&
+            !model->get_load_error())
+            open_journal(lmid, dm, filename);
+    }
+
+    return model;
+}
+
+std::unique_ptr<lm::LanguageModel> ModelCache::load_mapped_model(const std::string& filename)
+{
+    std::string binary_filename = get_binary_filename(filename);
+
+    std::error_code ec;
+    if (!fs::exists(binary_filename, ec))
+        return {};
+
+    LOG_INFO << "Loading language model " << repr(binary_filename);
+
+    auto model = std::make_unique<lm::MappedModel>();
+    try
+    {
+        model->load(binary_filename);
+    }
+    catch (const lm::Exception& ex)
+    {
+        LOG_WARNING << "Failed to load language model " << repr(binary_filename)
+                    << ": " << ex.what() << ", falling back to " << repr(filename);
+        return {};
+    }
+
+    // Don't let a stale binary model hide changes to the text model.
+    // File times aren't reliable for that, packages and copies
+    // may set any times.
+    if (fs::exists(filename, ec) &&
+        !model->is_converted_from(filename.c_str()))
+    {
+        LOG_WARNING << "Binary language model " << repr(binary_filename)
+                    << " wasn't converted from " << repr(filename)
+                    << ", skipping.";
+        return {};
+    }
+
     return model;
 }
 
@@ -242,13 +306,174 @@ void ModelCache::do_load_model(lm::LanguageModel* model, const std::string& file
 }
 
 void ModelCache::save_models()
+{
+    std::vector<PendingSave> pending;
+    take_snapshots(pending);
+    save_snapshots(pending);
+    commit_snapshots(pending);
+}
+
+void ModelCache::take_snapshots(std::vector<PendingSave>& pending)
 {
     for (auto& it : m_language_models)
     {
         const LMID& lmid = it.first;
         LanguageModel* model = it.second.get();
-        if (can_save(lmid))
+        if (!can_save(lmid))
+            continue;
+
+        std::string filename = get_filename(lmid);
+        if (filename.empty())
+            continue;
+
+        // Changes recorded in the journal are safe already,
+        // only rewrite the model file once the journal grew large.
+        auto journal = get_journal(lmid);
+        bool compact = journal && journal->get_size() >= JOURNAL_COMPACTION_SIZE;
+        if (!model->is_modified() && !compact)
+        {
+            if (journal)
+            {
+                pending.emplace_back();
+                pending.back().lmid = lmid;
+                pending.back().journal = journal;
+            }
+            continue;
+        }
+
+        if (model->get_load_error())
+        {
+            LOG_WARNING << "Not saving modified language model "
+                        << repr(filename)
+                        << " due to previous error on load.";
+            continue;
+        }
+
+        auto dm = dynamic_cast<lm::DynamicModelBase*>(model);
+        if (dm)
+        {
+            pending.emplace_back();
+            PendingSave& ps = pending.back();
+            ps.lmid = lmid;
+            ps.filename = filename;
+
+            // With all changes in the journal, the model file and the
+            // journal up to here make the snapshot. Rebuild the model
+            // from them while saving, instead of copying it here.
+            // User models are all CachedDynamicModels, see load_model().
+            if (!model->is_modified() &&
+                dynamic_cast<lm::CachedDynamicModel*>(model))
+            {
+                ps.rebuild = std::make_unique<lm::CachedDynamicModel>();
+            }
+            else
+            {
+                ps.snapshot = std::make_unique<lm::ModelSnapshot>();
+                dm->take_snapshot(*ps.snapshot);
+            }
+            if (journal)
+            {
+                ps.journal = journal;
+                ps.journal_offset = journal->get_size();
+            }
+
+            // Learning from here on goes into the next save.
+            model->set_modified(false);
+        }
+        else
+        {
+            // no snapshot support, save in place
             save_model(model, lmid);
+        }
+    }
+}
+
+void ModelCache::save_snapshots(std::vector<PendingSave>& pending)
+{
+    for (auto& ps : pending)
+    {
+        if (ps.snapshot)
+        {
+            ps.saved = write_temp_model_file(ps.filename, ps.tempfile,
+                                             [&](const std::string& tempfile)
+            {
+                ps.snapshot->save(tempfile.c_str());
+            });
+            ps.snapshot.reset();
+        }
+        else if (ps.rebuild)
+        {
+            ps.saved = rebuild_model(ps) &&
+                       write_temp_model_file(ps.filename, ps.tempfile,
+                                             [&](const std::string& tempfile)
+            {
+                ps.rebuild->save(tempfile);
+            });
+            ps.rebuild.reset();
+        }
+        else if (ps.journal)
+        {
+            ps.saved = ps.journal->sync() == lm::ERR_NONE;
+            if (!ps.saved)
+                LOG_ERROR << "failed to sync journal of language model "
+                          << repr(ps.lmid)
+                          << ": " << strerror(errno)
+                          << " (" << errno << ")";
+        }
+    }
+}
+
+void ModelCache::commit_snapshots(std::vector<PendingSave>& pending)
+{
+    for (auto& ps : pending)
+    {
+        if (ps.filename.empty())  // journal only
+            continue;
+
+        bool saved = ps.saved;
+
+        // Switch to a journal with only the changes that
+        // didn't make it into the snapshot.
+        if (saved && ps.journal)
+        {
+            auto base = lm::ModelJournal::get_base(ps.tempfile.c_str());
+            saved = ps.journal->prepare_rebase(base, ps.journal_offset) == lm::ERR_NONE;
+            if (!saved)
+                LOG_ERROR << "failed to compact journal of language model "
+                          << repr(ps.filename);
+        }
+
+        if (saved)
+            saved = replace_model_file(ps.filename, ps.tempfile);
+
+        if (ps.journal)
+        {
+            if (saved)
+            {
+                if (ps.journal->commit_rebase() != lm::ERR_NONE)
+                {
+                    LOG_ERROR << "failed to replace journal of language model "
+                              << repr(ps.filename);
+                    saved = false;
+                }
+            }
+            else
+            {
+                ps.journal->abort_rebase();
+            }
+        }
+
+        if (!saved)
+        {
+            std::error_code ec;
+            if (!ps.tempfile.empty())
+                fs::remove(ps.tempfile, ec);
+
+            // try again on the next save
+            auto it = m_language_models.find(ps.lmid);
+            if (it != m_language_models.end())
+                it->second->set_modified(true);
+        }
     }
 }
 
@@ -261,12 +486,8 @@ bool ModelCache::can_save(const LMID& lmid)
 
 void ModelCache::save_model(lm::LanguageModel* model, const LMID& lmid)
 {
-    std::string type_, class_, name;
-    std::tie(type_, class_, name) = ModelCache::split_lmid(lmid);
     std::string filename = get_filename(lmid);
 
-    std::string backup_filename = get_backup_filename(filename);
-
     if (!filename.empty() &&
         model->is_modified())
     {
@@ -279,43 +500,196 @@ void ModelCache::save_model(lm::LanguageModel* model, const LMID& lmid)
         }
         else
         {
-            LOG_INFO << "Saving language model " << repr(filename);
-            try
-            {
-                // create the path
-                auto path = fs::path(filename).remove_filename();
-                get_xdg_dirs()->assure_user_dir_exists(path);
+            std::string tempfile;
+            if (write_temp_model_file(filename, tempfile,
+                                      [&](const std::string& tempfile_)
+                                      {model->save(tempfile_);}) &&
+                replace_model_file(filename, tempfile))
+                model->set_modified(false);
+        }
+    }
+}
 
-                if (true)
-                {
-                    // save to temp file
-                    std::string basename = get_basename(filename);
-                    std::string tempfile = basename + ".tmp";
-                    model->save(tempfile);
-
-                    // rename to final file
-                    if (fs::exists(filename))
-                        fs::rename(filename, backup_filename);
-                    fs::rename(tempfile, filename);
-                }
+bool ModelCache::write_temp_model_file(const std::string& filename,
+                                       std::string& tempfile,
+                                       const std::function<void(const std::string&)>& save_func)
+{
+    LOG_INFO << "Saving language model " << repr(filename);
+    try
+    {
+        // create the path
+        auto path = fs::path(filename).remove_filename();
+        get_xdg_dirs()->assure_user_dir_exists(path);
 
-                model->set_modified(false);
-            }
-            catch (const lm::Exception& ex)
-            {
-                LOG_ERROR
-                        << "failed to save language model "
-                        << repr(filename)
-                        << ": " << ex.what();
-            }
-            catch (const fs::filesystem_error&)
-            {
-                LOG_ERROR
-                        << "failed to save language model "
-                        << repr(filename)
-                        << ": " << strerror(errno)
-                        << " (" << errno << ")";
-            }
+        // save to temp file next to the final one, renaming
+        // must not cross file systems
+        tempfile = filename + ".tmp";
+        save_func(tempfile);
+
+        return true;
+    }
+    catch (const lm::Exception& ex)
+    {
+        LOG_ERROR
+                << "failed to save language model "
+                << repr(filename)
+                << ": " << ex.what();
+    }
+    catch (const fs::filesystem_error&)
+    {
+        LOG_ERROR
+                << "failed to save language model "
+                << repr(filename)
+                << ": " << strerror(errno)
+                << " (" << errno << ")";
+    }
+    return false;
+}
+
+bool ModelCache::replace_model_file(const std::string& filename,
+                                    const std::string& tempfile)
+{
+    std::string backup_filename = get_backup_filename(filename);
+
+    try
+    {
+        // rename to final file
+        if (fs::exists(filename))
+            fs::rename(filename, backup_filename);
+        fs::rename(tempfile, filename);
+
+        return true;
+    }
+    catch (const fs::filesystem_error&)
+    {
+        LOG_ERROR
+                << "failed to save language model "
+                << repr(filename)
+                << ": " << strerror(errno)
+                << " (" << errno << ")";
+    }
+    return false;
+}
+
+bool ModelCache::rebuild_model(PendingSave& ps)
+{
+    lm::DynamicModelBase* model = ps.rebuild.get();
+    try
+    {
+        if (fs::exists(ps.filename))
+            model->load(ps.filename);
+    }
+    catch (const lm::Exception& ex)
+    {
+        LOG_ERROR << "failed to compact language model "
+                  << repr(ps.filename) << ": " << ex.what();
+        return false;
+    }
+
+    // The model file can't have changed since take_snapshots(),
+    // only commit_snapshots() replaces it.
+    std::string journal_filename = get_journal_filename(ps.filename);
+    auto base = lm::ModelJournal::get_base(ps.filename.c_str());
+    lm::LMError error = lm::ModelJournal::replay(*model,
+                                                 journal_filename.c_str(),
+                                                 base, NULL, ps.journal_offset);
+    if (error)
+    {
+        LOG_ERROR << "failed to compact journal " << repr(journal_filename)
+                  << ": " << strerror(errno) << " (" << errno << ")";
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<lm::ModelJournal> ModelCache::get_journal(const LMID& lmid)
+{
+    auto it = m_journals.find(canonicalize_lmid(lmid));
+    if (it != m_journals.end())
+        return it->second;
+    return {};
+}
+
+void ModelCache::open_journal(const LMID& lmid, lm::DynamicModelBase* model,
+                              const std::string& filename)
+{
+    std::string journal_filename = get_journal_filename(filename);
+    auto base = lm::ModelJournal::get_base(filename.c_str());
+
+    // apply the changes made since the model file was written
+    int num_records = 0;
+    lm::LMError error = lm::ModelJournal::replay(*model, journal_filename.c_str(),
+                                                 base, &num_records);
+    if (error == lm::ERR_FORMAT)
+    {
+        // The model file was replaced from outside, keep
+        // the journal around, but don't apply it.
+        auto broken_filename = get_broken_filename(journal_filename);
+        LOG_WARNING << "Journal " << repr(journal_filename)
+                    << " doesn't belong to " << repr(filename)
+                    << ", moving it to " << repr(broken_filename);
+        std::error_code ec;
+        fs::rename(journal_filename, broken_filename, ec);
+    }
+    else if (error)
+    {
+        LOG_ERROR << "Failed to read journal " << repr(journal_filename)
+                  << ": " << strerror(errno) << " (" << errno << ")";
+    }
+    else if (num_records)
+    {
+        LOG_INFO << "Replayed " << num_records << " journal records of "
+                 << repr(filename);
+    }
+
+    // all replayed changes are on disk
+    model->set_modified(false);
+
+    auto journal = std::make_shared<lm::ModelJournal>();
+    if (journal->open(journal_filename.c_str(), base) == lm::ERR_NONE)
+        m_journals[lmid] = journal;
+    else
+        LOG_ERROR << "Failed to open journal " << repr(journal_filename)
+                  << ", saving whole model files instead: "
+                  << strerror(errno) << " (" << errno << ")";
+}
+
+void ModelCache::learn_tokens(const LMID& lmid, const std::vector<UString>& tokens)
+{
+    auto dm = dynamic_cast<lm::DynamicModelBase*>(get_model(lmid));
+    if (dm)
+    {
+        bool modified = dm->is_modified();
+        dm->learn_tokens(tokens);
+
+        auto journal = get_journal(lmid);
+        if (journal)
+        {
+            std::vector<std::string> stokens;
+            lm::to_string(stokens, tokens);
+            if (journal->append_learn_tokens(stokens) == lm::ERR_NONE)
+                dm->set_modified(modified);
+        }
+    }
+}
+
+void ModelCache::remove_context(const LMID& lmid,
+                                std::map<std::vector<std::string>, int>& changes,
+                                const std::vector<UString>& context)
+{
+    auto dm = dynamic_cast<lm::DynamicModelBase*>(get_model(lmid));
+    if (dm)
+    {
+        bool modified = dm->is_modified();
+        dm->remove_context(changes, context);
+
+        auto journal = get_journal(lmid);
+        if (journal && !changes.empty())
+        {
+            std::vector<std::string> scontext;
+            lm::to_string(scontext, context);
+            if (journal->append_remove_context(scontext) == lm::ERR_NONE)
+                dm->set_modified(modified);
         }
     }
 }
@@ -348,6 +722,16 @@ std::string ModelCache::get_backup_filename(const std::string& filename)
     return filename + ".bak";
 }
 
+std::string ModelCache::get_journal_filename(const std::string& filename)
+{
+    return filename + ".journal";
+}
+
+std::string ModelCache::get_binary_filename(const std::string& filename)
+{
+    return filename + "b";   // "en_US.lm" -> "en_US.lmb"
+}
+
 std::string ModelCache::get_broken_filename(const std::string& filename)
 {
     std::string fn;
@@ -450,17 +834,45 @@ AutoSaveTimer::~AutoSaveTimer()
 }
 
 
+// State shared between the main thread and the prediction worker.
+// Idle callbacks hold weak references, so results arriving after
+// the engine was destroyed are ignored.
+struct PredictionQueue
+{
+    struct Request
+    {
+        uint64_t serial;
+        UString context_line;
+        size_t limit;
+        lm::PredictOptions options;
+        WPEngine::PredictCallback callback;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t serial{0};               // of the most recent request
+    std::optional<Request> request;   // waiting for the worker
+    bool exit{false};
+
+    uint64_t result_serial{0};
+    std::vector<UString> result_choices;
+    std::vector<bool> result_lower_case_exists;
+    WPEngine::PredictCallback result_callback;
+};
+
 
 WPEngine::WPEngine(const ContextBase& context) :
     ContextBase(context),
     m_model_cache(std::make_unique<ModelCache>(context)),
     m_auto_save_timer(std::make_unique<AutoSaveTimer>(context,
-                                                      this))
+                                                      this)),
+    m_prediction_queue(std::make_shared<PredictionQueue>())
 {
 }
 
 WPEngine::~WPEngine()
 {
+    stop_prediction_worker();
     save_models("WPEngine destructor");
 }
 
@@ -515,8 +927,26 @@ void WPEngine::save_models(const std::string& reason, bool concurrent)
 void WPEngine::do_save_models()
 {
     LOG_WARNING << "saving begin";
-    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
-    m_model_cache->save_models();
+
+    // Hold the models only while noting journal offsets and swapping
+    // files, learning and prediction continue while the files are
+    // written. Models are rebuilt from their files and journals for
+    // compaction. Only changes missing from a journal, e.g. after a
+    // failed append, are copied in time proportional to the model
+    // size, see DynamicModelBase::take_snapshot().
+    std::vector<ModelCache::PendingSave> pending;
+    {
+        std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+        m_model_cache->take_snapshots(pending);
+    }
+
+    m_model_cache->save_snapshots(pending);
+
+    {
+        std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+        m_model_cache->commit_snapshots(pending);
+    }
+
     LOG_WARNING << "saving end";
 }
 
@@ -539,9 +969,17 @@ void WPEngine::predict(std::vector<UString>& choices,
                        const UString& context_line, size_t limit,
                        lm::PredictOptions options)
 {
+    // The models look at no more than order-1 words of history, tokenize
+    // only the end of the context. Keep at least one history word,
+    // unigram models predict differently without one.
     std::vector<UString> context;
     std::vector<Span> spans;
-    lm::tokenize_context(context, spans, context_line);
+    int order = get_max_order(m_models);
+    if (order)
+        m_context_tokenizer.tokenize(context, spans, context_line,
+                                     static_cast<size_t>(std::max(order, 2)));
+    else
+        lm::tokenize_context(context, spans, context_line);
 
     std::vector<lm::UPredictResult> predictions;
     get_prediction(predictions, m_models, context, limit, options);
@@ -553,6 +991,131 @@ void WPEngine::predict(std::vector<UString>& choices,
     LOG_DEBUG << "choices=" <<  slice(choices, 0, 5);
 }
 
+void WPEngine::predict_async(const UString& context_line, size_t limit,
+                             lm::PredictOptions options,
+                             const PredictCallback& callback)
+{
+    // No way to get back to the main loop, predict synchronously.
+    auto callbacks = get_global_callbacks();
+    if (!callbacks->idle_run)
+    {
+        cancel_predictions();
+        std::vector<UString> choices;
+        std::vector<bool> exists;
+        predict(choices, context_line, limit, options);
+        lower_case_exists(exists, choices);
+        callback(choices, exists);
+        return;
+    }
+
+    start_prediction_worker();
+
+    auto& queue = *m_prediction_queue;
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.serial++;
+        queue.request = PredictionQueue::Request{queue.serial, context_line,
+                                                 limit, options, callback};
+    }
+    queue.cv.notify_one();
+}
+
+void WPEngine::cancel_predictions()
+{
+    auto& queue = *m_prediction_queue;
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.serial++;
+    queue.request.reset();
+    queue.result_callback = {};
+}
+
+void WPEngine::start_prediction_worker()
+{
+    if (!m_prediction_thread.joinable())
+        m_prediction_thread = std::thread([this]{run_prediction_worker();});
+}
+
+void WPEngine::stop_prediction_worker()
+{
+    if (m_prediction_thread.joinable())
+    {
+        auto& queue = *m_prediction_queue;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.exit = true;
+            queue.request.reset();
+        }
+        queue.cv.notify_one();
+        m_prediction_thread.join();
+    }
+}
+
+// Worker thread, runs until stop_prediction_worker().
+void WPEngine::run_prediction_worker()
+{
+    auto& queue = *m_prediction_queue;
+    while (true)
+    {
+        PredictionQueue::Request request;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.cv.wait(lock, [&]{return queue.exit || queue.request;});
+            if (queue.exit)
+                break;
+            request = std::move(*queue.request);
+            queue.request.reset();
+        }
+
+        // Look up the spellings here too, the main thread would
+        // have to wait for the models while the worker predicts.
+        std::vector<UString> choices;
+        std::vector<bool> exists;
+        predict(choices, request.context_line, request.limit, request.options);
+        lower_case_exists(exists, choices);
+
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (request.serial != queue.serial)
+                continue;   // superseded while predicting
+            queue.result_serial = request.serial;
+            queue.result_choices = std::move(choices);
+            queue.result_lower_case_exists = std::move(exists);
+            queue.result_callback = std::move(request.callback);
+        }
+
+        auto callbacks = get_global_callbacks();
+        callbacks->idle_run(on_predictions_done,
+            new std::weak_ptr<PredictionQueue>(m_prediction_queue));
+    }
+}
+
+// Idle callback, delivers the latest results in the main thread.
+int WPEngine::on_predictions_done(void* user_data)
+{
+    std::unique_ptr<std::weak_ptr<PredictionQueue>> ref(
+        static_cast<std::weak_ptr<PredictionQueue>*>(user_data));
+    auto queue = ref->lock();
+    if (queue)
+    {
+        std::vector<UString> choices;
+        std::vector<bool> exists;
+        PredictCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->result_serial == queue->serial)
+            {
+                choices = std::move(queue->result_choices);
+                exists = std::move(queue->result_lower_case_exists);
+                callback = std::move(queue->result_callback);
+                queue->result_callback = {};
+            }
+        }
+        if (callback)
+            callback(choices, exists);
+    }
+    return 0;  // 0=one-shot
+}
+
 void WPEngine::learn_text(const UString& text, bool allow_new_words)
 {
     LOG_WARNING << "learn_text1("
@@ -594,14 +1157,10 @@ void WPEngine::learn_text(const UString& text, bool allow_new_words)
             drop_new_words(token_sections, tokens, spans,
                            m_persistent_models);
 
-        auto models = m_model_cache->get_models(m_auto_learn_models);
-        for (auto model : models)
-        {
-            auto dm = dynamic_cast<lm::DynamicModelBase*>(model);
-            if (dm)
-                for (const auto& tokens_ : token_sections)
-                    dm->learn_tokens(tokens_);
-        }
+        // learn and record in the journals
+        for (const auto& lmid : m_auto_learn_models)
+            for (const auto& tokens_ : token_sections)
+                m_model_cache->learn_tokens(lmid, tokens_);
 
         LOG_INFO << "learn_text: tokens=" << token_sections;
 
@@ -648,6 +1207,8 @@ void WPEngine::drop_new_words(std::vector<std::vector<UString> >& token_sections
 
 void WPEngine::learn_scratch_text(const UString& text)
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     std::vector<UString> tokens;
     std::vector<Span> spans;
     lm::tokenize_text(tokens, spans, text);
@@ -665,6 +1226,8 @@ void WPEngine::learn_scratch_text(const UString& text)
 
 void WPEngine::clear_scratch_models()
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     const auto& models = m_model_cache->get_models(m_scratch_models);
     for (auto model : models)
         model->clear();
@@ -686,6 +1249,8 @@ void WPEngine::lookup_tokens(std::vector<USpan>& tokspans_out,
                              const std::vector<Span>& spans,
                              const LMIDs& lmids)
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     tokspans_out.clear();
     for (size_t i=0; i<tokens.size(); i++)
         tokspans_out.emplace_back(spans[i].begin, spans[i].length, tokens[i]);
@@ -711,6 +1276,8 @@ void WPEngine::lookup_tokens(std::vector<USpan>& tokspans_out,
 
 bool WPEngine::word_exists(const UString& word)
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     bool exists = false;
     const auto& lmids = m_persistent_models;
     for (size_t i=0; i<lmids.size(); i++)
@@ -729,6 +1296,19 @@ bool WPEngine::word_exists(const UString& word)
     return exists;
 }
 
+void WPEngine::lower_case_exists(std::vector<bool>& exists,
+                                 const std::vector<UString>& words)
+{
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
+    exists.clear();
+    for (const auto& word : words)
+    {
+        UString word_lower = word.lower();
+        exists.push_back(word != word_lower && word_exists(word_lower));
+    }
+}
+
 void WPEngine::tokenize_text(std::vector<UString>& tokens,
                              std::vector<Span>& spans,
                              const UString& text)
@@ -771,6 +1351,8 @@ void WPEngine::get_prediction(std::vector<lm::UPredictResult>& predictions,
                               const std::vector<UString>& context,
                               std::optional<size_t> limit, lm::PredictOptions options)
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     LMIDs lmids;
     std::vector<double> weights;
     m_model_cache->parse_lmdesc(lmids, weights, lmdescrs);
@@ -789,6 +1371,14 @@ void WPEngine::get_prediction(std::vector<lm::UPredictResult>& predictions,
             dm->set_smoothing(lm::Smoothing::ABS_DISC_I);
         }
 
+        // same for binary and frozen system models
+        auto mm = dynamic_cast<lm::MappedModel*>(model);
+        if (mm)
+            mm->set_smoothing(lm::Smoothing::ABS_DISC_I);
+        auto fm = dynamic_cast<lm::FrozenModel*>(model);
+        if (fm)
+            fm->set_smoothing(lm::Smoothing::ABS_DISC_I);
+
         // setup recency caching
         auto cdm = dynamic_cast<lm::CachedDynamicModel*>(model);
         if (cdm)
@@ -808,26 +1398,48 @@ void WPEngine::get_prediction(std::vector<lm::UPredictResult>& predictions,
 
     lm::OverlayModel model;
     model.set_models(models);
+    model.set_vocabulary(m_model_cache->get_vocabulary());
+    model.set_parallel(true);
     // model = pypredict.linint(models, weights)
     // model = pypredict.loglinint(models, weights)
 
     model.predict(predictions, context, limit, options);
 }
 
+int WPEngine::get_max_order(const LMDESCRs& lmdescrs)
+{
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
+    LMIDs lmids;
+    std::vector<double> weights;
+    m_model_cache->parse_lmdesc(lmids, weights, lmdescrs);
+
+    int order = 0;
+    for (auto model : m_model_cache->get_models(lmids))
+    {
+        auto ngm = dynamic_cast<lm::NGramModel*>(model);
+        if (!ngm)
+            return 0;    // unknown history length, don't cut it off
+        order = std::max(order, ngm->get_order());
+    }
+    return order;
+}
+
 void WPEngine::remove_context(const std::vector<UString>& context)
 {
+    std::lock_guard<std::recursive_mutex> locker(m_save_mutex);
+
     LMIDs lmids;
     std::vector<double> weights;
     m_model_cache->parse_lmdesc(lmids, weights, m_auto_learn_models);
-    const auto& models = m_model_cache->get_models(lmids);
 
-    for (size_t i=0; i<models.size(); i++)
+    for (size_t i=0; i<lmids.size(); i++)
     {
-        auto model = dynamic_cast<lm::DynamicModelBase*>(models[i]);
+        auto model = dynamic_cast<lm::DynamicModelBase*>(m_model_cache->get_model(lmids[i]));
         if (model)
         {
             std::map<std::vector<std::string>, int> changes;
-            model->remove_context(changes, context);
+            m_model_cache->remove_context(lmids[i], changes, context);
 
             // debug output
             if (logger()->can_log(LogLevel::DEBUG))
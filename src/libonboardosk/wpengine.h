@@ -1,10 +1,14 @@
 #ifndef WPENGINE_H
 #define WPENGINE_H
 
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
 
 #include "lm_decls.h"
+#include "lm_tokenize.h"
 
 #include "tools/textdecls.h"
 #include "tools/ustringmain.h"
@@ -14,6 +18,7 @@
 
 class AutoSaveTimer;
 class ModelCache;
+struct PredictionQueue;
 class UString;
 
 typedef TSpan<UString> USpan;
@@ -28,6 +33,10 @@ using LMIDs = std::vector<LMID>;
 
 namespace lm {
     struct PredictResult;
+    class DynamicModelBase;
+    class ModelJournal;
+    class ModelSnapshot;
+    class SharedVocabulary;
 }
 
 // Singleton for interfacing with low-level word prediction.
@@ -37,6 +46,13 @@ class WPEngine : public ContextBase
     public:
         using Super = ContextBase;
 
+        // Receives the choices of predict_async() in the main thread.
+        // lower_case_exists tells for each choice, whether a different,
+        // lower case spelling of it exists, see word_exists().
+        using PredictCallback = std::function<void(
+                std::vector<UString>& choices,
+                const std::vector<bool>& lower_case_exists)>;
+
         WPEngine(const ContextBase& context);
         ~WPEngine();
 
@@ -67,6 +83,17 @@ class WPEngine : public ContextBase
                      const UString& context_line, size_t limit=20,
                      lm::PredictOptions options=lm::DEFAULT_OPTIONS);
 
+        // Find choices in the prediction worker thread and pass them to
+        // callback in the main loop. A new request supersedes all earlier
+        // ones: waiting requests are skipped and late results are dropped.
+        // Without idle callbacks available, this runs synchronously.
+        void predict_async(const UString& context_line, size_t limit,
+                           lm::PredictOptions options,
+                           const PredictCallback& callback);
+
+        // Drop all pending predict_async() requests and results.
+        void cancel_predictions();
+
         // Count n-grams and add words to the auto-learn models.
         void learn_text(const UString& text, bool allow_new_words);
 
@@ -104,6 +131,12 @@ class WPEngine : public ContextBase
         // Does word exist in any of the non-scratch models?
         bool word_exists(const UString& word);
 
+        // For each of words, does a different, lower case spelling of
+        // it exist in any of the non-scratch models? Locks the models
+        // only once for all words.
+        void lower_case_exists(std::vector<bool>& exists,
+                               const std::vector<UString>& words);
+
         // Let the service find the words in text.
         void tokenize_text(std::vector<UString>& tokens,
                            std::vector<Span>& spans,
@@ -124,6 +157,9 @@ class WPEngine : public ContextBase
                             const std::vector<UString>& context,
                             std::optional<size_t> limit, lm::PredictOptions options);
 
+        // Highest n-gram order of the given models, 0 if unknown.
+        int get_max_order(const LMDESCRs& lmdescrs);
+
         // Remove the last word of context in the given context.
         // If len(context) == 1 then all occurences of the word will be removed.
         void remove_context(const std::vector<UString>& context);
@@ -133,6 +169,11 @@ class WPEngine : public ContextBase
     private:
         void do_save_models();
 
+        void start_prediction_worker();
+        void stop_prediction_worker();
+        void run_prediction_worker();
+        static int on_predictions_done(void* user_data);
+
     private:
         std::unique_ptr<ModelCache> m_model_cache;
         std::unique_ptr<AutoSaveTimer> m_auto_save_timer;
@@ -143,7 +184,16 @@ class WPEngine : public ContextBase
         LMDESCRs m_scratch_models;
 
         std::thread m_save_thread;
+
+        // Serializes all access to the language models between the main
+        // thread, the save thread and the prediction worker.
         std::recursive_mutex m_save_mutex;
+
+        std::thread m_prediction_thread;
+        std::shared_ptr<PredictionQueue> m_prediction_queue;
+
+        // Keeps the tokens of the context before the caret word.
+        lm::ContextTokenizer m_context_tokenizer;
 };
 
 
@@ -172,14 +222,62 @@ class ModelCache : public ContextBase
 
         std::vector<lm::LanguageModel*> get_models(const LMIDs& lmids);
 
+        // Word id space shared by the merged models of all predictions.
+        const std::shared_ptr<lm::SharedVocabulary>& get_vocabulary()
+        {return m_vocabulary;}
+
         void save_models();
 
+        // A modified user model, copied for saving, or just
+        // a journal to flush.
+        struct PendingSave
+        {
+            LMID lmid;
+            std::string filename;
+            std::string tempfile;
+            std::unique_ptr<lm::ModelSnapshot> snapshot;
+            std::unique_ptr<lm::DynamicModelBase> rebuild;  // or empty model to
+                                        // load with the journal's records
+            std::shared_ptr<lm::ModelJournal> journal;
+            size_t journal_offset{0};   // records included in snapshot
+            bool saved{false};
+        };
+
+        // Copy user models with changes missing from their journals and
+        // mark them unmodified. Models whose journals are due for
+        // compaction aren't copied, only their journal offsets noted.
+        // Call this with the models locked.
+        void take_snapshots(std::vector<PendingSave>& pending);
+
+        // Write the copies to temporary files, rebuild the compacted
+        // models from their files and journals and flush journals,
+        // doesn't access any models.
+        void save_snapshots(std::vector<PendingSave>& pending);
+
+        // Replace model files and journals with the saved ones, mark
+        // models modified again whose snapshots failed to save.
+        // Call this with the models locked.
+        void commit_snapshots(std::vector<PendingSave>& pending);
+
+        // Learn tokens or remove context and record the change in
+        // the model's journal.
+        void learn_tokens(const LMID& lmid, const std::vector<UString>& tokens);
+        void remove_context(const LMID& lmid,
+                            std::map<std::vector<std::string>, int>& changes,
+                            const std::vector<UString>& context);
+
         static bool is_user_lmid(const LMID& lmid);
 
         std::string get_filename(const LMID& lmid);
 
         static std::string get_backup_filename(const std::string& filename);
 
+        // Append-only log of changes to a user model file.
+        static std::string get_journal_filename(const std::string& filename);
+
+        // Binary, memory mapped variant of a system model file.
+        static std::string get_binary_filename(const std::string& filename);
+
         // Return filename for renamed broken files.
         static std::string get_broken_filename(const std::string& filename);
 
@@ -198,6 +296,10 @@ class ModelCache : public ContextBase
 
         std::unique_ptr<lm::LanguageModel> load_model(const LMID& lmid);
 
+        // Load the binary model for filename if there is an up-to-date
+        // one, else return nullptr.
+        std::unique_ptr<lm::LanguageModel> load_mapped_model(const std::string& filename);
+
         void do_load_model(lm::LanguageModel* model,
                            const std::string& filename,
                            const std::string& class_);
@@ -206,8 +308,30 @@ class ModelCache : public ContextBase
 
         void save_model(lm::LanguageModel* model, const LMID& lmid);
 
+        // Save to a temporary file next to filename.
+        bool write_temp_model_file(const std::string& filename,
+                                   std::string& tempfile,
+                                   const std::function<void(const std::string&)>& save_func);
+
+        // Replace filename with tempfile, keep a backup of the previous one.
+        bool replace_model_file(const std::string& filename,
+                                const std::string& tempfile);
+
+        // Load the empty model of ps with the model file and the
+        // journal's records up to the offset noted in take_snapshots().
+        bool rebuild_model(PendingSave& ps);
+
+        std::shared_ptr<lm::ModelJournal> get_journal(const LMID& lmid);
+
+        // Replay the journal of a freshly loaded user model
+        // and keep it open for recording changes.
+        void open_journal(const LMID& lmid, lm::DynamicModelBase* model,
+                          const std::string& filename);
+
     private:
         std::map<LMID, std::unique_ptr<lm::LanguageModel>> m_language_models;
+        std::map<LMID, std::shared_ptr<lm::ModelJournal>> m_journals;
+        std::shared_ptr<lm::SharedVocabulary> m_vocabulary;
 };
 
 #endif // WPENGINE_H